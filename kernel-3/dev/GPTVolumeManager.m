@@ -10,6 +10,7 @@
 
 #include "GPTVolumeManager.h"
 #include "devicekit/DKDisk.h"
+#include "devicekit/dk_buf.h"
 #include "libkern/uuid.h"
 
 struct gpt_header {
@@ -48,41 +49,29 @@ GPTVolumeManager (Private)
 
 + (BOOL)probe:(DKLogicalDisk *)disk
 {
-	vm_mdl_t	 *mdl;
 	struct gpt_header hdrGpt;
 	blksize_t	  blockSize;
 	int		  r;
 
-	r = vm_mdl_new_with_capacity(&mdl, sizeof(struct gpt_header));
-	if (r != 0)
-		return NO;
-
 	blockSize = [disk blockSize];
 
-	r = [disk readBytes:blockSize
-			 at:blockSize * 1
-		 intoBuffer:mdl
-		 completion:NULL];
-	assert(r >= 0);
+	r = dk_buf_copy(disk, blockSize * 1, &hdrGpt, sizeof(hdrGpt));
+	if (r < 0)
+		return NO;
 
-	memcpy(&hdrGpt, P2V(mdl->pages[0]->paddr), sizeof(hdrGpt));
 	if (memcmp(hdrGpt.signature, "EFI PART", 8) != 0) {
 		kprintf("Not a GPT disk\n");
 		return NO;
 	}
 
-	if ([[self alloc] initWithDisk:disk mdl:mdl header:&hdrGpt] != NULL)
+	if ([[self alloc] initWithDisk:disk header:&hdrGpt] != NULL)
 		return YES;
 
 	return NO;
 }
 
-- initWithDisk:(DKLogicalDisk *)disk
-	   mdl:(vm_mdl_t *)mdl
-	header:(struct gpt_header *)hdrGpt
+- initWithDisk:(DKLogicalDisk *)disk header:(struct gpt_header *)hdrGpt
 {
-	int	  r;
-	size_t	  sizGptEntryArray;
 	blksize_t blockSize;
 
 	self = [super init];
@@ -94,26 +83,20 @@ GPTVolumeManager (Private)
 
 		blockSize = [disk blockSize];
 
-		sizGptEntryArray = hdrGpt->sizEntry * hdrGpt->nEntries;
-		if (sizGptEntryArray > vm_mdl_capacity(mdl)) {
-			r = vm_mdl_expand(&mdl, sizGptEntryArray);
-			assert(r >= 0);
-		}
-
-		r = [disk readBytes:sizGptEntryArray
-				 at:blockSize * hdrGpt->lbaEntryArrayStart
-			 intoBuffer:mdl
-			 completion:NULL];
-		assert(r >= 0);
-
 		for (int i = 0; i < hdrGpt->nEntries; i++) {
 			struct gpt_entry ent;
 			char	       parttype[UUID_STRING_LENGTH + 1] = { 0 };
 			char	       partname[37];
 			DKLogicalDisk *ld;
 
-			vm_mdl_copy(mdl, &ent, sizeof(ent),
-			    hdrGpt->sizEntry * i);
+			/* the entries are read in order, so are read ahead */
+			if (dk_buf_copy(disk,
+				blockSize * hdrGpt->lbaEntryArrayStart +
+				    hdrGpt->sizEntry * i,
+				&ent, sizeof(ent)) < 0) {
+				DKDevLog(self, "failed to read entry %d\n", i);
+				break;
+			}
 
 			if (uuid_is_null(ent.type))
 				continue;
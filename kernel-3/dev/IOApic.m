@@ -107,7 +107,7 @@ static _TAILQ_HEAD(, IOApic, ) ioapics = TAILQ_HEAD_INITIALIZER(ioapics);
 
 			assert(ioapic->redirs[intr] == 0 && "shared");
 
-			vec = md_intr_alloc(kSPL0, handler, arg);
+			vec = md_intr_alloc(prio, handler, arg);
 			if (vec < 0) {
 				DKDevLog(ioapic,
 				    "failed to register interrupt for GSI %d\n",
@@ -3,9 +3,13 @@
 
 #include "PCIBus.h"
 
+@class NVMeDisk;
+
+struct nvme_aer;
 struct nvme_queue;
 struct nvm_identify_controller;
 struct dk_diskio_completion;
+struct dk_range;
 
 @interface NVMeController : DKDevice {
     //@private
@@ -16,14 +20,58 @@ struct dk_diskio_completion;
 	blkcnt_t maxBlockTransfer;
 	size_t	 dstrd;
 
+	dk_device_pci_info_t m_pciInfo;
+	BOOL		     msix; /* whether MSI-X is in use */
+
+	unsigned coalesceTime;	    /* in 100us units */
+	unsigned coalesceThreshold; /* completions */
+	/* whether namespaces poll for synchronous I/O (boot option nvme.poll) */
+	BOOL polled;
+
 	struct nvm_identify_controller *cident; /* a dedicated page */
 	struct nvme_queue		  *adminq;
-	struct nvme_queue		  *ioqueue;
+	/*
+	 * whether admin completions are delivered by interrupt; until they
+	 * are, synchronous admin commands poll for their completion
+	 */
+	BOOL adminIntr;
+	struct nvme_aer *aer; /* asynchronous event state */
+	/* entries in each I/O queue, from CAP.MQES and kNVMeMaxQueueEntries */
+	size_t ioQueueEntries;
+	/*!
+	 * I/O queue pairs. Where there are as many as CPUs, ioqueues[i] is used
+	 * only by CPU i, and its completions are delivered to CPU i by MSI-X.
+	 * Otherwise they are shared round-robin and locked.
+	 */
+	struct nvme_queue **ioqueues;
+	size_t		    nioqueues;
+	/*
+	 * Commands which don't go through a block queue wait on slotSem for a
+	 * queue slot when theirs is full; slotWaiters counts them.
+	 */
+	semaphore_t slotSem;
+	unsigned    slotWaiters;
+	/*!
+	 * Attached namespaces. Their block queues share the I/O queues, so
+	 * they are kicked whenever slots are freed.
+	 */
+	NVMeDisk **disks;
+	size_t	   ndisks;
 }
 
 @property (readonly) size_t	 controllerId;
 @property (readonly) const char *controllerName;
 @property (readonly) blkcnt_t	 maxBlockTransfer;
+/*!
+ * Most commands which may be in flight on one I/O queue. A namespace's queue
+ * depth is limited to its share of this, so that however its I/O is spread
+ * across CPUs, it can't take all of a queue from the others.
+ */
+@property (readonly) unsigned ioQueueDepth;
+/*! Interrupt coalescing aggregation time, in units of 100 microseconds. */
+@property (readonly) unsigned coalesceTime;
+/*! Interrupt coalescing aggregation threshold, in completions. */
+@property (readonly) unsigned coalesceThreshold;
 
 + (BOOL)probeWithPCIInfo:(dk_device_pci_info_t *)pciInfo;
 
@@ -34,6 +82,41 @@ struct dk_diskio_completion;
 	     nsid:(uint16_t)nsid
        intoBuffer:(vm_mdl_t *)buf
        completion:(struct dk_diskio_completion *)completion;
+- (int)writeBlocks:(blksize_t)nBlocks
+		at:(blkoff_t)offset
+	      nsid:(uint16_t)nsid
+	fromBuffer:(vm_mdl_t *)buf
+	   options:(int)options
+	completion:(struct dk_diskio_completion *)completion;
+/*!
+ * Flush the volatile write cache (if there is one) for a namespace. Waits for
+ * a queue slot if need be, so must be called from thread context.
+ */
+- (int)flushNamespace:(uint16_t)nsid
+	   completion:(struct dk_diskio_completion *)completion;
+/*!
+ * Begin a batch of submissions from this CPU; the doorbell is written once, on
+ * -commitBatch. Interrupts must be disabled throughout.
+ */
+- (void)beginBatch;
+- (void)commitBatch;
+/*! Process the completions pending on the current CPU's I/O queue. */
+- (void)pollCompletions;
+/*!
+ * Configure interrupt coalescing of the I/O queues: an interrupt is raised
+ * once \p threshold completions are pending (at most 256), or \p time units
+ * of 100 microseconds after the first (at most 255.) 0 and 0 disable it.
+ */
+- (int)setInterruptCoalescingTime:(unsigned)time
+			threshold:(unsigned)threshold;
+/*!
+ * Deallocate block ranges of a namespace, batching them into few commands.
+ * Waits for queue slots if need be, so must be called from thread context.
+ */
+- (int)trimBlockRanges:(const struct dk_range *)ranges
+		 count:(size_t)nRanges
+		  nsid:(uint16_t)nsid
+	    completion:(struct dk_diskio_completion *)completion;
 
 @end
 
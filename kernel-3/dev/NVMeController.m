@@ -1,7 +1,14 @@
+#include <sys/param.h>
+
+#include <kern/task.h>
 #include <machine/machdep.h>
 #include <vm/vm.h>
+#include <x86_64/boot.h>
 
+#include <errno.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "NVMeController.h"
 #include "dev/GPTVolumeManager.h"
@@ -85,13 +92,48 @@ _Static_assert(sizeof(struct nvme_cc) == sizeof(uint32_t), "NVMe cc size");
 struct nvme_request {
 	SIMPLEQ_ENTRY(nvme_request) entry;
 	struct dk_diskio_completion *completion;
+	uint32_t *result; /* if not NULL, receives DW0 of the completion */
 	uint16_t cid;	/* command ID */
 	size_t nbytes;	/* number of bytes to transfer */
-	struct nvme_sqe *sqe; /* nulled on submission */
+	/*
+	 * PRP list for transfers spanning more than two pages, or the data
+	 * (e.g. DSM ranges) of a command which has some; a whole page
+	 */
+	uint64_t *prpList;
+	paddr_t	  prpListPhys;
 };
 
+/* number of entries in a request's PRP list */
+#define NVME_PRP_LIST_ENTRIES (PGSIZE / sizeof(uint64_t))
+
+/*!
+ * Joins the completions of several commands into one, for operations which
+ * are split across commands.
+ */
+struct nvme_join {
+	struct dk_diskio_completion  completion; /* given to each command */
+	struct dk_diskio_completion *parent;
+	atomic_size_t		     remaining;
+	atomic_int		     error; /* first error (-errno) if any */
+	struct nvme_join	    *next;  /* in dead_joins */
+};
+
+/*
+ * Completed joins. Completion runs in interrupt context, where kmem can't be
+ * called, so they are freed later from thread context by reap_joins().
+ */
+static _Atomic(struct nvme_join *) dead_joins = NULL;
+
+/*!
+ * An I/O queue pair. An unshared queue is only ever submitted to by the CPU
+ * it belongs to, with interrupts disabled, and its completions interrupt only
+ * that CPU, so it needs no lock. A shared queue is locked.
+ */
 struct nvme_queue {
-	spinlock_t lock; /* locks all the things in a queue; todo split? */
+	spinlock_t lock; /* if shared, locks all the things in a queue */
+	bool	   shared;
+
+	NVMeController *controller;
 
 	SIMPLEQ_HEAD(, nvme_request) req_q;
 	struct nvme_request *reqs; /* n = sqslots */
@@ -108,10 +150,82 @@ struct nvme_queue {
 	uint16_t cqhead;
 
 	uint8_t phase;
+
+	/*
+	 * nesting depth of batches of submissions; while non-zero, the
+	 * doorbell is not written, and sqdirty notes that it must be at the end
+	 */
+	unsigned batch;
+	bool	 sqdirty;
+
+	/* completes the queue's requests, posted by its interrupt handler */
+	dpc_t dpc;
+};
+
+/*!
+ * Asynchronous event state. One Asynchronous Event Request is kept outstanding
+ * on the admin queue. When it completes, the event's log page is read, which
+ * the controller requires before it reports another event of the type; then
+ * the event is logged and a new request submitted. All this is done from the
+ * admin queue's completions, so nothing waits on it.
+ */
+struct nvme_aer {
+	NVMeController		   *controller;
+	uint32_t		    dw0; /* of the latest event's completion */
+	void			   *log; /* a page, into which its log is read */
+	struct dk_diskio_completion evCompletion;
+	struct dk_diskio_completion logCompletion;
+};
+
+/*! Waits on a synchronous admin command. */
+struct nvme_admin_sync {
+	semaphore_t sem;
+	atomic_bool done;
+	ssize_t	    result;
+};
+
+enum {
+	/*
+	 * Interrupt coalescing is off by default: it delays the completion of
+	 * I/O at low queue depths, unless that's polled for. With nvme.poll
+	 * given at boot, synchronous I/O is, so interrupts are coalesced.
+	 */
+	kNVMeDefaultCoalesceTime = 0,
+	kNVMeDefaultCoalesceThreshold = 0,
+	kNVMePolledCoalesceTime = 1,
+	kNVMePolledCoalesceThreshold = 8,
+	/*
+	 * Most entries in an I/O queue, if CAP.MQES allows as many. Each takes
+	 * a page for its request's PRP list.
+	 */
+	kNVMeMaxQueueEntries = 256,
+	/* the admin queue's entries; one page of submission entries */
+	kNVMeAdminQueueEntries = PGSIZE / sizeof(struct nvme_sqe),
+	/* polls of the admin queue before a command is given up on */
+	kNVMeAdminPollSpins = 0x10000000,
+	/* active NSIDs fitting in an Identify active namespace list */
+	kNVMeNSListEntries = PGSIZE / sizeof(uint32_t),
 };
 
 static int nvmeId = 0;
-static int cmdId = 0; /* todo move to nvme_queue:: */
+
+static void
+admin_sync_done(void *data, ssize_t result)
+{
+	struct nvme_admin_sync *sync = data;
+
+	sync->result = result;
+	atomic_store(&sync->done, true);
+	semaphore_signal(&sync->sem);
+}
+
+static void
+admin_discard(void *data, ssize_t result)
+{
+}
+
+/* replaces the completion of an admin command given up on */
+static struct dk_diskio_completion admin_discarded = { admin_discard, NULL };
 
 static void
 copy32(void *dst, void *src, size_t nbytes)
@@ -129,32 +243,61 @@ write32(void *dst, uint32_t val)
 	*(uint32_t *)dst = val;
 }
 
+static void
+queue_free(struct nvme_queue *q)
+{
+	size_t nsqpages = ROUNDUP(q->sqslots * sizeof(struct nvme_sqe),
+	    PGSIZE) / PGSIZE;
+	size_t ncqpages = ROUNDUP(q->cqslots * sizeof(struct nvme_cqe),
+	    PGSIZE) / PGSIZE;
+
+	if (q->reqs != NULL) {
+		for (size_t i = 0; i < q->sqslots - 1; i++)
+			if (q->reqs[i].prpList != NULL)
+				vm_page_free(vm_page_from_paddr(
+				    q->reqs[i].prpListPhys));
+		kmem_free(q->reqs, sizeof(*q->reqs) * (q->sqslots - 1));
+	}
+	for (size_t i = 0; q->sq != NULL && i < nsqpages; i++)
+		vm_page_free(vm_page_from_paddr(V2P(q->sq) + PGSIZE * i));
+	for (size_t i = 0; q->cq != NULL && i < ncqpages; i++)
+		vm_page_free(vm_page_from_paddr(V2P(q->cq) + PGSIZE * i));
+	kmem_free(q, sizeof(*q));
+}
+
+/*
+ * Allocate a queue pair of \p nslots entries each. The queues are physically
+ * contiguous, as controllers may require (CAP.CQR), and of the same number of
+ * entries (VirtualBox needs this, at least of the admin queue.) There is one
+ * request fewer than there are slots, since a submission queue whose tail is
+ * one behind its head is full.
+ */
 static struct nvme_queue *
-queue_alloc(uint16_t idx, uint16_t dstrd)
+queue_alloc(uint16_t idx, uint16_t dstrd, size_t nslots)
 {
 	struct nvme_queue *q = kmem_zalloc(sizeof (*q));
 	vm_page_t *page;
 	size_t	   stride = 4 << dstrd; /* xxx */
 
-	assert(q != NULL);
+	if (q == NULL)
+		return NULL;
 
-	page = vm_pagealloc(1, &vm_pgwiredq);
-	assert(page != NULL);
+	q->sqslots = nslots;
+	q->cqslots = nslots;
+
+	page = vm_pagealloc_contig(ROUNDUP(nslots * sizeof(struct nvme_cqe),
+				       PGSIZE) / PGSIZE,
+	    &vm_pgwiredq);
+	if (page == NULL)
+		goto fail;
 	q->cq = P2V(page->paddr);
-#if 0
-	q->cqslots = PGSIZE / sizeof(struct nvme_cqe);
-#else
-	/*
-	 * this is necessary for VirtualBox for some reason, differing sizes at
-	 * least for the admin queue don't work with it.
-	 */
-	q->cqslots = PGSIZE / sizeof(struct nvme_sqe);
-#endif
 
-	page = vm_pagealloc(1, &vm_pgwiredq);
-	assert(page != NULL);
+	page = vm_pagealloc_contig(ROUNDUP(nslots * sizeof(struct nvme_sqe),
+				       PGSIZE) / PGSIZE,
+	    &vm_pgwiredq);
+	if (page == NULL)
+		goto fail;
 	q->sq = P2V(page->paddr);
-	q->sqslots = PGSIZE / sizeof(struct nvme_sqe);
 
 	q->sqtdbl = NVME_SQTDBL(idx, stride);
 	q->cqhdbl = NVME_CQHDBL(idx, stride);
@@ -162,22 +305,128 @@ queue_alloc(uint16_t idx, uint16_t dstrd)
 	q->phase = 1;
 
 	SIMPLEQ_INIT(&q->req_q);
-	q->reqs = kmem_alloc(sizeof(*q->reqs) * q->sqslots);
-	for (int i = 0; i < q->sqslots; i++) {
+	q->reqs = kmem_zalloc(sizeof(*q->reqs) * (nslots - 1));
+	if (q->reqs == NULL)
+		goto fail;
+	for (int i = 0; i < nslots - 1; i++) {
 		q->reqs[i].cid = i;
 		q->reqs[i].completion = NULL;
+		q->reqs[i].prpList = NULL;
 		SIMPLEQ_INSERT_TAIL(&q->req_q, &q->reqs[i], entry);
+
+		/* admin commands need no PRP lists */
+		if (idx == 0)
+			continue;
+
+		page = vm_pagealloc(1, &vm_pgwiredq);
+		assert(page != NULL);
+		q->reqs[i].prpListPhys = page->paddr;
+		q->reqs[i].prpList = P2V(page->paddr);
 	}
 
 	return q;
+
+fail:
+	queue_free(q);
+	return NULL;
+}
+
+static inline void
+queue_lock(struct nvme_queue *queue)
+{
+	if (queue->shared)
+		spinlock_lock(&queue->lock);
+}
+
+static inline void
+queue_unlock(struct nvme_queue *queue)
+{
+	if (queue->shared)
+		spinlock_unlock(&queue->lock);
+}
+
+static void
+join_complete(void *data, ssize_t result)
+{
+	struct nvme_join *join = data;
+	int		  expected = 0;
+
+	if (result < 0)
+		atomic_compare_exchange_strong(&join->error, &expected, result);
+
+	if (atomic_fetch_sub(&join->remaining, 1) == 1) {
+		join->parent->callback(join->parent->data,
+		    atomic_load(&join->error));
+
+		join->next = atomic_load(&dead_joins);
+		while (!atomic_compare_exchange_weak(&dead_joins, &join->next,
+		    join))
+			;
+	}
+}
+
+static void
+reap_joins(void)
+{
+	struct nvme_join *join = atomic_exchange(&dead_joins, NULL);
+
+	while (join != NULL) {
+		struct nvme_join *next = join->next;
+		kmem_free(join, sizeof(*join));
+		join = next;
+	}
+}
+
+/*
+ * Fill in the PRP entries of an I/O command for a transfer of \p nBytes to or
+ * from \p buf, using the request's PRP list if more than two pages are
+ * spanned. The list is preallocated, so this never allocates.
+ */
+static void
+prp_setup(struct nvme_request *req, struct nvme_sqe_io *io, vm_mdl_t *buf,
+    size_t nBytes)
+{
+	size_t firstPage = buf->offset / PGSIZE;
+	size_t pageOff = buf->offset % PGSIZE;
+	size_t nPages = (pageOff + nBytes + PGSIZE - 1) / PGSIZE;
+
+	assert(firstPage + nPages <= buf->nPages);
+
+	io->entry.prp[0] = (uint64_t)buf->pages[firstPage]->paddr + pageOff;
+
+	if (nPages == 1) {
+		io->entry.prp[1] = 0;
+	} else if (nPages == 2) {
+		io->entry.prp[1] = (uint64_t)buf->pages[firstPage + 1]->paddr;
+	} else {
+		assert(nPages - 1 <= NVME_PRP_LIST_ENTRIES);
+
+		for (size_t i = 1; i < nPages; i++)
+			req->prpList[i - 1] =
+			    (uint64_t)buf->pages[firstPage + i]->paddr;
+
+		io->entry.prp[1] = (uint64_t)req->prpListPhys;
+	}
 }
 
 static void nvme_intr(md_intr_frame_t *frame, void *arg);
+static void nvme_msix_intr(md_intr_frame_t *frame, void *arg);
+static void nvme_intx_dpc(void *arg);
+static void nvme_queue_dpc(void *arg);
+static void nvme_aer_done(void *data, ssize_t result);
+static void nvme_aer_log_done(void *data, ssize_t result);
 
 @implementation NVMeController
 
 @synthesize controllerId = m_controllerId;
 @synthesize maxBlockTransfer = maxBlockTransfer;
+@synthesize coalesceTime = coalesceTime;
+@synthesize coalesceThreshold = coalesceThreshold;
+
+- (unsigned)ioQueueDepth
+{
+	return ioQueueEntries - 1;
+}
 
 + (BOOL)probeWithPCIInfo:(dk_device_pci_info_t *)pciInfo
 {
@@ -219,108 +468,262 @@ controller_disable(vaddr_t regs)
 }
 
 /*
- * Usable only when there are and will be no async requests in-flight!
+ * Submit a command to \p queue; its CID is filled in, as are its PRP entries
+ * if \p buf is not NULL. Alternatively, \p data (of at most a page) is copied
+ * to the request's PRP list page and PRP1 pointed at it. When the command
+ * completes, DW0 of its completion is stored in \p result if that is not NULL,
+ * then \p completion is called. Returns -EAGAIN if the queue is full.
  */
-- (int)polledSubmit:(struct nvme_sqe *)cmd toQueue:(struct nvme_queue *)queue
+- (int)submitCommand:(struct nvme_sqe *)sqe
+	     toQueue:(struct nvme_queue *)queue
+	      buffer:(vm_mdl_t *)buf
+	      nbytes:(size_t)nbytes
+		data:(const void *)data
+	      result:(uint32_t *)result
+	  completion:(struct dk_diskio_completion *)completion
 {
-	int    flags;
-	size_t cnt = 0;
+	int		     iff = md_intr_disable();
+	struct nvme_request *req;
 
-	write32(regs + NVME_INTMS, 0x1);
+	queue_lock(queue);
+	req = SIMPLEQ_FIRST(&queue->req_q);
+	if (req == NULL) {
+		queue_unlock(queue);
+		md_intr_x(iff);
+		return -EAGAIN;
+	}
+	SIMPLEQ_REMOVE_HEAD(&queue->req_q, entry);
 
-	cmd->cid = cmdId++;
+	req->completion = completion;
+	req->result = result;
+	/* a command without a data transfer completes with result 0 */
+	req->nbytes = buf != NULL ? nbytes : 0;
+	sqe->cid = req->cid;
+	if (buf != NULL) {
+		prp_setup(req, (struct nvme_sqe_io *)sqe, buf, nbytes);
+	} else if (data != NULL) {
+		assert(nbytes <= PGSIZE && req->prpList != NULL);
+		memcpy(req->prpList, data, nbytes);
+		sqe->entry.prp[0] = (uint64_t)req->prpListPhys;
+	}
 
-	queue->sq[queue->sqtail++] = *cmd;
+	queue->sq[queue->sqtail++] = *sqe;
 	if (queue->sqtail == queue->sqslots)
 		queue->sqtail = 0;
 
-	*(uint32_t *)(regs + queue->sqtdbl) = queue->sqtail;
+	if (queue->batch == 0)
+		*(uint32_t *)(regs + queue->sqtdbl) = queue->sqtail;
+	else
+		queue->sqdirty = true;
 
-	while (true) {
-		flags = queue->cq[queue->cqhead].flags;
+	queue_unlock(queue);
+	md_intr_x(iff);
 
-		if ((flags & 0x1) == queue->phase)
-			break;
+	return 0;
+}
 
-		asm("pause");
-		if (cnt++ > 0x10000000) {
-			fatal("FIXME: add a proper timeout\n");
-		}
-	}
+/* Submit an I/O command on the current CPU's queue. */
+- (int)submitCommand:(struct nvme_sqe *)sqe
+	      buffer:(vm_mdl_t *)buf
+	      nbytes:(size_t)nbytes
+		data:(const void *)data
+	  completion:(struct dk_diskio_completion *)completion
+{
+	int iff = md_intr_disable();
+	int r;
 
-	assert(queue->cq[queue->cqhead].cid == cmd->cid);
+	r = [self submitCommand:sqe
+			toQueue:ioqueues[curcpu()->num % nioqueues]
+			 buffer:buf
+			 nbytes:nbytes
+			   data:data
+			 result:NULL
+		     completion:completion];
+	md_intr_x(iff);
+
+	return r;
+}
+
+/*
+ * Submit a command without a buffer on the current CPU's queue; if the queue is
+ * full, wait for a completion and retry, as the block queue retries reads and
+ * writes. For commands which bypass the block queue; thread context only.
+ */
+- (int)submitCommandWaiting:(struct nvme_sqe *)sqe
+		     nbytes:(size_t)nbytes
+		       data:(const void *)data
+		 completion:(struct dk_diskio_completion *)completion
+{
+	int r;
+
+	/* counted before trying, so a slot freed after the try wakes us */
+	__atomic_add_fetch(&slotWaiters, 1, __ATOMIC_SEQ_CST);
+	while ((r = [self submitCommand:sqe
+				 buffer:NULL
+				 nbytes:nbytes
+				   data:data
+			     completion:completion]) == -EAGAIN)
+		semaphore_wait(&slotSem, -1);
+	__atomic_sub_fetch(&slotWaiters, 1, __ATOMIC_SEQ_CST);
+
+	return r;
+}
 
-	if (flags >> 1 != 0) {
-		DKDevLog(self, "Command error %d\n", flags);
-		union nvme_status_code code;
-		code.asShort = flags;
-		fatal("panicking for debug\n");
+/*
+ * Carry out an admin command synchronously. If \p result is not NULL, DW0 of
+ * the completion is stored there. Until admin completions are delivered by
+ * interrupt, the admin queue is polled for the completion, and the command is
+ * given up on if it takes too long. Returns 0 or -errno.
+ */
+- (int)adminCommand:(struct nvme_sqe *)cmd result:(uint32_t *)result
+{
+	struct nvme_admin_sync	    sync;
+	struct dk_diskio_completion comp;
+	struct nvme_request	   *req;
+	int			    iff, r;
+
+	sync.sem = (semaphore_t)SEMAPHORE_INITIALIZER(sync.sem);
+	sync.done = false;
+	comp.callback = admin_sync_done;
+	comp.data = &sync;
+
+	r = [self submitCommand:cmd
+			toQueue:adminq
+			 buffer:NULL
+			 nbytes:0
+			   data:NULL
+			 result:result
+		     completion:&comp];
+	if (r < 0)
+		return r;
+
+	if (adminIntr) {
+		r = semaphore_wait(&sync.sem, -1);
+		assert(r == kWQSuccess);
+		return sync.result;
 	}
 
-	if (++queue->cqhead == queue->cqslots) {
-		queue->cqhead = 0;
-		queue->phase = !queue->phase;
+	for (size_t cnt = 0; !atomic_load(&sync.done); cnt++) {
+		if (cnt < kNVMeAdminPollSpins) {
+			iff = md_intr_disable();
+			[self queueCompleteRequests:adminq];
+			md_intr_x(iff);
+			asm("pause");
+			continue;
+		}
+
+		/* abandon it, unless it's just completed */
+		req = &adminq->reqs[cmd->cid];
+		iff = md_intr_disable();
+		queue_lock(adminq);
+		if (req->completion == &comp) {
+			req->completion = &admin_discarded;
+			req->result = NULL;
+		}
+		queue_unlock(adminq);
+		md_intr_x(iff);
+		if (atomic_load(&sync.done))
+			break;
+
+		DKDevLog(self, "admin command 0x%x timed out\n", cmd->opcode);
+		return -ETIMEDOUT;
 	}
 
-	*(uint32_t *)(regs + queue->cqhdbl) = queue->cqhead;
+	return sync.result;
+}
 
-	write32(regs + NVME_INTMC, 0x1);
+/*
+ * Begin a batch of submissions on the current CPU's queue: the submission
+ * queue tail doorbell is written only once, when the batch is committed.
+ * Interrupts must be disabled until -commitBatch.
+ */
+- (void)beginBatch
+{
+	struct nvme_queue *queue = ioqueues[curcpu()->num % nioqueues];
 
-	return flags >> 1;
+	queue_lock(queue);
+	queue->batch++;
+	queue_unlock(queue);
 }
 
-- (int)submitRequest:(struct nvme_request *)req
-	   toQueue:(struct nvme_queue *)queue
-    withCompletion:(struct dk_diskio_completion *)completion
+- (void)commitBatch
+{
+	struct nvme_queue *queue = ioqueues[curcpu()->num % nioqueues];
+
+	queue_lock(queue);
+	assert(queue->batch > 0);
+	if (--queue->batch == 0 && queue->sqdirty) {
+		*(uint32_t *)(regs + queue->sqtdbl) = queue->sqtail;
+		queue->sqdirty = false;
+	}
+	queue_unlock(queue);
+}
+
+- (void)pollCompletions
 {
 	int iff = md_intr_disable();
+	[self queueCompleteRequests:ioqueues[curcpu()->num % nioqueues]];
+	md_intr_x(iff);
+}
 
-	spinlock_lock(&queue->lock);
-	req->sqe->cid = req->cid;
+- (int)setInterruptCoalescingTime:(unsigned)time
+			threshold:(unsigned)threshold
+{
+	struct nvme_sqe cmd = { 0 };
+	int		r;
 
-	queue->sq[queue->sqtail++] = *req->sqe;
-	req->sqe = NULL;
-	if (queue->sqtail == queue->sqslots)
-		queue->sqtail = 0;
+	if (time > 255 || threshold > 256)
+		return -EINVAL;
 
-	*(uint32_t *)(regs + queue->sqtdbl) = queue->sqtail;
+	cmd.opcode = NVM_ADMIN_SET_FEATURES;
+	cmd.cdw10 = NVM_FEAT_INTERRUPT_COALESCING;
+	cmd.cdw11 = NVM_INTR_COAL_TIME(time) |
+	    NVM_INTR_COAL_THR(threshold > 0 ? threshold - 1 : 0);
 
-	spinlock_unlock(&queue->lock);
-	md_intr_x(iff);
+	r = [self adminCommand:&cmd result:NULL];
+	if (r < 0)
+		return r;
+
+	coalesceTime = time;
+	coalesceThreshold = threshold;
 
 	return 0;
 }
 
 - (void)queueCompleteRequests:(struct nvme_queue *)queue
 {
-	spinlock_lock(&queue->lock);
+	unsigned nDone = 0, nWaiters;
+	size_t	 nDisks;
+
+	queue_lock(queue);
 	while (true) {
 		uint16_t flags = queue->cq[queue->cqhead].flags;
 		uint16_t cid = queue->cq[queue->cqhead].cid;
 		struct nvme_request *req;
+		struct dk_diskio_completion *completion;
+		ssize_t result;
 
 		if ((flags & 0x1) != queue->phase)
 			break;
 
-		if (flags >> 1 != 0) {
-			DKDevLog(self, "Command error %d\n", flags);
-			union nvme_status_code code;
-			code.asShort = flags;
-			fatal("panicking for debugging purposes\n");
-		}
-
-		assert(cid < queue->cqslots);
+		assert(cid < queue->sqslots - 1);
 		req = &queue->reqs[cid];
 		assert (req->completion);
-		req->completion->callback(req->completion->data, req->nbytes);
+		completion = req->completion;
+		result = req->nbytes;
 
-		/*
-		 * todo(med): free PRP list? i think better we just keep PRP
-		 * list allocated and associated with an nvme_req and reuse it.
-		 */
+		if (flags >> 1 != 0) {
+			DKDevLog(self,
+			    "command %hu failed: status type %d, code 0x%x\n",
+			    cid, NVME_CQE_SCT(flags) >> 8,
+			    NVME_CQE_SC(flags) >> 1);
+			result = -EIO;
+		} else if (req->result != NULL)
+			*req->result = queue->cq[queue->cqhead].cdw0;
 
 		/* return request to free queue */
 		req->completion = NULL;
+		req->result = NULL;
 		req->nbytes = 0;
 		SIMPLEQ_INSERT_HEAD(&queue->req_q, req, entry);
 
@@ -330,8 +733,34 @@ controller_disable(vaddr_t regs)
 		}
 
 		*(uint32_t *)(regs + queue->cqhdbl) = queue->cqhead;
+
+		/* the callback may submit more commands, e.g. the block queue's */
+		queue_unlock(queue);
+		completion->callback(completion->data, result);
+		queue_lock(queue);
+		nDone++;
+	}
+	queue_unlock(queue);
+
+	if (nDone == 0)
+		return;
+
+	/* wake as many waiting for a slot as slots were freed */
+	nWaiters = __atomic_load_n(&slotWaiters, __ATOMIC_SEQ_CST);
+	for (unsigned i = 0; i < MIN(nDone, nWaiters); i++)
+		semaphore_signal(&slotSem);
+
+	/*
+	 * and retry I/O refused for want of them; it may be another
+	 * namespace's, with nothing in flight to retry it on completion
+	 */
+	nDisks = __atomic_load_n(&ndisks, __ATOMIC_ACQUIRE);
+	for (size_t i = 0; i < nDisks; i++) {
+		dk_blk_queue_t *blkq = [disks[i] blockQueue];
+
+		if (blkq != NULL)
+			dk_blk_kick(blkq);
 	}
-	spinlock_unlock(&queue->lock);
 }
 
 #define TRIMSPACES(CHARARR)                                                   \
@@ -342,10 +771,11 @@ controller_disable(vaddr_t regs)
 			break;                                                \
 	}
 
-- (void)identifyController
+- (int)identifyController
 {
 	vm_page_t	  *page = vm_pagealloc(1, &vm_pgwiredq);
 	struct nvme_sqe cmd = { 0 };
+	int		r;
 
 	cident = P2V(page->paddr);
 
@@ -354,20 +784,34 @@ controller_disable(vaddr_t regs)
 	cmd.cdw10 = 1; /* get controller info */
 	cmd.entry.prp[0] = (uint64_t)V2P(cident);
 
-	[self polledSubmit:&cmd toQueue:adminq];
+	r = [self adminCommand:&cmd result:NULL];
+	if (r < 0)
+		return r;
 
 	TRIMSPACES(cident->mn);
 	TRIMSPACES(cident->fr);
 	TRIMSPACES(cident->sn);
-	/* TODO(low): handle non 512 byte block size */
-	maxBlockTransfer = (1 << cident->mdts) * PGSIZE / 512;
+	/*
+	 * MDTS is in units of the minimum page size, which we check is ours;
+	 * 0 means no limit. We are also limited by what one PRP list page can
+	 * describe.
+	 * TODO(low): handle non 512 byte block size
+	 */
+	if (cident->mdts != 0)
+		maxBlockTransfer = MIN((1 << cident->mdts),
+				       NVME_PRP_LIST_ENTRIES) *
+		    PGSIZE / 512;
+	else
+		maxBlockTransfer = NVME_PRP_LIST_ENTRIES * PGSIZE / 512;
 
 	DKDevLog(self, "%s, firmware %s, serial %s\n", cident->mn, cident->fr,
 	    cident->sn);
+
+	return 0;
 }
 
 /* out must be a pointer in the HHDM to a page */
-- (int)identifyNamespace:(uint8_t)nsNum out:(struct nvm_identify_namespace *)out
+- (int)identifyNamespace:(uint32_t)nsNum out:(struct nvm_identify_namespace *)out
 {
 	struct nvme_sqe cmd = { 0 };
 
@@ -376,7 +820,42 @@ controller_disable(vaddr_t regs)
 	cmd.cdw10 = 0; /* get namespace info */
 	cmd.entry.prp[0] = (uint64_t)V2P(out);
 
-	return [self polledSubmit:&cmd toQueue:adminq];
+	return [self adminCommand:&cmd result:NULL];
+}
+
+/*
+ * Get the active NSIDs, in ascending order and terminated by 0 if fewer than
+ * kNVMeNSListEntries, into the page at \p out. Controllers before NVMe 1.1
+ * lack the active namespace list, so NSIDs 1 to NN inclusive are tried there.
+ */
+- (void)activeNamespaces:(uint32_t *)out
+{
+	struct nvm_identify_namespace *nsident;
+	struct nvme_sqe		       cmd = { 0 };
+	vm_page_t		      *page;
+	size_t			       n = 0;
+
+	cmd.opcode = 0x06; /* admin identify */
+	cmd.nsid = 0;	   /* list those above 0 */
+	cmd.cdw10 = 2;	   /* get active namespace list */
+	cmd.entry.prp[0] = (uint64_t)V2P(out);
+
+	if ([self adminCommand:&cmd result:NULL] == 0)
+		return;
+
+	page = vm_pagealloc(1, &vm_pgwiredq);
+	nsident = P2V(page->paddr);
+
+	for (uint64_t i = 1; i <= cident->nn && n < kNVMeNSListEntries; i++) {
+		nsident->nsze = 0;
+		if ([self identifyNamespace:i out:nsident] == 0 &&
+		    nsident->nsze != 0)
+			out[n++] = i;
+	}
+	if (n < kNVMeNSListEntries)
+		out[n] = 0;
+
+	vm_page_free(page);
 }
 
 - (int)enable
@@ -414,26 +893,36 @@ controller_disable(vaddr_t regs)
 }
 
 - (struct nvme_queue *)createQueuePairWithID:(uint16_t)qid
+				      vector:(uint16_t)vector
 {
-	struct nvme_queue *queue = queue_alloc(qid, dstrd);
-	uint16_t	   status;
+	struct nvme_queue *queue = queue_alloc(qid, dstrd, ioQueueEntries);
+	int		   r;
 	struct nvme_sqe_q  create = { 0 };
 
-	assert(queue != NULL);
+	if (queue == NULL) {
+		DKDevLog(self, "failed to allocate queue pair %d\n", qid);
+		return NULL;
+	}
+	queue->controller = self;
 
 	/* completion queue */
 	create.opcode = NVM_ADMIN_ADD_IOCQ;
 	create.qid = qid;
 	create.prp1 = (uint64_t)V2P(queue->cq);
 	create.qsize = queue->cqslots - 1;
-	create.cqid = 0; /* IRQ vector */
+	create.cqid = vector; /* IRQ vector */
 	/* physically contiguous, interrupts enabled */
 	create.qflags = NVM_SQE_Q_PC | NVM_SQE_CQ_IEN;
 
-	status = [self polledSubmit:(struct nvme_sqe *)&create toQueue:adminq];
-	assert(status == 0);
+	r = [self adminCommand:(struct nvme_sqe *)&create result:NULL];
+	if (r < 0) {
+		DKDevLog(self, "failed to create completion queue %d: %d\n",
+		    qid, r);
+		queue_free(queue);
+		return NULL;
+	}
 
-	/* completion queue */
+	/* submission queue */
 	create.opcode = NVM_ADMIN_ADD_IOSQ;
 	create.cqid = qid;
 	create.prp1 = (uint64_t)V2P(queue->sq);
@@ -441,12 +930,239 @@ controller_disable(vaddr_t regs)
 	create.cqid = qid;	      /* completion queue */
 	create.qflags = NVM_SQE_Q_PC; /* physically contiguous */
 
-	status = [self polledSubmit:(struct nvme_sqe *)&create toQueue:adminq];
-	assert(status == 0);
+	r = [self adminCommand:(struct nvme_sqe *)&create result:NULL];
+	if (r < 0) {
+		/* the controller still has the completion queue; leak it */
+		DKDevLog(self, "failed to create submission queue %d: %d\n",
+		    qid, r);
+		return NULL;
+	}
 
 	return queue;
 }
 
+/*
+ * Ask for \p nwanted I/O queue pairs.
+ *
+ * @returns the number of pairs allocated, at most \p nwanted.
+ */
+- (size_t)requestIOQueues:(size_t)nwanted
+{
+	struct nvme_sqe cmd = { 0 };
+	uint32_t	result;
+	size_t		nsq, ncq;
+
+	cmd.opcode = NVM_ADMIN_SET_FEATURES;
+	cmd.cdw10 = NVM_FEATURE_NUMBER_OF_QUEUES;
+	cmd.cdw11 = (nwanted - 1) << 16 | (nwanted - 1);
+
+	if ([self adminCommand:&cmd result:&result] != 0)
+		return 1;
+
+	/* both are 0's-based */
+	nsq = (result & 0xffff) + 1;
+	ncq = (result >> 16) + 1;
+
+	return MIN(nwanted, MIN(nsq, ncq));
+}
+
+/*
+ * Create the I/O queue pairs and set up their interrupts. With MSI-X, there is
+ * a pair for each CPU, if the controller allows, and vector i + 1 serves queue
+ * ioqueues[i] and is delivered to CPU i. Vector 0 serves the admin queue and
+ * is delivered to CPU 0. Without MSI-X, a single pair is shared by all CPUs,
+ * and it and the admin queue are completed from the INTx handler. Either way,
+ * admin commands are interrupt-driven from then on.
+ */
+- (int)setupIOQueues
+{
+	size_t nmsix = [PCIBus msixVectorCountOf:&m_pciInfo];
+	size_t nwanted = 1;
+	BOOL   useMSIx = NO;
+	int    r;
+
+	if (nmsix >= 2) {
+		useMSIx = YES;
+		nwanted = MIN(ncpu, nmsix - 1);
+	}
+
+	nioqueues = [self requestIOQueues:nwanted];
+	ioqueues = kmem_alloc(sizeof(*ioqueues) * nioqueues);
+
+	adminq->dpc.callback = nvme_queue_dpc;
+	adminq->dpc.arg = adminq;
+	if (useMSIx) {
+		r = [PCIBus handleMSIxOf:&m_pciInfo
+				   entry:0
+			     withHandler:nvme_msix_intr
+				argument:adminq
+			      atPriority:kSPLBIO
+				   onCPU:cpus[0]];
+		if (r < 0) {
+			DKDevLog(self, "Failed to set up MSI-X vector 0: %d\n",
+			    r);
+			return r;
+		}
+	}
+
+	for (size_t i = 0; i < nioqueues; i++) {
+		uint16_t qid = i + 1;
+
+		ioqueues[i] = [self createQueuePairWithID:qid
+						   vector:useMSIx ? qid : 0];
+		if (ioqueues[i] == NULL)
+			return -EIO;
+		ioqueues[i]->shared = nioqueues < ncpu;
+		ioqueues[i]->dpc.callback = nvme_queue_dpc;
+		ioqueues[i]->dpc.arg = ioqueues[i];
+
+		if (!useMSIx)
+			continue;
+
+		r = [PCIBus handleMSIxOf:&m_pciInfo
+				   entry:qid
+			     withHandler:nvme_msix_intr
+				argument:ioqueues[i]
+			      atPriority:kSPLBIO
+				   onCPU:cpus[i]];
+		if (r < 0) {
+			DKDevLog(self, "Failed to set up MSI-X vector %d: %d\n",
+			    qid, r);
+			return r;
+		}
+	}
+
+	if (useMSIx) {
+		[PCIBus setMSIxOf:&m_pciInfo enabled:YES];
+		msix = YES;
+	} else {
+		/* the one DPC completes all queues, then unmasks INTx */
+		ioqueues[0]->dpc.callback = nvme_intx_dpc;
+		ioqueues[0]->dpc.arg = self;
+		r = [PCIBus handleInterruptOf:&m_pciInfo
+				  withHandler:nvme_intr
+				     argument:self
+				   atPriority:kSPLBIO];
+		if (r < 0) {
+			DKDevLog(self,
+			    "Failed to allocate interrupt handler: %d\n", r);
+			return r;
+		}
+		[PCIBus setInterruptsOf:&m_pciInfo enabled:YES];
+	}
+
+	adminIntr = YES;
+
+	DKDevLog(self, "%lu I/O queue pair(s) of %lu entries%s\n", nioqueues,
+	    ioQueueEntries, msix ? " with MSI-X" : "");
+
+	return 0;
+}
+
+- (void)submitAsyncEventRequest
+{
+	struct nvme_sqe cmd = { 0 };
+	int		r;
+
+	cmd.opcode = NVM_ADMIN_ASYNC_EV_REQ;
+
+	r = [self submitCommand:&cmd
+			toQueue:adminq
+			 buffer:NULL
+			 nbytes:0
+			   data:NULL
+			 result:&aer->dw0
+		     completion:&aer->evCompletion];
+	if (r < 0)
+		DKDevLog(self, "Failed to submit async event request: %d\n",
+		    r);
+}
+
+/* read the log page of the event just reported */
+- (void)readAsyncEventLog
+{
+	struct nvme_sqe cmd = { 0 };
+	int		r;
+
+	cmd.opcode = NVM_ADMIN_GET_LOG_PG;
+	cmd.cdw10 = NVM_LOG_PG_LID(NVME_AER_LOG_PAGE(aer->dw0)) |
+	    NVM_LOG_PG_NUMDL(PGSIZE);
+	cmd.entry.prp[0] = (uint64_t)V2P(aer->log);
+
+	r = [self submitCommand:&cmd
+			toQueue:adminq
+			 buffer:NULL
+			 nbytes:0
+			   data:NULL
+			 result:NULL
+		     completion:&aer->logCompletion];
+	if (r < 0)
+		aer->logCompletion.callback(aer, r);
+}
+
+- (void)reportAsyncEvent:(ssize_t)logResult
+{
+	static const char *types[8] = {
+		[NVME_AER_TYPE_ERROR] = "error",
+		[NVME_AER_TYPE_SMART] = "SMART/health",
+		[NVME_AER_TYPE_NOTICE] = "notice",
+		[NVME_AER_TYPE_IO] = "I/O command set",
+		[NVME_AER_TYPE_VENDOR] = "vendor specific",
+	};
+	uint32_t    dw0 = aer->dw0;
+	const char *type = types[NVME_AER_TYPE(dw0)];
+
+	DKDevLog(self, "Async event: %s, info 0x%x, log page 0x%x\n",
+	    type != NULL ? type : "reserved", NVME_AER_INFO(dw0),
+	    NVME_AER_LOG_PAGE(dw0));
+
+	if (logResult < 0)
+		DKDevLog(self, "Failed to read its log page: %ld\n",
+		    (long)logResult);
+	else if (NVME_AER_TYPE(dw0) == NVME_AER_TYPE_SMART)
+		/* the first byte of the SMART log is the critical warning */
+		DKDevLog(self, "Critical warning 0x%x\n",
+		    *(uint8_t *)aer->log);
+	else if (NVME_AER_TYPE(dw0) == NVME_AER_TYPE_NOTICE &&
+	    NVME_AER_INFO(dw0) == 0)
+		DKDevLog(self, "Namespace attributes changed; not rescanned\n");
+}
+
+/*
+ * Enable reporting of critical warnings and (if supported) namespace changes,
+ * and submit the first Asynchronous Event Request. Admin commands must be
+ * interrupt-driven by now.
+ */
+- (void)setupAsyncEvents
+{
+	struct nvme_sqe cmd = { 0 };
+	vm_page_t      *page;
+	int		r;
+
+	assert(adminIntr);
+
+	aer = kmem_zalloc(sizeof(*aer));
+	page = vm_pagealloc(1, &vm_pgwiredq);
+	aer->controller = self;
+	aer->log = P2V(page->paddr);
+	aer->evCompletion.callback = nvme_aer_done;
+	aer->evCompletion.data = aer;
+	aer->logCompletion.callback = nvme_aer_log_done;
+	aer->logCompletion.data = aer;
+
+	cmd.opcode = NVM_ADMIN_SET_FEATURES;
+	cmd.cdw10 = NVM_FEAT_ASYNC_EVENT_CONFIGURATION;
+	cmd.cdw11 = NVM_AEC_SMART_CRIT_WARN;
+	if (cident->oaes & NVME_ID_CTRLR_OAES_NS_ATTR)
+		cmd.cdw11 |= NVM_AEC_NS_ATTR;
+
+	r = [self adminCommand:&cmd result:NULL];
+	if (r < 0)
+		DKDevLog(self, "Failed to configure async events: %d\n", r);
+
+	[self submitAsyncEventRequest];
+}
+
 /* for GDB debugging purposes */
 #undef malloc
 void *malloc(size_t size)
@@ -460,26 +1176,23 @@ void *malloc(size_t size)
 	struct nvme_cap cap;
 	struct nvme_ver ver;
 	vm_page_t *page = vm_pagealloc(1, &vm_pgwiredq);
+	vm_page_t *listPage = vm_pagealloc(1, &vm_pgwiredq);
+	uint32_t  *nsids = P2V(listPage->paddr);
+	size_t	   nActive = 0;
+	unsigned   coalTime = kNVMeDefaultCoalesceTime;
+	unsigned   coalThreshold = kNVMeDefaultCoalesceThreshold;
 	int r;
 
 	self = [super initWithProvider:pciInfo->busObj];
 	m_controllerId = nvmeId++;
+	m_pciInfo = *pciInfo;
+	slotSem = (semaphore_t)SEMAPHORE_INITIALIZER(slotSem);
+	slotWaiters = 0;
 	kmem_asprintf(&m_name, "NVMe%d", m_controllerId);
 
 	[self registerDevice];
 	DKLogAttach(self);
 
-	r = [PCIBus handleInterruptOf:pciInfo
-			  withHandler:nvme_intr
-			     argument:self
-			   atPriority:kSPL0];
-
-	if (r < 0) {
-		DKDevLog(self, "Failed to allocate interrupt handler: %d\n", r);
-		[self release];
-		return NULL;
-	}
-
 	regs = P2V([PCIBus getBar:0 info:pciInfo]);
 	copy32(&cap, regs + NVME_CAP, sizeof cap);
 	copy32(&ver, regs + NVME_VS, sizeof ver);
@@ -490,7 +1203,14 @@ void *malloc(size_t size)
 	else
 		DKDevLog(self, "NVMe version %d.%d\n", ver.maj, ver.min);
 
-	adminq = queue_alloc(0, cap.DSTRD);
+	dstrd = cap.DSTRD;
+	/* MQES is 0's based */
+	ioQueueEntries = MIN(cap.MQES + 1, kNVMeMaxQueueEntries);
+	adminq = queue_alloc(0, dstrd, kNVMeAdminQueueEntries);
+	assert(adminq != NULL);
+	adminq->controller = self;
+	/* submitted to from any CPU, and completed on CPU 0 */
+	adminq->shared = true;
 
 	assert(cap.MPSMIN == 0 && "doesn't support host pagesize");
 
@@ -501,113 +1221,344 @@ void *malloc(size_t size)
 		return nil;
 	}
 
-	[PCIBus setInterruptsOf:pciInfo enabled:YES];
+	r = [self identifyController];
+	if (r < 0) {
+		DKDevLog(self, "Failed to identify controller: %d\n", r);
+		[self release];
+		return nil;
+	}
+
+	r = [self setupIOQueues];
+	if (r < 0) {
+		[self release];
+		return nil;
+	}
 
-	[self identifyController];
+	polled = boot_option("nvme.poll");
+	if (polled) {
+		coalTime = kNVMePolledCoalesceTime;
+		coalThreshold = kNVMePolledCoalesceThreshold;
+	}
+	r = [self setInterruptCoalescingTime:coalTime threshold:coalThreshold];
+	if (r < 0)
+		DKDevLog(self, "Failed to configure interrupt coalescing: %d\n",
+		    r);
 
-	/* create I/O submission and completion queues */
-	/* just one pair for now; eventually one per CPU would be nice */
-	ioqueue = [self createQueuePairWithID:1];
-	assert(ioqueue != NULL);
+	[self setupAsyncEvents];
 
-	/* identify namespaces */
-	for (int i = 1; i < cident->nn; i++) {
+	/*
+	 * Attach the active namespaces, each with an equal share of an I/O
+	 * queue's depth.
+	 */
+	[self activeNamespaces:nsids];
+	while (nActive < kNVMeNSListEntries && nsids[nActive] != 0)
+		nActive++;
+
+	disks = kmem_alloc(sizeof(*disks) * MAX(nActive, 1));
+	for (size_t i = 0; i < nActive; i++) {
 		struct nvm_identify_namespace *nsident = P2V(page->paddr);
 		struct nvme_disk_attach	       diskAttachInfo;
 
 		nsident->nsze = 0;
-		[self identifyNamespace:i out:nsident];
-		if (nsident->nsze == 0)
+		r = [self identifyNamespace:nsids[i] out:nsident];
+		if (r < 0 || nsident->nsze == 0)
 			continue;
 
 		diskAttachInfo.controller = self;
-		diskAttachInfo.nsid = i;
+		diskAttachInfo.nsid = nsids[i];
 		diskAttachInfo.nsident = nsident;
+		diskAttachInfo.queueDepth = MAX([self ioQueueDepth] / nActive,
+		    1);
+		diskAttachInfo.polled = polled;
 
 		NVMeDisk *disk = [[NVMeDisk alloc]
 		    initWithAttachmentInfo:&diskAttachInfo];
 
-		(void)disk; /* TODO: keep track of it? */
+		disks[ndisks] = disk;
+		/* queueCompleteRequests: may already be reading disks */
+		__atomic_store_n(&ndisks, ndisks + 1, __ATOMIC_RELEASE);
 	}
 
+	vm_page_free(listPage);
+
 	return self;
 }
 
+- (int)ioBlocks:(blksize_t)nBlocks
+	     at:(blkoff_t)offset
+	   nsid:(uint16_t)nsid
+	 opcode:(uint8_t)opcode
+	ioflags:(uint16_t)ioflags
+	 buffer:(vm_mdl_t *)buf
+     completion:(struct dk_diskio_completion *)completion
+{
+	struct nvme_sqe_io io = { 0 };
+
+	io.opcode = opcode;
+	io.nsid = nsid;
+	io.slba = offset;
+	io.nlb = nBlocks - 1;
+	io.ioflags = ioflags;
+
+	assert(nBlocks <= maxBlockTransfer);
+
+	/* TODO(low): block size other than 512 bytes */
+	return [self submitCommand:(struct nvme_sqe *)&io
+			    buffer:buf
+			    nbytes:nBlocks * 512
+			      data:NULL
+			completion:completion];
+}
+
 - (int)readBlocks:(blksize_t)nBlocks
 	       at:(blkoff_t)offset
 	     nsid:(uint16_t)nsid
        intoBuffer:(vm_mdl_t *)buf
        completion:(struct dk_diskio_completion *)completion
 {
-	int	  r;
-	int 	  iff = md_intr_disable();
-	struct nvme_sqe_io io = { 0 };
-	struct nvme_request *req;
-	vm_mdl_t *prpListMDL;
+	return [self ioBlocks:nBlocks
+			   at:offset
+			 nsid:nsid
+		       opcode:NVM_CMD_READ
+		      ioflags:0
+		       buffer:buf
+		   completion:completion];
+}
 
-	spinlock_lock(&ioqueue->lock);
-	req = SIMPLEQ_LAST(&ioqueue->req_q, nvme_request, entry);
-	assert(req != NULL);
-	SIMPLEQ_REMOVE(&ioqueue->req_q, req, nvme_request, entry);
-	spinlock_unlock(&ioqueue->lock);
-	md_intr_x(iff);
+- (int)writeBlocks:(blksize_t)nBlocks
+		at:(blkoff_t)offset
+	      nsid:(uint16_t)nsid
+	fromBuffer:(vm_mdl_t *)buf
+	   options:(int)options
+	completion:(struct dk_diskio_completion *)completion
+{
+	return [self ioBlocks:nBlocks
+			   at:offset
+			 nsid:nsid
+		       opcode:NVM_CMD_WRITE
+		      ioflags:(options & kDKWriteFUA) ? NVM_SQE_IO_FUA : 0
+		       buffer:buf
+		   completion:completion];
+}
 
-	req->completion = completion;
-	req->sqe = (struct nvme_sqe *)&io;
-	/* TODO(low): block size other than 512 bytes */
-	req->nbytes = nBlocks * 512;
-	io.opcode = NVM_CMD_READ;
-	io.nsid = nsid;
-	io.slba = offset;
-	io.nlb = nBlocks - 1;
+- (int)flushNamespace:(uint16_t)nsid
+	   completion:(struct dk_diskio_completion *)completion
+{
+	struct nvme_sqe cmd = { 0 };
 
-	assert(nBlocks < maxBlockTransfer);
+	/* without a volatile write cache, every completed write is durable */
+	if (!(cident->vwc & NVME_ID_CTRLR_VWC_PRESENT)) {
+		completion->callback(completion->data, 0);
+		return 0;
+	}
 
-	if (buf->nPages == 1) {
-		io.entry.prp[0] = (uint64_t)buf->pages[0]->paddr;
-	} else if (buf->nPages == 2) {
-		io.entry.prp[0] = (uint64_t)buf->pages[0]->paddr;
-		io.entry.prp[1] = (uint64_t)buf->pages[1]->paddr;
-	} else {
-		size_t nPRPPerList = PGSIZE / sizeof(void *) - 1;
-		size_t nPRPLists = ROUNDUP((buf->nPages - 1), nPRPPerList) /
-			nPRPPerList + 1;
-		size_t iPRPList = 0;
+	cmd.opcode = NVM_CMD_FLUSH;
+	cmd.nsid = nsid;
 
-		r = vm_mdl_new_with_capacity(&prpListMDL, nPRPLists * PGSIZE);
-		assert(r >= 0);
+	return [self submitCommandWaiting:&cmd
+				   nbytes:0
+				     data:NULL
+			       completion:completion];
+}
 
-		for (int i = 1; i < buf->nPages; i++) {
-			void **entry = prpListMDL->pages[iPRPList]->paddr +
-			    (i - 1) * sizeof(void *);
+/*
+ * The ranges are sorted and overlapping or adjacent ones merged; the result is
+ * packed NVM_DSM_MAX_RANGES to a Dataset Management command, each command's
+ * range list being copied into its request's PRP list page.
+ */
+- (int)trimBlockRanges:(const struct dk_range *)ranges
+		 count:(size_t)nRanges
+		  nsid:(uint16_t)nsid
+	    completion:(struct dk_diskio_completion *)completion
+{
+	struct dk_range *merged;
+	size_t		 nMerged = 0, nEntries = 0, nCmds, iEntry = 0;
+	struct nvme_join *join = NULL;
+	struct nvme_dsm_range *list;
 
-			entry = P2V(entry);
+	if (!(cident->oncs & NVME_ID_CTRLR_ONCS_DSM))
+		return -EOPNOTSUPP;
 
-			if (i > 1 && (i - 1) % nPRPPerList == 0) {
-				/* place the pointer to next PRP list */
-				*entry = prpListMDL->pages[++iPRPList]->paddr;
-				i--;
-				continue;
-			}
+	reap_joins();
+
+	merged = kmem_alloc(sizeof(*merged) * MAX(nRanges, 1));
+	if (merged == NULL)
+		return -ENOMEM;
 
-			*entry = buf->pages[i]->paddr;
+	/* insertion sort; lists of ranges are short */
+	for (size_t i = 0; i < nRanges; i++) {
+		size_t j = nMerged++;
+
+		while (j > 0 && merged[j - 1].start > ranges[i].start) {
+			merged[j] = merged[j - 1];
+			j--;
 		}
+		merged[j] = ranges[i];
+	}
 
-		io.entry.prp[0] = (uint64_t)buf->pages[0]->paddr;
-		io.entry.prp[1] = (uint64_t)prpListMDL->pages[0]->paddr;
+	/* merge overlapping and adjacent ranges */
+	if (nMerged > 0) {
+		size_t out = 0;
+
+		for (size_t i = 1; i < nMerged; i++) {
+			int64_t end = merged[out].start + merged[out].length;
+
+			if (merged[i].start <= end) {
+				int64_t iend = merged[i].start +
+				    merged[i].length;
+				if (iend > end)
+					merged[out].length = iend -
+					    merged[out].start;
+			} else
+				merged[++out] = merged[i];
+		}
+		nMerged = out + 1;
 	}
 
-	r = [self submitRequest:req toQueue:ioqueue withCompletion:completion];
+	/* a range entry's length is 32 bits */
+	for (size_t i = 0; i < nMerged; i++)
+		nEntries += ROUNDUP(merged[i].length, (uint64_t)UINT32_MAX + 1) /
+		    ((uint64_t)UINT32_MAX + 1);
 
-	return r;
+	if (nEntries == 0) {
+		kmem_free(merged, sizeof(*merged) * MAX(nRanges, 1));
+		completion->callback(completion->data, 0);
+		return 0;
+	}
+
+	list = kmem_alloc(sizeof(*list) * NVM_DSM_MAX_RANGES);
+	if (list == NULL) {
+		kmem_free(merged, sizeof(*merged) * MAX(nRanges, 1));
+		return -ENOMEM;
+	}
+
+	nCmds = ROUNDUP(nEntries, NVM_DSM_MAX_RANGES) / NVM_DSM_MAX_RANGES;
+	if (nCmds > 1) {
+		join = kmem_alloc(sizeof(*join));
+		if (join == NULL) {
+			kmem_free(list, sizeof(*list) * NVM_DSM_MAX_RANGES);
+			kmem_free(merged, sizeof(*merged) * MAX(nRanges, 1));
+			return -ENOMEM;
+		}
+		join->completion.callback = join_complete;
+		join->completion.data = join;
+		join->parent = completion;
+		join->remaining = nCmds;
+		join->error = 0;
+		completion = &join->completion;
+	}
+
+	for (size_t i = 0; i < nMerged; i++) {
+		uint64_t start = merged[i].start, left = merged[i].length;
+
+		while (left > 0) {
+			uint32_t nlb = MIN(left, UINT32_MAX);
+
+			list[iEntry].cattr = 0;
+			list[iEntry].nlb = nlb;
+			list[iEntry].slba = start;
+			start += nlb;
+			left -= nlb;
+
+			if (++iEntry == NVM_DSM_MAX_RANGES ||
+			    (left == 0 && i == nMerged - 1)) {
+				struct nvme_sqe cmd = { 0 };
+				int		r;
+
+				cmd.opcode = NVM_CMD_DSM;
+				cmd.nsid = nsid;
+				cmd.cdw10 = NVM_DSM_NR(iEntry);
+				cmd.cdw11 = NVM_DSM_AD;
+
+				r = [self
+				    submitCommandWaiting:&cmd
+						  nbytes:sizeof(*list) * iEntry
+						    data:list
+					      completion:completion];
+				if (r != 0)
+					completion->callback(completion->data,
+					    r);
+
+				iEntry = 0;
+			}
+		}
+	}
+
+	kmem_free(list, sizeof(*list) * NVM_DSM_MAX_RANGES);
+	kmem_free(merged, sizeof(*merged) * MAX(nRanges, 1));
+
+	return 0;
 }
 
 @end
 
+/*
+ * INTx handler; the one I/O queue is shared, and the admin queue shares its
+ * interrupt. INTx is level-triggered, so it is masked until the DPC has
+ * consumed the completions asserting it.
+ */
 static void
 nvme_intr(md_intr_frame_t *frame, void *arg)
 {
 	NVMeController *controller = arg;
 
-	[controller queueCompleteRequests:controller->ioqueue];
+	write32((void *)(controller->regs + NVME_INTMS), 1);
+	dpc_enqueue(&controller->ioqueues[0]->dpc);
+}
+
+static void
+nvme_intx_dpc(void *arg)
+{
+	NVMeController *controller = arg;
+
+	[controller queueCompleteRequests:controller->adminq];
+	for (size_t i = 0; i < controller->nioqueues; i++)
+		[controller queueCompleteRequests:controller->ioqueues[i]];
+	write32((void *)(controller->regs + NVME_INTMC), 1);
+}
+
+/*
+ * MSI-X handler; runs on the CPU to which the queue belongs. The completions
+ * themselves are left to the DPC, so that further interrupts arriving in the
+ * meantime are coalesced into its one pass over the completion queue.
+ */
+static void
+nvme_msix_intr(md_intr_frame_t *frame, void *arg)
+{
+	struct nvme_queue *queue = arg;
+
+	dpc_enqueue(&queue->dpc);
+}
+
+static void
+nvme_queue_dpc(void *arg)
+{
+	struct nvme_queue *queue = arg;
+
+	/*
+	 * Interrupts are enabled, but hard interrupts no longer touch the
+	 * queue, and submitters disable them, keeping this DPC off the CPU.
+	 */
+	[queue->controller queueCompleteRequests:queue];
+}
+
+static void
+nvme_aer_done(void *data, ssize_t result)
+{
+	struct nvme_aer *aer = data;
+
+	/* e.g. aborted as the controller is reset; don't resubmit */
+	if (result < 0)
+		return;
+
+	[aer->controller readAsyncEventLog];
+}
+
+static void
+nvme_aer_log_done(void *data, ssize_t result)
+{
+	struct nvme_aer *aer = data;
+
+	[aer->controller reportAsyncEvent:result];
+	[aer->controller submitAsyncEventRequest];
 }
@@ -19,6 +19,8 @@ struct nvme_disk_attach {
 	NVMeController		       *controller;
 	uint16_t		       nsid;
 	struct nvm_identify_namespace *nsident;
+	unsigned		       queueDepth; /* initial limit */
+	BOOL			       polled;	   /* initial polled */
 };
 
 @interface NVMeDisk : DKDrive <DKDriveMethods> {
@@ -8,6 +8,8 @@
  * All rights reserved.
  */
 
+#include <sys/param.h>
+
 #include "NVMeController.h"
 #include "NVMeDisk.h"
 #include "dev/GPTVolumeManager.h"
@@ -33,11 +35,14 @@
 			       ->lbaf[NVME_ID_NS_FLBAS(info->nsident->flbas)]
 			       .lbads;
 	m_maxBlockTransfer = [info->controller maxBlockTransfer];
+	m_queueDepth = info->queueDepth;
+	m_polled = info->polled;
 	[self registerDevice];
 
-	DKLogAttachExtra(self, "NSID %d; %lu MiB (blocksize %ld, blocks %ld)",
+	DKLogAttachExtra(self,
+	    "NSID %d; %lu MiB (blocksize %ld, blocks %ld); queue depth %u",
 	    info->nsid, m_nBlocks * m_blockSize / 1024 / 1024, m_blockSize,
-	    m_nBlocks);
+	    m_nBlocks, m_queueDepth);
 
 	[[DKLogicalDisk alloc]
 	    initWithUnderlyingDisk:self
@@ -50,6 +55,17 @@
 	return self;
 }
 
+/*
+ * A namespace deeper than an I/O queue could fill a CPU's queue by itself, and
+ * the I/O of the others would wait on it. So none is made deeper than a queue.
+ * (That doesn't bound the sum across namespaces; I/O refused for that reason is
+ * retried by the controller kicking every namespace's queue on completions.)
+ */
+- (void)setQueueDepth:(unsigned)depth
+{
+	[super setQueueDepth:MIN(depth, [[self getController] ioQueueDepth])];
+}
+
 - (int)readBlocks:(blksize_t)nBlocks
 	       at:(blkoff_t)offset
        intoBuffer:(vm_mdl_t *)buf
@@ -65,8 +81,46 @@
 - (int)writeBlocks:(blksize_t)nBlocks
 		at:(blkoff_t)offset
 	fromBuffer:(vm_mdl_t *)buf
+	   options:(int)options
 	completion:(struct dk_diskio_completion *)completion
 {
+	return [[self getController] writeBlocks:nBlocks
+					      at:offset
+					    nsid:nsid
+				      fromBuffer:buf
+					 options:options
+				      completion:completion];
+}
+
+- (void)beginBatch
+{
+	[[self getController] beginBatch];
+}
+
+- (void)commitBatch
+{
+	[[self getController] commitBatch];
+}
+
+- (BOOL)pollCompletions
+{
+	[[self getController] pollCompletions];
+	return YES;
+}
+
+- (int)flushCacheWithCompletion:(struct dk_diskio_completion *)completion
+{
+	return [[self getController] flushNamespace:nsid completion:completion];
+}
+
+- (int)trimBlockRanges:(const struct dk_range *)ranges
+		 count:(size_t)nRanges
+	    completion:(struct dk_diskio_completion *)completion
+{
+	return [[self getController] trimBlockRanges:ranges
+					       count:nRanges
+						nsid:nsid
+					  completion:completion];
 }
 
 @end
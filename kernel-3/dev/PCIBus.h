@@ -7,6 +7,8 @@
 #include "lai/core.h"
 #include "machine/intr.h"
 
+struct cpu;
+
 @class PCIBus;
 
 typedef struct dk_device_pci_info {
@@ -17,6 +19,10 @@ typedef struct dk_device_pci_info {
 	uint8_t	 fun;
 
 	uint8_t pin;
+	/** offset of the MSI-X capability in config space; 0 if none */
+	uint8_t msixCap;
+	/** MSI-X table, once handleMSIxOf: has mapped it */
+	volatile void *msixTable;
 } dk_device_pci_info_t;
 
 @interface PCIBus : DKDevice
@@ -26,6 +32,27 @@ typedef struct dk_device_pci_info {
 	     withHandler:(intr_handler_fn_t)handler
 		argument:(void *)arg
 	      atPriority:(ipl_t)priority;
+/**
+ * Count the MSI-X vectors of a function.
+ *
+ * @returns number of MSI-X table entries, or 0 if MSI-X is unsupported
+ */
++ (int)msixVectorCountOf:(dk_device_pci_info_t *)pciInfo;
+/**
+ * Handle an MSI-X vector: allocates an IDT vector, and programs and unmasks
+ * MSI-X table entry \p entry to deliver it to the local APIC of \p cpu.
+ * MSI-X must then be enabled with setMSIxOf:enabled:.
+ *
+ * @returns IDT vector number if installed successfully, -errno otherwise
+ */
++ (int)handleMSIxOf:(dk_device_pci_info_t *)pciInfo
+	      entry:(uint16_t)entry
+	withHandler:(intr_handler_fn_t)handler
+	   argument:(void *)arg
+	 atPriority:(ipl_t)priority
+	      onCPU:(struct cpu *)cpu;
+/** enable or disable MSI-X; while enabled, INTx is not asserted */
++ (void)setMSIxOf:(dk_device_pci_info_t *)pciInfo enabled:(BOOL)enabled;
 + (void)enableMemorySpace:(dk_device_pci_info_t *)pciInfo;
 + (void)enableBusMastering:(dk_device_pci_info_t *)pciInfo;
 + (void)setInterruptsOf:(dk_device_pci_info_t *)pciInfo enabled:(BOOL)enabled;
@@ -1,3 +1,7 @@
+#include <kern/task.h>
+
+#include <errno.h>
+
 #include "dev/IOApic.h"
 #include "dev/PCIBus.h"
 #include "acpi/laiex.h"
@@ -26,6 +30,26 @@ enum {
 	kCapMSIx = 0x11,
 };
 
+/* MSI-X capability registers, relative to the capability */
+enum {
+	kMSIxMessageControl = 0x2, /* u16 */
+	kMSIxTable = 0x4,	   /* u32; bits 0-2 BIR, rest offset */
+};
+
+enum {
+	kMSIxControlEnable = 1 << 15,
+	kMSIxControlFunctionMask = 1 << 14,
+	kMSIxControlTableSizeMask = 0x7ff, /* table size minus 1 */
+};
+
+/* MSI-X table entry */
+struct msix_entry {
+	uint32_t addrLow; /* 0xfee00000 | destination LAPIC ID << 12 */
+	uint32_t addrHigh;
+	uint32_t data; /* vector; fixed delivery, edge triggered */
+	uint32_t control; /* bit 0 = masked */
+};
+
 static int
 laiex_eval_one_int(lai_nsnode_t *node, const char *path, uint64_t *out,
     lai_state_t *state)
@@ -97,6 +121,74 @@ iterate(lai_nsnode_t *obj, size_t depth)
 	return 0;
 }
 
++ (int)msixVectorCountOf:(dk_device_pci_info_t *)pciInfo
+{
+	if (pciInfo->msixCap == 0)
+		return 0;
+
+	return (laihost_pci_readw(INFO_ARGS(pciInfo),
+		    pciInfo->msixCap + kMSIxMessageControl) &
+		   kMSIxControlTableSizeMask) +
+	    1;
+}
+
++ (int)handleMSIxOf:(dk_device_pci_info_t *)pciInfo
+	      entry:(uint16_t)entry
+	withHandler:(intr_handler_fn_t)handler
+	   argument:(void *)arg
+	 atPriority:(ipl_t)priority
+	      onCPU:(cpu_t *)cpu
+{
+	volatile struct msix_entry *table;
+	int			    nvecs = [self msixVectorCountOf:pciInfo];
+	int			    vec;
+
+	if (entry >= nvecs)
+		return -EINVAL;
+
+	if (pciInfo->msixTable == NULL) {
+		uint32_t tableReg = laihost_pci_readd(INFO_ARGS(pciInfo),
+		    pciInfo->msixCap + kMSIxTable);
+
+		/* the BAR may be above 4GiB, and beyond the direct map */
+		pciInfo->msixTable = vm_kernel_map_mmio(
+		    [self getBar:tableReg & 0x7 info:pciInfo] +
+			(tableReg & ~0x7u),
+		    sizeof(struct msix_entry) * nvecs);
+		if (pciInfo->msixTable == NULL)
+			return -ENOMEM;
+	}
+	table = pciInfo->msixTable;
+
+	vec = md_intr_alloc(priority, handler, arg);
+	if (vec < 0)
+		return -ENOSPC;
+
+	table[entry].control = 1;
+	table[entry].addrLow = 0xfee00000 | (cpu->md.lapic_id & 0xff) << 12;
+	table[entry].addrHigh = 0;
+	table[entry].data = vec;
+	table[entry].control = 0;
+
+	return vec;
+}
+
++ (void)setMSIxOf:(dk_device_pci_info_t *)pciInfo enabled:(BOOL)enabled
+{
+	voff_t	 reg = pciInfo->msixCap + kMSIxMessageControl;
+	uint16_t control;
+
+	assert(pciInfo->msixCap != 0);
+
+	control = laihost_pci_readw(INFO_ARGS(pciInfo), reg);
+	control &= ~kMSIxControlFunctionMask;
+	if (enabled)
+		control |= kMSIxControlEnable;
+	else
+		control &= ~kMSIxControlEnable;
+	laihost_pci_writew(INFO_ARGS(pciInfo), reg, control);
+}
+
 + (void)enableMemorySpace:(dk_device_pci_info_t *)pciInfo
 {
 	ENABLE_CMD_FLAG(pciInfo, 0x1 | 0x2);
@@ -117,9 +209,17 @@ iterate(lai_nsnode_t *obj, size_t depth)
 
 + (paddr_t)getBar:(uint8_t)num info:(dk_device_pci_info_t *)pciInfo
 {
-	return (paddr_t)((uintptr_t)laihost_pci_readd(INFO_ARGS(pciInfo),
-			     kBaseAddress0 + sizeof(uint32_t) * num) &
-	    0xfffffff0);
+	uint32_t  bar = laihost_pci_readd(INFO_ARGS(pciInfo),
+	     kBaseAddress0 + sizeof(uint32_t) * num);
+	uintptr_t addr = bar & 0xfffffff0;
+
+	/* 64-bit memory BAR; the next BAR holds the high dword */
+	if ((bar & 0x7) == 0x4)
+		addr |= (uintptr_t)laihost_pci_readd(INFO_ARGS(pciInfo),
+			    kBaseAddress0 + sizeof(uint32_t) * (num + 1))
+		    << 32;
+
+	return (paddr_t)addr;
 }
 
 + (BOOL)probeWithAcpiNode:(lai_nsnode_t *)node provider:(DKDevice*)provider;
@@ -162,6 +262,7 @@ doCapability(dk_device_pci_info_t *pciInfo, voff_t pCap)
 	switch (cap) {
 	case kCapMSIx:
 		DKDevLog(pciInfo->busObj, "Supports MSI-x\n");
+		pciInfo->msixCap = pCap;
 		break;
 	}
 }
@@ -189,6 +290,8 @@ doFunction(PCIBus *bus, uint16_t seg, uint8_t busNum, uint8_t slot, uint8_t fun)
 	pciInfo.slot = slot;
 	pciInfo.fun = fun;
 	pciInfo.pin = CFG_READ(b, kInterruptPin);
+	pciInfo.msixCap = 0;
+	pciInfo.msixTable = NULL;
 
 	DKDevLog(bus,
 	    "Function at %d:%d:%d:%d: "
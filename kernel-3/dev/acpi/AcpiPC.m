@@ -7,6 +7,7 @@
 #include "dev/PCIBus.h"
 //#include "dev/PS2Keyboard.h"
 #include <kern/kmem.h>
+#include <kern/task.h>
 #include <libkern/klib.h>
 
 #include "devicekit/DKDevice.h"
@@ -44,6 +45,55 @@ typedef struct {
 	uint16_t		 flags;
 } __attribute__((packed)) acpi_madt_int_override_t;
 
+typedef struct {
+	acpi_header_t header;
+	uint32_t      reserved1;
+	uint64_t      reserved2;
+	uint8_t	      entries[0];
+} __attribute__((packed)) acpi_srat_t;
+
+/* SRAT entry type 0 */
+typedef struct {
+	acpi_madt_entry_header_t header;
+	uint8_t			 domain_lo;
+	uint8_t			 lapic_id;
+	uint32_t		 flags;
+	uint8_t			 sapic_eid;
+	uint8_t			 domain_hi[3];
+	uint32_t		 clock_domain;
+} __attribute__((packed)) acpi_srat_lapic_t;
+
+/* SRAT entry type 1 */
+typedef struct {
+	acpi_madt_entry_header_t header;
+	uint32_t		 domain;
+	uint16_t		 reserved1;
+	uint64_t		 base;
+	uint64_t		 length;
+	uint32_t		 reserved2;
+	uint32_t		 flags;
+	uint64_t		 reserved3;
+} __attribute__((packed)) acpi_srat_mem_t;
+
+/* SRAT entry type 2 */
+typedef struct {
+	acpi_madt_entry_header_t header;
+	uint16_t		 reserved1;
+	uint32_t		 domain;
+	uint32_t		 x2apic_id;
+	uint32_t		 flags;
+	uint32_t		 clock_domain;
+	uint32_t		 reserved2;
+} __attribute__((packed)) acpi_srat_x2apic_t;
+
+typedef struct {
+	acpi_header_t header;
+	uint64_t      nlocalities;
+	uint8_t	      entries[0];
+} __attribute__((packed)) acpi_slit_t;
+
+enum { kSRATEnabled = 0x1 };
+
 acpi_rsdt_t *rsdt = NULL;
 acpi_xsdt_t *xsdt = NULL;
 mcfg_t      *mcfg = NULL;
@@ -467,6 +517,158 @@ parse_intrs(acpi_madt_entry_header_t *item, void *arg)
 	}
 }
 
+/* proximity domain -> node numbering; nodes numbered by first appearance */
+static uint32_t numa_domains[VM_MAX_NODES];
+static int	numa_ndomains = 0;
+
+static int
+numa_node_for(uint32_t domain)
+{
+	for (int i = 0; i < numa_ndomains; i++)
+		if (numa_domains[i] == domain)
+			return i;
+
+	if (numa_ndomains == VM_MAX_NODES) {
+		DKLog("AcpiPC0", "too many NUMA domains; domain %u on node 0\n",
+		    domain);
+		return 0;
+	}
+
+	numa_domains[numa_ndomains] = domain;
+	return numa_ndomains++;
+}
+
+static void
+srat_walk(acpi_srat_t *srat,
+    void (*callback)(acpi_madt_entry_header_t *item, void *arg), void *arg)
+{
+	for (uint8_t *item = &srat->entries[0];
+	     item < (uint8_t *)srat + srat->header.length;) {
+		acpi_madt_entry_header_t *header = (acpi_madt_entry_header_t *)
+		    item;
+		if (header->length == 0)
+			break;
+		callback(header, arg);
+		item += header->length;
+	}
+}
+
+struct numa_ranges {
+	struct vm_numa_range ranges[32];
+	size_t		     nranges;
+};
+
+static void
+parse_srat_mem(acpi_madt_entry_header_t *item, void *arg)
+{
+	struct numa_ranges *nr = arg;
+	acpi_srat_mem_t	   *mem;
+
+	if (item->type != 1)
+		return;
+
+	mem = (acpi_srat_mem_t *)item;
+	if (!(mem->flags & kSRATEnabled) || mem->length == 0)
+		return;
+
+	if (nr->nranges == elementsof(nr->ranges)) {
+		DKLog("AcpiPC0", "too many SRAT memory ranges\n");
+		return;
+	}
+
+	nr->ranges[nr->nranges].base = (paddr_t)mem->base;
+	nr->ranges[nr->nranges].size = mem->length;
+	nr->ranges[nr->nranges].node = numa_node_for(mem->domain);
+	nr->nranges++;
+}
+
+static void
+cpu_set_node(uint32_t apic_id, int node)
+{
+	for (int i = 0; i < ncpu; i++)
+		if (cpus[i]->md.lapic_id == apic_id)
+			cpus[i]->node = node;
+}
+
+/* arg non-NULL to assign CPUs to nodes, rather than just number the nodes */
+static void
+parse_srat_cpus(acpi_madt_entry_header_t *item, void *arg)
+{
+	if (item->type == 0) {
+		acpi_srat_lapic_t *lapic = (acpi_srat_lapic_t *)item;
+		uint32_t	   domain = lapic->domain_lo |
+		    lapic->domain_hi[0] << 8 | lapic->domain_hi[1] << 16 |
+		    lapic->domain_hi[2] << 24;
+
+		if (!(lapic->flags & kSRATEnabled))
+			return;
+		if (arg != NULL)
+			cpu_set_node(lapic->lapic_id, numa_node_for(domain));
+		else
+			numa_node_for(domain);
+	} else if (item->type == 2) {
+		acpi_srat_x2apic_t *x2apic = (acpi_srat_x2apic_t *)item;
+
+		if (!(x2apic->flags & kSRATEnabled))
+			return;
+		if (arg != NULL)
+			cpu_set_node(x2apic->x2apic_id,
+			    numa_node_for(x2apic->domain));
+		else
+			numa_node_for(x2apic->domain);
+	}
+}
+
+/*!
+ * Tell the VM system about the NUMA topology described by the SRAT, with
+ * distances from the SLIT if there is one, and assign CPUs to their nodes.
+ */
+static void
+numa_init(void)
+{
+	static struct numa_ranges nr;
+	static uint8_t		  distance[VM_MAX_NODES * VM_MAX_NODES];
+	acpi_srat_t		 *srat = laihost_scan("SRAT", 0);
+	acpi_slit_t		 *slit = laihost_scan("SLIT", 0);
+	bool			  havedistance = false;
+
+	if (srat == NULL)
+		return;
+
+	/* memory first, so that domains with memory get the low numbers */
+	srat_walk(srat, parse_srat_mem, &nr);
+	srat_walk(srat, parse_srat_cpus, NULL);
+
+	if (slit != NULL) {
+		havedistance = true;
+		for (int i = 0; i < numa_ndomains; i++)
+			for (int j = 0; j < numa_ndomains; j++) {
+				uint32_t from = numa_domains[i],
+					 to = numa_domains[j];
+
+				/* SLIT localities are the proximity domains */
+				if (from >= slit->nlocalities ||
+				    to >= slit->nlocalities) {
+					havedistance = false;
+					break;
+				}
+				distance[i * numa_ndomains + j] =
+				    slit->entries[from * slit->nlocalities +
+					to];
+			}
+	}
+
+	DKLog("AcpiPC0", "%d NUMA nodes, %zu memory ranges%s\n",
+	    numa_ndomains, nr.nranges, havedistance ? ", with SLIT" : "");
+
+	if (numa_ndomains > 1) {
+		vm_numa_configure(numa_ndomains, nr.ranges, nr.nranges,
+		    havedistance ? distance : NULL);
+		/* only now that the nodes are ready to allocate from */
+		srat_walk(srat, parse_srat_cpus, (void *)1);
+	}
+}
+
 #if 0
 static void
 laiex_create_integer(lai_variable_t *var, uint64_t val)
@@ -534,6 +736,8 @@ do_osc(lai_nsnode_t *osc)
 
 	mcfg = laihost_scan("MCFG", 0);
 
+	numa_init();
+
 	[self iterate:lai_resolve_path(NULL, "_SB_")];
 
 	return self;
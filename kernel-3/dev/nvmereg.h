@@ -348,6 +348,20 @@ NVME_CTASSERT(sizeof(struct nvme_cqe) == 16, "bad size for nvme_cqe");
 #define NVM_CMD_WRITE_ZEROES	0x08 /* Write Zeroes */
 #define NVM_CMD_DSM		0x09 /* Dataset Management */
 
+/* Dataset Management */
+#define NVM_DSM_MAX_RANGES	256
+#define NVM_DSM_NR(_n)		((_n) - 1)	/* CDW10: number of ranges */
+#define NVM_DSM_AD		__BIT(2)	/* CDW11: deallocate */
+#define NVM_DSM_IDW		__BIT(1)	/* CDW11: integral dataset write */
+#define NVM_DSM_IDR		__BIT(0)	/* CDW11: integral dataset read */
+
+struct nvme_dsm_range {
+	uint32_t	cattr;	/* Context Attributes */
+	uint32_t	nlb;	/* Length in Logical Blocks */
+	uint64_t	slba;	/* Starting LBA */
+} __packed __aligned(16);
+NVME_CTASSERT(sizeof(struct nvme_dsm_range) == 16, "bad size for nvme_dsm_range");
+
 /* Features for GET/SET FEATURES */
 /* 0x00 - reserved */
 #define NVM_FEAT_ARBITRATION			0x01
@@ -380,6 +394,28 @@ NVME_CTASSERT(sizeof(struct nvme_cqe) == 16, "bad size for nvme_cqe");
 
 #define NVM_VOLATILE_WRITE_CACHE_WCE	__BIT(0) 	/* Write Cache Enable */
 
+/* CDW11 of Interrupt Coalescing */
+#define NVM_INTR_COAL_THR(_n)	((_n) & 0xff)	/* threshold, 0's based */
+#define NVM_INTR_COAL_TIME(_t)	(((_t) & 0xff) << 8) /* time, 100us units */
+
+/* CDW11 of Asynchronous Event Configuration */
+#define NVM_AEC_SMART_CRIT_WARN	0xff		/* SMART critical warnings */
+#define NVM_AEC_NS_ATTR		__BIT(8)	/* namespace attribute notices */
+
+/* DW0 of an Asynchronous Event Request's completion */
+#define NVME_AER_TYPE(_dw0)	((_dw0) & 0x7)	/* event type */
+#define  NVME_AER_TYPE_ERROR	0x0
+#define  NVME_AER_TYPE_SMART	0x1
+#define  NVME_AER_TYPE_NOTICE	0x2
+#define  NVME_AER_TYPE_IO	0x6
+#define  NVME_AER_TYPE_VENDOR	0x7
+#define NVME_AER_INFO(_dw0)	(((_dw0) >> 8) & 0xff) /* event information */
+#define NVME_AER_LOG_PAGE(_dw0)	(((_dw0) >> 16) & 0xff) /* associated log */
+
+/* CDW10 of Get Log Page */
+#define NVM_LOG_PG_LID(_l)	((_l) & 0xff)	/* log page identifier */
+#define NVM_LOG_PG_NUMDL(_n)	((((_n) / 4) - 1) << 16) /* bytes, < 256KiB */
+
 /* Power State Descriptor Data */
 struct nvm_identify_psd {
 	uint16_t	mp;		/* Max Power */
@@ -438,6 +474,7 @@ struct nvm_identify_controller {
 	uint32_t	rtd3e;		/* RTD3 Enter Latency */
 
 	uint32_t	oaes;		/* Optional Asynchronous Events Supported */
+#define	NVME_ID_CTRLR_OAES_NS_ATTR	__BIT(8)
 	uint32_t	ctrattr;	/* Controller Attributes */
 
 	uint8_t		_reserved1[12];
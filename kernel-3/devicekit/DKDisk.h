@@ -16,25 +16,29 @@
 #include <vm/vm.h>
 
 #include "devicekit/DKDevice.h"
+#include "devicekit/dk_blk.h"
 
 /*!
- * Represents an I/O operation. The initiator of the operation allocates one of
- * these and passes it to a method; the initiator is responsible for freeing the
- * structure, but must ensure not to do so before the operation is completed.
- */
-struct dk_diskio_completion {
-	/*!
-	 * Function to be called when the I/O completes.
-	 * @param data the completion's data member
-	 * @param result number of writes read/writen, or -errno for error
-	 */
-	void (*callback)(void *data, ssize_t result);
-	/*! Opaque data passed to callback. */
-	void *data;
+ * A range of a disk; in bytes for DKAbstractDiskMethods, in blocks for
+ * DKDriveMethods.
+ */
+struct dk_range {
+	int64_t	 start;
+	uint64_t length;
+};
+
+/*! Options for a write. */
+enum dk_write_options {
+	/*! Complete only once the data is on non-volatile media. */
+	kDKWriteFUA = 1 << 0,
 };
 
 /*!
  * Protocol common to physical and logical disks.
+ *
+ * The flush and trim methods, like the reads and writes, complete
+ * synchronously if \p completion is NULL. Trim ranges need only remain valid
+ * for the duration of the call.
  */
 @protocol DKAbstractDiskMethods
 
@@ -45,9 +49,17 @@ struct dk_diskio_completion {
 	      at:(off_t)offset
       intoBuffer:(vm_mdl_t *)buf
       completion:(struct dk_diskio_completion *)completion;
+/*! @param options a mask of dk_write_options */
 - (int)writeBytes:(size_t)nBytes
 	       at:(off_t)offset
        fromBuffer:(vm_mdl_t *)buf
+	  options:(int)options
+       completion:(struct dk_diskio_completion *)completion;
+/*! Commit previously completed writes to non-volatile media. */
+- (int)flushWithCompletion:(struct dk_diskio_completion *)completion;
+/*! Discard (deallocate) the contents of some byte ranges of the disk. */
+- (int)trimRanges:(const struct dk_range *)ranges
+	    count:(size_t)nRanges
        completion:(struct dk_diskio_completion *)completion;
 
 @end
@@ -64,7 +76,17 @@ struct dk_diskio_completion {
 - (int)writeBlocks:(blksize_t)nBlocks
 		at:(blkoff_t)offset
 	fromBuffer:(vm_mdl_t *)buf
+	   options:(int)options
 	completion:(struct dk_diskio_completion *)completion;
+/*! Flush the drive's volatile write cache, if it has one. */
+- (int)flushCacheWithCompletion:(struct dk_diskio_completion *)completion;
+/*!
+ * Deallocate the given block ranges. The drive may merge and batch them as it
+ * sees fit; \p completion is called once, when all have been processed.
+ */
+- (int)trimBlockRanges:(const struct dk_range *)ranges
+		 count:(size_t)nRanges
+	    completion:(struct dk_diskio_completion *)completion;
 
 @end
 
@@ -75,12 +97,25 @@ struct dk_diskio_completion {
  *
  * Implementors must implement the DKDriveMethods protocol; its methods carry out
  * the actual I/O.
+ *
+ * Reads and writes pass through a block queue (see dk_blk.h), which merges,
+ * batches and schedules them; it is created when the drive is registered, so
+ * implementors must set the block size and maximum transfer (and the queue
+ * depth, if not the default) before calling -registerDevice.
  */
 @interface DKDrive : DKDevice <DKAbstractDiskMethods> {
 	int	  m_driveID;
 	blksize_t m_blockSize;
 	blkcnt_t  m_nBlocks;
 	blkcnt_t  m_maxBlockTransfer;
+	unsigned  m_queueDepth;
+
+	dk_blk_queue_t *m_blkq;
+	/*! serialises read-modify-writes of partial blocks */
+	mutex_t m_rmwLock;
+
+	BOOL	 m_polled;
+	uint64_t m_pollLatency; /* average synchronous I/O latency, cycles */
 }
 
 /*! Unique drive identifier. TODO: move into DKDrive */
@@ -92,6 +127,38 @@ struct dk_diskio_completion {
 /*! Maximum number of blocks transferrable in a single operation. */
 @property (readonly) blkcnt_t maxBlockTransfer;
 
+/*! Block queue through which reads and writes are issued (may be NULL.) */
+@property (readonly) dk_blk_queue_t *blockQueue;
+
+/*!
+ * Most reads and writes to have in flight at once. Implementors may set it
+ * before -registerDevice to size the block queue; afterwards it may be
+ * changed within that size (see dk_blk_set_depth().)
+ */
+@property unsigned queueDepth;
+
+/*!
+ * Begin a batch of reads and writes; they may be held back until the batch is
+ * committed. Called with interrupts disabled. The default does nothing.
+ */
+- (void)beginBatch;
+/*! Commit a batch of reads and writes. The default does nothing. */
+- (void)commitBatch;
+
+/*!
+ * Whether synchronous reads and writes poll for completion (for a time learnt
+ * from their latency) before sleeping. Only useful if -pollCompletions is
+ * implemented. NVMe namespaces set it if booted with nvme.poll.
+ */
+@property BOOL polled;
+
+/*!
+ * Process whatever I/O completions are pending for the current CPU, without
+ * waiting for an interrupt. The default does nothing.
+ * @returns whether the drive supports polling
+ */
+- (BOOL)pollCompletions;
+
 @end
 
 /*!
@@ -8,28 +8,239 @@
  * All rights reserved.
  */
 
+#include <sys/param.h>
+
+#include <kern/kmem.h>
 #include <kern/sync.h>
 #include <kern/task.h>
+#include <machine/machdep.h>
 
 #include <errno.h>
+#include <stdatomic.h>
 
 #include "DKDisk.h"
 
 #define selfDelegate ((DKDrive<DKDriveMethods> *)self)
 
 typedef enum dk_strategy {
-	kDKRead,
-	kDKWrite,
+	kDKRead = kDKBlkRead,
+	kDKWrite = kDKBlkWrite,
 } dk_strategy_t;
 
+enum {
+	/*! requests a drive's block queue keeps in flight, unless it says */
+	kDKDriveDefaultQueueDepth = 32,
+	/*!
+	 * most cycles to spin polling for a synchronous I/O; if they take
+	 * longer than this, sleeping is cheaper
+	 */
+	kDKDrivePollMaxSpin = 200000,
+};
+
+/*!
+ * One of the commands into which a split I/O is fanned out: either a direct
+ * transfer of whole blocks to or from a view of the parent's buffer, or a
+ * transfer of part of a single block, bounced through a block-sized buffer.
+ * A bounced write is a read-modify-write, carried out by -readModifyWrite:.
+ */
+struct dk_split_child {
+	struct dk_diskio_completion completion;
+	struct dk_split		   *split;
+	vm_mdl_t		   *mdl; /* buffer view, or bounce buffer */
+	blkoff_t		    block;
+	blkcnt_t		    nBlocks;
+
+	bool   bounce;
+	off_t  bufOff;	 /* offset of the data in the parent's buffer */
+	size_t blockOff; /* offset of the data in the block */
+	size_t len;	 /* bytes of data */
+};
+
+/*!
+ * An I/O too large or unaligned for the drive to carry out in one command.
+ */
+struct dk_split {
+	DKDrive<DKDriveMethods>	    *drive;
+	dk_strategy_t		     strategy;
+	int			     options;
+	vm_mdl_t		    *buf;
+	size_t			     nBytes;
+	struct dk_diskio_completion *completion;
+	atomic_size_t		     remaining; /* children not yet complete */
+	atomic_int		     error;	/* first error (-errno) if any */
+	struct dk_split		    *next;	/* in dead_splits */
+	size_t			     nChildren;
+	struct dk_split_child	     children[0];
+};
+
+/*
+ * Completed splits. Children complete in interrupt context, where kmem can't
+ * be called, so they are freed later from thread context by reap_splits().
+ */
+static _Atomic(struct dk_split *) dead_splits = NULL;
+
 static int driveIDCounter = 0;
 
+/* make an MDL referring to \p nBytes at \p off in \p mdl */
+static vm_mdl_t *
+mdl_view(vm_mdl_t *mdl, off_t off, size_t nBytes)
+{
+	size_t	  first, nPages;
+	vm_mdl_t *view;
+
+	off += mdl->offset;
+	first = off / PGSIZE;
+	nPages = (off % PGSIZE + nBytes + PGSIZE - 1) / PGSIZE;
+
+	view = kmem_alloc(sizeof(*view) + sizeof(vm_page_t *) * nPages);
+	if (view == NULL)
+		return NULL;
+
+	view->offset = off % PGSIZE;
+	view->nBytes = nBytes;
+	view->nPages = nPages;
+	for (size_t i = 0; i < nPages; i++)
+		view->pages[i] = mdl->pages[first + i];
+
+	return view;
+}
+
+static void
+split_free(struct dk_split *split)
+{
+	for (size_t i = 0; i < split->nChildren; i++) {
+		struct dk_split_child *child = &split->children[i];
+
+		if (child->mdl == NULL)
+			continue;
+		else if (child->bounce)
+			vm_mdl_free(child->mdl);
+		else
+			kmem_free(child->mdl,
+			    sizeof(*child->mdl) +
+				sizeof(vm_page_t *) * child->mdl->nPages);
+	}
+
+	kmem_free(split,
+	    sizeof(*split) + sizeof(struct dk_split_child) * split->nChildren);
+}
+
+static void
+reap_splits(void)
+{
+	struct dk_split *split = atomic_exchange(&dead_splits, NULL);
+
+	while (split != NULL) {
+		struct dk_split *next = split->next;
+		split_free(split);
+		split = next;
+	}
+}
+
+/* start a child other than a bounced write */
+static int
+split_child_start(struct dk_split_child *child)
+{
+	DKDrive<DKDriveMethods> *drive = child->split->drive;
+	dk_blk_queue_t		*blkq = [drive blockQueue];
+	bool			 reading = child->split->strategy == kDKRead;
+
+	if (blkq != NULL)
+		return dk_blk_submit(blkq, reading ? kDKBlkRead : kDKBlkWrite,
+		    child->block, child->nBlocks, child->mdl,
+		    reading ? 0 : child->split->options, &child->completion);
+
+	if (reading)
+		return [drive readBlocks:child->nBlocks
+				      at:child->block
+			      intoBuffer:child->mdl
+			      completion:&child->completion];
+	else
+		return [drive writeBlocks:child->nBlocks
+				       at:child->block
+			       fromBuffer:child->mdl
+				  options:child->split->options
+			       completion:&child->completion];
+}
+
+static void
+split_child_complete(void *data, ssize_t result)
+{
+	struct dk_split_child *child = data;
+	struct dk_split	      *split = child->split;
+	int		       expected = 0;
+
+	if (result < 0)
+		goto error;
+
+	if (child->bounce && split->strategy == kDKRead)
+		vm_mdl_copyin(split->buf,
+		    P2V(child->mdl->pages[0]->paddr) + child->blockOff,
+		    child->len, child->bufOff);
+
+	goto done;
+
+error:
+	atomic_compare_exchange_strong(&split->error, &expected, result);
+
+done:
+	if (atomic_fetch_sub(&split->remaining, 1) == 1) {
+		int error = atomic_load(&split->error);
+
+		split->completion->callback(split->completion->data,
+		    error != 0 ? error : split->nBytes);
+
+		split->next = atomic_load(&dead_splits);
+		while (!atomic_compare_exchange_weak(&dead_splits, &split->next,
+		    split))
+			;
+	}
+}
+
+static int
+drive_issue(void *arg, struct dk_blk_req *req, vm_mdl_t *buf)
+{
+	DKDrive<DKDriveMethods> *drive = arg;
+
+	if (req->op == kDKBlkRead)
+		return [drive readBlocks:req->nBlocks
+				      at:req->block
+			      intoBuffer:buf
+			      completion:&req->completion];
+	else
+		return [drive writeBlocks:req->nBlocks
+				       at:req->block
+			       fromBuffer:buf
+				  options:req->options
+			       completion:&req->completion];
+}
+
+static void
+drive_begin(void *arg)
+{
+	[(DKDrive *)arg beginBatch];
+}
+
+static void
+drive_commit(void *arg)
+{
+	[(DKDrive *)arg commitBatch];
+}
+
+static const struct dk_blk_driver_ops drive_blk_ops = {
+	.issue = drive_issue,
+	.begin = drive_begin,
+	.commit = drive_commit,
+};
+
 @implementation DKDrive
 
 @synthesize driveID = m_driveID;
 @synthesize blockSize = m_blockSize;
 @synthesize nBlocks = m_nBlocks;
 @synthesize maxBlockTransfer = m_maxBlockTransfer;
+@synthesize blockQueue = m_blkq;
+@synthesize polled = m_polled;
 
 - init
 {
@@ -40,9 +251,55 @@ static int driveIDCounter = 0;
 	return self;
 }
 
+- (void)registerDevice
+{
+	int r;
+
+	if (m_queueDepth == 0)
+		m_queueDepth = kDKDriveDefaultQueueDepth;
+
+	mutex_init(&m_rmwLock);
+
+	r = dk_blk_queue_new(&m_blkq, &drive_blk_ops, self, m_blockSize,
+	    m_maxBlockTransfer, m_queueDepth);
+	if (r < 0) {
+		DKDevLog(self, "failed to create block queue: %d\n", r);
+		m_blkq = NULL;
+	}
+
+	[super registerDevice];
+}
+
+- (unsigned)queueDepth
+{
+	return m_queueDepth;
+}
+
+- (void)setQueueDepth:(unsigned)depth
+{
+	if (m_blkq != NULL)
+		depth = dk_blk_set_depth(m_blkq, depth);
+	m_queueDepth = depth;
+}
+
+- (void)beginBatch
+{
+}
+
+- (void)commitBatch
+{
+}
+
+- (BOOL)pollCompletions
+{
+	return NO;
+}
+
 struct complete_sync_data {
 	semaphore_t sem;
 	ssize_t result;
+	uint64_t start, end; /* cycles at submission and completion */
+	atomic_bool done;
 };
 
 static void
@@ -50,36 +307,303 @@ complete_sync(void *data, ssize_t result)
 {
 	struct complete_sync_data *sync = data;
 	sync->result = result;
+	sync->end = md_cycles();
+	atomic_store(&sync->done, true);
 	semaphore_signal(&sync->sem);
 }
 
+/*
+ * If no completion was given, the operation is synchronous; substitute one
+ * which signals \p sync. Returns the completion to use.
+ */
+static struct dk_diskio_completion *
+sync_prepare(struct dk_diskio_completion *completion,
+    struct dk_diskio_completion *comp, struct complete_sync_data *sync)
+{
+	if (!completion) {
+		comp->callback = complete_sync;
+		comp->data = sync;
+		sync->sem = (semaphore_t)SEMAPHORE_INITIALIZER(sync->sem);
+		sync->done = false;
+		sync->start = md_cycles();
+		return comp;
+	} else {
+		comp->data = NULL;
+		return completion;
+	}
+}
+
+/* wait on a synchronous operation if it was started successfully */
+static int
+sync_finish(int r, struct dk_diskio_completion *comp,
+    struct complete_sync_data *sync)
+{
+	if (r != 0)
+		return r;
+
+	if (comp->data) {
+		/* synchronous case */
+		dk_blk_plug_flush();
+		r = semaphore_wait(&sync->sem, -1);
+		assert(r == kWQSuccess);
+		return sync->result;
+	} else
+		return 0;
+}
+
+/* carry out a one-block I/O synchronously, through the block queue if any */
+static int
+block_io_sync(DKDrive<DKDriveMethods> *drive, enum dk_blk_op op,
+    blkoff_t block, vm_mdl_t *mdl, int options)
+{
+	dk_blk_queue_t		   *blkq = [drive blockQueue];
+	struct dk_diskio_completion comp;
+	struct complete_sync_data   sync;
+	int			    r;
+
+	sync_prepare(NULL, &comp, &sync);
+
+	if (blkq != NULL)
+		r = dk_blk_submit(blkq, op, block, 1, mdl, options, &comp);
+	else if (op == kDKBlkRead)
+		r = [drive readBlocks:1 at:block intoBuffer:mdl completion:&comp];
+	else
+		r = [drive writeBlocks:1
+				    at:block
+			    fromBuffer:mdl
+			       options:options
+			    completion:&comp];
+
+	return sync_finish(r, &comp, &sync);
+}
+
+/*
+ * Carry out the read-modify-write of a bounced write, waiting on each half. A
+ * drive's read-modify-writes are serialised, lest two to the same block each
+ * write back the block as it was before the other's modification.
+ */
+- (int)readModifyWrite:(struct dk_split_child *)child
+{
+	struct dk_split *split = child->split;
+	int		 r;
+
+	mutex_lock(&m_rmwLock);
+	r = block_io_sync(selfDelegate, kDKBlkRead, child->block, child->mdl,
+	    0);
+	if (r >= 0) {
+		vm_mdl_copy(split->buf,
+		    P2V(child->mdl->pages[0]->paddr) + child->blockOff,
+		    child->len, child->bufOff);
+		r = block_io_sync(selfDelegate, kDKBlkWrite, child->block,
+		    child->mdl, split->options);
+	}
+	mutex_unlock(&m_rmwLock);
+
+	return r;
+}
+
+/*
+ * Carry out an I/O too large or unaligned to be done with one command. Whole
+ * blocks are transferred directly, in commands of at most maxBlockTransfer
+ * blocks; a partial block at the head or tail is bounced. All the commands are
+ * issued at once, except that a bounced write's read-modify-write is then
+ * carried out before returning; \p completion is called when the last
+ * completes.
+ */
+- (int)splitIO:(dk_strategy_t)strategy
+	  bytes:(size_t)nBytes
+	     at:(off_t)offset
+	 buffer:(vm_mdl_t *)buf
+	options:(int)options
+     completion:(struct dk_diskio_completion *)completion
+{
+	struct dk_split *split;
+	blkoff_t	 block = offset / m_blockSize;
+	blkoff_t	 endBlock = (offset + nBytes + m_blockSize - 1) /
+	    m_blockSize;
+	size_t		 headOff = offset % m_blockSize;
+	size_t		 tailLen = (offset + nBytes) % m_blockSize;
+	blkoff_t	 fullEnd = tailLen != 0 ? endBlock - 1 : endBlock;
+	size_t		 maxChildren, nChildren = 0;
+	off_t		 pos = 0;
+
+	assert(m_blockSize <= PGSIZE);
+
+	if (nBytes == 0) {
+		completion->callback(completion->data, 0);
+		return 0;
+	}
+
+	maxChildren = 2 +
+	    (endBlock - block + m_maxBlockTransfer - 1) / m_maxBlockTransfer;
+	split = kmem_zalloc(
+	    sizeof(*split) + sizeof(struct dk_split_child) * maxChildren);
+	if (split == NULL)
+		return -ENOMEM;
+
+	split->drive = selfDelegate;
+	split->strategy = strategy;
+	split->options = options;
+	split->buf = buf;
+	split->nBytes = nBytes;
+	split->completion = completion;
+	split->nChildren = maxChildren;
+
+#define NEW_CHILD()                                                     \
+	({                                                              \
+		struct dk_split_child *child_ = &split->children[nChildren++]; \
+		child_->completion.callback = split_child_complete;     \
+		child_->completion.data = child_;                       \
+		child_->split = split;                                  \
+		child_;                                                 \
+	})
+
+	/* partial head; perhaps the whole I/O, if it's within one block */
+	if (headOff != 0 || (tailLen != 0 && endBlock - block == 1)) {
+		struct dk_split_child *child = NEW_CHILD();
+
+		child->bounce = true;
+		child->block = block;
+		child->nBlocks = 1;
+		child->blockOff = headOff;
+		child->len = MIN(m_blockSize - headOff, nBytes);
+		child->bufOff = 0;
+
+		pos += child->len;
+		block++;
+	}
+
+	while (block < fullEnd) {
+		struct dk_split_child *child = NEW_CHILD();
+
+		child->block = block;
+		child->nBlocks = MIN(fullEnd - block, m_maxBlockTransfer);
+		child->mdl = mdl_view(buf, pos, child->nBlocks * m_blockSize);
+		if (child->mdl == NULL)
+			goto nomem;
+
+		pos += child->nBlocks * m_blockSize;
+		block += child->nBlocks;
+	}
+
+	/* partial tail */
+	if (block < endBlock) {
+		struct dk_split_child *child = NEW_CHILD();
+
+		child->bounce = true;
+		child->block = block;
+		child->nBlocks = 1;
+		child->blockOff = 0;
+		child->len = tailLen;
+		child->bufOff = pos;
+	}
+
+#undef NEW_CHILD
+
+	for (size_t i = 0; i < nChildren; i++) {
+		struct dk_split_child *child = &split->children[i];
+
+		if (child->bounce &&
+		    vm_mdl_new_with_capacity(&child->mdl, m_blockSize) < 0)
+			goto nomem;
+	}
+
+	split->remaining = nChildren;
+
+	for (size_t i = 0; i < nChildren; i++) {
+		struct dk_split_child *child = &split->children[i];
+		int		       r;
+
+		if (child->bounce && strategy == kDKWrite)
+			continue;
+		r = split_child_start(child);
+		if (r != 0)
+			split_child_complete(child, r);
+	}
+
+	for (size_t i = 0; i < nChildren; i++) {
+		struct dk_split_child *child = &split->children[i];
+
+		if (child->bounce && strategy == kDKWrite)
+			split_child_complete(child,
+			    [self readModifyWrite:child]);
+	}
+
+	return 0;
+
+nomem:
+	split_free(split);
+	return -ENOMEM;
+}
+
+/*
+ * Finish a read or write, waiting on it if it's synchronous. In polled mode,
+ * first spin polling the drive for its completion for a little longer than
+ * synchronous I/O has lately been taking (hybrid polling), sleeping only if it
+ * hasn't completed by then; the completion is then taken without the cost of a
+ * wakeup, and maybe without an interrupt.
+ */
+- (int)finishIO:(int)r
+     completion:(struct dk_diskio_completion *)comp
+	   sync:(struct complete_sync_data *)sync
+{
+	if (r != 0 || comp->data == NULL || !m_polled)
+		return sync_finish(r, comp, sync);
+
+	dk_blk_plug_flush();
+
+	if (m_pollLatency < kDKDrivePollMaxSpin) {
+		uint64_t spin = m_pollLatency + m_pollLatency / 4;
+
+		while (!atomic_load(&sync->done) &&
+		    md_cycles() - sync->start < spin)
+			if (![self pollCompletions])
+				break;
+	}
+
+	r = sync_finish(r, comp, sync);
+
+	/* learn (a moving average of) the latency */
+	m_pollLatency = m_pollLatency - m_pollLatency / 8 +
+	    (sync->end - sync->start) / 8;
+
+	return r;
+}
+
 - (int)commonIO:(dk_strategy_t)strategy
 	  bytes:(size_t)nBytes
 	     at:(off_t)offset
 	 buffer:(vm_mdl_t *)buf
+	options:(int)options
      completion:(struct dk_diskio_completion *)completion
 {
 	struct dk_diskio_completion comp;
 	struct complete_sync_data   sync;
 	int			    r;
 
-	if (!completion) {
-		completion = &comp;
-		comp.callback = complete_sync;
-		comp.data = &sync;
-		sync.sem = (semaphore_t)SEMAPHORE_INITIALIZER(sync.sem);
-	} else
-		comp.data = NULL;
+	reap_splits();
+
+	if (offset < 0 || offset + nBytes > m_nBlocks * m_blockSize)
+		return -EINVAL;
+
+	completion = sync_prepare(completion, &comp, &sync);
 
-	if (nBytes > m_maxBlockTransfer * m_blockSize) {
-		DKDevLog(self, "Excessive request received - not yet handled.");
-		return -EOPNOTSUPP;
+	if (nBytes == 0 || nBytes > m_maxBlockTransfer * m_blockSize ||
+	    offset % m_blockSize != 0 || nBytes % m_blockSize != 0) {
+		r = [self splitIO:strategy
+			    bytes:nBytes
+			       at:offset
+			   buffer:buf
+			  options:options
+		       completion:completion];
+		return sync_finish(r, &comp, &sync);
 	}
 
-	if (offset % m_blockSize != 0 || nBytes % m_blockSize != 0) {
-		DKDevLog(self,
-		    "Unaligned read request received - not yet handled.\n");
-		return -EOPNOTSUPP;
+	if (m_blkq != NULL) {
+		r = dk_blk_submit(m_blkq, (enum dk_blk_op)strategy,
+		    offset / m_blockSize, nBytes / m_blockSize, buf, options,
+		    completion);
+		return [self finishIO:r completion:&comp sync:&sync];
 	}
 
 	r = strategy == kDKRead ? [selfDelegate readBlocks:nBytes / m_blockSize
@@ -89,18 +613,10 @@ complete_sync(void *data, ssize_t result)
 				  [selfDelegate writeBlocks:nBytes / m_blockSize
 							 at:offset / m_blockSize
 						 fromBuffer:buf
+						    options:options
 						 completion:completion];
 
-	if (r != 0)
-		return r;
-
-	if (comp.data) {
-		/* synchronous case */
-		r = semaphore_wait(&sync.sem, -1);
-		assert(r == kWQSuccess);
-		return sync.result;
-	} else
-		return 0;
+	return [self finishIO:r completion:&comp sync:&sync];
 }
 
 - (int)readBytes:(size_t)nBytes
@@ -112,19 +628,82 @@ complete_sync(void *data, ssize_t result)
 			bytes:nBytes
 			   at:offset
 		       buffer:buf
+		      options:0
 		   completion:completion];
 }
 
 - (int)writeBytes:(size_t)nBytes
 	       at:(off_t)offset
        fromBuffer:(vm_mdl_t *)buf
+	  options:(int)options
        completion:(struct dk_diskio_completion *)completion
 {
 	return [self commonIO:kDKWrite
 			bytes:nBytes
 			   at:offset
 		       buffer:buf
+		      options:options
 		   completion:completion];
 }
 
+- (int)flushWithCompletion:(struct dk_diskio_completion *)completion
+{
+	struct dk_diskio_completion comp;
+	struct complete_sync_data   sync;
+	int			    r;
+
+	completion = sync_prepare(completion, &comp, &sync);
+	r = [selfDelegate flushCacheWithCompletion:completion];
+
+	return sync_finish(r, &comp, &sync);
+}
+
+/*
+ * Byte ranges are shrunk to the whole blocks they contain, since a partial
+ * block can't be trimmed; ranges containing no whole block are dropped.
+ */
+- (int)trimRanges:(const struct dk_range *)ranges
+	    count:(size_t)nRanges
+       completion:(struct dk_diskio_completion *)completion
+{
+	struct dk_diskio_completion comp;
+	struct complete_sync_data   sync;
+	struct dk_range		   *blockRanges;
+	size_t			    nBlockRanges = 0;
+	int			    r;
+
+	blockRanges = kmem_alloc(sizeof(*blockRanges) * MAX(nRanges, 1));
+	if (blockRanges == NULL)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < nRanges; i++) {
+		int64_t start = ROUNDUP(ranges[i].start, m_blockSize) /
+		    m_blockSize;
+		int64_t end = ROUNDDOWN(ranges[i].start + ranges[i].length,
+				  m_blockSize) /
+		    m_blockSize;
+
+		if (ranges[i].start < 0 || end > m_nBlocks) {
+			kmem_free(blockRanges,
+			    sizeof(*blockRanges) * MAX(nRanges, 1));
+			return -EINVAL;
+		}
+
+		if (end <= start)
+			continue;
+
+		blockRanges[nBlockRanges].start = start;
+		blockRanges[nBlockRanges].length = end - start;
+		nBlockRanges++;
+	}
+
+	completion = sync_prepare(completion, &comp, &sync);
+	r = [selfDelegate trimBlockRanges:blockRanges
+				    count:nBlockRanges
+			       completion:completion];
+	kmem_free(blockRanges, sizeof(*blockRanges) * MAX(nRanges, 1));
+
+	return sync_finish(r, &comp, &sync);
+}
+
 @end
@@ -8,8 +8,12 @@
  * All rights reserved.
  */
 
+#include <sys/param.h>
 #include <sys/sysmacros.h>
 
+#include <kern/kmem.h>
+#include <kern/task.h>
+
 #include <libkern/klib.h>
 
 #include <errno.h>
@@ -17,11 +21,161 @@
 #include "DKDisk.h"
 #include "dev/GPTVolumeManager.h"
 #include "dev/dev.h"
+#include "devicekit/dk_buf.h"
 //#include "posix/dev.h"
 //#include "posix/vfs.h"
 
-static int major = -1;
-static int minor = 0;
+enum {
+	kDKMaxLogicalDisks = 64,
+	/*! most bytes of a direct I/O's user buffer wired at once */
+	kDKDirectChunk = 1024 * 1024,
+};
+
+/*
+ * Each logical disk gets two nodes: a buffered one (e.g. dk0s1), whose I/O
+ * goes through the buffer cache and may be of any size and alignment, and a
+ * raw one (e.g. rdk0s1), whose I/O is done directly between the disk and the
+ * caller's pages, and so must be aligned to the disk's block size. The minor
+ * is the disk's index shifted left by one, with the low bit set for raw.
+ */
+#define MINOR_DISK(min) ((min) >> 1)
+#define MINOR_RAW(min) ((min)&1)
+
+static int	     major = -1;
+static int	     ndisks = 0;
+static DKLogicalDisk *disks[kDKMaxLogicalDisks];
+
+static DKLogicalDisk *
+disk_from_dev(dev_t dev)
+{
+	unsigned idx = MINOR_DISK(minor(dev));
+	return idx < ndisks ? disks[idx] : NULL;
+}
+
+static int
+dk_open(dev_t dev, struct vnode **out, int mode)
+{
+	return disk_from_dev(dev) == NULL ? -ENXIO : 0;
+}
+
+/* I/O through the buffer cache. */
+static int
+dk_buffered_io(DKLogicalDisk *disk, char *buf, size_t nbyte, off_t off,
+    bool write)
+{
+	size_t done = 0;
+
+	while (done < nbyte) {
+		blkoff_t  block = (off + done) / DK_BUF_SIZE;
+		size_t	  boff = (off + done) % DK_BUF_SIZE;
+		dk_buf_t *dbuf;
+		size_t	  len;
+		int	  r;
+
+		/* a whole buffer to be overwritten needn't be read in */
+		if (write && boff == 0 && nbyte - done >= DK_BUF_SIZE)
+			r = dk_buf_get(disk, block, &dbuf);
+		else
+			r = dk_buf_read(disk, block, &dbuf);
+		if (r < 0)
+			return done > 0 ? (int)done : r;
+
+		len = MIN(nbyte - done, dbuf->size - boff);
+		if (write) {
+			memcpy(dbuf->data + boff, buf + done, len);
+			dk_buf_dirty(dbuf);
+		} else
+			memcpy(buf + done, dbuf->data + boff, len);
+		dk_buf_release(dbuf);
+
+		done += len;
+	}
+
+	return done;
+}
+
+/*
+ * I/O directly to or from the caller's pages, wired into an MDL a chunk at a
+ * time. Cached buffers of the range are written back and evicted first, so
+ * that neither a read sees stale data nor a later write-back undoes a write.
+ */
+static int
+dk_direct_io(DKLogicalDisk *disk, char *buf, size_t nbyte, off_t off,
+    bool write)
+{
+	blksize_t bs = [disk blockSize];
+	size_t	  done = 0;
+	int	  r;
+
+	if (off % bs != 0 || nbyte % bs != 0 || (uintptr_t)buf % bs != 0)
+		return -EINVAL;
+
+	r = dk_buf_invalidate(disk, off, nbyte);
+	if (r < 0)
+		return r;
+
+	while (done < nbyte) {
+		size_t	  len = MIN(nbyte - done, kDKDirectChunk);
+		vm_mdl_t *mdl;
+
+		/* reading from the disk writes into the pages */
+		r = vm_mdl_new_with_range(&mdl, curtask()->map,
+		    (vaddr_t)buf + done, len, !write);
+		if (r < 0)
+			break;
+
+		if (write)
+			r = [disk writeBytes:len
+					  at:off + done
+				  fromBuffer:mdl
+				     options:0
+				  completion:NULL];
+		else
+			r = [disk readBytes:len
+					 at:off + done
+				 intoBuffer:mdl
+				 completion:NULL];
+		vm_mdl_unwire(mdl);
+		if (r < 0)
+			break;
+
+		done += len;
+	}
+
+	return done > 0 ? (int)done : r;
+}
+
+static int
+dk_io(dev_t dev, void *buf, size_t nbyte, off_t off, bool write)
+{
+	DKLogicalDisk *disk = disk_from_dev(dev);
+
+	if (disk == NULL)
+		return -ENXIO;
+	if (off < 0)
+		return -EINVAL;
+	if ((size_t)off >= disk.size)
+		return write && nbyte > 0 ? -ENOSPC : 0;
+
+	nbyte = MIN(nbyte, disk.size - off);
+
+	if (MINOR_RAW(minor(dev)))
+		return dk_direct_io(disk, buf, nbyte, off, write);
+	else
+		return dk_buffered_io(disk, buf, nbyte, off, write);
+}
+
+static int
+dk_read(dev_t dev, void *buf, size_t nbyte, off_t off)
+{
+	return dk_io(dev, buf, nbyte, off, false);
+}
+
+static int
+dk_write(dev_t dev, void *buf, size_t nbyte, off_t off)
+{
+	return dk_io(dev, buf, nbyte, off, true);
+}
 
 @implementation DKLogicalDisk
 
@@ -32,9 +186,12 @@ static int minor = 0;
 
 + (void)initialize
 {
-	cdevsw_t cdev;
+	cdevsw_t cdev = { 0 };
 	cdev.is_tty = false;
 	cdev.private = self;
+	cdev.open = dk_open;
+	cdev.read = dk_read;
+	cdev.write = dk_write;
 	major = cdevsw_attach(&cdev);
 }
 
@@ -67,7 +224,7 @@ static int minor = 0;
 		provider:(DKDevice *)provider
 {
 	char nameBuf[64];
-	int  r;
+	int  idx, r;
 
 	self = [super initWithProvider:provider];
 	if (!self) {
@@ -86,11 +243,21 @@ static int minor = 0;
 	m_size = size;
 	m_location = location;
 
-	[self buildPosixDeviceName:nameBuf withMaxSize:63];
+	nameBuf[0] = 'r';
+	[self buildPosixDeviceName:nameBuf + 1 withMaxSize:62];
 
-	DKDevLog(self, "POSIX DevFS node: %s\n", nameBuf);
-	r = devfs_make_node(makedev(major, minor++), nameBuf);
-	assert (r >= 0);
+	if (ndisks < kDKMaxLogicalDisks) {
+		idx = ndisks++;
+		disks[idx] = self;
+
+		DKDevLog(self, "POSIX DevFS nodes: %s, %s\n", nameBuf + 1,
+		    nameBuf);
+		r = devfs_make_node(makedev(major, idx << 1), nameBuf + 1);
+		assert(r >= 0);
+		r = devfs_make_node(makedev(major, idx << 1 | 1), nameBuf);
+		assert(r >= 0);
+	} else
+		DKDevLog(self, "too many logical disks for DevFS nodes\n");
 
 	if (![m_underlying isKindOfClass:[DKDrive class]]) {
 		int mountit(DKLogicalDisk * disk);
@@ -121,15 +288,49 @@ static int minor = 0;
 - (int)writeBytes:(size_t)nBytes
 	       at:(off_t)offset
        fromBuffer:(vm_mdl_t *)buf
+	  options:(int)options
        completion:(struct dk_diskio_completion *)completion
 {
 	if (offset + nBytes > m_size)
 		return -EINVAL;
 
 	return [m_underlying writeBytes:nBytes
-				     at:offset
+				     at:offset + m_base
 			     fromBuffer:buf
+				options:options
 			     completion:completion];
 }
 
+- (int)flushWithCompletion:(struct dk_diskio_completion *)completion
+{
+	return [m_underlying flushWithCompletion:completion];
+}
+
+- (int)trimRanges:(const struct dk_range *)ranges
+	    count:(size_t)nRanges
+       completion:(struct dk_diskio_completion *)completion
+{
+	struct dk_range *based;
+	int		 r;
+
+	based = kmem_alloc(sizeof(*based) * MAX(nRanges, 1));
+	if (based == NULL)
+		return -ENOMEM;
+
+	for (size_t i = 0; i < nRanges; i++) {
+		if (ranges[i].start < 0 ||
+		    ranges[i].start + ranges[i].length > m_size) {
+			kmem_free(based, sizeof(*based) * MAX(nRanges, 1));
+			return -EINVAL;
+		}
+		based[i].start = ranges[i].start + m_base;
+		based[i].length = ranges[i].length;
+	}
+
+	r = [m_underlying trimRanges:based count:nRanges completion:completion];
+	kmem_free(based, sizeof(*based) * MAX(nRanges, 1));
+
+	return r;
+}
+
 @end
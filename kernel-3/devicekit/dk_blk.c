@@ -0,0 +1,1328 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+/*!
+ * @file dk_blk.c
+ * @brief Block I/O queueing: merging, plugging and the I/O schedulers.
+ *
+ * See dk_blk.h for an overview. Locking: each software queue has a lock, which
+ * protects its list; the queue lock protects the scheduler and the requeue
+ * list; the pool lock protects the free requests. No two of these are ever
+ * held at once except the queue lock with a software queue's, and all are
+ * taken with interrupts disabled.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _KERNEL
+#include <kern/kmem.h>
+#include <kern/task.h>
+#include <libkern/klib.h>
+#include <machine/machdep.h>
+
+#include "devicekit/dk_blk.h"
+
+/*! index of the current CPU; cpu0 is -1 until smp_init() */
+#define DK_BLK_CPU() (curcpu()->num < 0 ? 0 : curcpu()->num)
+#define DK_BLK_NCPU() (ncpu > 0 ? ncpu : 1)
+/*! the current thread, as owner of the requests it submits */
+#define DK_BLK_OWNER() ((void *)curthread())
+/*! the current thread's plug */
+#define DK_BLK_PLUG() (curthread()->blkplug)
+#else
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dk_blk.h"
+
+#define PGSIZE 4096
+
+static int		      dk_blk_host_ncpu = 1;
+static __thread int	      dk_blk_host_cpu;
+static __thread int	      dk_blk_host_owner;
+static __thread struct dk_blk_plug *dk_blk_host_plug;
+
+#define DK_BLK_CPU() dk_blk_host_cpu
+#define DK_BLK_NCPU() dk_blk_host_ncpu
+#define DK_BLK_OWNER() ((void *)&dk_blk_host_owner)
+#define DK_BLK_PLUG() dk_blk_host_plug
+
+#define kmem_zalloc(SIZE) calloc(1, SIZE)
+#define kmem_free(PTR, SIZE) free(PTR)
+
+static inline int
+md_intr_disable(void)
+{
+	return 0;
+}
+
+static inline void
+md_intr_x(int iff)
+{
+}
+
+static inline void
+spinlock_init(spinlock_t *lock)
+{
+	atomic_flag_clear(lock);
+}
+
+static inline void
+spinlock_lock(spinlock_t *lock)
+{
+	while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire))
+		;
+}
+
+static inline void
+spinlock_unlock(spinlock_t *lock)
+{
+	atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+static inline void
+semaphore_wait(semaphore_t *sem, uint64_t nanosecs)
+{
+	while (sem_wait(sem) != 0)
+		;
+}
+
+static inline void
+semaphore_signal(semaphore_t *sem)
+{
+	sem_post(sem);
+}
+#endif
+
+enum {
+	/*!
+	 * requests in a queue's pool (I/Os which may be outstanding), or the
+	 * queue's depth if it is deeper
+	 */
+	kDKBlkNReqs = 256,
+	/*! most requests held on a plug before it is flushed anyway */
+	kDKBlkPlugMax = 32,
+	/*! how many of the most recently queued requests to try merging with */
+	kDKBlkMergeScan = 8,
+	/*! deadline: default most requests dispatched per sorted batch */
+	kDKBlkFifoBatch = 16,
+	/*! deadline: default read batches dispatched before a pending write */
+	kDKBlkWritesStarved = 2,
+	/*! budget-fair: default bytes served per turn */
+	kDKBlkBudgetBytes = 512 * 1024,
+	/*! budget-fair: per-thread queues; the first is shared by overflow */
+	kDKBlkBFQueues = 32,
+};
+
+/* deadline: default expiries; in TSC cycles, about 0.5s and 5s at 2 GHz */
+#define DK_BLK_READ_EXPIRE (1000ull * 1000 * 1000)
+#define DK_BLK_WRITE_EXPIRE (10000ull * 1000 * 1000)
+
+static void req_done(void *data, ssize_t result);
+
+/*
+ * Request pool
+ */
+
+static struct dk_blk_req *
+req_alloc(dk_blk_queue_t *q)
+{
+	struct dk_blk_req *req;
+	int		   iff;
+
+	semaphore_wait(&q->poolSem, -1);
+
+	iff = md_intr_disable();
+	spinlock_lock(&q->poolLock);
+	req = q->freeReqs;
+	assert(req != NULL);
+	q->freeReqs = req->next;
+	q->nFree--;
+	spinlock_unlock(&q->poolLock);
+	md_intr_x(iff);
+
+	return req;
+}
+
+static void
+req_free(dk_blk_queue_t *q, struct dk_blk_req *req)
+{
+	int iff = md_intr_disable();
+
+	spinlock_lock(&q->poolLock);
+	req->next = q->freeReqs;
+	q->freeReqs = req;
+	q->nFree++;
+	spinlock_unlock(&q->poolLock);
+	md_intr_x(iff);
+
+	semaphore_signal(&q->poolSem);
+}
+
+/*
+ * Merging
+ */
+
+/* whether the data of \p a followed by that of \p b can be one transfer */
+static bool
+req_adjacent(struct dk_blk_req *a, struct dk_blk_req *b)
+{
+	return a->block + a->nBlocks == b->block && a->endOff == 0 &&
+	    b->startOff == 0;
+}
+
+/*
+ * Try to merge request \p req into request \p into, behind or in front of it.
+ * The two must be contiguous both on disk and, at the junction, in memory: the
+ * data before it must end at the end of a page and the data after begin at the
+ * beginning of one, so that the merged data can be described by one list of
+ * whole pages, as drivers' scatter-gather lists typically require.
+ */
+static bool
+req_merge(dk_blk_queue_t *q, struct dk_blk_req *into, struct dk_blk_req *req)
+{
+	if (into->op != req->op || into->options != req->options ||
+	    into->nBlocks + req->nBlocks > q->maxBlocks ||
+	    into->nPages + req->nPages > DK_BLK_MERGE_PAGES)
+		return false;
+
+	if (req_adjacent(into, req)) {
+		into->last->next = req->first;
+		into->last = req->last;
+		into->endOff = req->endOff;
+	} else if (req_adjacent(req, into)) {
+		req->last->next = into->first;
+		into->first = req->first;
+		into->block = req->block;
+		into->startOff = req->startOff;
+	} else
+		return false;
+
+	into->nBlocks += req->nBlocks;
+	into->nPages += req->nPages;
+	into->nIOs += req->nIOs;
+	into->deadline = MIN(into->deadline, req->deadline);
+	atomic_fetch_add_explicit(&q->nMerged, req->nIOs,
+	    memory_order_relaxed);
+
+	return true;
+}
+
+/*
+ * Merge \p req into one of the last few requests (of queue \p q) on \p list if
+ * possible, otherwise append it.
+ */
+static void
+list_insert(dk_blk_queue_t *q, struct dk_blk_reqlist *list,
+    struct dk_blk_req *req)
+{
+	struct dk_blk_req *it;
+	int		   n = 0;
+
+	TAILQ_FOREACH_REVERSE (it, list, dk_blk_reqlist, entry) {
+		if (it->q == q && req_merge(q, it, req))
+			return;
+		if (++n == kDKBlkMergeScan)
+			break;
+	}
+
+	TAILQ_INSERT_TAIL(list, req, entry);
+}
+
+/* the buffer to issue a request with; merged requests' are gathered */
+static vm_mdl_t *
+req_buffer(struct dk_blk_req *req)
+{
+	vm_mdl_t *mdl = &req->mdl;
+	size_t	  n = 0;
+
+	if (req->nIOs == 1)
+		return req->ioBuf;
+
+	mdl->offset = req->startOff;
+	mdl->nBytes = req->nBlocks * req->q->blockSize;
+
+	for (struct dk_blk_req *io = req->first; io != NULL; io = io->next) {
+		vm_mdl_t *buf = io->ioBuf;
+		size_t	  first = buf->offset / PGSIZE;
+		size_t	  nPages = (buf->offset % PGSIZE +
+			       io->ioNBlocks * req->q->blockSize + PGSIZE - 1) /
+		    PGSIZE;
+
+		for (size_t i = 0; i < nPages; i++)
+			mdl->pages[n++] = buf->pages[first + i];
+	}
+
+	assert(n == req->nPages);
+	mdl->nPages = n;
+
+	return mdl;
+}
+
+/* complete each I/O of a request, and free them */
+static void
+req_end(struct dk_blk_req *req, ssize_t result)
+{
+	dk_blk_queue_t	  *q = req->q;
+	struct dk_blk_req *io = req->first;
+
+	while (io != NULL) {
+		struct dk_blk_req	    *next = io->next;
+		struct dk_diskio_completion *completion = io->ioCompletion;
+
+		completion->callback(completion->data,
+		    result < 0 ? result :
+				 (ssize_t)(io->ioNBlocks * q->blockSize));
+		req_free(q, io);
+		io = next;
+	}
+}
+
+/*
+ * Deadline scheduler. For each direction, requests are kept both sorted by
+ * block and in order of arrival. Requests are dispatched in batches in block
+ * order, continuing on from the last; a batch ends after fifoBatch requests or
+ * at the last block, and the next begins with the oldest request if that has
+ * expired. Reads are preferred, but a write batch is dispatched after
+ * writesStarved read batches if writes are waiting.
+ */
+
+struct deadline {
+	struct dk_blk_reqlist sorted[2];
+	struct dk_blk_reqlist fifo[2];
+	/* next in block order after the last dispatched, per direction */
+	struct dk_blk_req *nextReq[2];
+	enum dk_blk_op	   dir;	     /* direction of the current batch */
+	unsigned	   batching; /* dispatched in the current batch */
+	unsigned	   starved;  /* read batches while writes waited */
+};
+
+static int
+deadline_init(dk_blk_queue_t *q)
+{
+	struct deadline *dl = kmem_zalloc(sizeof(*dl));
+
+	if (dl == NULL)
+		return -ENOMEM;
+
+	for (int i = 0; i < 2; i++) {
+		TAILQ_INIT(&dl->sorted[i]);
+		TAILQ_INIT(&dl->fifo[i]);
+	}
+	q->schedData = dl;
+
+	return 0;
+}
+
+static void
+deadline_fini(dk_blk_queue_t *q)
+{
+	kmem_free(q->schedData, sizeof(struct deadline));
+}
+
+static void
+deadline_insert(dk_blk_queue_t *q, struct dk_blk_req *req)
+{
+	struct deadline	  *dl = q->schedData;
+	struct dk_blk_req *prev, *next;
+
+	req->deadline = dk_blk_now() +
+	    (req->op == kDKBlkRead ? q->readExpire : q->writeExpire);
+
+	/* find the requests either side of it in block order */
+	TAILQ_FOREACH_REVERSE (prev, &dl->sorted[req->op], dk_blk_reqlist,
+	    entry)
+		if (prev->block < req->block)
+			break;
+	next = prev != NULL ? TAILQ_NEXT(prev, entry) :
+				    TAILQ_FIRST(&dl->sorted[req->op]);
+
+	if ((prev != NULL && req_merge(q, prev, req)) ||
+	    (next != NULL && req_merge(q, next, req)))
+		return;
+
+	if (prev != NULL)
+		TAILQ_INSERT_AFTER(&dl->sorted[req->op], prev, req, entry);
+	else
+		TAILQ_INSERT_HEAD(&dl->sorted[req->op], req, entry);
+	TAILQ_INSERT_TAIL(&dl->fifo[req->op], req, fifo);
+}
+
+static struct dk_blk_req *
+deadline_next(dk_blk_queue_t *q, uint64_t now)
+{
+	struct deadline	  *dl = q->schedData;
+	struct dk_blk_req *req;
+	enum dk_blk_op	   dir;
+
+	if (dl->batching < q->fifoBatch && dl->nextReq[dl->dir] != NULL) {
+		req = dl->nextReq[dl->dir];
+		goto dispatch;
+	}
+
+	if (!TAILQ_EMPTY(&dl->fifo[kDKBlkRead]) &&
+	    (TAILQ_EMPTY(&dl->fifo[kDKBlkWrite]) ||
+		dl->starved++ < q->writesStarved))
+		dir = kDKBlkRead;
+	else if (!TAILQ_EMPTY(&dl->fifo[kDKBlkWrite])) {
+		dir = kDKBlkWrite;
+		dl->starved = 0;
+	} else
+		return NULL;
+
+	/* begin the batch at the oldest if it's expired, else carry on */
+	req = TAILQ_FIRST(&dl->fifo[dir]);
+	if (req->deadline > now && dl->nextReq[dir] != NULL)
+		req = dl->nextReq[dir];
+	dl->dir = dir;
+	dl->batching = 0;
+
+dispatch:
+	dl->nextReq[req->op] = TAILQ_NEXT(req, entry);
+	TAILQ_REMOVE(&dl->sorted[req->op], req, entry);
+	TAILQ_REMOVE(&dl->fifo[req->op], req, fifo);
+	dl->batching++;
+
+	return req;
+}
+
+static const struct dk_blk_sched_ops deadline_ops = {
+	.name = "deadline",
+	.init = deadline_init,
+	.fini = deadline_fini,
+	.insert = deadline_insert,
+	.next = deadline_next,
+};
+
+/*
+ * Budget-fair scheduler. Each submitting thread has a queue of its requests,
+ * in order of submission; threads with requests queued are served in turn, each
+ * being granted a budget of blocks per turn and keeping any not spent (deficit
+ * round robin.) So each thread gets an equal share of the transfer, however
+ * many requests it queues, and its requests are dispatched consecutively,
+ * preserving the locality of sequential streams.
+ */
+
+struct bf_queue {
+	TAILQ_ENTRY(bf_queue) active; /* linkage for budgetfair::active */
+	struct dk_blk_reqlist reqs;
+	void		     *owner;
+	uint64_t	      deficit; /* blocks which may yet be dispatched */
+	bool		      isActive;
+	bool		      granted; /* budget granted this turn */
+};
+
+struct budgetfair {
+	TAILQ_HEAD(, bf_queue) active;
+	struct bf_queue queues[kDKBlkBFQueues];
+};
+
+static int
+bf_init(dk_blk_queue_t *q)
+{
+	struct budgetfair *bf = kmem_zalloc(sizeof(*bf));
+
+	if (bf == NULL)
+		return -ENOMEM;
+
+	TAILQ_INIT(&bf->active);
+	for (int i = 0; i < kDKBlkBFQueues; i++)
+		TAILQ_INIT(&bf->queues[i].reqs);
+	q->schedData = bf;
+
+	return 0;
+}
+
+static void
+bf_fini(dk_blk_queue_t *q)
+{
+	kmem_free(q->schedData, sizeof(struct budgetfair));
+}
+
+/* find the queue of \p owner, or assign it one */
+static struct bf_queue *
+bf_lookup(struct budgetfair *bf, void *owner)
+{
+	size_t		 hash = ((uintptr_t)owner >> 6) % (kDKBlkBFQueues - 1);
+	struct bf_queue *idle = NULL;
+
+	for (size_t i = 0; i < kDKBlkBFQueues - 1; i++) {
+		struct bf_queue *bfq =
+		    &bf->queues[1 + (hash + i) % (kDKBlkBFQueues - 1)];
+
+		if (!bfq->isActive) {
+			if (idle == NULL)
+				idle = bfq;
+		} else if (bfq->owner == owner)
+			return bfq;
+	}
+
+	if (idle == NULL)
+		return &bf->queues[0];
+
+	idle->owner = owner;
+	return idle;
+}
+
+static void
+bf_insert(dk_blk_queue_t *q, struct dk_blk_req *req)
+{
+	struct budgetfair *bf = q->schedData;
+	struct bf_queue	  *bfq = bf_lookup(bf, req->owner);
+	struct dk_blk_req *last = TAILQ_LAST(&bfq->reqs, dk_blk_reqlist);
+
+	if (last != NULL && req_merge(q, last, req))
+		return;
+
+	TAILQ_INSERT_TAIL(&bfq->reqs, req, entry);
+	if (!bfq->isActive) {
+		bfq->isActive = true;
+		TAILQ_INSERT_TAIL(&bf->active, bfq, active);
+	}
+}
+
+static struct dk_blk_req *
+bf_next(dk_blk_queue_t *q, uint64_t now)
+{
+	struct budgetfair *bf = q->schedData;
+	struct bf_queue	  *bfq;
+
+	while ((bfq = TAILQ_FIRST(&bf->active)) != NULL) {
+		struct dk_blk_req *req = TAILQ_FIRST(&bfq->reqs);
+
+		if (!bfq->granted) {
+			bfq->deficit += q->budget;
+			bfq->granted = true;
+		}
+
+		if (req->nBlocks <= bfq->deficit) {
+			bfq->deficit -= req->nBlocks;
+			TAILQ_REMOVE(&bfq->reqs, req, entry);
+			if (TAILQ_EMPTY(&bfq->reqs)) {
+				TAILQ_REMOVE(&bf->active, bfq, active);
+				bfq->isActive = false;
+				bfq->granted = false;
+				bfq->deficit = 0;
+			}
+			return req;
+		}
+
+		/* turn over; move on to the next */
+		bfq->granted = false;
+		TAILQ_REMOVE(&bf->active, bfq, active);
+		TAILQ_INSERT_TAIL(&bf->active, bfq, active);
+	}
+
+	return NULL;
+}
+
+static const struct dk_blk_sched_ops bf_ops = {
+	.name = "budget-fair",
+	.init = bf_init,
+	.fini = bf_fini,
+	.insert = bf_insert,
+	.next = bf_next,
+};
+
+/*
+ * Queues
+ */
+
+#ifdef _KERNEL
+uint64_t
+dk_blk_now(void)
+{
+	return md_cycles();
+}
+#endif
+
+int
+dk_blk_queue_new(dk_blk_queue_t **out, const struct dk_blk_driver_ops *ops,
+    void *driverArg, size_t blockSize, uint64_t maxBlocks, unsigned depth)
+{
+	dk_blk_queue_t *q;
+	size_t		nReqs = MAX(kDKBlkNReqs, depth);
+
+	assert(blockSize <= PGSIZE && maxBlocks > 0 && depth > 0);
+
+	q = kmem_zalloc(sizeof(*q));
+	if (q == NULL)
+		return -ENOMEM;
+
+	q->driver = ops;
+	q->driverArg = driverArg;
+	q->blockSize = blockSize;
+	q->maxBlocks = maxBlocks;
+	q->depth = depth;
+
+	q->readExpire = DK_BLK_READ_EXPIRE;
+	q->writeExpire = DK_BLK_WRITE_EXPIRE;
+	q->fifoBatch = kDKBlkFifoBatch;
+	q->writesStarved = kDKBlkWritesStarved;
+	q->budget = MAX(kDKBlkBudgetBytes / blockSize, maxBlocks);
+
+	spinlock_init(&q->lock);
+	q->schedKind = kDKBlkSchedNone;
+	TAILQ_INIT(&q->requeue);
+
+	q->nCtxs = DK_BLK_NCPU();
+	q->ctxs = kmem_zalloc(sizeof(*q->ctxs) * q->nCtxs);
+	q->reqs = kmem_zalloc(sizeof(*q->reqs) * nReqs);
+	if (q->ctxs == NULL || q->reqs == NULL)
+		goto nomem;
+	for (size_t i = 0; i < q->nCtxs; i++) {
+		spinlock_init(&q->ctxs[i].lock);
+		TAILQ_INIT(&q->ctxs[i].reqs);
+	}
+
+	spinlock_init(&q->poolLock);
+	for (q->nReqs = 0; q->nReqs < nReqs; q->nReqs++) {
+		struct dk_blk_req *req = kmem_zalloc(sizeof(*req) +
+		    sizeof(vm_page_t *) * DK_BLK_MERGE_PAGES);
+
+		if (req == NULL)
+			goto nomem;
+
+		req->q = q;
+		req->completion.callback = req_done;
+		req->completion.data = req;
+		req->next = q->freeReqs;
+		q->freeReqs = req;
+		q->reqs[q->nReqs] = req;
+	}
+	q->nFree = q->nReqs;
+#ifdef _KERNEL
+	q->poolSem = (semaphore_t)SEMAPHORE_INITIALIZER(q->poolSem);
+	q->poolSem.count = q->nReqs;
+#else
+	sem_init(&q->poolSem, 0, q->nReqs);
+#endif
+
+	*out = q;
+	return 0;
+
+nomem:
+	for (size_t i = 0; i < q->nReqs; i++)
+		kmem_free(q->reqs[i],
+		    sizeof(struct dk_blk_req) +
+			sizeof(vm_page_t *) * DK_BLK_MERGE_PAGES);
+	if (q->reqs != NULL)
+		kmem_free(q->reqs, sizeof(*q->reqs) * nReqs);
+	if (q->ctxs != NULL)
+		kmem_free(q->ctxs, sizeof(*q->ctxs) * q->nCtxs);
+	kmem_free(q, sizeof(*q));
+	return -ENOMEM;
+}
+
+unsigned
+dk_blk_set_depth(dk_blk_queue_t *q, unsigned depth)
+{
+	q->depth = MAX(1, MIN(depth, q->nReqs));
+	/* a deeper queue may be able to dispatch more now */
+	dk_blk_run(q);
+	return q->depth;
+}
+
+int
+dk_blk_set_scheduler(dk_blk_queue_t *q, enum dk_blk_sched kind)
+{
+	const struct dk_blk_sched_ops *ops;
+	void			      *oldData = q->schedData;
+	const struct dk_blk_sched_ops *oldOps = q->sched;
+	int			       r;
+
+	switch (kind) {
+	case kDKBlkSchedNone:
+		ops = NULL;
+		break;
+	case kDKBlkSchedDeadline:
+		ops = &deadline_ops;
+		break;
+	case kDKBlkSchedBudgetFair:
+		ops = &bf_ops;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	assert(atomic_load(&q->inflight) == 0 && q->nFree == q->nReqs);
+
+	if (ops != NULL && (r = ops->init(q)) < 0) {
+		q->schedData = oldData;
+		return r;
+	}
+
+	if (oldOps != NULL) {
+		void *newData = q->schedData;
+		q->schedData = oldData;
+		oldOps->fini(q);
+		q->schedData = newData;
+	}
+
+	q->sched = ops;
+	q->schedKind = kind;
+
+	return 0;
+}
+
+/* move all requests on the software queues into the scheduler */
+static void
+sched_drain(dk_blk_queue_t *q)
+{
+	for (size_t i = 0; i < q->nCtxs; i++) {
+		struct dk_blk_ctx *ctx = &q->ctxs[i];
+		struct dk_blk_req *req;
+
+		if (TAILQ_EMPTY(&ctx->reqs))
+			continue;
+
+		spinlock_lock(&ctx->lock);
+		while ((req = TAILQ_FIRST(&ctx->reqs)) != NULL) {
+			TAILQ_REMOVE(&ctx->reqs, req, entry);
+			q->sched->insert(q, req);
+		}
+		spinlock_unlock(&ctx->lock);
+	}
+}
+
+/* take the next request to dispatch; the local software queue's first */
+static struct dk_blk_req *
+next_req(dk_blk_queue_t *q)
+{
+	struct dk_blk_req *req = NULL;
+	size_t		   me = DK_BLK_CPU() % q->nCtxs;
+
+	if (!TAILQ_EMPTY(&q->requeue) || q->sched != NULL) {
+		spinlock_lock(&q->lock);
+		req = TAILQ_FIRST(&q->requeue);
+		if (req != NULL)
+			TAILQ_REMOVE(&q->requeue, req, entry);
+		else if (q->sched != NULL)
+			req = q->sched->next(q, dk_blk_now());
+		spinlock_unlock(&q->lock);
+
+		if (req != NULL || q->sched != NULL)
+			return req;
+	}
+
+	for (size_t i = 0; i < q->nCtxs; i++) {
+		struct dk_blk_ctx *ctx = &q->ctxs[(me + i) % q->nCtxs];
+
+		if (TAILQ_EMPTY(&ctx->reqs))
+			continue;
+
+		spinlock_lock(&ctx->lock);
+		req = TAILQ_FIRST(&ctx->reqs);
+		if (req != NULL)
+			TAILQ_REMOVE(&ctx->reqs, req, entry);
+		spinlock_unlock(&ctx->lock);
+
+		if (req != NULL)
+			return req;
+	}
+
+	return NULL;
+}
+
+void
+dk_blk_run(dk_blk_queue_t *q)
+{
+	int  iff = md_intr_disable();
+	bool begun = false;
+
+	if (q->sched != NULL) {
+		spinlock_lock(&q->lock);
+		sched_drain(q);
+		spinlock_unlock(&q->lock);
+	}
+
+	while (true) {
+		unsigned	   inflight = atomic_load(&q->inflight);
+		unsigned	   kicks;
+		struct dk_blk_req *req;
+		int		   r;
+
+		/* reserve a place in flight */
+		do {
+			if (inflight >= q->depth)
+				goto out;
+		} while (!atomic_compare_exchange_weak(&q->inflight, &inflight,
+		    inflight + 1));
+
+		req = next_req(q);
+		if (req == NULL) {
+			atomic_fetch_sub(&q->inflight, 1);
+			break;
+		}
+
+		if (!begun && q->driver->begin != NULL) {
+			q->driver->begin(q->driverArg);
+			begun = true;
+		}
+
+		kicks = atomic_load(&q->kicks);
+		r = q->driver->issue(q->driverArg, req, req_buffer(req));
+		if (r == 0) {
+			atomic_fetch_add_explicit(&q->nIssued, 1,
+			    memory_order_relaxed);
+		} else if (r == -EAGAIN) {
+			atomic_fetch_sub(&q->inflight, 1);
+			atomic_fetch_add_explicit(&q->nBusy, 1,
+			    memory_order_relaxed);
+			spinlock_lock(&q->lock);
+			TAILQ_INSERT_HEAD(&q->requeue, req, entry);
+			spinlock_unlock(&q->lock);
+			/* resources freed since, whose kick found no requeue? */
+			if (atomic_load(&q->kicks) != kicks)
+				continue;
+			break;
+		} else {
+			req_end(req, r);
+			atomic_fetch_sub(&q->inflight, 1);
+		}
+	}
+
+out:
+	if (begun) {
+		if (q->driver->commit != NULL)
+			q->driver->commit(q->driverArg);
+		atomic_fetch_add_explicit(&q->nBatches, 1,
+		    memory_order_relaxed);
+	}
+	md_intr_x(iff);
+}
+
+void
+dk_blk_kick(dk_blk_queue_t *q)
+{
+	bool requeued;
+
+	atomic_fetch_add(&q->kicks, 1);
+	/* locked, to order this against dk_blk_run()'s requeuing */
+	spinlock_lock(&q->lock);
+	requeued = !TAILQ_EMPTY(&q->requeue);
+	spinlock_unlock(&q->lock);
+
+	if (requeued)
+		dk_blk_run(q);
+}
+
+static void
+req_done(void *data, ssize_t result)
+{
+	struct dk_blk_req *req = data;
+	dk_blk_queue_t	  *q = req->q;
+
+	req_end(req, result);
+	atomic_fetch_sub(&q->inflight, 1);
+	dk_blk_run(q);
+}
+
+/* move the requests held on a plug to the software queues and run them */
+static void
+plug_flush(struct dk_blk_plug *plug)
+{
+	int		   iff = md_intr_disable();
+	size_t		   cpu = DK_BLK_CPU();
+	dk_blk_queue_t	  *q = NULL;
+	struct dk_blk_req *req;
+
+	while ((req = TAILQ_FIRST(&plug->reqs)) != NULL) {
+		struct dk_blk_ctx *ctx = &req->q->ctxs[cpu % req->q->nCtxs];
+
+		if (q != NULL && q != req->q)
+			dk_blk_run(q);
+		q = req->q;
+
+		TAILQ_REMOVE(&plug->reqs, req, entry);
+		spinlock_lock(&ctx->lock);
+		list_insert(q, &ctx->reqs, req);
+		spinlock_unlock(&ctx->lock);
+	}
+
+	if (q != NULL)
+		dk_blk_run(q);
+
+	plug->nReqs = 0;
+	md_intr_x(iff);
+}
+
+int
+dk_blk_submit(dk_blk_queue_t *q, enum dk_blk_op op, uint64_t block,
+    uint64_t nBlocks, vm_mdl_t *buf, int options,
+    struct dk_diskio_completion *completion)
+{
+	struct dk_blk_plug *plug = DK_BLK_PLUG();
+	struct dk_blk_req  *req;
+	struct dk_blk_ctx  *ctx;
+	size_t		    startOff = buf->offset % PGSIZE;
+	int		    iff;
+
+	assert(nBlocks > 0 && nBlocks <= q->maxBlocks);
+
+	/* don't sit on plugged requests while waiting for one */
+	if (plug != NULL && plug->nReqs > 0 && q->nFree < kDKBlkPlugMax)
+		plug_flush(plug);
+
+	req = req_alloc(q);
+	req->ioBlock = block;
+	req->ioNBlocks = nBlocks;
+	req->ioBuf = buf;
+	req->ioCompletion = completion;
+	req->next = NULL;
+	req->op = op;
+	req->options = options;
+	req->block = block;
+	req->nBlocks = nBlocks;
+	req->nPages = (startOff + nBlocks * q->blockSize + PGSIZE - 1) / PGSIZE;
+	req->startOff = startOff;
+	req->endOff = (startOff + nBlocks * q->blockSize) % PGSIZE;
+	req->first = req->last = req;
+	req->nIOs = 1;
+	req->owner = DK_BLK_OWNER();
+	req->deadline = UINT64_MAX;
+	atomic_fetch_add_explicit(&q->nSubmitted, 1, memory_order_relaxed);
+
+	if (plug != NULL) {
+		list_insert(q, &plug->reqs, req);
+		if (++plug->nReqs >= kDKBlkPlugMax)
+			plug_flush(plug);
+		return 0;
+	}
+
+	iff = md_intr_disable();
+	ctx = &q->ctxs[DK_BLK_CPU() % q->nCtxs];
+	spinlock_lock(&ctx->lock);
+	list_insert(q, &ctx->reqs, req);
+	spinlock_unlock(&ctx->lock);
+	dk_blk_run(q);
+	md_intr_x(iff);
+
+	return 0;
+}
+
+void
+dk_blk_plug_start(struct dk_blk_plug *plug)
+{
+	TAILQ_INIT(&plug->reqs);
+	plug->nReqs = 0;
+	if (DK_BLK_PLUG() == NULL)
+		DK_BLK_PLUG() = plug;
+}
+
+void
+dk_blk_plug_finish(struct dk_blk_plug *plug)
+{
+	if (DK_BLK_PLUG() != plug)
+		return;
+	DK_BLK_PLUG() = NULL;
+	plug_flush(plug);
+}
+
+void
+dk_blk_plug_flush(void)
+{
+	struct dk_blk_plug *plug = DK_BLK_PLUG();
+
+	if (plug != NULL && plug->nReqs > 0)
+		plug_flush(plug);
+}
+
+#ifndef _KERNEL
+/*
+ * Benchmarks of the block layer; build with:
+ *	cc -O2 -pthread -o blk_bench dk_blk.c
+ *
+ * A simulated drive carries out commands one at a time, in order, taking
+ * kSimCommandNs per command plus kSimSeekNs if it doesn't follow on from the
+ * last, plus the transfer time; and kSimDoorbellNs per doorbell written (an
+ * MMIO write, which can be expensive under virtualisation.) Time is virtual:
+ * it advances only as the drive works, so results are deterministic in
+ * throughput if not in ordering. The drive rings a doorbell per command issued
+ * outside a batch, and one per batch. Each workload is run with each scheduler,
+ * with and without submitters plugging their I/O in groups of kBenchPlugBatch.
+ *
+ * Workloads, with threads standing in for CPUs:
+ * - seqwrite: kBenchThreads threads each write 4 KiB blocks sequentially
+ *   through a region of their own, with kBenchDepth outstanding.
+ * - randread: kBenchThreads threads read random 4 KiB blocks.
+ * - mixed: one thread streams sequential writes with kBenchDepth * 4
+ *   outstanding, while another reads random blocks one at a time; the latency
+ *   of the reads is what's of interest.
+ */
+
+enum {
+	kSimCommandNs = 10000,
+	kSimSeekNs = 40000,
+	kSimBytesPerUs = 2000,
+	kSimDoorbellNs = 2000,
+	kSimSlots = 64,
+
+	kBenchBlockSize = 512,
+	kBenchIOBlocks = 8,
+	kBenchQueueDepth = 16,
+	kBenchThreads = 4,
+	kBenchDepth = 32,
+	kBenchIOs = 20000,
+	kBenchPlugBatch = 16,
+	kBenchRegion = 1 << 22, /* blocks per thread */
+};
+
+struct sim_cmd {
+	struct dk_blk_req *req;
+	uint64_t	   block;
+	uint64_t	   nBlocks;
+};
+
+static struct sim {
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;
+	struct sim_cmd	cmds[kSimSlots];
+	size_t		head, tail, visible; /* ring indices; visible to drive */
+	size_t		nCmds, nDoorbells;
+	uint64_t	lastEnd;
+	bool		stop;
+} sim;
+
+static _Atomic uint64_t sim_clock;
+static __thread int	sim_batch;
+
+uint64_t
+dk_blk_now(void)
+{
+	return atomic_load(&sim_clock);
+}
+
+/* make commands visible to the drive; sim.lock held */
+static void
+sim_doorbell(void)
+{
+	sim.visible = sim.tail;
+	sim.nDoorbells++;
+	atomic_fetch_add(&sim_clock, kSimDoorbellNs);
+	pthread_cond_signal(&sim.cond);
+}
+
+static int
+sim_issue(void *arg, struct dk_blk_req *req, vm_mdl_t *buf)
+{
+	int r = 0;
+
+	assert(buf->nBytes == 0 || buf->nPages == req->nPages);
+
+	pthread_mutex_lock(&sim.lock);
+	if (sim.tail - sim.head == kSimSlots)
+		r = -EAGAIN;
+	else {
+		sim.cmds[sim.tail++ % kSimSlots] = (struct sim_cmd) { req,
+			req->block, req->nBlocks };
+		if (sim_batch == 0)
+			sim_doorbell();
+	}
+	pthread_mutex_unlock(&sim.lock);
+
+	return r;
+}
+
+static void
+sim_begin(void *arg)
+{
+	sim_batch++;
+}
+
+static void
+sim_commit(void *arg)
+{
+	if (--sim_batch == 0) {
+		pthread_mutex_lock(&sim.lock);
+		if (sim.visible != sim.tail)
+			sim_doorbell();
+		pthread_mutex_unlock(&sim.lock);
+	}
+}
+
+static const struct dk_blk_driver_ops sim_ops = {
+	.issue = sim_issue,
+	.begin = sim_begin,
+	.commit = sim_commit,
+};
+
+static void *
+sim_drive(void *arg)
+{
+	dk_blk_host_cpu = 0;
+
+	pthread_mutex_lock(&sim.lock);
+	while (true) {
+		struct sim_cmd cmd;
+		uint64_t       ns;
+
+		while (sim.head == sim.visible && !sim.stop)
+			pthread_cond_wait(&sim.cond, &sim.lock);
+		if (sim.head == sim.visible)
+			break;
+
+		cmd = sim.cmds[sim.head % kSimSlots];
+		ns = kSimCommandNs +
+		    cmd.nBlocks * kBenchBlockSize * 1000 / kSimBytesPerUs;
+		if (cmd.block != sim.lastEnd)
+			ns += kSimSeekNs;
+		sim.lastEnd = cmd.block + cmd.nBlocks;
+		sim.nCmds++;
+		atomic_fetch_add(&sim_clock, ns);
+
+		/* complete it, as an interrupt would, without the lock */
+		pthread_mutex_unlock(&sim.lock);
+		cmd.req->completion.callback(cmd.req->completion.data,
+		    cmd.nBlocks * kBenchBlockSize);
+		pthread_mutex_lock(&sim.lock);
+		sim.head++;
+	}
+	pthread_mutex_unlock(&sim.lock);
+
+	return NULL;
+}
+
+struct bench_io {
+	struct dk_diskio_completion completion;
+	struct bench_thread	   *thread;
+	uint64_t		    start;
+	vm_mdl_t		   *mdl;
+};
+
+struct bench_thread {
+	pthread_t	 pthread;
+	int		 cpu;
+	enum dk_blk_op	 op;
+	bool		 sequential;
+	bool		 plug;
+	size_t		 depth;
+	size_t		 nIOs;
+	sem_t		 slots; /* free ios */
+	pthread_mutex_t	 lock;
+	struct bench_io *ios;
+	size_t		 freeIO;
+	size_t		*freeList;
+	uint64_t	 latSum, latMax;
+};
+
+static dk_blk_queue_t *bench_q;
+static uint64_t	       bench_rng = 88172645463325252ull;
+
+static uint64_t
+bench_rand(void)
+{
+	uint64_t r = __atomic_load_n(&bench_rng, __ATOMIC_RELAXED);
+	r ^= r << 13;
+	r ^= r >> 7;
+	r ^= r << 17;
+	__atomic_store_n(&bench_rng, r, __ATOMIC_RELAXED);
+	return r;
+}
+
+static void
+bench_done(void *data, ssize_t result)
+{
+	struct bench_io	    *io = data;
+	struct bench_thread *thr = io->thread;
+	uint64_t	     lat = dk_blk_now() - io->start;
+
+	assert(result == kBenchIOBlocks * kBenchBlockSize);
+
+	pthread_mutex_lock(&thr->lock);
+	thr->latSum += lat;
+	thr->latMax = MAX(thr->latMax, lat);
+	thr->freeList[thr->freeIO++] = io - thr->ios;
+	pthread_mutex_unlock(&thr->lock);
+	sem_post(&thr->slots);
+}
+
+static void *
+bench_thread(void *arg)
+{
+	struct bench_thread *thr = arg;
+	struct dk_blk_plug   plug;
+	uint64_t	     base = (uint64_t)thr->cpu * kBenchRegion;
+	uint64_t	     pos = 0;
+
+	dk_blk_host_cpu = thr->cpu;
+
+	for (size_t i = 0; i < thr->nIOs; i++) {
+		struct bench_io *io;
+		uint64_t	 block;
+
+		if (thr->plug && i % kBenchPlugBatch == 0)
+			dk_blk_plug_start(&plug);
+
+		/* don't wait with I/O held on the plug */
+		if (sem_trywait(&thr->slots) != 0) {
+			dk_blk_plug_flush();
+			sem_wait(&thr->slots);
+		}
+
+		pthread_mutex_lock(&thr->lock);
+		io = &thr->ios[thr->freeList[--thr->freeIO]];
+		pthread_mutex_unlock(&thr->lock);
+
+		if (thr->sequential) {
+			block = base + pos;
+			pos += kBenchIOBlocks;
+		} else
+			block = base +
+			    bench_rand() % (kBenchRegion / kBenchIOBlocks) *
+				kBenchIOBlocks;
+
+		io->start = dk_blk_now();
+		dk_blk_submit(bench_q, thr->op, block, kBenchIOBlocks,
+		    io->mdl, 0, &io->completion);
+
+		if (thr->plug && i % kBenchPlugBatch == kBenchPlugBatch - 1)
+			dk_blk_plug_finish(&plug);
+	}
+	if (thr->plug)
+		dk_blk_plug_finish(&plug);
+
+	for (size_t i = 0; i < thr->depth; i++)
+		sem_wait(&thr->slots);
+
+	return NULL;
+}
+
+static void
+bench_thread_init(struct bench_thread *thr, int cpu, enum dk_blk_op op,
+    bool sequential, bool plug, size_t depth, size_t nIOs)
+{
+	memset(thr, 0, sizeof(*thr));
+	thr->cpu = cpu;
+	thr->op = op;
+	thr->sequential = sequential;
+	thr->plug = plug;
+	thr->depth = depth;
+	thr->nIOs = nIOs;
+	sem_init(&thr->slots, 0, depth);
+	pthread_mutex_init(&thr->lock, NULL);
+	thr->ios = calloc(depth, sizeof(struct bench_io));
+	thr->freeList = calloc(depth, sizeof(size_t));
+	for (size_t i = 0; i < depth; i++) {
+		struct bench_io *io = &thr->ios[i];
+
+		io->completion.callback = bench_done;
+		io->completion.data = io;
+		io->thread = thr;
+		io->mdl = calloc(1, sizeof(vm_mdl_t) + sizeof(vm_page_t *));
+		io->mdl->offset = 0;
+		io->mdl->nBytes = kBenchIOBlocks * kBenchBlockSize;
+		io->mdl->nPages = 1;
+		io->mdl->pages[0] = (vm_page_t *)(uintptr_t)(cpu * depth + i);
+		thr->freeList[thr->freeIO++] = i;
+	}
+}
+
+static void
+bench_run(const char *name, enum dk_blk_sched kind, bool plug,
+    struct bench_thread *thrs, size_t nThrs)
+{
+	static const char *scheds[] = { "none", "deadline", "budget-fair" };
+	pthread_t	   drive;
+	uint64_t	   start;
+	size_t		   bytes = 0;
+
+	assert(dk_blk_queue_new(&bench_q, &sim_ops, NULL, kBenchBlockSize,
+		   256, kBenchQueueDepth) == 0);
+	assert(dk_blk_set_scheduler(bench_q, kind) == 0);
+	/* in virtual nanoseconds */
+	bench_q->readExpire = 2 * 1000 * 1000;
+	bench_q->writeExpire = 20 * 1000 * 1000;
+
+	memset(&sim, 0, sizeof(sim));
+	pthread_mutex_init(&sim.lock, NULL);
+	pthread_cond_init(&sim.cond, NULL);
+	pthread_create(&drive, NULL, sim_drive, NULL);
+
+	start = dk_blk_now();
+	for (size_t i = 0; i < nThrs; i++)
+		pthread_create(&thrs[i].pthread, NULL, bench_thread, &thrs[i]);
+	for (size_t i = 0; i < nThrs; i++) {
+		pthread_join(thrs[i].pthread, NULL);
+		bytes += thrs[i].nIOs * kBenchIOBlocks * kBenchBlockSize;
+	}
+
+	pthread_mutex_lock(&sim.lock);
+	sim.stop = true;
+	pthread_cond_signal(&sim.cond);
+	pthread_mutex_unlock(&sim.lock);
+	pthread_join(drive, NULL);
+
+	printf("%-10s%-13s%-6s%-9.1f%-8zu%-8zu%-8zu%-10.1f%-10.1f\n", name,
+	    scheds[kind], plug ? "yes" : "no",
+	    bytes * 1000.0 / (dk_blk_now() - start), sim.nCmds,
+	    (size_t)bench_q->nMerged, sim.nDoorbells,
+	    thrs[nThrs - 1].latSum / 1000.0 / thrs[nThrs - 1].nIOs,
+	    thrs[nThrs - 1].latMax / 1000.0);
+
+	for (size_t i = 0; i < nThrs; i++) {
+		for (size_t j = 0; j < thrs[i].depth; j++)
+			free(thrs[i].ios[j].mdl);
+		free(thrs[i].ios);
+		free(thrs[i].freeList);
+	}
+	/* the queue is leaked; it's a benchmark */
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_thread thrs[kBenchThreads];
+
+	dk_blk_host_ncpu = kBenchThreads;
+
+	printf("%-10s%-13s%-6s%-9s%-8s%-8s%-8s%-10s%-10s\n", "workload",
+	    "scheduler", "plug", "MB/s", "cmds", "merged", "dbells",
+	    "lat (us)", "max (us)");
+
+	for (int kind = 0; kind < 3; kind++) {
+		for (int plug = 0; plug < 2; plug++) {
+			for (int i = 0; i < kBenchThreads; i++)
+				bench_thread_init(&thrs[i], i, kDKBlkWrite,
+				    true, plug, kBenchDepth, kBenchIOs);
+			bench_run("seqwrite", kind, plug, thrs, kBenchThreads);
+		}
+	}
+
+	for (int kind = 0; kind < 3; kind++) {
+		for (int plug = 0; plug < 2; plug++) {
+			for (int i = 0; i < kBenchThreads; i++)
+				bench_thread_init(&thrs[i], i, kDKBlkRead,
+				    false, plug, kBenchDepth, kBenchIOs);
+			bench_run("randread", kind, plug, thrs, kBenchThreads);
+		}
+	}
+
+	for (int kind = 0; kind < 3; kind++) {
+		bench_thread_init(&thrs[0], 0, kDKBlkWrite, true, true,
+		    kBenchDepth * 4, kBenchIOs * 4);
+		bench_thread_init(&thrs[1], 1, kDKBlkRead, false, false, 1,
+		    kBenchIOs / 20);
+		bench_run("mixed", kind, true, thrs, 2);
+	}
+
+	return 0;
+}
+#endif
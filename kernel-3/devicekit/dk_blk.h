@@ -0,0 +1,304 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+/*!
+ * @file dk_blk.h
+ * @brief Block I/O queueing: merging, plugging and scheduling of block I/O on
+ * its way from a DKDrive to the driver.
+ *
+ * Each I/O submitted becomes a request. Requests are first put on the software
+ * queue of the submitting CPU - or, if the submitting thread is plugged, on its
+ * plug, to be moved to the software queue in a batch when the plug is
+ * finished. Either way, an I/O contiguous with one recently queued is merged
+ * into it, so that the two are carried out by one command.
+ *
+ * Requests are dispatched to the driver while fewer than the queue's depth are
+ * in flight. Without a scheduler they are dispatched from the software queues
+ * directly, in order; with one, the software queues are drained into the
+ * scheduler, which chooses the order. Each run of dispatches is bracketed by
+ * the driver's begin and commit operations, so that a driver may (for
+ * example) write a doorbell once for the batch rather than once per command.
+ *
+ * Dispatch is run after each submission and each completion, so completions
+ * may dispatch further requests; the driver must allow this. Everything is
+ * preallocated when the queue is created: submission only blocks when all
+ * requests are in use, and completion never allocates or frees memory.
+ */
+
+#ifndef DK_BLK_H_
+#define DK_BLK_H_
+
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _KERNEL
+#include <kern/sync.h>
+#include <vm/vm.h>
+#else
+#include <pthread.h>
+#include <semaphore.h>
+
+typedef atomic_flag spinlock_t;
+typedef sem_t	    semaphore_t;
+
+typedef struct vm_page {
+	uintptr_t paddr;
+} vm_page_t;
+
+typedef struct vm_mdl {
+	off_t		offset;
+	size_t		nBytes;
+	size_t		nPages;
+	struct vm_page *pages[0];
+} vm_mdl_t;
+#endif
+
+/*!
+ * Represents an I/O operation. The initiator of the operation allocates one of
+ * these and passes it to a method; the initiator is responsible for freeing the
+ * structure, but must ensure not to do so before the operation is completed.
+ */
+struct dk_diskio_completion {
+	/*!
+	 * Function to be called when the I/O completes.
+	 * @param data the completion's data member
+	 * @param result number of writes read/writen, or -errno for error
+	 */
+	void (*callback)(void *data, ssize_t result);
+	/*! Opaque data passed to callback. */
+	void *data;
+};
+
+/*! Most pages a merged request may span. */
+#define DK_BLK_MERGE_PAGES 32
+
+/*! Direction of a block I/O. */
+enum dk_blk_op {
+	kDKBlkRead,
+	kDKBlkWrite,
+};
+
+/*! I/O schedulers. */
+enum dk_blk_sched {
+	/*! no scheduling; requests are dispatched in order of submission */
+	kDKBlkSchedNone,
+	/*!
+	 * requests are dispatched in block order in batches, reads preferred
+	 * to writes, but any request which has waited past its expiry time is
+	 * dispatched next
+	 */
+	kDKBlkSchedDeadline,
+	/*!
+	 * requests are queued per submitting thread, and the threads are
+	 * served in turn, each for a budget of blocks at a time
+	 */
+	kDKBlkSchedBudgetFair,
+};
+
+/*!
+ * A block I/O request: one I/O as submitted, and perhaps others merged into it,
+ * in which case it is their head. The fields from @p op onwards describe the
+ * request as a whole and are valid only in a head.
+ */
+struct dk_blk_req {
+	/*! linkage for a plug, software queue, or scheduler queue */
+	TAILQ_ENTRY(dk_blk_req) entry;
+	/*! linkage for a scheduler's secondary queue */
+	TAILQ_ENTRY(dk_blk_req) fifo;
+
+	/*! @name this I/O @{ */
+	uint64_t		     ioBlock;
+	uint64_t		     ioNBlocks;
+	vm_mdl_t		    *ioBuf;
+	struct dk_diskio_completion *ioCompletion;
+	/*! next I/O in the merged request, in block order; or next free */
+	struct dk_blk_req *next;
+	/*! @} */
+
+	/*! @name the request as a whole @{ */
+	struct dk_blk_queue *q;
+	enum dk_blk_op	     op;
+	int		     options;  /*!< dk_write_options */
+	uint64_t	     block;    /*!< first block */
+	uint64_t	     nBlocks;  /*!< count of blocks */
+	size_t		     nPages;   /*!< count of pages the data spans */
+	uint16_t	     startOff; /*!< offset of the data in first page */
+	uint16_t	     endOff;   /*!< offset of the data's end in last page */
+	struct dk_blk_req   *first;    /*!< first I/O */
+	struct dk_blk_req   *last;     /*!< last I/O */
+	size_t		     nIOs;     /*!< count of I/Os */
+	void		    *owner;    /*!< submitting thread */
+	uint64_t	     deadline; /*!< deadline scheduler expiry */
+	/*! passed to the driver when the request is issued */
+	struct dk_diskio_completion completion;
+	/*! @} */
+
+	/*! the data of a merged request; must come last */
+	vm_mdl_t mdl;
+};
+
+TAILQ_HEAD(dk_blk_reqlist, dk_blk_req);
+
+/*! Operations a driver provides to a block queue. */
+struct dk_blk_driver_ops {
+	/*!
+	 * Issue a request: transfer @p req->nBlocks blocks at @p req->block
+	 * to or from @p buf, calling @p req->completion when done.
+	 * @returns 0 if issued, -EAGAIN if the driver is out of resources and
+	 * the request should be retried after a completion, or other -errno if
+	 * the request failed.
+	 */
+	int (*issue)(void *driver, struct dk_blk_req *req, vm_mdl_t *buf);
+	/*! Begin a batch of issues; optional. Interrupts are disabled. */
+	void (*begin)(void *driver);
+	/*! End a batch of issues; optional. Interrupts are disabled. */
+	void (*commit)(void *driver);
+};
+
+/*! An I/O scheduler's operations. All are called with the queue locked. */
+struct dk_blk_sched_ops {
+	const char *name;
+	/*! Set up the scheduler's state in @p q->schedData. */
+	int (*init)(struct dk_blk_queue *q);
+	/*! Free the scheduler's state. */
+	void (*fini)(struct dk_blk_queue *q);
+	/*! Queue a request, or merge it into a queued one. */
+	void (*insert)(struct dk_blk_queue *q, struct dk_blk_req *req);
+	/*! Take the next request to dispatch, if any. */
+	struct dk_blk_req *(*next)(struct dk_blk_queue *q, uint64_t now);
+};
+
+/*! Per-CPU software queue. */
+struct dk_blk_ctx {
+	spinlock_t	      lock;
+	struct dk_blk_reqlist reqs;
+} __attribute__((aligned(64)));
+
+/*! A block I/O queue belonging to a drive. */
+typedef struct dk_blk_queue {
+	const struct dk_blk_driver_ops *driver;
+	void			       *driverArg;
+
+	size_t	 blockSize;
+	uint64_t maxBlocks;    /*!< most blocks the driver takes in a request */
+	unsigned depth;	       /*!< most requests in flight */
+	atomic_uint inflight;  /*!< requests in flight */
+
+	/*! @name tunables @{ */
+	uint64_t readExpire;  /*!< deadline: read expiry, in dk_blk_now() units */
+	uint64_t writeExpire; /*!< deadline: write expiry */
+	unsigned fifoBatch;   /*!< deadline: most requests per sorted batch */
+	unsigned writesStarved; /*!< deadline: read batches before a write */
+	uint64_t budget;      /*!< budget-fair: blocks per turn */
+	/*! @} */
+
+	/*! locks the scheduler, and the requeue list */
+	spinlock_t lock;
+	enum dk_blk_sched		 schedKind;
+	const struct dk_blk_sched_ops	*sched;
+	void				*schedData;
+	/*! requests the driver was too busy to accept */
+	struct dk_blk_reqlist requeue;
+	/*! calls of dk_blk_kick(), so that one racing a requeue is noticed */
+	atomic_uint kicks;
+
+	/*! @name request pool @{ */
+	spinlock_t	   poolLock;
+	semaphore_t	   poolSem;
+	struct dk_blk_req *freeReqs;
+	size_t		   nFree;
+	struct dk_blk_req **reqs;
+	size_t		   nReqs;
+	/*! @} */
+
+	size_t		   nCtxs;
+	struct dk_blk_ctx *ctxs;
+
+	/*! @name statistics @{ */
+	atomic_size_t nSubmitted; /*!< I/Os submitted */
+	atomic_size_t nMerged;	  /*!< I/Os merged into another request */
+	atomic_size_t nIssued;	  /*!< requests issued to the driver */
+	atomic_size_t nBusy;	  /*!< times the driver was too busy */
+	atomic_size_t nBatches;	  /*!< batches (begin/commit pairs) issued */
+	/*! @} */
+} dk_blk_queue_t;
+
+/*!
+ * Plugs a thread's I/O: while a plug is started, I/O submitted by the thread
+ * is held on the plug (and merged there) until the plug is finished. Plugs are
+ * typically on-stack; a plug started while one is already does nothing.
+ */
+struct dk_blk_plug {
+	struct dk_blk_reqlist reqs;
+	size_t		      nReqs;
+};
+
+/*! Time in the units of the deadline scheduler's expiries (TSC cycles.) */
+uint64_t dk_blk_now(void);
+
+/*!
+ * Create a block queue for a driver.
+ * @param blockSize the drive's block size
+ * @param maxBlocks most blocks the driver takes in a request
+ * @param depth most requests to have in flight at once
+ */
+int dk_blk_queue_new(dk_blk_queue_t **out, const struct dk_blk_driver_ops *ops,
+    void *driverArg, size_t blockSize, uint64_t maxBlocks, unsigned depth);
+
+/*!
+ * Change the most requests a queue has in flight at once, within the size of
+ * its request pool (its depth when created, or more.) Requests already in
+ * flight beyond a lowered depth are left to complete.
+ * @returns the new depth
+ */
+unsigned dk_blk_set_depth(dk_blk_queue_t *q, unsigned depth);
+
+/*! Change a queue's I/O scheduler. The queue must be idle. */
+int dk_blk_set_scheduler(dk_blk_queue_t *q, enum dk_blk_sched kind);
+
+/*!
+ * Submit an I/O of @p nBlocks blocks at @p block, to or from @p buf; at most
+ * @p q->maxBlocks. @p completion is called with the number of bytes
+ * transferred, or -errno. Must be called from thread context; may block while
+ * all requests are in use.
+ */
+int dk_blk_submit(dk_blk_queue_t *q, enum dk_blk_op op, uint64_t block,
+    uint64_t nBlocks, vm_mdl_t *buf, int options,
+    struct dk_diskio_completion *completion);
+
+/*! Dispatch what requests can be. May be called from interrupt context. */
+void dk_blk_run(dk_blk_queue_t *q);
+
+/*!
+ * Retry the requests the driver refused for want of resources, if there are
+ * any. A queue retries them itself on its own completions, but it may have
+ * none in flight; so a driver whose resources are shared with other queues, or
+ * with commands which don't go through one, must call this as they are freed.
+ * May be called from interrupt context.
+ */
+void dk_blk_kick(dk_blk_queue_t *q);
+
+/*! Start plugging the current thread's I/O. */
+void dk_blk_plug_start(struct dk_blk_plug *plug);
+
+/*! Finish plugging, and submit the I/O held on the plug. */
+void dk_blk_plug_finish(struct dk_blk_plug *plug);
+
+/*!
+ * Submit the I/O held on the current thread's plug, if it's plugged, leaving
+ * it plugged. A plugged thread must do this before waiting on I/O.
+ */
+void dk_blk_plug_flush(void);
+
+#endif /* DK_BLK_H_ */
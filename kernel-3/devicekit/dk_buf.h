@@ -0,0 +1,140 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+/*!
+ * @file dk_buf.h
+ * @brief Block buffer cache for disks.
+ *
+ * The cache holds the contents of disks in page-sized buffers, each keyed by
+ * its disk and its block: the index of the DK_BUF_SIZE-byte unit of the disk
+ * it covers. A buffer is backed by a single wired page, so a filesystem may
+ * read and write its contents in place through @p data, and share the page
+ * (e.g. with a vnode's object) rather than copy it.
+ *
+ * Buffers are referenced while in use. Unreferenced ones are kept on an LRU
+ * list, from the head of which clean ones are reused once the cache has grown
+ * to its limit. Reading blocks of a disk in sequence starts reads ahead of
+ * them, over a window which doubles with each sequential read. Dirtied
+ * buffers are written back later by a flusher thread, once they have been
+ * dirty for a few of its passes, or sooner if too many are dirty; they are
+ * written in a plugged batch, so that adjacent ones are merged by the block
+ * queue.
+ *
+ * None of these may be called from interrupt context.
+ */
+
+#ifndef DK_BUF_H_
+#define DK_BUF_H_
+
+#include <sys/queue.h>
+
+#include <kern/sync.h>
+#include <vm/vm.h>
+
+/*! Initialise the buffer cache and start its flusher thread. */
+void dk_buf_init(void);
+
+/* the rest concerns disks, so is only for Objective-C */
+#ifdef __OBJC__
+#include "devicekit/DKDisk.h"
+
+/*! Size of a buffer, and the unit in which its block is expressed. */
+#define DK_BUF_SIZE PGSIZE
+
+/*! A disk whose data may be cached. */
+typedef DKDevice<DKAbstractDiskMethods> dk_buf_disk_t;
+
+/*! Buffer state. */
+enum dk_buf_flags {
+	kDKBufValid = 1 << 0,	/*!< contents are those of the disk */
+	kDKBufDirty = 1 << 1,	/*!< contents are to be written back */
+	kDKBufBusy = 1 << 2,	/*!< I/O is in progress */
+	kDKBufWriting = 1 << 3, /*!< the I/O in progress is a write */
+	kDKBufError = 1 << 4,	/*!< the last I/O failed */
+	kDKBufFilling = 1 << 5, /*!< busy being filled by dk_buf_get()'s caller */
+};
+
+/*!
+ * A cached page of a disk. The fields are protected by the cache's lock; the
+ * holder of a reference may use @p data, @p size, @p disk and @p block freely.
+ */
+typedef struct dk_buf {
+	/*! linkage for the hash chain */
+	LIST_ENTRY(dk_buf) hashEntry;
+	/*! linkage for the LRU list while unreferenced, or the free list */
+	TAILQ_ENTRY(dk_buf) lruEntry;
+	/*! linkage for the dirty list while dirty */
+	TAILQ_ENTRY(dk_buf) dirtyEntry;
+
+	dk_buf_disk_t *disk;
+	blkoff_t       block; /*!< in units of DK_BUF_SIZE */
+	size_t	       size;  /*!< bytes of the disk covered; less at its end */
+
+	vm_mdl_t  *mdl;	 /*!< a one-page MDL with which I/O is done */
+	vm_page_t *page; /*!< the page */
+	void	  *data; /*!< the page's kernel mapping */
+
+	unsigned refcnt;
+	unsigned flags;	   /*!< dk_buf_flags */
+	unsigned dirtyGen; /*!< flusher pass at which it was dirtied */
+	unsigned nWaiters; /*!< threads waiting for I/O to finish */
+	/*! signalled once for each waiter when I/O finishes */
+	semaphore_t wait;
+
+	struct dk_diskio_completion completion;
+} dk_buf_t;
+
+/*!
+ * Get a referenced buffer holding block @p block of @p disk, reading it in if
+ * it isn't cached (and perhaps reading ahead.)
+ * @returns 0, or -errno if the read failed.
+ */
+int dk_buf_read(dk_buf_disk_t *disk, blkoff_t block, dk_buf_t **out);
+
+/*!
+ * Get a referenced buffer for block @p block of @p disk without reading it in,
+ * for a caller who is going to overwrite all of it. Its contents are undefined
+ * unless kDKBufValid is set; the caller must fill it and then dirty it. If it
+ * isn't valid it is kept busy until then, so that others wait for its contents
+ * rather than read the disk's in over them.
+ */
+int dk_buf_get(dk_buf_disk_t *disk, blkoff_t block, dk_buf_t **out);
+
+/*!
+ * Copy @p nBytes bytes at byte offset @p offset of @p disk into @p dst through
+ * the cache, for small metadata reads that don't keep the buffers.
+ */
+int dk_buf_copy(dk_buf_disk_t *disk, off_t offset, void *dst, size_t nBytes);
+
+/*! Mark a referenced buffer's contents as valid and to be written back. */
+void dk_buf_dirty(dk_buf_t *buf);
+
+/*! Write a referenced buffer now, and wait for the write to finish. */
+int dk_buf_write(dk_buf_t *buf);
+
+/*! Drop a reference to a buffer. */
+void dk_buf_release(dk_buf_t *buf);
+
+/*!
+ * Write back and evict the buffers of @p disk overlapping @p nBytes bytes at
+ * byte offset @p offset, so that I/O bypassing the cache stays coherent with
+ * it. Buffers in use by others are written back but kept.
+ */
+int dk_buf_invalidate(dk_buf_disk_t *disk, off_t offset, size_t nBytes);
+
+/*!
+ * Write back all the dirty buffers of @p disk, wait for them, and flush the
+ * disk's write cache.
+ */
+int dk_buf_sync(dk_buf_disk_t *disk);
+
+#endif /* __OBJC__ */
+
+#endif /* DK_BUF_H_ */
@@ -0,0 +1,800 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+#include <sys/param.h>
+
+#include <kern/kmem.h>
+#include <kern/sync.h>
+#include <kern/task.h>
+#include <kern/types.h>
+#include <libkern/klib.h>
+#include <machine/machdep.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "devicekit/dk_buf.h"
+
+enum {
+	/* buffers the cache grows to before reusing them */
+	kDKBufMax = 2048,
+	/* hash chains; a power of 2 */
+	kDKBufNHash = 512,
+	/* dirty buffers beyond which the flusher is woken early */
+	kDKBufDirtyHigh = kDKBufMax / 2,
+	/* flusher passes a buffer may stay dirty for */
+	kDKBufWriteBackDelay = 5,
+	/* buffers written back in one plugged batch */
+	kDKBufFlushBatch = 64,
+	/* sequential streams whose read-ahead is tracked */
+	kDKBufRAStreams = 8,
+	/* read-ahead window, in buffers, after the first sequential read */
+	kDKBufRAMin = 4,
+	/* largest read-ahead window */
+	kDKBufRAMax = 32,
+};
+
+/* interval between the flusher's passes */
+#define DK_BUF_FLUSH_INTERVAL NS_PER_S
+
+/*
+ * A stream of sequential reads of a disk. Reads ahead of it are started over
+ * a window which doubles with each sequential read; @p next is the first
+ * block not yet read ahead.
+ */
+struct dk_buf_ra {
+	dk_buf_disk_t *disk;
+	blkoff_t       last;
+	blkoff_t       next;
+	unsigned       window;
+};
+
+/*
+ * The cache. The lock is taken with interrupts disabled, as I/O completions
+ * (which run in interrupt context) take it too.
+ */
+static struct dk_bcache {
+	spinlock_t lock;
+
+	LIST_HEAD(, dk_buf) hash[kDKBufNHash];
+	/* unreferenced buffers, least recently used first */
+	TAILQ_HEAD(, dk_buf) lru;
+	/* dirty buffers, least recently dirtied first */
+	TAILQ_HEAD(, dk_buf) dirty;
+	/* allocated buffers not in the cache */
+	TAILQ_HEAD(, dk_buf) free;
+
+	size_t nBufs;
+	size_t nDirty;
+
+	struct dk_buf_ra ra[kDKBufRAStreams];
+	unsigned	 raNext; /* stream to replace next */
+
+	/* flusher passes so far; advanced by the flusher's callout */
+	atomic_uint gen;
+	/* whether the flusher is to write back everything dirty */
+	atomic_bool urgent;
+	semaphore_t flushSem;
+	callout_t   flushCallout;
+
+	/* statistics */
+	size_t nHits, nMisses, nReadAheads, nWriteBacks;
+} bc;
+
+static inline bool
+bc_lock(void)
+{
+	bool iff = md_intr_disable();
+	spinlock_lock(&bc.lock);
+	return iff;
+}
+
+static inline void
+bc_unlock(bool iff)
+{
+	spinlock_unlock(&bc.lock);
+	md_intr_x(iff);
+}
+
+static inline size_t
+buf_hash(dk_buf_disk_t *disk, blkoff_t block)
+{
+	return (((uintptr_t)disk >> 4) ^ (block * 0x9e3779b97f4a7c15ull)) &
+	    (kDKBufNHash - 1);
+}
+
+/* size in bytes of a disk, or -1 if unknown */
+static off_t
+disk_size(dk_buf_disk_t *disk)
+{
+	if ([disk isKindOfClass:[DKLogicalDisk class]])
+		return [(DKLogicalDisk *)disk size];
+	else if ([disk isKindOfClass:[DKDrive class]])
+		return [(DKDrive *)disk nBlocks] * [disk blockSize];
+	return -1;
+}
+
+static dk_buf_t *
+buf_lookup(dk_buf_disk_t *disk, blkoff_t block)
+{
+	dk_buf_t *buf;
+
+	LIST_FOREACH (buf, &bc.hash[buf_hash(disk, block)], hashEntry)
+		if (buf->disk == disk && buf->block == block)
+			return buf;
+
+	return NULL;
+}
+
+/* wake the waiters for a buffer's I/O; called locked, returns how many */
+static unsigned
+buf_wakeup(dk_buf_t *buf)
+{
+	unsigned n = buf->nWaiters;
+	buf->nWaiters = 0;
+	return n;
+}
+
+/* wait, locked, for any I/O on a buffer to finish */
+static void
+buf_await(dk_buf_t *buf, bool *iff)
+{
+	while (buf->flags & kDKBufBusy) {
+		buf->nWaiters++;
+		bc_unlock(*iff);
+		semaphore_wait(&buf->wait, -1);
+		*iff = bc_lock();
+	}
+}
+
+static void
+buf_mark_dirty(dk_buf_t *buf)
+{
+	if (buf->flags & kDKBufDirty)
+		return;
+	buf->flags |= kDKBufDirty;
+	buf->dirtyGen = atomic_load(&bc.gen);
+	TAILQ_INSERT_TAIL(&bc.dirty, buf, dirtyEntry);
+	bc.nDirty++;
+}
+
+static void
+buf_clear_dirty(dk_buf_t *buf)
+{
+	if (!(buf->flags & kDKBufDirty))
+		return;
+	buf->flags &= ~kDKBufDirty;
+	TAILQ_REMOVE(&bc.dirty, buf, dirtyEntry);
+	bc.nDirty--;
+}
+
+/* I/O completion; may run in interrupt context */
+static void
+buf_iodone(void *data, ssize_t result)
+{
+	dk_buf_t *buf = data;
+	unsigned  nWake;
+	bool	  iff;
+
+	iff = bc_lock();
+	assert(buf->flags & kDKBufBusy);
+	if (result < 0) {
+		buf->flags |= kDKBufError;
+		/* a failed write stays dirty, to be retried */
+		if (buf->flags & kDKBufWriting)
+			buf_mark_dirty(buf);
+	} else
+		buf->flags = (buf->flags & ~kDKBufError) | kDKBufValid;
+	buf->flags &= ~(kDKBufBusy | kDKBufWriting);
+	nWake = buf_wakeup(buf);
+	bc_unlock(iff);
+
+	while (nWake--)
+		semaphore_signal(&buf->wait);
+}
+
+/*
+ * Start I/O on a buffer which the caller has marked busy (and, for a write,
+ * kDKBufWriting and not dirty.) Completes with buf_iodone().
+ */
+static void
+buf_start_io(dk_buf_t *buf, bool write)
+{
+	int r;
+
+	buf->completion.callback = buf_iodone;
+	buf->completion.data = buf;
+
+	if (write)
+		r = [buf->disk writeBytes:buf->size
+				       at:buf->block * DK_BUF_SIZE
+			       fromBuffer:buf->mdl
+				  options:0
+			       completion:&buf->completion];
+	else
+		r = [buf->disk readBytes:buf->size
+				      at:buf->block * DK_BUF_SIZE
+			      intoBuffer:buf->mdl
+			      completion:&buf->completion];
+
+	if (r < 0)
+		buf_iodone(buf, r);
+}
+
+static dk_buf_t *
+buf_alloc(void)
+{
+	dk_buf_t *buf = kmem_zalloc(sizeof(*buf));
+
+	if (buf == NULL)
+		return NULL;
+
+	if (vm_mdl_new_with_capacity(&buf->mdl, DK_BUF_SIZE) != 0) {
+		kmem_free(buf, sizeof(*buf));
+		return NULL;
+	}
+
+	buf->page = buf->mdl->pages[0];
+	buf->data = P2V(buf->page->paddr);
+	buf->wait = (semaphore_t)SEMAPHORE_INITIALIZER(buf->wait);
+
+	return buf;
+}
+
+/*
+ * Take the least recently used clean buffer for reuse, locked. If there is
+ * none, but there are unreferenced dirty ones, the least recently used of
+ * those is written back; or if there are only some with I/O in progress, one
+ * is waited for. In either case the lock was dropped, and @p retry is set for
+ * the caller to look again. If every buffer is referenced, returns NULL.
+ */
+static dk_buf_t *
+buf_reclaim(bool *iff, bool nowait, bool *retry)
+{
+	dk_buf_t *buf, *dirty = NULL, *busy = NULL;
+
+	*retry = false;
+
+	TAILQ_FOREACH (buf, &bc.lru, lruEntry) {
+		if (buf->flags & kDKBufBusy) {
+			if (busy == NULL)
+				busy = buf;
+			continue;
+		} else if (buf->flags & kDKBufDirty) {
+			if (dirty == NULL)
+				dirty = buf;
+			continue;
+		}
+
+		TAILQ_REMOVE(&bc.lru, buf, lruEntry);
+		LIST_REMOVE(buf, hashEntry);
+		return buf;
+	}
+
+	if (nowait)
+		return NULL;
+
+	if (dirty != NULL) {
+		dirty->flags |= kDKBufBusy | kDKBufWriting;
+		buf_clear_dirty(dirty);
+		bc.nWriteBacks++;
+		bc_unlock(*iff);
+		buf_start_io(dirty, true);
+		*iff = bc_lock();
+		*retry = true;
+	} else if (busy != NULL) {
+		buf_await(busy, iff);
+		*retry = true;
+	}
+
+	return NULL;
+}
+
+/*
+ * Get a buffer for a block, referenced, waiting for any I/O on it to finish.
+ * The cache is grown past its limit only if every buffer is referenced.
+ *
+ * For read-ahead, a buffer is only got if the block isn't already cached and
+ * one can be had without waiting; it is left unreferenced but busy, on the
+ * LRU list, and its read started.
+ *
+ * @returns 0, or -errno; -EEXIST if read-ahead found the block cached.
+ */
+static int
+buf_getblk(dk_buf_disk_t *disk, blkoff_t block, dk_buf_t **out,
+    bool readAhead)
+{
+	dk_buf_t *buf, *spare = NULL;
+	off_t	  size = disk_size(disk);
+	bool	  iff, retry;
+
+	if (block < 0 || (size >= 0 && block * DK_BUF_SIZE >= size))
+		return -EINVAL;
+
+	iff = bc_lock();
+again:
+	buf = buf_lookup(disk, block);
+	if (buf != NULL) {
+		if (spare != NULL)
+			TAILQ_INSERT_HEAD(&bc.free, spare, lruEntry);
+		if (readAhead) {
+			bc_unlock(iff);
+			return -EEXIST;
+		}
+		if (buf->refcnt++ == 0)
+			TAILQ_REMOVE(&bc.lru, buf, lruEntry);
+		buf_await(buf, &iff);
+		bc.nHits++;
+		bc_unlock(iff);
+		*out = buf;
+		return 0;
+	}
+
+	if (spare == NULL && (spare = TAILQ_FIRST(&bc.free)) != NULL)
+		TAILQ_REMOVE(&bc.free, spare, lruEntry);
+
+	if (spare == NULL && bc.nBufs >= kDKBufMax) {
+		spare = buf_reclaim(&iff, readAhead, &retry);
+		if (retry)
+			goto again;
+		if (spare == NULL && readAhead) {
+			bc_unlock(iff);
+			return -ENOMEM;
+		}
+	}
+
+	if (spare == NULL) {
+		bc.nBufs++;
+		bc_unlock(iff);
+		spare = buf_alloc();
+		iff = bc_lock();
+		if (spare == NULL) {
+			bc.nBufs--;
+			bc_unlock(iff);
+			return -ENOMEM;
+		}
+		/* the block may have been entered while unlocked */
+		goto again;
+	}
+
+	buf = spare;
+	buf->disk = disk;
+	buf->block = block;
+	buf->size = size >= 0 ? MIN(DK_BUF_SIZE, size - block * DK_BUF_SIZE) :
+				DK_BUF_SIZE;
+	buf->flags = 0;
+	LIST_INSERT_HEAD(&bc.hash[buf_hash(disk, block)], buf, hashEntry);
+	bc.nMisses++;
+
+	if (readAhead) {
+		buf->refcnt = 0;
+		buf->flags = kDKBufBusy;
+		TAILQ_INSERT_TAIL(&bc.lru, buf, lruEntry);
+		bc.nReadAheads++;
+		bc_unlock(iff);
+		buf_start_io(buf, false);
+		return 0;
+	}
+
+	buf->refcnt = 1;
+	bc_unlock(iff);
+	*out = buf;
+	return 0;
+}
+
+/*
+ * Note a read of @p block of @p disk, and determine what to read ahead of it.
+ * Returns the count of blocks from @p *from to read ahead.
+ */
+static size_t
+ra_note(dk_buf_disk_t *disk, blkoff_t block, blkoff_t *from)
+{
+	struct dk_buf_ra *ra = NULL;
+	blkoff_t	  to;
+	bool		  iff;
+
+	iff = bc_lock();
+	for (int i = 0; i < kDKBufRAStreams; i++)
+		if (bc.ra[i].disk == disk && (block == bc.ra[i].last + 1 ||
+		    block == bc.ra[i].last)) {
+			ra = &bc.ra[i];
+			break;
+		}
+
+	if (ra == NULL) {
+		/* not sequential; start tracking a new stream */
+		ra = &bc.ra[bc.raNext++ % kDKBufRAStreams];
+		ra->disk = disk;
+		ra->last = block;
+		ra->next = block + 1;
+		ra->window = 0;
+		bc_unlock(iff);
+		return 0;
+	}
+
+	if (block != ra->last)
+		ra->window = ra->window == 0 ? kDKBufRAMin :
+					       MIN(ra->window * 2, kDKBufRAMax);
+	ra->last = block;
+
+	*from = MAX(block + 1, ra->next);
+	to = block + 1 + ra->window;
+	if (*from >= to) {
+		bc_unlock(iff);
+		return 0;
+	}
+
+	ra->next = to;
+	bc_unlock(iff);
+
+	return to - *from;
+}
+
+int
+dk_buf_read(dk_buf_disk_t *disk, blkoff_t block, dk_buf_t **out)
+{
+	struct dk_blk_plug plug;
+	dk_buf_t	  *buf;
+	blkoff_t	   from;
+	size_t		   nAhead;
+	bool		   iff;
+	int		   r;
+
+	r = buf_getblk(disk, block, &buf, false);
+	if (r < 0)
+		return r;
+
+	dk_blk_plug_start(&plug);
+
+	iff = bc_lock();
+	/* another thread may have got it first, and be reading it in */
+	if (!(buf->flags & (kDKBufValid | kDKBufBusy))) {
+		buf->flags |= kDKBufBusy;
+		bc_unlock(iff);
+		buf_start_io(buf, false);
+	} else
+		bc_unlock(iff);
+
+	nAhead = ra_note(disk, block, &from);
+	for (size_t i = 0; i < nAhead; i++)
+		if (buf_getblk(disk, from + i, NULL, true) == -EINVAL)
+			break; /* past the end of the disk */
+
+	dk_blk_plug_finish(&plug);
+
+	iff = bc_lock();
+	buf_await(buf, &iff);
+	r = buf->flags & kDKBufValid ? 0 : -EIO;
+	bc_unlock(iff);
+
+	if (r < 0) {
+		dk_buf_release(buf);
+		return r;
+	}
+
+	*out = buf;
+	return 0;
+}
+
+int
+dk_buf_copy(dk_buf_disk_t *disk, off_t offset, void *dst, size_t nBytes)
+{
+	while (nBytes > 0) {
+		dk_buf_t *buf;
+		size_t	  off = offset % DK_BUF_SIZE, len;
+		int	  r;
+
+		r = dk_buf_read(disk, offset / DK_BUF_SIZE, &buf);
+		if (r < 0)
+			return r;
+
+		if (off >= buf->size) {
+			dk_buf_release(buf);
+			return -EINVAL;
+		}
+
+		len = MIN(nBytes, buf->size - off);
+		memcpy(dst, buf->data + off, len);
+		dk_buf_release(buf);
+
+		dst += len;
+		offset += len;
+		nBytes -= len;
+	}
+
+	return 0;
+}
+
+int
+dk_buf_get(dk_buf_disk_t *disk, blkoff_t block, dk_buf_t **out)
+{
+	dk_buf_t *buf;
+	bool	  iff;
+	int	  r;
+
+	r = buf_getblk(disk, block, &buf, false);
+	if (r < 0)
+		return r;
+
+	iff = bc_lock();
+	/* a dk_buf_read() may have started reading it in meanwhile */
+	buf_await(buf, &iff);
+	if (!(buf->flags & kDKBufValid))
+		buf->flags |= kDKBufBusy | kDKBufFilling;
+	bc_unlock(iff);
+
+	*out = buf;
+	return 0;
+}
+
+/* end the filling of a buffer from dk_buf_get(); called locked */
+static unsigned
+buf_filled(dk_buf_t *buf)
+{
+	if (!(buf->flags & kDKBufFilling))
+		return 0;
+	buf->flags &= ~(kDKBufBusy | kDKBufFilling);
+	return buf_wakeup(buf);
+}
+
+void
+dk_buf_dirty(dk_buf_t *buf)
+{
+	unsigned nWake;
+	bool	 iff, kick;
+
+	iff = bc_lock();
+	assert(buf->refcnt > 0);
+	buf->flags = (buf->flags & ~kDKBufError) | kDKBufValid;
+	nWake = buf_filled(buf);
+	buf_mark_dirty(buf);
+	kick = bc.nDirty > kDKBufDirtyHigh && !atomic_load(&bc.urgent);
+	if (kick)
+		atomic_store(&bc.urgent, true);
+	bc_unlock(iff);
+
+	while (nWake--)
+		semaphore_signal(&buf->wait);
+	if (kick)
+		semaphore_signal(&bc.flushSem);
+}
+
+int
+dk_buf_write(dk_buf_t *buf)
+{
+	bool iff;
+	int  r;
+
+	iff = bc_lock();
+	assert(buf->refcnt > 0);
+	/* if filling, its waiters are woken once the write is done instead */
+	if (buf->flags & kDKBufFilling)
+		buf->flags &= ~(kDKBufBusy | kDKBufFilling);
+	buf_await(buf, &iff);
+	buf->flags |= kDKBufValid | kDKBufBusy | kDKBufWriting;
+	buf_clear_dirty(buf);
+	bc_unlock(iff);
+
+	buf_start_io(buf, true);
+
+	iff = bc_lock();
+	buf_await(buf, &iff);
+	r = buf->flags & kDKBufError ? -EIO : 0;
+	bc_unlock(iff);
+
+	return r;
+}
+
+void
+dk_buf_release(dk_buf_t *buf)
+{
+	unsigned nWake;
+	bool	 iff;
+
+	iff = bc_lock();
+	assert(buf->refcnt > 0);
+	/* abandoned unfilled; a waiting dk_buf_read() will read it in */
+	nWake = buf_filled(buf);
+	if (--buf->refcnt == 0) {
+		if (!(buf->flags & (kDKBufValid | kDKBufDirty | kDKBufBusy))) {
+			/* nothing worth keeping */
+			LIST_REMOVE(buf, hashEntry);
+			TAILQ_INSERT_HEAD(&bc.free, buf, lruEntry);
+		} else
+			TAILQ_INSERT_TAIL(&bc.lru, buf, lruEntry);
+	}
+	bc_unlock(iff);
+
+	while (nWake--)
+		semaphore_signal(&buf->wait);
+}
+
+int
+dk_buf_invalidate(dk_buf_disk_t *disk, off_t offset, size_t nBytes)
+{
+	blkoff_t end = (offset + nBytes + DK_BUF_SIZE - 1) / DK_BUF_SIZE;
+	int	 r = 0;
+
+	for (blkoff_t block = offset / DK_BUF_SIZE; block < end; block++) {
+		dk_buf_t *buf;
+		bool	  iff, dirty;
+
+		iff = bc_lock();
+		buf = buf_lookup(disk, block);
+		if (buf == NULL) {
+			bc_unlock(iff);
+			continue;
+		}
+		if (buf->refcnt++ == 0)
+			TAILQ_REMOVE(&bc.lru, buf, lruEntry);
+		buf_await(buf, &iff);
+		dirty = buf->flags & kDKBufDirty;
+		bc_unlock(iff);
+
+		if (dirty && dk_buf_write(buf) < 0)
+			r = -EIO;
+
+		iff = bc_lock();
+		if (--buf->refcnt == 0) {
+			/* keep it if it was dirtied again meanwhile */
+			if (!(buf->flags & (kDKBufDirty | kDKBufBusy))) {
+				LIST_REMOVE(buf, hashEntry);
+				TAILQ_INSERT_HEAD(&bc.free, buf, lruEntry);
+			} else
+				TAILQ_INSERT_TAIL(&bc.lru, buf, lruEntry);
+		}
+		bc_unlock(iff);
+	}
+
+	return r;
+}
+
+/*
+ * Write back dirty buffers: those of @p disk, or of all disks if it is NULL;
+ * those dirtied at least kDKBufWriteBackDelay passes ago, unless @p all. If
+ * @p disk is given, buffers in use are written too, and the writes awaited.
+ * @returns whether there may be more to write.
+ */
+static bool
+flush_batch(dk_buf_disk_t *disk, bool all, int *error)
+{
+	struct dk_blk_plug plug;
+	dk_buf_t	  *bufs[kDKBufFlushBatch], *buf, *next;
+	size_t		   nBufs = 0;
+	unsigned	   gen = atomic_load(&bc.gen);
+	bool		   iff, more = false;
+
+	iff = bc_lock();
+	for (buf = TAILQ_FIRST(&bc.dirty); buf != NULL; buf = next) {
+		next = TAILQ_NEXT(buf, dirtyEntry);
+
+		if (!all && gen - buf->dirtyGen < kDKBufWriteBackDelay)
+			break;
+		if (disk != NULL && buf->disk != disk)
+			continue;
+		if (buf->flags & kDKBufBusy || (disk == NULL && buf->refcnt > 0))
+			continue;
+		if (nBufs == kDKBufFlushBatch) {
+			more = true;
+			break;
+		}
+
+		if (disk != NULL && buf->refcnt++ == 0)
+			TAILQ_REMOVE(&bc.lru, buf, lruEntry);
+		buf->flags |= kDKBufBusy | kDKBufWriting;
+		buf_clear_dirty(buf);
+		bufs[nBufs++] = buf;
+	}
+	bc.nWriteBacks += nBufs;
+	bc_unlock(iff);
+
+	dk_blk_plug_start(&plug);
+	for (size_t i = 0; i < nBufs; i++)
+		buf_start_io(bufs[i], true);
+	dk_blk_plug_finish(&plug);
+
+	if (disk == NULL)
+		return more;
+
+	for (size_t i = 0; i < nBufs; i++) {
+		iff = bc_lock();
+		buf_await(bufs[i], &iff);
+		if (bufs[i]->flags & kDKBufError)
+			*error = -EIO;
+		bc_unlock(iff);
+		dk_buf_release(bufs[i]);
+	}
+
+	return more;
+}
+
+int
+dk_buf_sync(dk_buf_disk_t *disk)
+{
+	dk_buf_t *buf;
+	bool	  iff, pending;
+	int	  r = 0;
+
+	do {
+		while (flush_batch(disk, true, &r))
+			;
+
+		/*
+		 * Wait out write-backs the flusher started; if one fails, its
+		 * buffer is dirty again, and goes round again.
+		 */
+		pending = false;
+		iff = bc_lock();
+		TAILQ_FOREACH (buf, &bc.lru, lruEntry)
+			if (buf->disk == disk && buf->flags & kDKBufWriting) {
+				pending = true;
+				buf->refcnt++;
+				TAILQ_REMOVE(&bc.lru, buf, lruEntry);
+				buf_await(buf, &iff);
+				break;
+			}
+		bc_unlock(iff);
+		if (pending)
+			dk_buf_release(buf);
+	} while (pending && r == 0);
+
+	if (r < 0)
+		return r;
+
+	return [disk flushWithCompletion:NULL];
+}
+
+/* runs in interrupt context */
+static void
+flush_tick(md_intr_frame_t *frame, void *arg)
+{
+	atomic_fetch_add(&bc.gen, 1);
+	semaphore_signal(&bc.flushSem);
+}
+
+static void
+flush_thread(void *arg)
+{
+	while (true) {
+		bool iff, all;
+		int  unused;
+
+		/* semaphores can't time out yet, so a callout ticks us */
+		iff = md_intr_disable();
+		if (bc.flushCallout.state == kCalloutDisabled) {
+			bc.flushCallout.nanosecs = DK_BUF_FLUSH_INTERVAL;
+			callout_enqueue(&bc.flushCallout);
+		}
+		md_intr_x(iff);
+
+		semaphore_wait(&bc.flushSem, -1);
+
+		all = atomic_exchange(&bc.urgent, false);
+		while (flush_batch(NULL, all, &unused))
+			;
+	}
+}
+
+void
+dk_buf_init(void)
+{
+	spinlock_init(&bc.lock);
+	for (int i = 0; i < kDKBufNHash; i++)
+		LIST_INIT(&bc.hash[i]);
+	TAILQ_INIT(&bc.lru);
+	TAILQ_INIT(&bc.dirty);
+	TAILQ_INIT(&bc.free);
+	bc.flushSem = (semaphore_t)SEMAPHORE_INITIALIZER(bc.flushSem);
+	bc.flushCallout.callback = flush_tick;
+	bc.flushCallout.arg = NULL;
+	bc.flushCallout.state = kCalloutDisabled;
+
+	thread_resume(thread_new(&task0, flush_thread, NULL));
+}
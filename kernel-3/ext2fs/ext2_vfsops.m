@@ -13,27 +13,31 @@
 #include <errno.h>
 
 #include "devicekit/DKDisk.h"
+#include "devicekit/dk_buf.h"
 #include "ext2_fs.h"
 
 int
 mountit(DKLogicalDisk *disk)
 {
-	vm_mdl_t		 *mdl;
-	int			r;
-	struct ext2_super_block sb;
+	dk_buf_t		 *buf;
+	struct ext2_super_block *sb;
+	int			 r;
 
-	r = vm_mdl_new_with_capacity(&mdl, PGSIZE);
-	assert(r == 0);
+	/* the superblock is at byte 1024, in the first buffer */
+	r = dk_buf_read(disk, 0, &buf);
+	if (r < 0)
+		return r;
 
-	[disk readBytes:1024 at:1024 intoBuffer:mdl completion:NULL];
-	vm_mdl_copy(mdl, &sb, 1024, 0);
-
-	if (sb.s_magic != EXT2_SUPER_MAGIC) {
+	sb = buf->data + 1024;
+	if (sb->s_magic != EXT2_SUPER_MAGIC) {
 		kprintf("ext2fs: bad superblock magic number "
 			"(expected 0x%x, got 0x%hx)\n",
-		    EXT2_SUPER_MAGIC, sb.s_magic);
+		    EXT2_SUPER_MAGIC, sb->s_magic);
+		dk_buf_release(buf);
 		return -EINVAL;
 	}
 
+	dk_buf_release(buf);
+
         return 0;
 }
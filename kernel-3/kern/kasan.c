@@ -1,31 +1,178 @@
-#include <vm/vm.h>
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+#include <sys/param.h>
+
+#include <kern/kasan.h>
+#include <kern/task.h>
 #include <libkern/klib.h>
+#include <vm/vm.h>
+
+#include <string.h>
+
+#define KASAN_SHADOW_SCALE 3
+#define KASAN_GRANULE (1 << KASAN_SHADOW_SCALE)
+
+/*! bitmap of which pages of the shadow are mapped */
+static uint64_t shadow_mapped[KASAN_SHADOW_SIZE / PGSIZE / 64];
+static spinlock_t shadow_lock = SPINLOCK_INITIALISER;
+static bool	  reporting = false;
+
+static const char *kasan_code_str[256] = {
+	[kKasanRedzone] = "redzone",
+	[kKasanFreed] = "use after free",
+	[kKasanSlabFree] = "unallocated slab object",
+	[kKasanFreePage] = "unallocated page",
+};
 
-static void
-kasan_check(vaddr_t addr, size_t size, bool isStore, void *ip)
+KASAN_NOSANITIZE static inline int8_t *
+shadow_for(uintptr_t addr)
 {
-#if 0
-	static bool in_check = false;
+	return (int8_t *)(KASAN_SHADOW_BASE +
+	    ((addr - KHEAP_BASE) >> KASAN_SHADOW_SCALE));
+}
 
-	if (in_check || addr < (vaddr_t)KHEAP_BASE ||
-	    addr > (vaddr_t)KHEAP_BASE + KHEAP_SIZE)
-		return;
+KASAN_NOSANITIZE static inline bool
+shadow_is_mapped(uintptr_t addr)
+{
+	size_t pg = (addr - KHEAP_BASE) >> KASAN_SHADOW_SCALE >> 12;
+	return shadow_mapped[pg / 64] & (1ul << (pg % 64));
+}
+
+KASAN_NOSANITIZE static inline bool
+in_heap(uintptr_t addr, size_t size)
+{
+	return addr >= (uintptr_t)KHEAP_BASE &&
+	    addr + size <= (uintptr_t)KHEAP_BASE + KHEAP_SIZE && addr + size > addr;
+}
 
-	in_check = true;
+KASAN_NOSANITIZE void
+kasan_map_shadow(const void *addr, size_t size)
+{
+	uintptr_t start, end;
 
-	if (addr == 0xffff8001005d4f00) {
-		kprintf("%p %s(%d) by %p. Old value: %p\n", addr,
-		    isStore ? "STORED" : "loaded", size,
-		    __builtin_return_address(1), *(void **)addr);
+	if (!in_heap((uintptr_t)addr, size) || size == 0)
+		return;
 
-		kprintf(" --> %p\n", __builtin_return_address(2));
-		kprintf(" --> %p\n", __builtin_return_address(3));
-		kprintf(" --> %p\n", __builtin_return_address(4));
-		kprintf(" --> %p\n", __builtin_return_address(5));
+	start = PGROUNDDOWN(shadow_for((uintptr_t)addr));
+	end = PGROUNDUP(shadow_for((uintptr_t)addr + size - 1) + 1);
+
+	for (uintptr_t va = start; va < end; va += PGSIZE) {
+		size_t	   pg = (va - KASAN_SHADOW_BASE) / PGSIZE;
+		vm_page_t *page;
+		bool	   iff;
+
+		if (shadow_mapped[pg / 64] & (1ul << (pg % 64)))
+			continue;
+
+		/* comes zeroed, i.e. all accessible */
+		page = vm_pagealloc(true, &vm_pgkmemq);
+
+		iff = md_intr_disable();
+		spinlock_lock(&shadow_lock);
+		if (shadow_mapped[pg / 64] & (1ul << (pg % 64))) {
+			/* someone beat us to it */
+			spinlock_unlock(&shadow_lock);
+			md_intr_x(iff);
+			vm_page_free(page);
+			continue;
+		}
+		pmap_enter_kern(kmap.pmap, page->paddr, (vaddr_t)va,
+		    kVMRead | kVMWrite);
+		__atomic_or_fetch(&shadow_mapped[pg / 64], 1ul << (pg % 64),
+		    __ATOMIC_RELEASE);
+		spinlock_unlock(&shadow_lock);
+		md_intr_x(iff);
 	}
+}
+
+KASAN_NOSANITIZE void
+kasan_poison(const void *addr, size_t size, enum kasan_code code)
+{
+	uintptr_t va = (uintptr_t)addr;
+
+	if (!in_heap(va, size) || size == 0 || !shadow_is_mapped(va))
+		return;
+
+	assert(va % KASAN_GRANULE == 0);
+	memset(shadow_for(va), code, ROUNDUP(size, KASAN_GRANULE) >>
+	    KASAN_SHADOW_SCALE);
+}
+
+KASAN_NOSANITIZE void
+kasan_unpoison(const void *addr, size_t size)
+{
+	uintptr_t va = (uintptr_t)addr;
 
-	in_check = false;
-#endif
+	if (!in_heap(va, size) || size == 0 || !shadow_is_mapped(va))
+		return;
+
+	assert(va % KASAN_GRANULE == 0);
+	memset(shadow_for(va), 0, size >> KASAN_SHADOW_SCALE);
+	if (size % KASAN_GRANULE != 0)
+		*shadow_for(va + size) = size % KASAN_GRANULE;
+}
+
+KASAN_NOSANITIZE void
+kasan_alloc(const void *addr, size_t size, size_t total)
+{
+	size_t accessible = ROUNDUP(size, KASAN_GRANULE);
+
+	kasan_unpoison(addr, size);
+	if (total > accessible)
+		kasan_poison(addr + accessible, total - accessible,
+		    kKasanRedzone);
+}
+
+KASAN_NOSANITIZE static void
+kasan_report(uintptr_t addr, size_t size, bool isStore, void *ip, int8_t code)
+{
+	const char *why = kasan_code_str[(uint8_t)code];
+
+	if (reporting)
+		return;
+	reporting = true;
+
+	kprintf("KASAN: invalid %s of %zu bytes at %p by %p (%s)\n",
+	    isStore ? "store" : "load", size, (void *)addr, ip,
+	    why ? why : "partially accessible granule");
+	kprintf(" --> %p\n", __builtin_return_address(1));
+	kprintf(" --> %p\n", __builtin_return_address(2));
+
+	reporting = false;
+}
+
+KASAN_NOSANITIZE static void
+kasan_check(uintptr_t addr, size_t size, bool isStore, void *ip)
+{
+	uintptr_t last = addr + size - 1;
+
+	if (size == 0 || !in_heap(addr, size) || !shadow_is_mapped(addr) ||
+	    !shadow_is_mapped(last))
+		return;
+
+	for (uintptr_t granule = ROUNDDOWN(addr, KASAN_GRANULE); granule <= last;
+	     granule += KASAN_GRANULE) {
+		int8_t shadow = *shadow_for(granule);
+
+		if (shadow == 0)
+			continue;
+		/* a partially accessible granule: is the last byte used ok? */
+		if (shadow > 0 &&
+		    (MIN(last, granule + KASAN_GRANULE - 1) & (KASAN_GRANULE -
+			1)) < (uintptr_t)shadow)
+			continue;
+
+		kasan_report(addr, size, isStore, ip, shadow);
+		return;
+	}
 }
 
 void
@@ -45,7 +192,7 @@ __asan_allocas_unpoison(void *stackTop, void *stackBase)
 #define _KASAN_HANDLE_FUN(NAME, SIZE, IS_STORE)            \
 	void __asan_##NAME##_noabort(uintptr_t addr)       \
 	{                                                  \
-		kasan_check((vaddr_t)addr, SIZE, IS_STORE, \
+		kasan_check(addr, SIZE, IS_STORE, \
 		    __builtin_return_address(0));          \
 	}
 
@@ -64,25 +211,25 @@ KASAN_HANDLE_FUN(16);
 void
 __asan_loadN_noabort(uintptr_t addr, size_t size)
 {
-	kasan_check((vaddr_t)addr, size, false, __builtin_return_address(0));
+	kasan_check(addr, size, false, __builtin_return_address(0));
 }
 
 void
 __asan_storeN_noabort(uintptr_t addr, size_t size)
 {
-	kasan_check((vaddr_t)addr, size, true, __builtin_return_address(0));
+	kasan_check(addr, size, true, __builtin_return_address(0));
 }
 
 void
 __asan_report_load_n_noabort(uintptr_t addr, size_t size)
 {
-	kasan_check((vaddr_t)addr, size, true, __builtin_return_address(0));
+	kasan_check(addr, size, false, __builtin_return_address(0));
 }
 
 void
 __asan_report_store_n_noabort(uintptr_t addr, size_t size)
 {
-	kasan_check((vaddr_t)addr, size, true, __builtin_return_address(0));
+	kasan_check(addr, size, true, __builtin_return_address(0));
 }
 
 void
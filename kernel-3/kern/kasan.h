@@ -0,0 +1,101 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+/*!
+ * @file kasan.h
+ * @brief Kernel address sanitiser: shadow memory for the kernel heap.
+ *
+ * When the kernel is built with KASAN (the `kasan` build option), every byte
+ * of the kernel heap between KHEAP_BASE and KHEAP_BASE + KHEAP_SIZE has a
+ * shadow, one shadow byte describing each 8-byte granule: 0 if the granule is
+ * wholly accessible, 1-7 if only that many leading bytes are, and one of the
+ * kasan_code values if none are. The shadow is mapped as the heap is, by
+ * kasan_map_shadow(); granules whose shadow isn't mapped are not checked.
+ *
+ * kmem poisons slab objects as they are freed and unpoisons them as they are
+ * allocated, with a redzone after each; freed objects are held in quarantine
+ * for a while before they can be reallocated. vm_kalloc() and vm_kfree() do
+ * likewise for whole pages.
+ *
+ * Without KASAN these are all no-ops, and nothing is instrumented.
+ */
+
+#ifndef KASAN_H_
+#define KASAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*! Codes describing why a granule is inaccessible. */
+enum kasan_code {
+	/*! redzone after a slab object or after a kmem_alloc() */
+	kKasanRedzone = 0xfa,
+	/*! freed slab object, perhaps in quarantine */
+	kKasanFreed = 0xfb,
+	/*! slab object never yet allocated */
+	kKasanSlabFree = 0xfc,
+	/*! kernel wired memory not currently allocated */
+	kKasanFreePage = 0xff,
+};
+
+#ifdef KASAN
+
+/*! Minimum redzone which kmem places after each slab object. */
+#define KASAN_REDZONE 16
+
+/*! Don't instrument a function; for those which handle poisoned memory. */
+#define KASAN_NOSANITIZE __attribute__((no_sanitize_address))
+
+/*!
+ * Ensure shadow memory is mapped for \p size bytes of the kernel heap at
+ * \p addr. Newly mapped shadow marks its memory accessible.
+ */
+void kasan_map_shadow(const void *addr, size_t size);
+
+/*! Mark \p size bytes at \p addr (8-byte aligned) inaccessible. */
+void kasan_poison(const void *addr, size_t size, enum kasan_code code);
+
+/*! Mark \p size bytes at \p addr (8-byte aligned) accessible. */
+void kasan_unpoison(const void *addr, size_t size);
+
+/*!
+ * Mark the first \p size bytes of a \p total byte allocation at \p addr
+ * accessible, and the rest a redzone.
+ */
+void kasan_alloc(const void *addr, size_t size, size_t total);
+
+#else
+
+#define KASAN_REDZONE 0
+#define KASAN_NOSANITIZE
+
+static inline void
+kasan_map_shadow(const void *addr, size_t size)
+{
+}
+
+static inline void
+kasan_poison(const void *addr, size_t size, enum kasan_code code)
+{
+}
+
+static inline void
+kasan_unpoison(const void *addr, size_t size)
+{
+}
+
+static inline void
+kasan_alloc(const void *addr, size_t size, size_t total)
+{
+}
+
+#endif /* KASAN */
+
+#endif /* KASAN_H_ */
@@ -20,14 +20,58 @@
 #include <sys/types.h>
 
 #ifndef _KERNEL
-#define mutex_t int
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define mutex_t pthread_mutex_t
+typedef atomic_flag spinlock_t;
 #else
 #include <kern/sync.h>
 #endif
 
+/*! Maximum number of CPUs for which a zone keeps a per-CPU cache. */
+#define KMEM_MAX_CPUS 64
+
+/*! Maximum number of NUMA nodes for which a zone keeps slabs apart. */
+#define KMEM_MAX_NODES 8
+
+/*! Size of a cache line, to which kKMemCacheAlign zones align objects. */
+#define KMEM_CACHE_LINE 64
+
+/*! Flags for a zone. */
+enum kmem_zone_flags {
+	/*! no magazine layer; used for the allocator's internal zones */
+	kKMemNoMagazines = 1 << 0,
+	/*! align objects to (at least) a cache line */
+	kKMemCacheAlign = 1 << 1,
+	/*!
+	 * keep slab headers and bufctls out-of-line whatever the object size,
+	 * so that the objects are never touched; for caches of things which
+	 * aren't memory, such as vmem quantum caches
+	 */
+	kKMemOffSlab = 1 << 2,
+};
+
+struct vmem;
+
+/*! Object constructor or destructor for a zone. */
+typedef void (*kmem_ctor_t)(void *obj);
+
+/*!
+ * Per-CPU cache of a zone (the magazine layer.) Allocations pop from, and
+ * frees push to, the loaded magazine; the previous magazine is kept so that
+ * alternating allocation and freeing at a magazine boundary doesn't thrash the
+ * depot. Only ever accessed by its own CPU, with interrupts disabled.
+ */
+typedef struct kmem_cpucache {
+	struct kmem_magazine *loaded, *previous;
+	/*! allocations and frees satisfied by the magazine layer */
+	size_t nallocs, nfrees;
+} __attribute__((aligned(64))) kmem_cpucache_t;
+
 /*!
- * A KMem zone - provides slab allocation for a particular size of object. In
- * the future it will incorporate per-CPU caches.
+ * A KMem zone - provides slab allocation for a particular size of object,
+ * fronted by per-CPU magazines and a depot of magazines.
  */
 typedef struct kmem_zone {
 	/*! linkage for kmem_zones */
@@ -36,14 +80,68 @@ typedef struct kmem_zone {
 	const char *name;
 	/*! size of contained objects */
 	size_t size;
-	/*! queue of slabs */
-	SIMPLEQ_HEAD(, kmem_slab) slablist;
+	/*! alignment of contained objects */
+	size_t align;
+	/*! distance between successive objects in a slab */
+	size_t chunksize;
+	/*!
+	 * offset of the freelist link within a free object in a small slab;
+	 * beyond the object proper if there is a constructor, so as not to
+	 * clobber the constructed state
+	 */
+	size_t linkoff;
+	/*! flags (see enum kmem_zone_flags) */
+	uint32_t flags;
+	/*! constructor and destructor, may be NULL */
+	kmem_ctor_t ctor, dtor;
+	/*!
+	 * arena from which slabs are allocated with vmem_xalloc(); NULL for
+	 * kernel wired memory. May be set only before first allocation.
+	 */
+	struct vmem *source;
+	/*! colour (offset of first object) for the next slab, and its limit */
+	size_t colour, maxcolour;
 	/*! locking */
 	mutex_t lock;
+	/*!
+	 * for each NUMA node, the slabs of memory local to it with some objects
+	 * free (allocation is from the head) and with every object free; slabs
+	 * of zones with a source arena all count as node 0's
+	 */
+	struct kmem_zone_node {
+		TAILQ_HEAD(, kmem_slab) partialslabs, emptyslabs;
+	} nodes[KMEM_MAX_NODES];
+	/*! slabs with no objects free */
+	TAILQ_HEAD(, kmem_slab) fullslabs;
+	/*! number of slabs in total, and of empty slabs */
+	size_t nslabs, nemptyslabs;
 
 	/*! the below are applicable only to large slabs */
-	/*! list of allocated bufctls, used TODO(med): Use a hash table? */
-	SLIST_HEAD(, kmem_bufctl) bufctllist;
+	/*! hash table of allocated bufctls, keyed by object address */
+	SLIST_HEAD(kmem_bufctl_bucket, kmem_bufctl) *bufctlhash;
+	/*! number of buckets (a power of 2) and of allocated bufctls */
+	size_t nbuckets, nbufctls;
+	/*! shift applied to object addresses before hashing */
+	unsigned hashshift;
+
+	/*!
+	 * @name Depot
+	 * The below are protected by depotlock, taken with interrupts disabled.
+	 * @{
+	 */
+	spinlock_t depotlock;
+	/*! full and empty magazines */
+	SLIST_HEAD(, kmem_magazine) fullmags, emptymags;
+	size_t nfullmags, nemptymags;
+	/*! index into kmem_magsizes of the size of newly-made magazines */
+	unsigned magsizeidx;
+	/*! depot lock acquisitions (and how many were contended) since the
+	 * magazine size was last reviewed */
+	unsigned ndepotops, ncontended;
+	/*! @} */
+
+	/*! per-CPU caches */
+	kmem_cpucache_t cpucache[KMEM_MAX_CPUS];
 } kmem_zone_t;
 
 SIMPLEQ_HEAD(kmem_zones, kmem_zone);
@@ -54,6 +152,12 @@ void kmem_init(void);
 /*! Dump information about all zones. */
 void kmem_dump(void);
 
+/*!
+ * Return memory to the system: purge the depot of every zone, then release
+ * every empty slab. Zones whose lock the caller holds are skipped.
+ */
+void kmem_reap(void);
+
 /*!
  * Initialise a new zone.
  *
@@ -63,6 +167,26 @@ void kmem_dump(void);
  */
 void kmem_zone_init(struct kmem_zone *zone, const char *name, size_t size);
 
+/*!
+ * Initialise a new zone as an object cache. Objects are constructed with
+ * \p ctor once, when their slab is created, and are kept in their constructed
+ * state while free; so objects must be returned to that state before being
+ * freed. \p dtor is run on each object only when its slab is destroyed.
+ *
+ * @param align required alignment of objects (a power of 2), or 0 for the
+ * default of 8 bytes.
+ * @param ctor, dtor constructor and destructor, either may be NULL.
+ * @param flags see enum kmem_zone_flags.
+ */
+void kmem_cache_init(struct kmem_zone *zone, const char *name, size_t size,
+    size_t align, kmem_ctor_t ctor, kmem_ctor_t dtor, uint32_t flags);
+
+/*!
+ * Allocate and initialise a new object cache; see kmem_cache_init().
+ */
+kmem_zone_t *kmem_cache_create(const char *name, size_t size, size_t align,
+    kmem_ctor_t ctor, kmem_ctor_t dtor, uint32_t flags);
+
 /*!
  * Allocate from a zone.
  */
@@ -75,7 +199,8 @@ void kmem_zonefree(kmem_zone_t *zone, void *ptr);
 
 /*!
  * Allocate kernel wired memory. Memory will be aligned to zone's size (thus
- * power-of-2 allocations will be naturally aligned).
+ * power-of-2 allocations will be naturally aligned). In a KASAN kernel,
+ * alignment is instead as if the zone's size included KASAN_REDZONE.
  */
 void *kmem_alloc(size_t size);
 
@@ -107,12 +232,14 @@ void *kmem_strfree(char *str);
 /*!
  * Allocate kernel wired memory generically; this is a compatibility interface
  * for those who aren't able to provide the size of allocation when freeing the
- * allocated memory. Alignment is to 8 bytes only.
+ * allocated memory. Alignment is to 8 bytes only. This backs malloc() and
+ * friends in klib_libc.h as well as strdup().
  */
 void *kmem_genalloc(size_t size);
 
 /*!
- * The realloc-like counterpart to kmem_genalloc().
+ * The realloc-like counterpart to kmem_genalloc(). Resizes within the same
+ * kmem zone (or number of pages) are done in place.
  */
 void *kmem_genrealloc(void * ptr, size_t newSize);
 
@@ -36,28 +36,87 @@
  * Large slabs have out-of-line slab headers and bufctls, and their bufctls have
  * a back-pointer to their containing slab as well as their base address. To
  * free an object in a large zone requires to look up the bufctl; their bufctls
- * are therefore linked into a list of allocated bufctls in the kmem_zone.
- * [in the future this will be a hash table.]
+ * are therefore entered into a hash table of allocated bufctls in the
+ * kmem_zone, keyed by object address. This is grown (by doubling) whenever its
+ * load factor would exceed kKMemHashLoad.
+ *
+ * A zone keeps its slabs on three lists: partial, full (no free objects), and
+ * empty (every object free.) Allocation is from the head of the partial list,
+ * falling back to the empty list, so as to concentrate allocations in as few
+ * slabs as possible and let the others drain. Empty slabs are cached until
+ * kmem_reap() returns them to the system, which is done by the pagedaemon when
+ * free memory runs low.
+ *
+ * Magazine layer
+ * --------------
+ *
+ * See: Bonwick, J. and Adams, J. (2001). Magazines and Vmem: Extending the Slab
+ * Allocator to Many CPUs and Arbitrary Resources.
+ *
+ * In front of the slab layer of each zone sit per-CPU caches, each holding a
+ * loaded and a previous magazine (a magazine being an array of pointers to
+ * free objects.) These are accessed only by their own CPU with interrupts
+ * disabled, so the common case of allocation and freeing takes no locks.
+ *
+ * When both of a CPU's magazines are empty (on allocation) or full (on
+ * freeing), one is exchanged with the zone's depot, a list of full and a list
+ * of empty magazines under a spinlock. Only if the depot has nothing to offer
+ * is the slab layer (under the zone's sleeping mutex) consulted.
+ *
+ * Magazine size is dynamic: every kKMemResizeInterval depot acquisitions, if
+ * more than 1/kKMemContentionRatio were contended, the zone moves on to the
+ * next larger magazine size so that the depot is visited less frequently.
+ *
+ * KASAN
+ * -----
+ *
+ * In a KASAN kernel, each object (except in kKMemOffSlab zones, which needn't
+ * be memory) is followed by a redzone of at least KASAN_REDZONE bytes. Objects
+ * are poisoned until kmem_zonealloc() hands them out and again once they are
+ * given to kmem_zonefree(), which then holds them in a quarantine FIFO, so
+ * their memory isn't reused (and use-after-free goes unnoticed) until enough
+ * has been freed since. kmem_alloc() also poisons the slack between the size
+ * asked for and the size of the zone it allocated from. Only slab_alloc() and
+ * slab_free() touch free objects, and they are not instrumented.
  */
+#include <sys/param.h>
 #include <sys/queue.h>
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
 #ifdef _KERNEL
+#include <kern/kasan.h>
 #include <kern/kmem.h>
+#include <kern/kmem_trace.h>
+#include <kern/task.h>
 #include <vm/vm.h>
 #include <libkern/klib.h>
+
+/*!
+ * index of the current CPU's cache; cpu0 is -1 until smp_init(), which starts
+ * no more than KMEM_MAX_CPUS CPUs
+ */
+#define KMEM_CPU() (curcpu()->num < 0 ? 0 : curcpu()->num)
+/*! NUMA node of the current CPU */
+#define KMEM_NODE() (curcpu()->node)
+_Static_assert(KMEM_MAX_NODES == VM_MAX_NODES, "kmem and VM node counts");
+/*! whether the current thread holds a zone's lock */
+#define KMEM_ZONE_LOCKED_BY_ME(ZONE) ((ZONE)->lock.owner == curthread())
 #else
 #include <sys/mman.h>
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "kasan.h"
 #include "kmem.h"
+#include "kmem_trace.h"
 
 #define PGSIZE 4096
 #define ROUNDUP(addr, align) (((addr) + align - 1) & ~(align - 1))
@@ -65,10 +124,43 @@
 #define PGROUNDUP(addr) ROUNDUP(addr, PGSIZE)
 #define PGROUNDDOWN(addr) ROUNDDOWN(addr, PGSIZE)
 #define kVMKSleep 0
+#define elementsof(ARR) (sizeof(ARR) / sizeof(ARR[0]))
+
+#define mutex_init(MTX) pthread_mutex_init(MTX, NULL)
+#define mutex_lock(MTX) pthread_mutex_lock(MTX)
+#define mutex_unlock(MTX) pthread_mutex_unlock(MTX)
 
-#define mutex_lock(...)
-#define mutex_unlock(...)
+#define spinlock_init(LOCK) atomic_flag_clear(LOCK)
+#define spinlock_unlock(LOCK) atomic_flag_clear(LOCK)
 
+static inline void
+spinlock_lock(spinlock_t *lock)
+{
+	while (atomic_flag_test_and_set(lock))
+		__asm__("pause");
+}
+
+static inline int
+spinlock_trylock(spinlock_t *lock, bool spin)
+{
+	if (!atomic_flag_test_and_set(lock))
+		return 1;
+	if (spin) {
+		spinlock_lock(lock);
+		return 1;
+	}
+	return 0;
+}
+
+/* each benchmark thread plays the part of a CPU */
+static __thread int kmem_host_cpu;
+#define KMEM_CPU() kmem_host_cpu
+#define KMEM_NODE() 0
+#define KMEM_ZONE_LOCKED_BY_ME(ZONE) false
+#define md_intr_disable() false
+#define md_intr_x(IFF) (void)(IFF)
+
+#define npf_vsnprintf vsnprintf
 #define kprintf(...) printf(__VA_ARGS__)
 #define fatal(...)                   \
 	({                           \
@@ -80,9 +172,15 @@ static inline void *
 vm_kalloc(int npages, int unused)
 {
 	void *ret;
-	assert(posix_memalign(&ret, PGSIZE * npages, PGSIZE) == 0);
+	assert(posix_memalign(&ret, PGSIZE, PGSIZE * npages) == 0);
 	return ret;
 }
+
+static inline void
+vm_kfree(void *addr, int npages)
+{
+	free(addr);
+}
 #endif
 
 /*!
@@ -97,7 +195,7 @@ vm_kalloc(int npages, int unused)
 struct kmem_bufctl {
 	/*!
 	 * Linkage either for free list (only case for small slab); or for large
-	 * slabs, kmem_zone::bufctllist
+	 * slabs, a bucket of kmem_zone::bufctlhash
 	 */
 	SLIST_ENTRY(kmem_bufctl) entrylist;
 
@@ -111,14 +209,18 @@ struct kmem_bufctl {
  * A single slab.
  */
 struct kmem_slab {
-	/*! linkage kmem_zone::slablist */
-	SIMPLEQ_ENTRY(kmem_slab) slablist;
+	/*! linkage for kmem_zone_node::partialslabs/emptyslabs or fullslabs */
+	TAILQ_ENTRY(kmem_slab) slablist;
 	/*! zone to which it belongs */
 	struct kmem_zone *zone;
 	/*! number of free entries */
 	uint32_t nfree;
+	/*! NUMA node whose lists it is kept on */
+	uint32_t node;
 	/*! first free bufctl */
 	struct kmem_bufctl *firstfree;
+	/*! offset of the first object from the start of the slab's data */
+	size_t colour;
 	/*!
 	 * For a small slab, slab contents precede this structure. Large slabs
 	 * however have a pointer to their data here.
@@ -126,6 +228,20 @@ struct kmem_slab {
 	void *data[0];
 };
 
+/*!
+ * A magazine - an array of pointers to free objects, of which the first
+ * nrounds are valid.
+ */
+struct kmem_magazine {
+	/*! linkage for kmem_zone::fullmags/emptymags */
+	SLIST_ENTRY(kmem_magazine) maglist;
+	/*! capacity */
+	uint32_t size;
+	/*! number of objects held */
+	uint32_t nrounds;
+	void	*rounds[0];
+};
+
 /*!
  * Get the address of a small slab's header from the base address of the slab.
  */
@@ -134,6 +250,10 @@ struct kmem_slab {
 /*! Maximum size of object that will be stored in a small slab. */
 const size_t kSmallSlabMax = 256;
 
+/*! Whether a zone uses small slabs. */
+#define ZONE_SMALL(ZONE) \
+	((ZONE)->size <= kSmallSlabMax && !((ZONE)->flags & kKMemOffSlab))
+
 /*!
  * 8-byte granularity <= 64 byte;
  * 16-byte granularity <= 128 byte;
@@ -194,98 +314,290 @@ static kmem_zone_t *kmem_alloc_zones[] = { ZONE_SIZES(REFERENCE_ZONE) };
 /*! list of all zones; TODO(med): protect with a lock */
 struct kmem_zones kmem_zones = SIMPLEQ_HEAD_INITIALIZER(kmem_zones);
 
+/*! capacities of magazines */
+#define MAGAZINE_SIZES(X) \
+	X(3)              \
+	X(7)              \
+	X(15)             \
+	X(31)             \
+	X(63)
+
+#define MAGAZINE_SIZE(N) N,
+static const uint32_t kmem_magsizes[] = { MAGAZINE_SIZES(MAGAZINE_SIZE) };
+#undef MAGAZINE_SIZE
+#define MAGAZINE_NAME(N) "kmem_magazine_" #N,
+static const char *kmem_magazine_names[] = { MAGAZINE_SIZES(MAGAZINE_NAME) };
+#undef MAGAZINE_NAME
+/*! zones for magazines, one per entry in kmem_magsizes */
+static struct kmem_zone kmem_magazine_zones[elementsof(kmem_magsizes)];
+
+enum {
+	/*! mean number of bufctls per hash bucket above which to grow */
+	kKMemHashLoad = 2,
+	/*! depot acquisitions between reviews of a zone's magazine size */
+	kKMemResizeInterval = 256,
+	/*! grow magazines if more than 1/this of acquisitions were contended */
+	kKMemContentionRatio = 16,
+};
+
+/* return the size in bytes held in a slab of a given zone*/
+static size_t
+slabsize(kmem_zone_t *zone)
+{
+	if (ZONE_SMALL(zone)) {
+		return PGSIZE;
+	} else if (zone->flags & kKMemOffSlab) {
+		/* not necessarily memory, so no rounding to pages */
+		return zone->chunksize * 16;
+	} else {
+		/* aim for at least 16 entries */
+		return PGROUNDUP(zone->chunksize * 16);
+	}
+}
+
+/* return the capacity in number of objects of a slab of this zone */
+static uint32_t
+slabcapacity(kmem_zone_t *zone)
+{
+	if (ZONE_SMALL(zone)) {
+		return (slabsize(zone) - sizeof(struct kmem_slab)) /
+		    zone->chunksize;
+	} else {
+		return slabsize(zone) / zone->chunksize;
+	}
+}
+
 void
 kmem_zone_init(struct kmem_zone *zone, const char *name, size_t size)
 {
+	kmem_cache_init(zone, name, size, 0, NULL, NULL, 0);
+}
+
+void
+kmem_cache_init(struct kmem_zone *zone, const char *name, size_t size,
+    size_t align, kmem_ctor_t ctor, kmem_ctor_t dtor, uint32_t flags)
+{
+	size_t slack, redzone = flags & kKMemOffSlab ? 0 : KASAN_REDZONE;
+
+	if (align == 0)
+		align = sizeof(void *);
+	if (flags & kKMemCacheAlign && align < KMEM_CACHE_LINE)
+		align = KMEM_CACHE_LINE;
+	assert((align & (align - 1)) == 0);
+
 	zone->name = name;
 	zone->size = size;
+	zone->align = align;
+	zone->flags = flags;
+	zone->ctor = ctor;
+	zone->dtor = dtor;
+	zone->source = NULL;
+
+	/* small slabs keep their freelist link in the free object itself */
+	if (ctor != NULL && ZONE_SMALL(zone)) {
+		zone->linkoff = ROUNDUP(size, sizeof(void *));
+		zone->chunksize = ROUNDUP(zone->linkoff + sizeof(void *) +
+			redzone,
+		    align);
+	} else {
+		zone->linkoff = 0;
+		zone->chunksize = ROUNDUP(MAX(size, sizeof(void *)) + redzone,
+		    align);
+	}
+
+	/*
+	 * successive slabs offset their first object by successive multiples
+	 * of a cache line (or of the alignment, if greater), within the space
+	 * left over at the end of the slab
+	 */
+	if (flags & kKMemOffSlab)
+		slack = 0;
+	else if (ZONE_SMALL(zone))
+		slack = PGSIZE - sizeof(struct kmem_slab) -
+		    slabcapacity(zone) * zone->chunksize;
+	else
+		slack = slabsize(zone) - slabcapacity(zone) * zone->chunksize;
+	zone->colour = 0;
+	zone->maxcolour = ROUNDDOWN(slack, MAX(align, KMEM_CACHE_LINE));
+
 	mutex_init(&zone->lock);
-	SIMPLEQ_INIT(&zone->slablist);
-	SLIST_INIT(&zone->bufctllist);
+	for (int i = 0; i < KMEM_MAX_NODES; i++) {
+		TAILQ_INIT(&zone->nodes[i].partialslabs);
+		TAILQ_INIT(&zone->nodes[i].emptyslabs);
+	}
+	TAILQ_INIT(&zone->fullslabs);
+	zone->nslabs = zone->nemptyslabs = 0;
+	zone->bufctlhash = NULL;
+	zone->nbuckets = zone->nbufctls = 0;
+	zone->hashshift = 63 - __builtin_clzl(zone->chunksize);
+
+	spinlock_init(&zone->depotlock);
+	SLIST_INIT(&zone->fullmags);
+	SLIST_INIT(&zone->emptymags);
+	zone->nfullmags = zone->nemptymags = 0;
+	/* smaller objects get bigger magazines to begin with */
+	zone->magsizeidx = size <= 256 ? 2 : size <= 1024 ? 1 : 0;
+	zone->ndepotops = zone->ncontended = 0;
+	for (int i = 0; i < KMEM_MAX_CPUS; i++) {
+		zone->cpucache[i].loaded = NULL;
+		zone->cpucache[i].previous = NULL;
+		zone->cpucache[i].nallocs = 0;
+		zone->cpucache[i].nfrees = 0;
+	}
+
 	SIMPLEQ_INSERT_TAIL(&kmem_zones, zone, zonelist);
 }
 
+kmem_zone_t *
+kmem_cache_create(const char *name, size_t size, size_t align,
+    kmem_ctor_t ctor, kmem_ctor_t dtor, uint32_t flags)
+{
+	kmem_zone_t *zone = kmem_alloc(sizeof(*zone));
+	if (zone == NULL)
+		return NULL;
+	kmem_cache_init(zone, name, size, align, ctor, dtor, flags);
+	return zone;
+}
+
 void
 kmem_init(void)
 {
-	kmem_zone_init(&kmem_slab, "kmem_slab",
-	    sizeof(struct kmem_slab) + sizeof(void *));
-	kmem_zone_init(&kmem_bufctl, "kmem_bufctl",
-	    sizeof(struct kmem_bufctl));
-#define ZONE_INIT(SIZE, NAME) kmem_zone_init(&NAME, #NAME, SIZE);
+	kmem_cache_init(&kmem_slab, "kmem_slab",
+	    sizeof(struct kmem_slab) + sizeof(void *), 0, NULL, NULL,
+	    kKMemNoMagazines);
+	kmem_cache_init(&kmem_bufctl, "kmem_bufctl",
+	    sizeof(struct kmem_bufctl), 0, NULL, NULL, kKMemNoMagazines);
+	for (size_t i = 0; i < elementsof(kmem_magsizes); i++)
+		kmem_cache_init(&kmem_magazine_zones[i],
+		    kmem_magazine_names[i],
+		    sizeof(struct kmem_magazine) +
+			sizeof(void *) * kmem_magsizes[i],
+		    0, NULL, NULL, kKMemNoMagazines);
+	/*
+	 * natural alignment, which colouring mustn't disturb; a KASAN redzone
+	 * is counted in, since aligning the object alone would round the chunk
+	 * of a power-of-2 zone up to twice its size
+	 */
+#define ZONE_ALIGN(SIZE) (((SIZE) + KASAN_REDZONE) & -((SIZE) + KASAN_REDZONE))
+#define ZONE_INIT(SIZE, NAME) \
+	kmem_cache_init(&NAME, #NAME, SIZE, ZONE_ALIGN(SIZE), NULL, NULL, 0);
 	ZONE_SIZES(ZONE_INIT);
 #undef ZONE_INIT
+#undef ZONE_ALIGN
 }
 
-/* return the size in bytes held in a slab of a given zone*/
-static size_t
-slabsize(kmem_zone_t *zone)
+/*!
+ * Allocate \p size bytes of backing for slabs (or the bufctl hash) from
+ * \p source, or from NUMA node \p node's kernel wired memory if it is NULL.
+ * This uses vmem_xalloc(), which bypasses the quantum caches; those being
+ * built on kmem, going through them could recurse into a zone whose lock we
+ * hold.
+ */
+static void *
+slab_data_alloc(struct vmem *source, size_t size, int node)
 {
-	if (zone->size <= kSmallSlabMax) {
-		return PGSIZE;
-	} else {
-		/* aim for at least 16 entries */
-		return PGROUNDUP(zone->size * 16);
-	}
+#ifdef _KERNEL
+	vmem_addr_t addr;
+
+	if (vmem_xalloc(source ? source : vm_kernel_wired_arena(node), size, 0,
+		0, 0, 0, 0, kVMemSleep, &addr) < 0)
+		return NULL;
+	kasan_unpoison((void *)addr, size);
+	return (void *)addr;
+#else
+	return vm_kalloc(size / PGSIZE, kVMKSleep);
+#endif
 }
 
-/* return the capacity in number of objects of a slab of this zone */
-static uint32_t
-slabcapacity(kmem_zone_t *zone)
+static void
+slab_data_free(struct vmem *source, void *addr, size_t size)
 {
-	if (zone->size <= kSmallSlabMax) {
-		return (slabsize(zone) - sizeof(struct kmem_slab)) / zone->size;
-	} else {
-		return slabsize(zone) / zone->size;
-	}
+#ifdef _KERNEL
+	kasan_poison(addr, size, kKasanFreePage);
+	vmem_xfree(source ? source : vm_kernel_wired_owner(addr),
+	    (vmem_addr_t)addr, size);
+#else
+	vm_kfree(addr, size / PGSIZE);
+#endif
+}
+
+/*! Pick the colour for a new slab of a zone; zone must be locked. */
+static size_t
+slab_colour(kmem_zone_t *zone)
+{
+	size_t colour = zone->colour;
+
+	zone->colour += MAX(zone->align, KMEM_CACHE_LINE);
+	if (zone->colour > zone->maxcolour)
+		zone->colour = 0;
+
+	return colour;
 }
 
 static struct kmem_slab *
-small_slab_new(kmem_zone_t *zone)
+small_slab_new(kmem_zone_t *zone, int node)
 {
 	struct kmem_slab	 *slab;
 	struct kmem_bufctl *entry = NULL;
-	void	       *base;
+	void	       *base, *obj;
 
 	/* create a new slab */
-	base = vm_kalloc(1, kVMKSleep);
+	base = slab_data_alloc(zone->source, PGSIZE, node);
+	if (base == NULL)
+		return NULL;
 	slab = SMALL_SLAB_HDR(base);
 
-	SIMPLEQ_INSERT_HEAD(&zone->slablist, slab, slablist);
-
 	slab->zone = zone;
 	slab->nfree = slabcapacity(zone);
+	slab->node = node;
+	slab->colour = slab_colour(zone);
+	base += slab->colour;
 
-	/* set up the freelist */
+	/* construct the objects and set up the freelist */
 	for (size_t i = 0; i < slabcapacity(zone); i++) {
-		entry = (struct kmem_bufctl *)(base + i * zone->size);
-		entry->entrylist.sle_next = (struct kmem_bufctl *)(base +
-		    (i + 1) * zone->size);
+		obj = base + i * zone->chunksize;
+		if (zone->ctor)
+			zone->ctor(obj);
+		entry = (struct kmem_bufctl *)(obj + zone->linkoff);
+		entry->entrylist.sle_next = (struct kmem_bufctl *)(obj +
+		    zone->chunksize + zone->linkoff);
 	}
 	entry->entrylist.sle_next = NULL;
-	slab->firstfree = (struct kmem_bufctl *)(base);
+	slab->firstfree = (struct kmem_bufctl *)(base + zone->linkoff);
+	if (!(zone->flags & kKMemOffSlab))
+		kasan_poison(base, slabcapacity(zone) * zone->chunksize,
+		    kKasanSlabFree);
 
 	return slab;
 }
 
 static struct kmem_slab *
-large_slab_new(kmem_zone_t *zone)
+large_slab_new(kmem_zone_t *zone, int node)
 {
 	struct kmem_slab	 *slab;
 	struct kmem_bufctl *entry = NULL, *prev = NULL;
+	void	       *data;
+
+	data = slab_data_alloc(zone->source, slabsize(zone), node);
+	if (data == NULL)
+		return NULL;
 
 	slab = kmem_zonealloc(&kmem_slab);
 
-	SIMPLEQ_INSERT_HEAD(&zone->slablist, slab, slablist);
 	slab->zone = zone;
 	slab->nfree = slabcapacity(zone);
-	slab->data[0] = vm_kalloc(slabsize(zone) / PGSIZE, kVMKSleep);
+	slab->node = node;
+	slab->colour = slab_colour(zone);
+	slab->data[0] = data;
 
-	/* set up the freelist */
+	/* construct the objects and set up the freelist */
 	for (size_t i = 0; i < slabcapacity(zone); i++) {
 		entry = kmem_zonealloc(&kmem_bufctl);
 		entry->slab = slab;
-		entry->base = slab->data[0] + zone->size * i;
+		entry->base = slab->data[0] + slab->colour +
+		    zone->chunksize * i;
+		if (zone->ctor)
+			zone->ctor(entry->base);
 		if (prev)
 			prev->entrylist.sle_next = entry;
 		else {
@@ -295,47 +607,177 @@ large_slab_new(kmem_zone_t *zone)
 		prev = entry;
 	}
 	entry->entrylist.sle_next = NULL;
+	if (!(zone->flags & kKMemOffSlab))
+		kasan_poison(slab->data[0] + slab->colour,
+		    slabcapacity(zone) * zone->chunksize, kKasanSlabFree);
 
 	return slab;
 }
 
-void *
-kmem_zonealloc(kmem_zone_t *zone)
+/*!
+ * Destroy a slab with every object free, which has already been removed from
+ * its zone's lists. Zone need not be locked.
+ */
+static void
+slab_destroy(kmem_zone_t *zone, struct kmem_slab *slab)
+{
+	struct kmem_bufctl *entry, *next;
+
+	if (ZONE_SMALL(zone)) {
+		void *base = (void *)PGROUNDDOWN(slab);
+
+		/* it's all going anyway, and the dtor will want at it */
+		kasan_unpoison(base, PGSIZE);
+		if (zone->dtor)
+			for (size_t i = 0; i < slabcapacity(zone); i++)
+				zone->dtor(base + slab->colour +
+				    i * zone->chunksize);
+
+		slab_data_free(zone->source, base, PGSIZE);
+		return;
+	}
+
+	if (!(zone->flags & kKMemOffSlab))
+		kasan_unpoison(slab->data[0], slabsize(zone));
+	for (entry = slab->firstfree; entry != NULL; entry = next) {
+		next = entry->entrylist.sle_next;
+		if (zone->dtor)
+			zone->dtor(entry->base);
+		kmem_zonefree(&kmem_bufctl, entry);
+	}
+
+	slab_data_free(zone->source, slab->data[0], slabsize(zone));
+	kmem_zonefree(&kmem_slab, slab);
+}
+
+static inline struct kmem_bufctl_bucket *
+bufctl_bucket(kmem_zone_t *zone, void *ptr)
+{
+	uintptr_t hash = (uintptr_t)ptr >> zone->hashshift;
+	return &zone->bufctlhash[hash & (zone->nbuckets - 1)];
+}
+
+/*!
+ * Make room in the bufctl hash for one more entry, doubling the table if the
+ * load factor would otherwise be exceeded. The table is allocated directly
+ * from kernel wired memory so as not to recurse into kmem. Zone must be locked.
+ */
+static void
+bufctl_hash_grow(kmem_zone_t *zone)
+{
+	struct kmem_bufctl_bucket *oldhash = zone->bufctlhash, *newhash;
+	size_t			   oldnbuckets = zone->nbuckets, newnbuckets;
+
+	if (zone->nbufctls + 1 <= oldnbuckets * kKMemHashLoad)
+		return;
+
+	newnbuckets = oldnbuckets == 0 ? PGSIZE / sizeof(*oldhash) :
+					 oldnbuckets * 2;
+	newhash = slab_data_alloc(NULL, newnbuckets * sizeof(*oldhash),
+	    KMEM_NODE());
+	if (newhash == NULL) {
+		/* carry on overloaded if we can */
+		if (oldhash == NULL)
+			fatal("bufctl_hash_grow: out of memory\n");
+		return;
+	}
+	zone->bufctlhash = newhash;
+	zone->nbuckets = newnbuckets;
+	for (size_t i = 0; i < newnbuckets; i++)
+		SLIST_INIT(&zone->bufctlhash[i]);
+
+	for (size_t i = 0; i < oldnbuckets; i++) {
+		struct kmem_bufctl *entry;
+
+		while ((entry = SLIST_FIRST(&oldhash[i])) != NULL) {
+			SLIST_REMOVE_HEAD(&oldhash[i], entrylist);
+			SLIST_INSERT_HEAD(bufctl_bucket(zone, entry->base),
+			    entry, entrylist);
+		}
+	}
+
+	if (oldhash != NULL)
+		slab_data_free(NULL, oldhash, oldnbuckets * sizeof(*oldhash));
+}
+
+/*!
+ * Get a slab with a free object from a node's partial or empty slabs, moving
+ * it to the partial list if it was empty. Zone must be locked.
+ */
+static struct kmem_slab *
+slab_get(kmem_zone_t *zone, int node)
+{
+	struct kmem_zone_node *zn = &zone->nodes[node];
+	struct kmem_slab      *slab;
+
+	if ((slab = TAILQ_FIRST(&zn->partialslabs)) != NULL)
+		return slab;
+	if ((slab = TAILQ_FIRST(&zn->emptyslabs)) != NULL) {
+		TAILQ_REMOVE(&zn->emptyslabs, slab, slablist);
+		zone->nemptyslabs--;
+		TAILQ_INSERT_HEAD(&zn->partialslabs, slab, slablist);
+	}
+	return slab;
+}
+
+/*! Allocate an object from the slab layer of a zone. */
+KASAN_NOSANITIZE static void *
+slab_alloc(kmem_zone_t *zone)
 {
 	struct kmem_bufctl *entry, *next;
 	struct kmem_slab	 *slab;
 	void	       *ret;
+	int		node = zone->source ? 0 : KMEM_NODE();
 
 	mutex_lock(&zone->lock);
 
-	slab = SIMPLEQ_FIRST(&zone->slablist);
-	if (!slab || slab->nfree == 0) {
-		/* no slabs or all full (full slabs always at tail of queue) */
-		if (zone->size > kSmallSlabMax) {
-			slab = large_slab_new(zone);
+	/*
+	 * prefer a slab local to this CPU's node, then a new one (which is
+	 * local unless the node is out of memory), and only then a remote one
+	 */
+	slab = slab_get(zone, node);
+	if (slab == NULL) {
+		if (!ZONE_SMALL(zone)) {
+			slab = large_slab_new(zone, node);
 		} else {
-			slab = small_slab_new(zone);
+			slab = small_slab_new(zone, node);
 		}
+		if (slab != NULL) {
+			zone->nslabs++;
+			TAILQ_INSERT_HEAD(&zone->nodes[node].partialslabs, slab,
+			    slablist);
+		}
+	}
+	for (int i = 0; i < KMEM_MAX_NODES && slab == NULL; i++)
+		slab = slab_get(zone, i);
+	if (slab == NULL) {
+		/* source exhausted */
+		mutex_unlock(&zone->lock);
+		return NULL;
 	}
 
-	__atomic_sub_fetch(&slab->nfree, 1, __ATOMIC_RELAXED);
+	if (!ZONE_SMALL(zone))
+		bufctl_hash_grow(zone);
+
+	slab->nfree--;
 	entry = slab->firstfree;
 
 	next = entry->entrylist.sle_next;
 	if (next == NULL) {
-		/* slab is now empty; put it to the back of the slab queue */
-		SIMPLEQ_REMOVE(&zone->slablist, slab, kmem_slab, slablist);
-		SIMPLEQ_INSERT_TAIL(&zone->slablist, slab, slablist);
+		/* slab is now full; move it to the full list */
+		TAILQ_REMOVE(&zone->nodes[slab->node].partialslabs, slab,
+		    slablist);
+		TAILQ_INSERT_HEAD(&zone->fullslabs, slab, slablist);
 		slab->firstfree = NULL;
 	} else {
 #ifdef KMEM_SANITY_CHECKS
 		void *slab_base, *slab_end, *next_data;
 
-		if (zone->size <= kSmallSlabMax) {
-			slab_base = (void *)PGROUNDDOWN(slab);
-			next_data = next;
+		if (ZONE_SMALL(zone)) {
+			slab_base = (void *)PGROUNDDOWN(slab) + slab->colour;
+			next_data = (void *)next - zone->linkoff;
 		} else {
-			slab_base = slab->data[0];
+			slab_base = slab->data[0] + slab->colour;
 			next_data = next->base;
 		}
 		slab_end = slab_base + slabsize(zone);
@@ -345,69 +787,480 @@ kmem_zonealloc(kmem_zone_t *zone)
 		assert((void *)next_data >= slab_base
 		    && (void *)next_data < slab_end);
 		assert((uintptr_t)((void *)next_data - slab_base)
-		    % zone->size == 0);
+		    % zone->chunksize == 0);
 #endif
 
 		slab->firstfree = next;
 	}
 
-	if (zone->size <= kSmallSlabMax) {
-		ret = (void *)entry;
+	if (ZONE_SMALL(zone)) {
+		ret = (void *)entry - zone->linkoff;
 	} else {
-		SLIST_INSERT_HEAD(&zone->bufctllist, entry, entrylist);
+		SLIST_INSERT_HEAD(bufctl_bucket(zone, entry->base), entry,
+		    entrylist);
+		zone->nbufctls++;
 		ret = entry->base;
 	}
 	mutex_unlock(&zone->lock);
 	return ret;
 }
 
-void
-kmem_zonefree(kmem_zone_t *zone, void *ptr)
+/*! Return an object to the slab layer of a zone. */
+KASAN_NOSANITIZE static void
+slab_free(kmem_zone_t *zone, void *ptr)
 {
 	struct kmem_slab	 *slab;
-	struct kmem_bufctl *newfree;
+	struct kmem_bufctl *newfree = NULL;
 
 	mutex_lock(&zone->lock);
 
-	if (zone->size <= kSmallSlabMax) {
+	if (ZONE_SMALL(zone)) {
 		slab = (struct kmem_slab *)SMALL_SLAB_HDR(PGROUNDDOWN(ptr));
-		newfree = (struct kmem_bufctl *)ptr;
+		newfree = (struct kmem_bufctl *)(ptr + zone->linkoff);
 	} else {
-		struct kmem_bufctl *iter;
-
-		SLIST_FOREACH(iter, &zone->bufctllist, entrylist)
-		{
-			if (iter->base == ptr) {
-				newfree = iter;
-				break;
+		struct kmem_bufctl_bucket *bucket;
+		struct kmem_bufctl	   *iter;
+
+		bucket = zone->nbuckets ? bufctl_bucket(zone, ptr) : NULL;
+		if (bucket)
+			SLIST_FOREACH (iter, bucket, entrylist) {
+				if (iter->base == ptr) {
+					newfree = iter;
+					break;
+				}
 			}
-		}
 
 		if (!newfree) {
 			fatal("kmem_slabfree: invalid pointer %p", ptr);
 			return;
 		}
 
-		SLIST_REMOVE(&zone->bufctllist, newfree, kmem_bufctl,
-		    entrylist);
-		slab = iter->slab;
+		SLIST_REMOVE(bucket, newfree, kmem_bufctl, entrylist);
+		zone->nbufctls--;
+		slab = newfree->slab;
 	}
 
-	slab->nfree++;
-	/* TODO: push slab to front; if nfree == slab capacity, free the slab */
+	if (slab->nfree++ == 0) {
+		/* was full; it's now partial, and warm, so put it first */
+		TAILQ_REMOVE(&zone->fullslabs, slab, slablist);
+		TAILQ_INSERT_HEAD(&zone->nodes[slab->node].partialslabs, slab,
+		    slablist);
+	}
+	if (slab->nfree == slabcapacity(zone)) {
+		/* now empty; cache it until reaped */
+		TAILQ_REMOVE(&zone->nodes[slab->node].partialslabs, slab,
+		    slablist);
+		TAILQ_INSERT_HEAD(&zone->nodes[slab->node].emptyslabs, slab,
+		    slablist);
+		zone->nemptyslabs++;
+	}
 	newfree->entrylist.sle_next = slab->firstfree;
 	slab->firstfree = newfree;
 
 	mutex_unlock(&zone->lock);
 }
 
+/*
+ * magazine layer
+ */
+
+static struct kmem_magazine *
+magazine_alloc(kmem_zone_t *zone)
+{
+	unsigned	      idx = zone->magsizeidx;
+	struct kmem_magazine *mag;
+
+	mag = kmem_zonealloc(&kmem_magazine_zones[idx]);
+	if (mag == NULL)
+		return NULL;
+
+	mag->size = kmem_magsizes[idx];
+	mag->nrounds = 0;
+
+	return mag;
+}
+
+static void
+magazine_free(struct kmem_magazine *mag)
+{
+	for (size_t i = 0; i < elementsof(kmem_magsizes); i++)
+		if (kmem_magsizes[i] == mag->size) {
+			kmem_zonefree(&kmem_magazine_zones[i], mag);
+			return;
+		}
+	fatal("magazine_free: bad magazine %p\n", mag);
+}
+
+/*!
+ * Lock the depot of a zone; interrupts must be disabled. Contention is tracked
+ * and, if there is enough of it, bigger magazines are used henceforth.
+ */
+static void
+depot_lock(kmem_zone_t *zone)
+{
+	if (!spinlock_trylock(&zone->depotlock, false)) {
+		spinlock_lock(&zone->depotlock);
+		zone->ncontended++;
+	}
+
+	if (++zone->ndepotops >= kKMemResizeInterval) {
+		if (zone->ncontended > zone->ndepotops / kKMemContentionRatio &&
+		    zone->magsizeidx < elementsof(kmem_magsizes) - 1)
+			zone->magsizeidx++;
+		zone->ndepotops = zone->ncontended = 0;
+	}
+}
+
+static inline void
+depot_unlock(kmem_zone_t *zone)
+{
+	spinlock_unlock(&zone->depotlock);
+}
+
+/*! Put a magazine into the depot; depot must be locked. */
+static void
+depot_put(kmem_zone_t *zone, struct kmem_magazine *mag)
+{
+	if (mag->nrounds == 0) {
+		SLIST_INSERT_HEAD(&zone->emptymags, mag, maglist);
+		zone->nemptymags++;
+	} else {
+		SLIST_INSERT_HEAD(&zone->fullmags, mag, maglist);
+		zone->nfullmags++;
+	}
+}
+
+/*! Allocate from a zone's magazine layer, falling back to the slab layer. */
+static void *
+zone_alloc(kmem_zone_t *zone)
+{
+	kmem_cpucache_t	     *cc;
+	struct kmem_magazine *mag;
+	bool		      iff;
+
+	if (zone->flags & kKMemNoMagazines)
+		return slab_alloc(zone);
+
+	iff = md_intr_disable();
+	cc = &zone->cpucache[KMEM_CPU()];
+
+	for (;;) {
+		if (cc->loaded && cc->loaded->nrounds > 0) {
+			void *obj = cc->loaded->rounds[--cc->loaded->nrounds];
+			cc->nallocs++;
+			md_intr_x(iff);
+			return obj;
+		}
+
+		if (cc->previous && cc->previous->nrounds > 0) {
+			mag = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+			continue;
+		}
+
+		/* both empty (or absent); exchange previous for a full one */
+		depot_lock(zone);
+		mag = SLIST_FIRST(&zone->fullmags);
+		if (mag == NULL) {
+			depot_unlock(zone);
+			break;
+		}
+		SLIST_REMOVE_HEAD(&zone->fullmags, maglist);
+		zone->nfullmags--;
+		if (cc->previous)
+			depot_put(zone, cc->previous);
+		depot_unlock(zone);
+
+		cc->previous = cc->loaded;
+		cc->loaded = mag;
+	}
+
+	md_intr_x(iff);
+
+	return slab_alloc(zone);
+}
+
+/*! Free to a zone's magazine layer, falling back to the slab layer. */
+static void
+zone_free(kmem_zone_t *zone, void *ptr)
+{
+	kmem_cpucache_t	     *cc;
+	struct kmem_magazine *mag;
+	bool		      iff;
+
+	if (zone->flags & kKMemNoMagazines)
+		return slab_free(zone, ptr);
+
+	iff = md_intr_disable();
+	cc = &zone->cpucache[KMEM_CPU()];
+
+	for (;;) {
+		if (cc->loaded && cc->loaded->nrounds < cc->loaded->size) {
+			cc->loaded->rounds[cc->loaded->nrounds++] = ptr;
+			cc->nfrees++;
+			md_intr_x(iff);
+			return;
+		}
+
+		if (cc->previous && cc->previous->nrounds == 0) {
+			mag = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+			continue;
+		}
+
+		/* both full (or absent); exchange previous for an empty one */
+		depot_lock(zone);
+		mag = SLIST_FIRST(&zone->emptymags);
+		if (mag != NULL) {
+			SLIST_REMOVE_HEAD(&zone->emptymags, maglist);
+			zone->nemptymags--;
+
+			if (mag->size < kmem_magsizes[zone->magsizeidx]) {
+				/* outgrown; replace it with a bigger one */
+				depot_unlock(zone);
+				md_intr_x(iff);
+				magazine_free(mag);
+				mag = NULL;
+			} else {
+				if (cc->previous)
+					depot_put(zone, cc->previous);
+				depot_unlock(zone);
+
+				cc->previous = cc->loaded;
+				cc->loaded = mag;
+				continue;
+			}
+		} else {
+			depot_unlock(zone);
+			md_intr_x(iff);
+		}
+
+		/* allocate a new empty magazine for the depot */
+		mag = magazine_alloc(zone);
+		if (mag == NULL) {
+			slab_free(zone, ptr);
+			return;
+		}
+
+		/* we might have migrated meanwhile */
+		iff = md_intr_disable();
+		cc = &zone->cpucache[KMEM_CPU()];
+		depot_lock(zone);
+		depot_put(zone, mag);
+		depot_unlock(zone);
+	}
+}
+
+#ifdef KASAN
+enum {
+	/*! most objects held in quarantine */
+	kKMemQuarantineMax = 4096,
+	/*! most bytes of objects held in quarantine */
+	kKMemQuarantineBytes = 4 * 1024 * 1024,
+};
+
+/*! FIFO of freed objects not yet returned to their zones */
+static struct {
+	kmem_zone_t *zone;
+	void	    *ptr;
+} quarantine[kKMemQuarantineMax];
+static size_t	  quarantine_head, quarantine_count, quarantine_bytes;
+static spinlock_t quarantine_lock = SPINLOCK_INITIALISER;
+
+/*!
+ * Take the oldest object out of quarantine, if there is one and either \p all
+ * is set or there is not room for a further \p size bytes.
+ */
+static bool
+quarantine_evict(size_t size, bool all, kmem_zone_t **zone, void **ptr)
+{
+	bool iff, evicted = false;
+
+	iff = md_intr_disable();
+	spinlock_lock(&quarantine_lock);
+	if (quarantine_count > 0 &&
+	    (all || quarantine_count == kKMemQuarantineMax ||
+		quarantine_bytes + size > kKMemQuarantineBytes)) {
+		*zone = quarantine[quarantine_head].zone;
+		*ptr = quarantine[quarantine_head].ptr;
+		quarantine_head = (quarantine_head + 1) % kKMemQuarantineMax;
+		quarantine_count--;
+		quarantine_bytes -= (*zone)->chunksize;
+		evicted = true;
+	}
+	spinlock_unlock(&quarantine_lock);
+	md_intr_x(iff);
+
+	return evicted;
+}
+
+/*! Quarantine a freed (and poisoned) object, evicting older ones to fit. */
+static void
+quarantine_put(kmem_zone_t *zone, void *ptr)
+{
+	kmem_zone_t *oldzone;
+	void	    *old;
+	size_t	     slot;
+	bool	     iff;
+
+	while (quarantine_evict(zone->chunksize, false, &oldzone, &old))
+		zone_free(oldzone, old);
+
+	/* (someone may have put another in meanwhile; no matter) */
+	iff = md_intr_disable();
+	spinlock_lock(&quarantine_lock);
+	if (quarantine_count == kKMemQuarantineMax) {
+		spinlock_unlock(&quarantine_lock);
+		md_intr_x(iff);
+		zone_free(zone, ptr);
+		return;
+	}
+	slot = (quarantine_head + quarantine_count++) % kKMemQuarantineMax;
+	quarantine[slot].zone = zone;
+	quarantine[slot].ptr = ptr;
+	quarantine_bytes += zone->chunksize;
+	spinlock_unlock(&quarantine_lock);
+	md_intr_x(iff);
+}
+
+/*! Release everything in quarantine to its zone. */
+static void
+quarantine_drain(void)
+{
+	kmem_zone_t *zone;
+	void	    *ptr;
+
+	while (quarantine_evict(0, true, &zone, &ptr))
+		zone_free(zone, ptr);
+}
+#endif
+
+void *
+kmem_zonealloc(kmem_zone_t *zone)
+{
+	void *obj = zone_alloc(zone);
+
+	if (obj != NULL && !(zone->flags & kKMemOffSlab))
+		kasan_alloc(obj, zone->size, zone->chunksize);
+	kmem_trace_alloc(kKMemTraceZone, obj, zone->size, KMEM_TRACE_SITE());
+
+	return obj;
+}
+
+void
+kmem_zonefree(kmem_zone_t *zone, void *ptr)
+{
+	kmem_trace_free(kKMemTraceZone, ptr, zone->size);
+
+	if (!(zone->flags & kKMemOffSlab)) {
+		kasan_poison(ptr, zone->chunksize, kKasanFreed);
+#ifdef KASAN
+		/* the internal zones may be freed to with a zone lock held */
+		if (!(zone->flags & kKMemNoMagazines)) {
+			quarantine_put(zone, ptr);
+			return;
+		}
+#endif
+	}
+
+	zone_free(zone, ptr);
+}
+
+/*!
+ * Return the contents of a zone's depot to its slab layer and free the
+ * magazines. The per-CPU caches are left alone.
+ */
+static void
+depot_purge(kmem_zone_t *zone)
+{
+	struct kmem_magazine *full, *empty, *mag;
+	bool		      iff;
+
+	iff = md_intr_disable();
+	spinlock_lock(&zone->depotlock);
+	full = SLIST_FIRST(&zone->fullmags);
+	empty = SLIST_FIRST(&zone->emptymags);
+	SLIST_INIT(&zone->fullmags);
+	SLIST_INIT(&zone->emptymags);
+	zone->nfullmags = zone->nemptymags = 0;
+	spinlock_unlock(&zone->depotlock);
+	md_intr_x(iff);
+
+	while ((mag = full) != NULL) {
+		full = SLIST_NEXT(mag, maglist);
+		for (uint32_t i = 0; i < mag->nrounds; i++)
+			slab_free(zone, mag->rounds[i]);
+		magazine_free(mag);
+	}
+
+	while ((mag = empty) != NULL) {
+		empty = SLIST_NEXT(mag, maglist);
+		magazine_free(mag);
+	}
+}
+
+/*! Release the empty slabs of a zone. */
+static void
+zone_reap(kmem_zone_t *zone)
+{
+	TAILQ_HEAD(, kmem_slab) slabs = TAILQ_HEAD_INITIALIZER(slabs);
+	struct kmem_slab *slab;
+
+	mutex_lock(&zone->lock);
+	for (int i = 0; i < KMEM_MAX_NODES; i++)
+		while ((slab = TAILQ_FIRST(&zone->nodes[i].emptyslabs)) !=
+		    NULL) {
+			TAILQ_REMOVE(&zone->nodes[i].emptyslabs, slab,
+			    slablist);
+			TAILQ_INSERT_TAIL(&slabs, slab, slablist);
+		}
+	zone->nslabs -= zone->nemptyslabs;
+	zone->nemptyslabs = 0;
+	mutex_unlock(&zone->lock);
+
+	while ((slab = TAILQ_FIRST(&slabs)) != NULL) {
+		TAILQ_REMOVE(&slabs, slab, slablist);
+		slab_destroy(zone, slab);
+	}
+}
+
+void
+kmem_reap(void)
+{
+	kmem_zone_t *zone;
+
+#ifdef KASAN
+	quarantine_drain();
+#endif
+
+	/*
+	 * The depots are purged first, as that frees magazines and may empty
+	 * slabs. The allocator's internal zones come first in kmem_zones, so
+	 * another pass releases whatever freeing the others' slabs emptied.
+	 */
+	SIMPLEQ_FOREACH (zone, &kmem_zones, zonelist) {
+		if (KMEM_ZONE_LOCKED_BY_ME(zone))
+			continue;
+		depot_purge(zone);
+	}
+
+	for (int pass = 0; pass < 2; pass++)
+		SIMPLEQ_FOREACH (zone, &kmem_zones, zonelist) {
+			if (KMEM_ZONE_LOCKED_BY_ME(zone))
+				continue;
+			zone_reap(zone);
+		}
+}
+
 void
 kmem_dump()
 {
 	kmem_zone_t *zone;
 
-	kprintf("\033[7m%-24s%-6s%-6s%-6s%-6s\033[m\n", "name", "size", "slabs",
-	    "objs", "free");
+	kprintf("\033[7m%-24s%-6s%-6s%-6s%-6s%-6s%-6s%-6s\033[m\n", "name",
+	    "size", "slabs", "empty", "objs", "free", "magsz", "fmags");
 
 	SIMPLEQ_FOREACH(zone, &kmem_zones, zonelist)
 	{
@@ -420,17 +1273,25 @@ kmem_dump()
 
 		cap = slabcapacity(zone);
 
-		SIMPLEQ_FOREACH(slab, &zone->slablist, slablist)
-		{
-			nSlabs++;
-			totalFree += slab->nfree;
-		}
-
-		kprintf("%-24s%-6zu%-6lu%-6lu%-6lu\n", zone->name, zone->size,
-		    nSlabs, cap * nSlabs - totalFree, totalFree);
+		for (int i = 0; i < KMEM_MAX_NODES; i++)
+			TAILQ_FOREACH (slab, &zone->nodes[i].partialslabs,
+			    slablist)
+				totalFree += slab->nfree;
+		nSlabs = zone->nslabs;
+		totalFree += zone->nemptyslabs * cap;
+
+		kprintf("%-24s%-6zu%-6lu%-6zu%-6lu%-6lu%-6u%-6zu\n", zone->name,
+		    zone->size, nSlabs, zone->nemptyslabs,
+		    cap * nSlabs - totalFree, totalFree,
+		    zone->flags & kKMemNoMagazines ?
+			0 :
+			kmem_magsizes[zone->magsizeidx],
+		    zone->nfullmags);
 
 		mutex_unlock(&zone->lock);
 	}
+
+	kmem_trace_dump();
 }
 
 static inline int
@@ -455,6 +1316,14 @@ zonenum(size_t size)
 		return -1;
 }
 
+/*! how many bytes kmem_alloc() really gives over for \p size */
+static size_t
+realsize(size_t size)
+{
+	int zoneidx = zonenum(size);
+	return zoneidx == -1 ? PGROUNDUP(size) : kmem_alloc_zones[zoneidx]->size;
+}
+
 static void *
 _kmem_alloc(size_t size)
 {
@@ -471,10 +1340,14 @@ _kmem_alloc(size_t size)
 		return kmem_zonealloc(kmem_alloc_zones[zoneidx]);
 }
 
-void *
-kmem_alloc(size_t size)
+/*! kmem_alloc() on behalf of \p site, for the tracer */
+static void *
+kmem_alloc_site(size_t size, const void *site)
 {
 	void *ret = _kmem_alloc(size);
+	if (ret != NULL)
+		kasan_alloc(ret, size, realsize(size));
+	kmem_trace_alloc(kKMemTraceAlloc, ret, size, site);
 #if 0
 	memset(ret - 64, 0xDEAFBEEF, 64);
 	memset(ret + size, 0xDEADBEEF, 64);
@@ -483,6 +1356,12 @@ kmem_alloc(size_t size)
 	return ret;
 }
 
+void *
+kmem_alloc(size_t size)
+{
+	return kmem_alloc_site(size, KMEM_TRACE_SITE());
+}
+
 void
 kmem_free(void *ptr, size_t size)
 {
@@ -490,6 +1369,8 @@ kmem_free(void *ptr, size_t size)
 
 	assert(size > 0);
 
+	kmem_trace_free(kKMemTraceAlloc, ptr, size);
+
 	if (zoneidx == -1) {
 		size_t realsize = PGROUNDUP(size);
 		return vm_kfree(ptr, realsize / PGSIZE);
@@ -502,7 +1383,7 @@ kmem_realloc(void *ptr, size_t oldSize, size_t size)
 {
 	void *ret;
 
-	ret = kmem_alloc(size);
+	ret = kmem_alloc_site(size, KMEM_TRACE_SITE());
 	if (ptr != NULL) {
 		assert(oldSize > 0);
 		assert(size > oldSize);
@@ -515,7 +1396,7 @@ kmem_realloc(void *ptr, size_t oldSize, size_t size)
 void *
 kmem_zalloc(size_t size)
 {
-	void *ret = kmem_alloc(size);
+	void *ret = kmem_alloc_site(size, KMEM_TRACE_SITE());
 	memset(ret, 0x0, size);
 	return ret;
 }
@@ -558,40 +1439,220 @@ kmem_asprintf(char **str, const char *fmt, ...)
 void *
 kmem_strfree(char *str)
 {
-	kmem_free(str, strlen(str));
+	kmem_free(str, strlen(str) + 1);
 	return NULL;
 }
 
+/*
+ * Generic allocations carry their size in a header immediately before the
+ * object, so they can be freed without it; the header is one word so that the
+ * object keeps 8-byte alignment. They are otherwise ordinary kmem_alloc()
+ * allocations, so they are served from the per-CPU magazines of the kmem_
+ * zones, or for larger sizes by the quantum caches of vm_kernel_wired.
+ */
+
+/*! the size to pass kmem_alloc()/kmem_free() for a generic allocation */
+#define GENSIZE(SIZE) ((SIZE) + sizeof(size_t))
+
+static void *
+genalloc_site(size_t size, const void *site)
+{
+	size_t *hdr = kmem_alloc_site(GENSIZE(size), site);
+
+	if (hdr == NULL)
+		return NULL;
+
+	*hdr = size;
+	return hdr + 1;
+}
+
+void *
+kmem_genalloc(size_t size)
+{
+	return genalloc_site(size, KMEM_TRACE_SITE());
+}
+
+void *
+kmem_genrealloc(void *ptr, size_t newSize)
+{
+	size_t *hdr;
+	void   *ret;
+
+	if (ptr == NULL)
+		return genalloc_site(newSize, KMEM_TRACE_SITE());
+
+	hdr = (size_t *)ptr - 1;
+	if (realsize(GENSIZE(*hdr)) == realsize(GENSIZE(newSize))) {
+		/* same zone or page count, so it fits where it is */
+		kasan_alloc(hdr, GENSIZE(newSize), realsize(GENSIZE(newSize)));
+		kmem_trace_free(kKMemTraceAlloc, hdr, GENSIZE(*hdr));
+		kmem_trace_alloc(kKMemTraceAlloc, hdr, GENSIZE(newSize),
+		    KMEM_TRACE_SITE());
+		*hdr = newSize;
+		return ptr;
+	}
+
+	ret = genalloc_site(newSize, KMEM_TRACE_SITE());
+	if (ret == NULL)
+		return NULL;
+	memcpy(ret, ptr, MIN(*hdr, newSize));
+	kmem_genfree(ptr);
+
+	return ret;
+}
+
+void
+kmem_genfree(void *ptr)
+{
+	size_t *hdr;
+
+	if (ptr == NULL)
+		return;
+
+	hdr = (size_t *)ptr - 1;
+	kmem_free(hdr, GENSIZE(*hdr));
+}
+
 #ifndef _KERNEL
+/*
+ * Benchmarks of kmem; build with:
+ *	cc -O2 -pthread -o kmem_bench kmem_slab.c
+ *
+ * Throughput: each thread stands in for a CPU and repeatedly allocates a batch
+ * of objects then frees them, first through the slab layer alone and then with
+ * magazines.
+ *
+ * Footprint: a large number of objects are allocated, then seven in eight are
+ * freed in random order; the pages held by the zone are reported before and
+ * after kmem_reap(), and again after the rest are freed.
+ */
+#include <time.h>
+
+enum { kBenchBatch = 32, kBenchIters = 200000 };
+
+static kmem_zone_t *bench_zone;
+
+static void *
+bench_thread(void *arg)
+{
+	void *objs[kBenchBatch];
+
+	kmem_host_cpu = (int)(uintptr_t)arg;
+
+	for (int i = 0; i < kBenchIters; i++) {
+		for (int j = 0; j < kBenchBatch; j++)
+			objs[j] = kmem_zonealloc(bench_zone);
+		for (int j = 0; j < kBenchBatch; j++)
+			kmem_zonefree(bench_zone, objs[j]);
+	}
+
+	return NULL;
+}
+
+static double
+bench_run(int nthreads)
+{
+	pthread_t	threads[8];
+	struct timespec start, end;
+	double		secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, bench_thread,
+		    (void *)(uintptr_t)i);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	return 2.0 * kBenchBatch * kBenchIters * nthreads / secs;
+}
+
+enum { kFootprintNObjs = 65536 };
+
+static size_t
+zone_pages(kmem_zone_t *zone)
+{
+	return zone->nslabs * slabsize(zone) / PGSIZE;
+}
+
+static void
+footprint_run(kmem_zone_t *zone)
+{
+	static void    *objs[kFootprintNObjs];
+	struct timespec start, end;
+	size_t		peak, frag, fragreaped, freed;
+	double		secs;
+
+	zone->flags |= kKMemNoMagazines;
+
+	for (size_t i = 0; i < kFootprintNObjs; i++)
+		objs[i] = kmem_zonealloc(zone);
+	peak = zone_pages(zone);
+
+	/* shuffle, so frees are in an order unrelated to allocation */
+	for (size_t i = kFootprintNObjs - 1; i > 0; i--) {
+		size_t j = rand() % (i + 1);
+		void  *tmp = objs[i];
+		objs[i] = objs[j];
+		objs[j] = tmp;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 0; i < kFootprintNObjs; i++)
+		if (i % 8 != 0)
+			kmem_zonefree(zone, objs[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	frag = zone_pages(zone);
+	kmem_reap();
+	fragreaped = zone_pages(zone);
+
+	for (size_t i = 0; i < kFootprintNObjs; i += 8)
+		kmem_zonefree(zone, objs[i]);
+	kmem_reap();
+	freed = zone_pages(zone);
+
+	printf("%-12s%-10zu%-10zu%-10zu%-10zu%-16.0f\n", zone->name, peak,
+	    frag, fragreaped, freed, kFootprintNObjs * 7 / 8 / secs);
+
+	zone->flags &= ~kKMemNoMagazines;
+}
+
 int
 main(int argc, char *argv[])
 {
-	void *two;
+	kmem_zone_t *zones[] = { &kmem_64, &kmem_1024 };
 
 	kmem_init();
 
-	printf("alloc 8/1: %p\n", kmem_zonealloc(&kmem_slab_8));
-	two = kmem_zonealloc(&kmem_slab_8);
-	printf("alloc 8/2: %p\n", two);
-	printf("alloc 8/3: %p\n", kmem_zonealloc(&kmem_slab_8));
-
-	kprintf("free 8/2\n");
-	kmem_slabfree(&kmem_slab_8, two);
+	printf("%-12s%-9s%-16s%-16s\n", "zone", "threads", "slab (ops/s)",
+	    "magazine (ops/s)");
+	for (int z = 0; z < elementsof(zones); z++) {
+		bench_zone = zones[z];
+		for (int n = 1; n <= 8; n *= 2) {
+			double slab, mag;
 
-	printf("alloc 8/4 (should match 8/2): %p\n",
-	    kmem_zonealloc(&kmem_slab_8));
+			bench_zone->flags |= kKMemNoMagazines;
+			slab = bench_run(n);
+			bench_zone->flags &= ~kKMemNoMagazines;
+			mag = bench_run(n);
 
-	printf("alloc 1024/1: %p\n", kmem_zonealloc(&kmem_slab_1024));
-	two = kmem_zonealloc(&kmem_slab_1024);
-	printf("alloc 1024/2: %p\n", two);
-	printf("alloc 1024/3: %p\n", kmem_zonealloc(&kmem_slab_1024));
+			printf("%-12s%-9d%-16.0f%-16.0f\n", bench_zone->name, n,
+			    slab, mag);
+		}
+	}
 
-	kprintf("free 1024/2\n");
-	kmem_slabfree(&kmem_slab_1024, two);
+	printf("\n%-12s%-10s%-10s%-10s%-10s%-16s\n", "zone", "peak pg",
+	    "7/8 free", "reaped", "all free", "frees/s");
+	for (int z = 0; z < elementsof(zones); z++)
+		footprint_run(zones[z]);
 
-	printf("alloc 1024/4 (should match 1024/2): %p\n",
-	    kmem_zonealloc(&kmem_slab_1024));
+	kmem_dump();
 
-	return 2;
+	return 0;
 }
 #endif
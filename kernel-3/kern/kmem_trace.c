@@ -0,0 +1,497 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+/*
+ * Each CPU has a ring of events, to which only that CPU writes, with
+ * interrupts disabled, advancing `head`; whoever holds drain_lock consumes
+ * from `tail`. So neither side ever waits for the other: a writer that finds
+ * its ring full counts the event as dropped, and a writer that finds the ring
+ * three-quarters full drains all the rings itself if the lock is free.
+ *
+ * Draining merges the rings by timestamp, so that a free on one CPU is always
+ * applied after the allocation it frees, even if that was on another CPU.
+ * Only events stamped before the drain began are consumed; any such event has
+ * been published (the stamp is taken with interrupts disabled, just before the
+ * event is published), and an allocation is published before it is returned
+ * and hence before it can be freed. This relies on the timestamp counters of
+ * all CPUs being synchronised, as they are on any machine with an invariant
+ * TSC.
+ *
+ * The tables the rings drain into are fixed in size, since they can't be
+ * allocated from the allocators they trace. If they fill, the excess is
+ * counted and reported rather than tracked.
+ */
+
+#include <sys/param.h>
+
+#include <kern/kmem.h>
+#include <kern/kmem_trace.h>
+#include <kern/task.h>
+#include <libkern/klib.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+enum {
+	/*! events per CPU ring (a power of 2) */
+	kRingSize = 1024,
+	/*! call sites tracked (a power of 2), including an "others" per kind */
+	kNSites = 1024,
+	/*! live allocations tracked (a power of 2) */
+	kNLive = 65536,
+	/*! buckets of the interval histogram; bucket n is [2^n, 2^(n+1)) */
+	kNIntervals = 40,
+	/*! dumps an allocation must survive to be reported as a suspected leak */
+	kLeakGenerations = 3,
+	/*! sites shown by kmem_trace_dump() */
+	kNTop = 16,
+};
+
+struct trace_event {
+	uint64_t    tsc;
+	const void *ptr;
+	/*! allocating call site, or NULL for a free */
+	const void *site;
+	uint64_t    size : 60, kind : 4;
+};
+
+struct trace_ring {
+	/*! next slot to write; written only by the owning CPU */
+	uint64_t head;
+	/*! events dropped because the ring was full */
+	uint64_t ndropped;
+	/*! time of the last allocation of each kind on this CPU */
+	uint64_t lastalloc[kKMemTraceNKinds];
+	/*! histogram of intervals between allocations, in log2 cycles */
+	uint64_t intervals[kKMemTraceNKinds][kNIntervals];
+
+	/*! next slot to read; written only with drain_lock held */
+	uint64_t tail __attribute__((aligned(64)));
+
+	struct trace_event ev[kRingSize];
+} __attribute__((aligned(64)));
+
+struct trace_site {
+	const void *site;
+	uint8_t	    kind;
+	bool	    used;
+	/*! allocations live, and their total size */
+	size_t nlive, livebytes;
+	/*! allocations and frees since boot */
+	size_t nallocs, nfrees;
+	/*! nallocs as of the last dump */
+	size_t nallocs_lastdump;
+	/*! live allocations older than kLeakGenerations; computed by dump */
+	size_t nold;
+};
+
+struct trace_live {
+	/*! address of the allocation, or NULL for an empty slot */
+	const void *ptr;
+	size_t	    size;
+	uint16_t    site;
+	uint8_t	    kind;
+	/*! generation (number of dumps) when it was allocated */
+	uint32_t gen;
+};
+
+static const char *kind_names[kKMemTraceNKinds] = {
+	[kKMemTraceAlloc] = "kmem_alloc",
+	[kKMemTraceZone] = "kmem_zonealloc",
+	[kKMemTraceKWired] = "vm_kalloc",
+	[kKMemTracePage] = "vm_pagealloc",
+};
+
+static struct trace_ring rings[KMEM_MAX_CPUS];
+/*! 1 + highest CPU number which has logged an event */
+static int nrings = 0;
+
+/*! protects everything below */
+static spinlock_t	 drain_lock = SPINLOCK_INITIALISER;
+static struct trace_site sites[kNSites];
+static size_t		 nsites = 0;
+static struct trace_live live[kNLive];
+static size_t		 nlive = 0;
+static uint32_t		 generation = 0;
+/*! allocations not tracked for want of room in live[] */
+static size_t nuntracked = 0;
+/*! frees of allocations not found in live[] */
+static size_t nunmatched = 0;
+
+static inline size_t
+hash(const void *ptr, unsigned kind, size_t nbuckets)
+{
+	uint64_t h = ((uintptr_t)ptr >> 3) ^ kind;
+	return (h * 0x9e3779b97f4a7c15ull) >> 32 & (nbuckets - 1);
+}
+
+static struct trace_site *
+site_lookup(const void *site, unsigned kind)
+{
+	size_t i;
+
+	/* keep room for the "others" sites once the table is nearly full */
+	if (nsites >= kNSites - kKMemTraceNKinds)
+		site = NULL;
+
+	for (i = hash(site, kind, kNSites);; i = (i + 1) & (kNSites - 1)) {
+		struct trace_site *ts = &sites[i];
+
+		if (!ts->used) {
+			ts->used = true;
+			ts->site = site;
+			ts->kind = kind;
+			nsites++;
+			return ts;
+		} else if (ts->site == site && ts->kind == kind)
+			return ts;
+	}
+}
+
+static struct trace_live *
+live_lookup(const void *ptr, unsigned kind)
+{
+	for (size_t i = hash(ptr, kind, kNLive);; i = (i + 1) & (kNLive - 1)) {
+		if (live[i].ptr == NULL)
+			return NULL;
+		else if (live[i].ptr == ptr && live[i].kind == kind)
+			return &live[i];
+	}
+}
+
+/*! remove an entry from live[], shifting back any that probed past it */
+static void
+live_remove(struct trace_live *entry)
+{
+	size_t i = entry - live, j = i;
+
+	for (;;) {
+		size_t k;
+
+		j = (j + 1) & (kNLive - 1);
+		if (live[j].ptr == NULL)
+			break;
+
+		/* can entry j move to i, i.e. is its home not in (i, j]? */
+		k = hash(live[j].ptr, live[j].kind, kNLive);
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			live[i] = live[j];
+			i = j;
+		}
+	}
+
+	live[i].ptr = NULL;
+	nlive--;
+}
+
+static void
+live_unaccount(struct trace_live *entry)
+{
+	struct trace_site *ts = &sites[entry->site];
+
+	ts->nlive--;
+	ts->livebytes -= entry->size;
+}
+
+static void
+process(struct trace_event *ev)
+{
+	struct trace_live *entry = live_lookup(ev->ptr, ev->kind);
+
+	if (ev->site == NULL) {
+		if (entry == NULL) {
+			nunmatched++;
+			return;
+		}
+		live_unaccount(entry);
+		sites[entry->site].nfrees++;
+		live_remove(entry);
+	} else {
+		struct trace_site *ts = site_lookup(ev->site, ev->kind);
+
+		ts->nallocs++;
+
+		if (entry != NULL) {
+			/* its free must have been dropped */
+			live_unaccount(entry);
+		} else if (nlive >= kNLive / 8 * 7) {
+			nuntracked++;
+			return;
+		} else {
+			size_t i = hash(ev->ptr, ev->kind, kNLive);
+
+			while (live[i].ptr != NULL)
+				i = (i + 1) & (kNLive - 1);
+			entry = &live[i];
+			entry->ptr = ev->ptr;
+			entry->kind = ev->kind;
+			nlive++;
+		}
+
+		entry->size = ev->size;
+		entry->site = ts - sites;
+		entry->gen = generation;
+		ts->nlive++;
+		ts->livebytes += ev->size;
+	}
+}
+
+/*! drain all the rings; drain_lock held, interrupts disabled */
+static void
+drain(void)
+{
+	uint64_t heads[KMEM_MAX_CPUS];
+	uint64_t now = md_cycles();
+	int	 n = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+	for (int i = 0; i < n; i++)
+		heads[i] = __atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		struct trace_ring *oldest = NULL;
+		uint64_t	   oldesttsc = now;
+
+		for (int i = 0; i < n; i++) {
+			struct trace_event *ev;
+
+			if (rings[i].tail == heads[i])
+				continue;
+
+			ev = &rings[i].ev[rings[i].tail & (kRingSize - 1)];
+			if (ev->tsc < oldesttsc) {
+				oldest = &rings[i];
+				oldesttsc = ev->tsc;
+			}
+		}
+
+		if (oldest == NULL)
+			break;
+
+		process(&oldest->ev[oldest->tail & (kRingSize - 1)]);
+		__atomic_store_n(&oldest->tail, oldest->tail + 1,
+		    __ATOMIC_RELEASE);
+	}
+}
+
+static void
+trace_log(enum kmem_trace_kind kind, const void *ptr, size_t size,
+    const void *site)
+{
+	struct trace_ring *ring;
+	uint64_t	   head, tail, now;
+	int		   num, n;
+	bool		   iff;
+
+	if (ptr == NULL)
+		return;
+
+	iff = md_intr_disable();
+	/*
+	 * cpu0 is -1 until smp_init(), which starts no more than KMEM_MAX_CPUS
+	 * CPUs; before then it is alone, so may borrow ring 0
+	 */
+	num = curcpu()->num < 0 ? 0 : curcpu()->num;
+	assert(num < KMEM_MAX_CPUS);
+	ring = &rings[num];
+	now = md_cycles();
+
+	n = __atomic_load_n(&nrings, __ATOMIC_RELAXED);
+	while (num >= n &&
+	    !__atomic_compare_exchange_n(&nrings, &n, num + 1, false,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	if (site != NULL) {
+		if (ring->lastalloc[kind] != 0) {
+			uint64_t delta = now - ring->lastalloc[kind];
+			int	 bucket = delta == 0 ? 0 : 63 - __builtin_clzll(delta);
+			ring->intervals[kind][MIN(bucket, kNIntervals - 1)]++;
+		}
+		ring->lastalloc[kind] = now;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail == kRingSize)
+		ring->ndropped++;
+	else {
+		struct trace_event *ev = &ring->ev[head & (kRingSize - 1)];
+
+		ev->tsc = now;
+		ev->ptr = ptr;
+		ev->site = site;
+		ev->size = size;
+		ev->kind = kind;
+		__atomic_store_n(&ring->head, ++head, __ATOMIC_RELEASE);
+	}
+
+	if (head - tail >= kRingSize / 4 * 3 &&
+	    spinlock_trylock(&drain_lock, false)) {
+		drain();
+		spinlock_unlock(&drain_lock);
+	}
+
+	md_intr_x(iff);
+}
+
+void
+kmem_trace_alloc(enum kmem_trace_kind kind, const void *ptr, size_t size,
+    const void *site)
+{
+	/* NULL marks a free, so make sure no allocation looks like one */
+	trace_log(kind, ptr, size, site != NULL ? site : (void *)1);
+}
+
+void
+kmem_trace_free(enum kmem_trace_kind kind, const void *ptr, size_t size)
+{
+	trace_log(kind, ptr, size, NULL);
+}
+
+/*! insert \p ts into \p top (of \p n, descending by \p key) if it belongs */
+static void
+top_insert(struct trace_site *top, size_t *n, struct trace_site *ts,
+    size_t (*key)(struct trace_site *))
+{
+	size_t i;
+
+	if (*n == kNTop && key(ts) <= key(&top[kNTop - 1]))
+		return;
+
+	if (*n < kNTop)
+		(*n)++;
+	for (i = *n - 1; i > 0 && key(&top[i - 1]) < key(ts); i--)
+		top[i] = top[i - 1];
+	top[i] = *ts;
+}
+
+static size_t
+key_livebytes(struct trace_site *ts)
+{
+	return ts->livebytes;
+}
+
+static size_t
+key_nold(struct trace_site *ts)
+{
+	return ts->nold;
+}
+
+static void
+print_sites(struct trace_site *top, size_t n)
+{
+	kprintf("\033[7m%-16s%-20s%-12s%-9s%-9s%-11s%-11s%-9s\033[m\n",
+	    "kind", "site", "live bytes", "live", "old", "allocs", "frees",
+	    "new");
+	for (size_t i = 0; i < n; i++) {
+		struct trace_site *ts = &top[i];
+
+		if (ts->site == NULL)
+			kprintf("%-16s%-20s", kind_names[ts->kind], "(others)");
+		else
+			kprintf("%-16s%-20p", kind_names[ts->kind], ts->site);
+		kprintf("%-12zu%-9zu%-9zu%-11zu%-11zu%-9zu\n", ts->livebytes,
+		    ts->nlive, ts->nold, ts->nallocs, ts->nfrees,
+		    ts->nallocs - ts->nallocs_lastdump);
+	}
+}
+
+void
+kmem_trace_dump(void)
+{
+	static struct trace_site bybytes[kNTop], byage[kNTop];
+	static uint64_t		 intervals[kKMemTraceNKinds][kNIntervals];
+	size_t			 nbybytes = 0, nbyage = 0;
+	size_t			 livebytes[kKMemTraceNKinds] = { 0 };
+	size_t			 nsites_, nlive_, nuntracked_, nunmatched_;
+	uint64_t		 ndropped = 0;
+	bool			 iff;
+
+	iff = md_intr_disable();
+	spinlock_lock(&drain_lock);
+
+	drain();
+	generation++;
+
+	for (size_t i = 0; i < kNSites; i++)
+		sites[i].nold = 0;
+	for (size_t i = 0; i < kNLive; i++)
+		if (live[i].ptr != NULL &&
+		    generation - live[i].gen >= kLeakGenerations)
+			sites[live[i].site].nold++;
+
+	for (size_t i = 0; i < kNSites; i++) {
+		struct trace_site *ts = &sites[i];
+
+		if (!ts->used)
+			continue;
+
+		livebytes[ts->kind] += ts->livebytes;
+		top_insert(bybytes, &nbybytes, ts, key_livebytes);
+		if (ts->nold > 0)
+			top_insert(byage, &nbyage, ts, key_nold);
+		ts->nallocs_lastdump = ts->nallocs;
+	}
+
+	memset(intervals, 0, sizeof(intervals));
+	for (int i = 0; i < nrings; i++) {
+		ndropped += rings[i].ndropped;
+		for (int k = 0; k < kKMemTraceNKinds; k++)
+			for (int b = 0; b < kNIntervals; b++)
+				intervals[k][b] += rings[i].intervals[k][b];
+	}
+
+	nsites_ = nsites;
+	nlive_ = nlive;
+	nuntracked_ = nuntracked;
+	nunmatched_ = nunmatched;
+
+	spinlock_unlock(&drain_lock);
+	md_intr_x(iff);
+
+	kprintf("kmem trace: %zu sites, %zu live allocations; %lu events "
+		"dropped, %zu allocations untracked, %zu frees unmatched\n",
+	    nsites_, nlive_, ndropped, nuntracked_, nunmatched_);
+	for (int k = 0; k < kKMemTraceNKinds; k++)
+		kprintf("%-16s%zu bytes live\n", kind_names[k], livebytes[k]);
+
+	kprintf("top sites by live bytes:\n");
+	print_sites(bybytes, nbybytes);
+
+	kprintf("interval between allocations (cycles, per CPU):\n");
+	kprintf("\033[7m%-12s", "interval");
+	for (int k = 0; k < kKMemTraceNKinds; k++)
+		kprintf("%-16s", kind_names[k]);
+	kprintf("\033[m\n");
+	for (int b = 0; b < kNIntervals; b++) {
+		uint64_t any = 0;
+
+		for (int k = 0; k < kKMemTraceNKinds; k++)
+			any |= intervals[k][b];
+		if (!any)
+			continue;
+
+		if (b == kNIntervals - 1)
+			kprintf(">= 2^%-7d", b);
+		else
+			kprintf("< 2^%-8d", b + 1);
+		for (int k = 0; k < kKMemTraceNKinds; k++)
+			kprintf("%-16lu", intervals[k][b]);
+		kprintf("\n");
+	}
+
+	if (nbyage > 0) {
+		kprintf("suspected leaks (allocations live for %d dumps):\n",
+		    kLeakGenerations);
+		print_sites(byage, nbyage);
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+/*!
+ * @file kmem_trace.h
+ * @brief Allocation tracing and per-call-site memory accounting.
+ *
+ * When the kernel is built with KMEM_TRACE (the `kmem_trace` build option),
+ * kmem_alloc(), kmem_zonealloc(), vm_kalloc() and vm_pagealloc() and their
+ * corresponding frees each log an event, stamped with the caller's return
+ * address, to a per-CPU ring. The rings are written with interrupts disabled
+ * and without locks; they are drained into a table of call sites and a table
+ * of live allocations when they fill up and by kmem_trace_dump(), which prints
+ * per-call-site live bytes and counts, histograms of the interval between
+ * allocations, and sites holding allocations which have survived several
+ * dumps (leak suspects.)
+ *
+ * Each layer is accounted separately: an allocation made with kmem_alloc() is
+ * logged as such against its caller, and again against kmem in the layer
+ * beneath from which kmem satisfied it.
+ *
+ * Without KMEM_TRACE these are all no-ops.
+ */
+
+#ifndef KMEM_TRACE_H_
+#define KMEM_TRACE_H_
+
+#include <stddef.h>
+
+/*! Which allocator an event concerns. */
+enum kmem_trace_kind {
+	kKMemTraceAlloc, /*!< kmem_alloc() */
+	kKMemTraceZone, /*!< kmem_zonealloc() */
+	kKMemTraceKWired, /*!< vm_kalloc() */
+	kKMemTracePage, /*!< vm_pagealloc() */
+	kKMemTraceNKinds,
+};
+
+#ifdef KMEM_TRACE
+
+/*! The call site to attribute an allocation to; use in the allocator. */
+#define KMEM_TRACE_SITE() __builtin_return_address(0)
+
+/*! Log an allocation of \p size bytes at \p ptr made from \p site. */
+void kmem_trace_alloc(enum kmem_trace_kind kind, const void *ptr, size_t size,
+    const void *site);
+
+/*! Log the freeing of the \p size byte allocation at \p ptr. */
+void kmem_trace_free(enum kmem_trace_kind kind, const void *ptr, size_t size);
+
+/*! Drain the rings and print the accounting and a leak report. */
+void kmem_trace_dump(void);
+
+#else
+
+#define KMEM_TRACE_SITE() NULL
+
+static inline void
+kmem_trace_alloc(enum kmem_trace_kind kind, const void *ptr, size_t size,
+    const void *site)
+{
+}
+
+static inline void
+kmem_trace_free(enum kmem_trace_kind kind, const void *ptr, size_t size)
+{
+}
+
+static inline void
+kmem_trace_dump(void)
+{
+}
+
+#endif /* KMEM_TRACE */
+
+#endif /* KMEM_TRACE_H_ */
@@ -31,6 +31,7 @@ thread_t thread0 = {
 	.lock = SPINLOCK_INITIALISER,
 	.wq = NULL,
 	.in_pagefault = false,
+	.blkplug = NULL,
 };
 
 cpu_t cpu0 = {
@@ -169,6 +170,50 @@ finish:
 	md_intr_x(iff);
 }
 
+void
+dpc_enqueue(dpc_t *dpc)
+{
+	__typeof__(curcpu()->pendingdpcs) *queue;
+	bool				   iff;
+
+	if (atomic_exchange(&dpc->pending, true))
+		return;
+
+	/* disabled first, lest we migrate and enqueue on another CPU's queue */
+	iff = md_intr_disable();
+	queue = &curcpu()->pendingdpcs;
+	/* the interrupt is already requested if others are pending */
+	if (TAILQ_EMPTY(queue))
+		md_raise_dpc_interrupt();
+	TAILQ_INSERT_TAIL(queue, dpc, queue);
+	md_intr_x(iff);
+}
+
+void
+dpc_interrupt(md_intr_frame_t *frame, void *unused)
+{
+	__auto_type queue = &curcpu()->pendingdpcs;
+	dpc_t *dpc;
+	bool   iff;
+
+	iff = md_intr_disable();
+
+	/*
+	 * The DPC vector is in service until we return, so only hard
+	 * interrupts can come in while callbacks run; and those may post
+	 * further DPCs, which are run in this same pass.
+	 */
+	while ((dpc = TAILQ_FIRST(queue)) != NULL) {
+		TAILQ_REMOVE(queue, dpc, queue);
+		atomic_store(&dpc->pending, false);
+		md_intr_x(true);
+		dpc->callback(dpc->arg);
+		md_intr_disable();
+	}
+
+	md_intr_x(iff);
+}
+
 void
 mutex_lock(mutex_t *mtx)
 {
@@ -292,8 +337,8 @@ thread_new(task_t *task, void (*fun)(void *arg), void *arg)
 
 	thread->state = kThreadRunnable;
 	thread->task = task;
-	thread->kstack = vm_kalloc(4, kVMKSleep) + 4 * PGSIZE;
 	thread->ustack = NULL;
+	thread->blkplug = NULL;
 
 	iff = md_intr_disable();
 	spinlock_lock(&sched_lock);
@@ -302,6 +347,10 @@ thread_new(task_t *task, void (*fun)(void *arg), void *arg)
 	spinlock_unlock(&sched_lock);
 	md_intr_x(iff);
 
+	/* the stack belongs on the node of the CPU it's going to run on */
+	thread->kstack = vm_kalloc_node(thread->cpu->node, 4, kVMKSleep) +
+	    4 * PGSIZE;
+
 	/* TODO(portability) */
 	thread->md.frame.cs = 0x28;
 	thread->md.frame.ss = 0x30;
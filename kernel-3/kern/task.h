@@ -37,6 +37,21 @@ typedef struct callout {
 	} state;
 } callout_t;
 
+/*!
+ * A deferred procedure call: work posted (typically by an interrupt handler) to
+ * be run soon after by the CPU which posted it, in a soft interrupt at
+ * kSPLSoft, with interrupts enabled. Posting a DPC already pending does
+ * nothing, so work posted by several interrupts before it runs is batched.
+ */
+typedef struct dpc {
+	/* links cpu::pendingdpcs */
+	TAILQ_ENTRY(dpc) queue;
+	void (*callback)(void *arg);
+	void *arg;
+	/* whether enqueued; cleared just before the callback is called */
+	atomic_bool pending;
+} dpc_t;
+
 typedef struct task {
 	char	  name[31];
 	vm_map_t *map;
@@ -78,6 +93,9 @@ typedef struct thread {
 
 	bool in_pagefault : 1;
 
+	/*! block I/O plug, if the thread is plugged; see dk_blk.h */
+	struct dk_blk_plug *blkplug;
+
 	/*! kernal stack */
 	vaddr_t kstack;
 	/*! user-mode stack (or NULL) */
@@ -92,6 +110,8 @@ typedef struct thread {
 
 typedef struct cpu {
 	int	  num;
+	/*! NUMA node which the CPU belongs to */
+	int	  node;
 	thread_t *curthread;
 
 	thread_t *idlethread;
@@ -116,6 +136,12 @@ typedef struct cpu {
 	 */
 	TAILQ_HEAD(, callout) pendingcallouts;
 
+	/*!
+	 * Queue of pending DPCs. Linked by dpc::queue. Needs interrupts off.
+	 * Emptied by the DPC interrupt.
+	 */
+	TAILQ_HEAD(, dpc) pendingdpcs;
+
 	/*! machine-dependent cpu block */
 	md_cpu_t md;
 } cpu_t;
@@ -139,6 +165,14 @@ void callout_dequeue(callout_t *callout);
 /*! Private - callout interrupt handler. */
 void callout_interrupt(md_intr_frame_t *frame, void *unused);
 
+/*!
+ * Enqueue a DPC to run on this CPU, unless it is already pending. May be
+ * called from interrupt context.
+ */
+void dpc_enqueue(dpc_t *dpc);
+/*! Private - DPC interrupt handler. */
+void dpc_interrupt(md_intr_frame_t *frame, void *unused);
+
 /*! Create a new thread; it is assigned a CPU but not enqueued for running. */
 thread_t *thread_new(task_t *task, void (*fun)(void *arg), void *arg);
 /*! Resume a suspended thread; it may preempt the currently running. */
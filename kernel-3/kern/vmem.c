@@ -53,11 +53,12 @@
  *
  * # Technical details
  *
- * VMem has its own allocation scheme for its segment tags; a freelist is kept
- * filled with a reserve of tags prior to each operation, so that any nested
- * operations which are invoked on the kernel VA arena can use those instead of
- * trying to allocate new segments, which would create a cycle. A miniature slab
- * allocator is used by default to allocate the segment structures.
+ * VMem has its own allocation scheme for its segment tags (boundary tags): they
+ * are carved from whole pages taken directly from the page queues, rather than
+ * from any arena, so that allocating a tag can never recurse into VMem and so
+ * create a cycle. The free tags are kept on a global list, which is simply
+ * refilled with another page whenever it runs dry; so a burst of allocations
+ * is never limited by some reserve having been set aside beforehand.
  *
  * A segment is a subdivision of a span. Arenas are divided into a tail queue of
  * segments; a segment may either be a free area, an allocated area, or a span
@@ -80,6 +81,52 @@
  * index. (XXX not currently, they don't yet know of arena quantums; formula
  * right now is just `2 ^ n`).
  *
+ * ## Allocation strategies
+ *
+ * Instant-fit (the default) takes the first segment on the first freelist
+ * which can only contain segments large enough: freelist `n + 1` for a request
+ * sized between `2 ^ n` and `2 ^ (n + 1)`. Best-fit searches from freelist `n`
+ * for the smallest segment which fits, and stops at the first freelist with
+ * any fit, since all segments on later freelists are larger. Next-fit walks
+ * the segment queue from the last allocation it made, the rotor, wrapping
+ * around at the end; this is slower, but hands out addresses in sequence.
+ *
+ * All three respect vmem_xalloc()'s alignment, phase, boundary-crossing and
+ * address range constraints; seg_fit() finds the lowest address in a free
+ * segment satisfying them, and a segment for which there is none is passed
+ * over. When a constrained request must import from the source arena, enough
+ * is imported to satisfy its alignment wherever in the source the span lands.
+ *
+ * ## Hash table
+ *
+ * Allocated segments are found on free by a hash table keyed on their base
+ * address. An arena starts with a small inline table, which suffices for most;
+ * once the allocated segments outnumber its buckets by more than
+ * kVMemHashLoad, it is grown into pages of buckets, and the number of those
+ * pages is then doubled each time the load is again exceeded. The pages, like
+ * segment tags, come straight from the page queues, so the hash of an arena
+ * never depends on that or any other arena. Since the bucket count is always a
+ * power of 2, doubling splits each bucket in place between itself and its
+ * counterpart in the new half; the old pages are kept.
+ *
+ * ## Locking
+ *
+ * Each arena has a mutex protecting its segment queue, freelists, hash table,
+ * and span list. It is dropped around calls to the import and release
+ * functions, since these operate on the source arena (and may well sleep); so
+ * a free segment is always claimed in the same critical section in which it is
+ * found or imported. The free segment tag list has its own spinlock.
+ *
+ * ## Quantum caches
+ *
+ * As described by Adams and Bonwick, an arena created with a nonzero
+ * qcache_max fronts itself with a kmem cache for each multiple of the quantum
+ * up to qcache_max. vmem_alloc() and vmem_free() of sizes within that range go
+ * to those caches, and so (thanks to kmem's per-CPU magazines) usually don't
+ * touch the arena lock at all; the caches import slabs of several objects at
+ * a time from the arena with vmem_xalloc(), which never uses them. As kmem
+ * itself allocates from vm_kernel_wired, arenas created before kmem is up get
+ * their caches later, from vmem_qcache_init().
  */
 
 /**
@@ -87,12 +134,14 @@
  * @brief Implementation of the VMem resource allocator.
  */
 
+#include <sys/param.h>
 #include <sys/queue.h>
 
 #include <errno.h>
 #include <string.h>
 
 #ifdef _KERNEL
+#include <kern/kmem.h>
 #include <kern/sync.h>
 #include <vm/vm.h>
 #include <libkern/klib.h>
@@ -101,9 +150,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#define vm_kalloc(SIZE, FLAGS) malloc(SIZE)
-#define kmalloc malloc
+#include <pthread.h>
+#include <time.h>
+
+#define PGSIZE 4096
 #define kprintf printf
+#define elementsof(ARR) (sizeof(ARR) / sizeof((ARR)[0]))
+#define splhigh() 0
+#define splx(PL) (void)(PL)
+#define spinlock_t pthread_mutex_t
+#define SPINLOCK_INITIALISER PTHREAD_MUTEX_INITIALIZER
+#define spinlock_lock pthread_mutex_lock
+#define spinlock_unlock pthread_mutex_unlock
+#define mutex_init(MTX) pthread_mutex_init(MTX, NULL)
+#define mutex_lock pthread_mutex_lock
+#define mutex_unlock pthread_mutex_unlock
 #define fatal(...)                              \
 	{                                       \
 		kprintf("fatal: " __VA_ARGS__); \
@@ -117,21 +178,18 @@
 #define ERESOURCEEXHAUSTED 1200
 #endif
 
-struct seg_chunk {
-	bool	   used;
-	vmem_seg_t seg;
+enum {
+	/** maximum mean number of allocated segs per hash bucket */
+	kVMemHashLoad = 2,
+	/** buckets per page of the hash table */
+	kVMemHashPageBuckets = PGSIZE / sizeof(vmem_seglist_t),
+	/** limit of hash table pages, i.e. what fits in the directory page */
+	kVMemHashMaxPages = PGSIZE / sizeof(vmem_seglist_t *),
 };
 
-typedef struct seg_block {
-	LIST_ENTRY(seg_block);
-	struct seg_chunk _chunks[63];
-} seg_slab_t;
-
-static vmem_seg_t     static_segs[128];
 static vmem_seglist_t free_segs = LIST_HEAD_INITIALIZER(free_segs);
 static spinlock_t     free_segs_lock = SPINLOCK_INITIALISER;
-static int	      nfreesegs = 0;
-// static LIST_HEAD(, seg_block) seg_blocks = LIST_HEAD_INITIALIZER(seg_blocks);
+static size_t	      nfreesegs = 0;
 
 static const char *vmem_seg_type_str[] = {
 	[kVMemSegFree] = " free",
@@ -167,6 +225,47 @@ freelist_insert(vmem_t *vmem, vmem_seg_t *freeseg)
 	    seglist);
 }
 
+/**
+ * Allocate a zeroed page for VMem's own use. These are taken directly from the
+ * page queues so as never to recurse into an arena.
+ */
+static void *
+vmem_page_alloc(void)
+{
+#ifdef _KERNEL
+	return P2V(vm_pagealloc(true, &vm_pgkmemq)->paddr);
+#else
+	return calloc(1, PGSIZE);
+#endif
+}
+
+/** Free a page allocated by vmem_page_alloc(). */
+static void
+vmem_page_free(void *addr)
+{
+#ifdef _KERNEL
+	vm_page_free(vm_page_from_paddr((paddr_t)V2P(addr)));
+#else
+	free(addr);
+#endif
+}
+
+/** Carve a fresh page into segment tags and put them on the free list. */
+static void
+seg_slab_add(void)
+{
+	vmem_seg_t *segs = vmem_page_alloc();
+	ipl_t	    pl;
+
+	pl = splhigh();
+	spinlock_lock(&free_segs_lock);
+	for (size_t i = 0; i < PGSIZE / sizeof(*segs); i++)
+		LIST_INSERT_HEAD(&free_segs, &segs[i], seglist);
+	nfreesegs += PGSIZE / sizeof(*segs);
+	spinlock_unlock(&free_segs_lock);
+	splx(pl);
+}
+
 /** Allocate a segment. */
 static vmem_seg_t *
 seg_alloc(vmem_t *vmem, vmem_flag_t flags)
@@ -176,7 +275,13 @@ seg_alloc(vmem_t *vmem, vmem_flag_t flags)
 
 	pl = splhigh();
 	spinlock_lock(&free_segs_lock);
-	assert(!LIST_EMPTY(&free_segs));
+	while (LIST_EMPTY(&free_segs)) {
+		spinlock_unlock(&free_segs_lock);
+		splx(pl);
+		seg_slab_add();
+		pl = splhigh();
+		spinlock_lock(&free_segs_lock);
+	}
 	seg = LIST_FIRST(&free_segs);
 	LIST_REMOVE(seg, seglist);
 	nfreesegs--;
@@ -200,24 +305,6 @@ seg_free(vmem_t *vmem, vmem_seg_t *seg)
 	splx(pl);
 }
 
-/** Refill the free segments list. */
-static void
-seg_refill(int flags)
-{
-	struct seg_block *block;
-
-	if (nfreesegs >= 128)
-		return;
-
-	block = vm_kalloc(1, flags & kVMemSleep ? 0x3 : 0x2);
-	assert(block != NULL);
-	for (int i = 0; i < elementsof(block->_chunks); i++) {
-		memset(&block->_chunks[i].seg, 0x0,
-		    sizeof(block->_chunks[i].seg));
-		seg_free(NULL, &block->_chunks[i].seg);
-	}
-}
-
 uint64_t
 murmur64(uint64_t h)
 {
@@ -229,17 +316,102 @@ murmur64(uint64_t h)
 	return h;
 }
 
+static vmem_seglist_t *
+hashbucket(vmem_t *vmem, size_t idx)
+{
+	if (vmem->hashdir == NULL)
+		return &vmem->hash0[idx];
+	return &vmem->hashdir[idx / kVMemHashPageBuckets]
+			     [idx % kVMemHashPageBuckets];
+}
+
 static vmem_seglist_t *
 hashbucket_for_addr(vmem_t *vmem, vmem_addr_t addr)
 {
-	uintptr_t hash = murmur64(addr) % kNHashBuckets;
-	return &vmem->hashtab[hash];
+	return hashbucket(vmem, murmur64(addr) & (vmem->nhashbuckets - 1));
 }
 
 static void
 hashtab_insert(vmem_t *vmem, vmem_seg_t *seg)
 {
 	LIST_INSERT_HEAD(hashbucket_for_addr(vmem, seg->base), seg, seglist);
+	vmem->nalloced++;
+}
+
+/**
+ * Double the number of hash buckets of \p vmem, which must be unlocked. The
+ * new pages of buckets are allocated with the lock dropped; only the thread
+ * which set hashgrowing touches the directory beyond the current buckets.
+ */
+static void
+hash_grow(vmem_t *vmem)
+{
+	vmem_seglist_t **dir;
+	size_t		 oldn, oldpages, newpages;
+
+	mutex_lock(&vmem->lock);
+	if (vmem->hashgrowing ||
+	    vmem->nalloced <= vmem->nhashbuckets * kVMemHashLoad ||
+	    vmem->nhashbuckets >= kVMemHashMaxPages * kVMemHashPageBuckets) {
+		mutex_unlock(&vmem->lock);
+		return;
+	}
+	vmem->hashgrowing = true;
+	oldn = vmem->nhashbuckets;
+	mutex_unlock(&vmem->lock);
+
+	if (vmem->hashdir == NULL) {
+		dir = vmem_page_alloc();
+		oldpages = 0;
+		newpages = 1;
+	} else {
+		dir = vmem->hashdir;
+		oldpages = oldn / kVMemHashPageBuckets;
+		newpages = oldpages * 2;
+	}
+
+	for (size_t i = oldpages; i < newpages; i++) {
+		dir[i] = vmem_page_alloc();
+		for (size_t j = 0; j < kVMemHashPageBuckets; j++)
+			LIST_INIT(&dir[i][j]);
+	}
+
+	mutex_lock(&vmem->lock);
+	if (vmem->hashdir == NULL) {
+		/* move everything out of the inline table */
+		for (size_t i = 0; i < kNHashBuckets; i++) {
+			vmem_seg_t *seg;
+
+			while ((seg = LIST_FIRST(&vmem->hash0[i])) != NULL) {
+				LIST_REMOVE(seg, seglist);
+				LIST_INSERT_HEAD(&dir[0][murmur64(seg->base) &
+						     (kVMemHashPageBuckets - 1)],
+				    seg, seglist);
+			}
+		}
+		vmem->hashdir = dir;
+		vmem->nhashbuckets = kVMemHashPageBuckets;
+	} else {
+		size_t newn = oldn * 2;
+
+		/* split each bucket between itself and bucket + oldn */
+		for (size_t i = 0; i < oldn; i++) {
+			vmem_seg_t *seg, *next;
+
+			for (seg = LIST_FIRST(hashbucket(vmem, i)); seg != NULL;
+			     seg = next) {
+				next = LIST_NEXT(seg, seglist);
+				if ((murmur64(seg->base) & (newn - 1)) == i)
+					continue;
+				LIST_REMOVE(seg, seglist);
+				LIST_INSERT_HEAD(hashbucket(vmem, i + oldn), seg,
+				    seglist);
+			}
+		}
+		vmem->nhashbuckets = newn;
+	}
+	vmem->hashgrowing = false;
+	mutex_unlock(&vmem->lock);
 }
 
 static int
@@ -303,24 +475,63 @@ vmem_init(vmem_t *vmem, const char *name, vmem_addr_t base, vmem_size_t size,
 	vmem->allocfn = allocfn;
 	vmem->freefn = freefn;
 	vmem->source = source;
+	vmem->qcache_max = MIN(qcache_max, quantum * kVMemMaxQCaches);
+	vmem->nqcaches = 0;
+	vmem->rotor = base;
 
+	mutex_init(&vmem->lock);
 	TAILQ_INIT(&vmem->segqueue);
 	LIST_INIT(&vmem->spanlist);
 	for (int i = 0; i < kNFreeLists; i++)
 		LIST_INIT(&vmem->freelist[i]);
 	for (int i = 0; i < kNHashBuckets; i++)
-		LIST_INIT(&vmem->hashtab[i]);
+		LIST_INIT(&vmem->hash0[i]);
+	vmem->hashdir = NULL;
+	vmem->nhashbuckets = kNHashBuckets;
+	vmem->nalloced = 0;
+	vmem->hashgrowing = false;
 
 	if (size != 0 && !source)
 		vmem_add_internal(vmem, kVMemSegSpan, base, size, flags, NULL);
 
+	if (vmem->qcache_max != 0 && !(flags & kVMemBootstrap))
+		vmem_qcache_init(vmem);
+
 	return vmem;
 }
 
+void
+vmem_qcache_init(vmem_t *vmem)
+{
+#ifdef _KERNEL
+	size_t n = vmem->qcache_max / vmem->quantum;
+
+	for (size_t i = 0; i < n; i++) {
+		vmem_size_t size = (i + 1) * vmem->quantum;
+		char	   *name;
+
+		kmem_asprintf(&name, "%s-qc-%zu", vmem->name, size);
+		vmem->qcache[i] = kmem_cache_create(name, size, vmem->quantum,
+		    NULL, NULL, kKMemOffSlab);
+		assert(vmem->qcache[i] != NULL);
+		vmem->qcache[i]->source = vmem;
+	}
+
+	/* only now, lest making the caches recurse into them */
+	vmem->nqcaches = n;
+#endif
+}
+
 int
 vmem_add(vmem_t *vmem, vmem_addr_t base, vmem_size_t size, vmem_flag_t flags)
 {
-	return vmem_add_internal(vmem, kVMemSegSpan, base, size, flags, NULL);
+	int r;
+
+	mutex_lock(&vmem->lock);
+	r = vmem_add_internal(vmem, kVMemSegSpan, base, size, flags, NULL);
+	mutex_unlock(&vmem->lock);
+
+	return r;
 }
 
 /**
@@ -380,6 +591,10 @@ next_seg(vmem_seg_t *seg)
 	return TAILQ_NEXT(seg, segqueue);
 }
 
+/**
+ * Import a span of at least \p size from the source arena and add it to
+ * \p vmem, which must be locked; the lock is dropped during the import.
+ */
 static int
 try_import(vmem_t *vmem, vmem_size_t size, vmem_flag_t flags, vmem_seg_t **out)
 {
@@ -389,83 +604,251 @@ try_import(vmem_t *vmem, vmem_size_t size, vmem_flag_t flags, vmem_seg_t **out)
 	if (!vmem->allocfn)
 		return -ERESOURCEEXHAUSTED;
 
+	mutex_unlock(&vmem->lock);
 	r = vmem->allocfn(vmem->source, size, flags, &addr);
+	mutex_lock(&vmem->lock);
 	if (r < 0)
 		return r;
 
 	r = vmem_add_internal(vmem, kVMemSegSpanImported, addr, size, flags,
 	    out);
-	if (r < 0)
+	if (r < 0) {
+		mutex_unlock(&vmem->lock);
 		vmem->freefn(vmem->source, addr, size);
+		mutex_lock(&vmem->lock);
+	}
 
 	return r;
 }
 
+/**
+ * The constraints of a vmem_xalloc() request, gathered up to be passed to the
+ * strategy routines.
+ */
+struct xalloc_req {
+	vmem_size_t size;
+	vmem_size_t align; /** always nonzero; the quantum if unspecified */
+	vmem_size_t phase;
+	vmem_size_t nocross;
+	vmem_addr_t min;
+	vmem_addr_t max; /** exclusive; 0 if unbounded */
+	bool	    exact;
+};
+
+/**
+ * Find the lowest address within free segment \p seg at which \p req can be
+ * satisfied.
+ *
+ * @returns true and sets *\p out if there is one, otherwise false.
+ */
+static bool
+seg_fit(const struct xalloc_req *req, const vmem_seg_t *seg, vmem_addr_t *out)
+{
+	/* end is inclusive, lest a span at the top of the space overflow */
+	vmem_addr_t start = seg->base, end = seg->base + seg->size - 1;
+	vmem_addr_t addr;
+
+	if (req->min > start)
+		start = req->min;
+	if (req->max != 0 && req->max - 1 < end)
+		end = req->max - 1;
+	if (start > end)
+		return false;
+
+	addr = start + ((req->phase - start) & (req->align - 1));
+	if (req->nocross != 0 &&
+	    ((addr ^ (addr + req->size - 1)) & -req->nocross) != 0)
+		/* move to the next boundary; align divides nocross */
+		addr = (addr & -req->nocross) + req->nocross + req->phase;
+
+	if (addr < start || addr + req->size - 1 < addr ||
+	    addr + req->size - 1 > end)
+		return false;
+	if (req->exact && addr != req->min)
+		return false;
+
+	*out = addr;
+	return true;
+}
+
+/**
+ * Instant-fit: take the first segment from the first freelist whose every
+ * member is at least as large as the request, which without constraints is a
+ * constant-time operation. Only if those are exhausted is the freelist that
+ * may also contain smaller segments searched.
+ */
+static vmem_seg_t *
+instantfit_search(vmem_t *vmem, const struct xalloc_req *req, vmem_addr_t *out)
+{
+	size_t	    partial = freelist(req->size);
+	size_t	    first = partial + ((req->size & (req->size - 1)) ? 1 : 0);
+	vmem_seg_t *seg;
+
+	for (size_t i = first; i < kNFreeLists; i++) {
+		LIST_FOREACH (seg, &vmem->freelist[i], seglist) {
+			if (seg_fit(req, seg, out))
+				return seg;
+		}
+	}
+
+	if (first != partial) {
+		LIST_FOREACH (seg, &vmem->freelist[partial], seglist) {
+			if (seg_fit(req, seg, out))
+				return seg;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Best-fit: find the smallest segment that satisfies the request. As each
+ * freelist holds segments sized below those of the next, this is the best fit
+ * in the lowest freelist with any fit at all.
+ */
+static vmem_seg_t *
+bestfit_search(vmem_t *vmem, const struct xalloc_req *req, vmem_addr_t *out)
+{
+	for (size_t i = freelist(req->size); i < kNFreeLists; i++) {
+		vmem_seg_t *seg, *best = NULL;
+		vmem_addr_t addr;
+
+		LIST_FOREACH (seg, &vmem->freelist[i], seglist) {
+			if ((best == NULL || seg->size < best->size) &&
+			    seg_fit(req, seg, &addr)) {
+				best = seg;
+				*out = addr;
+			}
+		}
+
+		if (best != NULL)
+			return best;
+	}
+
+	return NULL;
+}
+
+/**
+ * Next-fit: find the first segment that satisfies the request at or after the
+ * last next-fit allocation, wrapping around to the start of the arena.
+ */
+static vmem_seg_t *
+nextfit_search(vmem_t *vmem, const struct xalloc_req *req, vmem_addr_t *out)
+{
+	vmem_seg_t *start = NULL, *seg;
+
+	/* the rotor is usually still allocated, so try to find it cheaply */
+	LIST_FOREACH (seg, hashbucket_for_addr(vmem, vmem->rotor), seglist) {
+		if (seg->base == vmem->rotor) {
+			start = next_seg(seg);
+			break;
+		}
+	}
+
+	if (seg == NULL) {
+		TAILQ_FOREACH (start, &vmem->segqueue, segqueue) {
+			if (start->base + start->size > vmem->rotor)
+				break;
+		}
+	}
+
+	for (seg = start; seg != NULL; seg = next_seg(seg)) {
+		if (seg->type == kVMemSegFree && seg_fit(req, seg, out))
+			return seg;
+	}
+
+	TAILQ_FOREACH (seg, &vmem->segqueue, segqueue) {
+		if (seg == start)
+			break;
+		if (seg->type == kVMemSegFree && seg_fit(req, seg, out))
+			return seg;
+	}
+
+	return NULL;
+}
+
 int
 vmem_xalloc(vmem_t *vmem, vmem_size_t size, vmem_size_t align,
     vmem_size_t phase, vmem_size_t nocross, vmem_addr_t min, vmem_addr_t max,
     vmem_flag_t flags, vmem_addr_t *out)
 {
-	size_t		freelist_idx = freelist(size) - 1;
-	vmem_seglist_t *list;
-	vmem_seg_t	   *freeseg, *newlseg, *newrseg;
-	vmem_addr_t	addr;
-	bool		tried_import = false;
-
-	assert(align == 0 && "not supported yet\n");
-	assert(phase == 0 && "not supported yet\n");
-	assert(min == 0 || ((flags & kVMemExact) && " not supported yet\n"));
-	assert(max == 0 && " not supported yet\n");
-
-	if (!(flags & kVMemBootstrap))
-		seg_refill(flags);
+	struct xalloc_req req;
+	vmem_seg_t	 *freeseg, *newlseg, *newrseg;
+	vmem_addr_t	  addr;
+	bool		  tried_import = false;
+	int		  r;
 
 	assert(size != 0);
+	assert((flags & (kVMemBestFit | kVMemNextFit)) !=
+	    (kVMemBestFit | kVMemNextFit));
+	assert(align % vmem->quantum == 0 && (align & (align - 1)) == 0);
+	assert(phase % vmem->quantum == 0 && (align == 0 || phase < align));
+	assert((nocross & (nocross - 1)) == 0);
+	assert(nocross == 0 || (nocross >= align && size + phase <= nocross));
+	assert(max == 0 || min < max);
+	assert(!(flags & kVMemExact) || min % vmem->quantum == 0);
+
+	req.size = (size + vmem->quantum - 1) / vmem->quantum * vmem->quantum;
+	req.align = align ? align : vmem->quantum;
+	req.phase = phase;
+	req.nocross = nocross;
+	req.min = min;
+	req.max = max;
+	req.exact = flags & kVMemExact;
 
 	/* preallocate new segments, they will be freed if necessary */
 	newlseg = seg_alloc(vmem, flags);
 	newrseg = seg_alloc(vmem, flags);
 
-search:
-	/* TODO: strategies other than this one... */
-	if (++freelist_idx >= elementsof(vmem->freelist)) {
-		if (tried_import)
-			return -ERESOURCEEXHAUSTED;
-		else {
-			int r;
-			tried_import = true;
-			r = try_import(vmem, size, flags, &freeseg);
-			if (r < 0)
-				return r;
-			addr = freeseg->base;
-			goto split_seg;
-		}
-	}
+	mutex_lock(&vmem->lock);
 
-	list = &vmem->freelist[freelist_idx];
-	LIST_FOREACH (freeseg, list, seglist) {
-		if (freeseg->base <= min) {
-			addr = min;
-		} else if (flags & kVMemExact && freeseg->base > min) {
-			continue;
-		} else {
-			addr = freeseg->base;
-		}
+	for (;;) {
+		if (flags & kVMemNextFit)
+			freeseg = nextfit_search(vmem, &req, &addr);
+		else if (flags & kVMemBestFit)
+			freeseg = bestfit_search(vmem, &req, &addr);
+		else
+			freeseg = instantfit_search(vmem, &req, &addr);
+
+		if (freeseg != NULL)
+			break;
 
-		if (addr + size > freeseg->base + freeseg->size) {
-			continue;
+		if (tried_import) {
+			r = -ERESOURCEEXHAUSTED;
+			goto fail;
 		}
 
-		goto split_seg;
+		/*
+		 * Import enough to fit the alignment wherever the span lands;
+		 * if it can't fit the address constraints the search fails.
+		 */
+		tried_import = true;
+		r = try_import(vmem,
+		    req.size + (req.align > vmem->quantum ?
+				       req.align - vmem->quantum :
+				       0),
+		    flags, &freeseg);
+		if (r < 0)
+			goto fail;
 	}
 
-	goto search;
+	split_seg(vmem, freeseg, &newlseg, &newrseg, addr, req.size);
+	if (flags & kVMemNextFit)
+		vmem->rotor = addr;
+	mutex_unlock(&vmem->lock);
 
-split_seg:
-	split_seg(vmem, freeseg, &newlseg, &newrseg, addr, size);
+	/* an unlocked peek; hash_grow() checks again */
+	if (vmem->nalloced > vmem->nhashbuckets * kVMemHashLoad)
+		hash_grow(vmem);
 
 	*out = addr;
 	return 0;
+
+fail:
+	mutex_unlock(&vmem->lock);
+	seg_free(vmem, newlseg);
+	seg_free(vmem, newrseg);
+	return r;
 }
 
 static void
@@ -487,15 +870,21 @@ freeseg_expand(vmem_t *vmem, vmem_seg_t *seg, vmem_addr_t newbase,
 int
 vmem_xfree(vmem_t *vmem, vmem_addr_t addr, vmem_size_t size)
 {
-	vmem_seglist_t *bucket = hashbucket_for_addr(vmem, addr);
+	vmem_seglist_t *bucket;
 	vmem_seg_t	   *seg, *left, *right;
-	bool		coalesced_left = false, coalesced = false;
+	vmem_addr_t	spanbase = 0;
+	vmem_size_t	spansize = 0;
+
+	mutex_lock(&vmem->lock);
+	/* hash_grow() may move segs between buckets while it isn't held */
+	bucket = hashbucket_for_addr(vmem, addr);
 
 	LIST_FOREACH (seg, bucket, seglist) {
 		if (seg->base == addr)
 			goto free;
 	}
 
+	mutex_unlock(&vmem->lock);
 	fatal("vmem_xfree: segment at address 0x%lx\n", addr);
 	return -ENOENT;
 
@@ -511,69 +900,128 @@ free:
 
 	/* remove from hashtable */
 	LIST_REMOVE(seg, seglist);
+	vmem->nalloced--;
+	seg->type = kVMemSegFree;
 
 	/* coalesce to the left */
 	left = prev_seg(seg);
 	if (left->type == kVMemSegFree) {
-		freeseg_expand(vmem, left, left->base, left->size + seg->size);
 		TAILQ_REMOVE(&vmem->segqueue, seg, segqueue);
+		freeseg_expand(vmem, left, left->base, left->size + seg->size);
 		seg_free(vmem, seg);
 		seg = left;
-		left = prev_seg(seg);
-		coalesced_left = coalesced = true;
+	} else {
+		freelist_insert(vmem, seg);
 	}
 
 	/* coalesce to the right */
 	right = next_seg(seg);
 	if (right && right->type == kVMemSegFree) {
-		freeseg_expand(vmem, right, seg->base, right->size + seg->size);
-		TAILQ_REMOVE(&vmem->segqueue, seg, segqueue);
-		if (coalesced_left)
-			/* remaining on a freelist */
-			LIST_REMOVE(seg, seglist);
-		seg_free(vmem, seg);
-		seg = right;
-		right = next_seg(seg);
-		coalesced = true;
+		LIST_REMOVE(right, seglist);
+		TAILQ_REMOVE(&vmem->segqueue, right, segqueue);
+		freeseg_expand(vmem, seg, seg->base, seg->size + right->size);
+		seg_free(vmem, right);
 	}
 
+	left = prev_seg(seg);
 	if (left->type == kVMemSegSpanImported && seg->size == left->size) {
-		assert(!right || right->type == kVMemSegSpanImported);
 		kprintf("Entire ispan 0x%lx-0x%lx is free\n", left->base,
 		    left->base + left->size);
-		vmem->freefn(vmem->source, left->base, left->size);
+		/* released to the source once we've unlocked */
+		spanbase = left->base;
+		spansize = left->size;
 
-		/* XXX seg not set free yet if it wasn't coalesced */
-#if 0
-		if(seg->type != kVMemSegFree) {
-			fatal("unexpected seg type %d\n", seg->type);
-		}
-#endif
-		if (coalesced)
-			LIST_REMOVE(seg, seglist);
+		LIST_REMOVE(seg, seglist);
 		TAILQ_REMOVE(&vmem->segqueue, seg, segqueue);
 		seg_free(vmem, seg);
 
 		LIST_REMOVE(left, seglist);
 		TAILQ_REMOVE(&vmem->segqueue, left, segqueue);
 		seg_free(vmem, left);
+	}
+
+	mutex_unlock(&vmem->lock);
 
-		coalesced = true;
+	if (spansize != 0)
+		vmem->freefn(vmem->source, spanbase, spansize);
+
+	return size;
+}
+
+int
+vmem_alloc(vmem_t *vmem, vmem_size_t size, vmem_flag_t flags,
+    vmem_addr_t *out)
+{
+#ifdef _KERNEL
+	if (size <= vmem->nqcaches * vmem->quantum &&
+	    !(flags & kVMemBootstrap)) {
+		/* NB: the caches may sleep to import regardless of flags */
+		void *addr = kmem_zonealloc(
+		    vmem->qcache[(size - 1) / vmem->quantum]);
+		if (addr == NULL)
+			return -ERESOURCEEXHAUSTED;
+		*out = (vmem_addr_t)addr;
+		return 0;
 	}
+#endif
 
-	if (!coalesced) {
-		TAILQ_REMOVE(&vmem->segqueue, seg, segqueue);
-		seg_free(vmem, seg);
+	return vmem_xalloc(vmem, size, 0, 0, 0, 0, 0, flags, out);
+}
+
+#ifdef KASAN
+/**
+ * Whether \p addr is the base of an allocated segment of \p size (rounded up
+ * to the quantum), i.e. memory which came straight from vmem_xalloc() rather
+ * than from a quantum cache; a quantum cache's slabs are segments of 16 of its
+ * objects, so never match.
+ */
+static bool
+is_xalloced(vmem_t *vmem, vmem_addr_t addr, vmem_size_t size)
+{
+	vmem_seg_t *seg;
+	bool	    r = false;
+
+	size = (size + vmem->quantum - 1) / vmem->quantum * vmem->quantum;
+
+	mutex_lock(&vmem->lock);
+	LIST_FOREACH (seg, hashbucket_for_addr(vmem, addr), seglist) {
+		if (seg->base == addr) {
+			r = seg->size == size;
+			break;
+		}
 	}
+	mutex_unlock(&vmem->lock);
 
-	return size;
+	return r;
+}
+#endif
+
+void
+vmem_free(vmem_t *vmem, vmem_addr_t addr, vmem_size_t size)
+{
+#ifdef _KERNEL
+	if (size <= vmem->nqcaches * vmem->quantum) {
+#ifdef KASAN
+		/* this would otherwise corrupt the quantum cache silently */
+		if (is_xalloced(vmem, addr, size))
+			fatal("vmem_free: 0x%lx in arena %s is from vmem_xalloc "
+			      "(or a bootstrap vmem_alloc); use vmem_xfree\n",
+			    addr, vmem->name);
+#endif
+		kmem_zonefree(vmem->qcache[(size - 1) / vmem->quantum],
+		    (void *)addr);
+		return;
+	}
+#endif
+
+	vmem_xfree(vmem, addr, size);
 }
 
 void
 vmem_earlyinit()
 {
-	for (int i = 0; i < elementsof(static_segs); i++)
-		seg_free(NULL, &static_segs[i]);
+	/* get the first page of segment tags in while things are simple */
+	seg_slab_add();
 }
 
 void
@@ -581,11 +1029,19 @@ vmem_destroy(vmem_t *vmem)
 {
 	vmem_seg_t *seg;
 
-	for (int i = 0; i < kNHashBuckets; i++)
-		assert(LIST_EMPTY(&vmem->hashtab[i]));
+	assert(vmem->nalloced == 0);
 
-	TAILQ_FOREACH (seg, &vmem->segqueue, segqueue)
+	while ((seg = TAILQ_FIRST(&vmem->segqueue)) != NULL) {
+		TAILQ_REMOVE(&vmem->segqueue, seg, segqueue);
 		seg_free(vmem, seg);
+	}
+
+	if (vmem->hashdir != NULL) {
+		for (size_t i = 0; i < vmem->nhashbuckets / kVMemHashPageBuckets;
+		     i++)
+			vmem_page_free(vmem->hashdir[i]);
+		vmem_page_free(vmem->hashdir);
+	}
 }
 
 void
@@ -593,58 +1049,238 @@ vmem_dump(const vmem_t *vmem)
 {
 	vmem_seg_t *span;
 
+	mutex_lock((mutex_t *)&vmem->lock);
 	kprintf("VMem arena <%s> segment queue:\n", vmem->name);
 	TAILQ_FOREACH (span, &vmem->segqueue, segqueue) {
 		kprintf("[%s:0x%lx-0x%lx]\n", vmem_seg_type_str[span->type],
 		    span->base, span->base + span->size);
 	}
+	mutex_unlock((mutex_t *)&vmem->lock);
 }
 
 #ifndef _KERNEL
-int
-main()
+enum {
+	kBenchQuantum = 4096,
+	kBenchSlots = 4096,
+	kBenchOps = 1000000,
+	kCheckOps = 20000,
+};
+
+static const struct {
+	const char *name;
+	vmem_flag_t flags;
+} strategies[] = {
+	{ "instantfit", kVMemInstantFit },
+	{ "bestfit", kVMemBestFit },
+	{ "nextfit", kVMemNextFit },
+};
+
+static uint64_t bench_rng = 88172645463325252ull;
+
+static uint64_t
+bench_rand(void)
 {
-	vmem_t     *vmem = malloc(sizeof *vmem);
-	vmem_seg_t *span;
-	vmem_addr_t addr = -1ul;
+	bench_rng ^= bench_rng << 13;
+	bench_rng ^= bench_rng >> 7;
+	bench_rng ^= bench_rng << 17;
+	return bench_rng;
+}
 
-	vmem_earlyinit();
+static uint64_t
+bench_nanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-	vmem_init(vmem, "hello", 0x0, 0x1000000, 0x1000, NULL, NULL, NULL, 0, 0,
-	    0);
-	vmem_xalloc(vmem, 0x2000, 0, 0, 0, 0x2000, 0, kVMemExact, &addr);
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
 
-#if 0
-	vmem_add(vmem, 0x1000, 0x1000, 0);
-	vmem_add(vmem, 0x3000, 0x5000, 0);
-	vmem_add(vmem, 0x0, 0x1000, 0);
-	vmem_add(vmem, 0x2000, 0x1000, 0);
-	vmem_add(vmem, 0x10000, 0x5000, 0);
-#endif
+/** mostly small, occasionally large, like kernel VA requests */
+static vmem_size_t
+bench_size(void)
+{
+	unsigned r = bench_rand() % 100;
+
+	if (r < 60)
+		return (1 + bench_rand() % 4) * kBenchQuantum;
+	else if (r < 90)
+		return (5 + bench_rand() % 28) * kBenchQuantum;
+	else
+		return (33 + bench_rand() % 224) * kBenchQuantum;
+}
 
-	kprintf("spans:\n");
-	LIST_FOREACH (span, &vmem->spanlist, seglist) {
-		kprintf("[%p-%p]\n", span->base, span->base + span->size);
-	}
-	kprintf("\nsegs\n");
-	TAILQ_FOREACH (span, &vmem->segqueue, segqueue) {
-		kprintf("[%s:%p-%p]\n", vmem_seg_type_str[span->type],
-		    span->base, span->base + span->size);
+static size_t
+count_segs(vmem_t *vmem, int type)
+{
+	vmem_seg_t *seg;
+	size_t	    n = 0;
+
+	TAILQ_FOREACH (seg, &vmem->segqueue, segqueue)
+		if (seg->type == type)
+			n++;
+
+	return n;
+}
+
+/**
+ * Make randomly constrained allocations with each strategy, check that they
+ * honour the constraints, then free them and check all was coalesced again.
+ */
+static void
+constraint_check(void)
+{
+	static struct {
+		vmem_addr_t addr;
+		vmem_size_t size;
+	} allocs[kCheckOps + 1];
+
+	for (size_t s = 0; s < elementsof(strategies); s++) {
+		vmem_t vmem;
+		size_t n = 0;
+
+		vmem_init(&vmem, "check", 0x10000000, 1ul << 32, kBenchQuantum,
+		    NULL, NULL, NULL, 0, 0, 0);
+
+		for (size_t i = 0; i < kCheckOps; i++) {
+			vmem_size_t size = bench_size();
+			vmem_size_t align = 0, phase = 0, nocross = 0;
+			vmem_addr_t min = 0, max = 0, addr;
+
+			if (bench_rand() % 2) {
+				align = kBenchQuantum << (bench_rand() % 7);
+				phase = bench_rand() % (align / kBenchQuantum) *
+				    kBenchQuantum;
+			}
+			if (bench_rand() % 4 == 0 && size + phase <= 0x200000)
+				nocross = 0x200000;
+			if (bench_rand() % 4 == 0) {
+				min = 0x40000000;
+				max = 0x80000000;
+			}
+
+			if (vmem_xalloc(&vmem, size, align, phase, nocross, min,
+				max, strategies[s].flags, &addr) < 0)
+				continue;
+
+			if ((align && (addr - phase) % align != 0) ||
+			    (nocross &&
+				(addr / nocross !=
+				    (addr + size - 1) / nocross)) ||
+			    (min && addr < min) || (max && addr + size > max)) {
+				fatal("%s: 0x%lx+0x%lx breaks constraints "
+				      "(align 0x%lx phase 0x%lx nocross 0x%lx "
+				      "min 0x%lx max 0x%lx)\n",
+				    strategies[s].name, addr, size, align,
+				    phase, nocross, min, max);
+			}
+
+			allocs[n].addr = addr;
+			allocs[n++].size = size;
+		}
+
+		if (vmem_xalloc(&vmem, kBenchQuantum, 0, 0, 0, 0x7fff0000, 0,
+			strategies[s].flags | kVMemExact, &allocs[n].addr) == 0) {
+			if (allocs[n].addr != 0x7fff0000)
+				fatal("%s: exact allocation misplaced\n",
+				    strategies[s].name);
+			allocs[n++].size = kBenchQuantum;
+		}
+
+		for (size_t i = 0; i < n; i++)
+			vmem_xfree(&vmem, allocs[i].addr, allocs[i].size);
+
+		if (count_segs(&vmem, kVMemSegFree) != 1 ||
+		    count_segs(&vmem, kVMemSegAllocated) != 0)
+			fatal("%s: arena not coalesced after freeing\n",
+			    strategies[s].name);
+
+		kprintf("%-12s%zu constrained allocations ok\n",
+		    strategies[s].name, n);
+		vmem_destroy(&vmem);
 	}
+}
 
-	vmem_xalloc(vmem, 0x2000, 0, 0, 0, 0, 0, 0, &addr);
+/**
+ * Keep kBenchSlots allocations of varying size live, repeatedly replacing a
+ * random one, and measure the latency of each allocation and how far the
+ * arena had to be spread to hold the live set.
+ */
+static void
+frag_run(size_t s)
+{
+	static struct {
+		vmem_addr_t addr;
+		vmem_size_t size;
+	} slots[kBenchSlots];
+	static uint32_t lat[kBenchOps];
+	vmem_t		vmem;
+	vmem_seg_t     *seg;
+	vmem_addr_t	extent = 0;
+	vmem_size_t	live = 0;
+	uint64_t	total = 0, freetotal = 0, t;
+
+	vmem_init(&vmem, "bench", 0x10000000, 1ul << 36, kBenchQuantum, NULL,
+	    NULL, NULL, 0, 0, 0);
+
+	for (size_t i = 0; i < kBenchSlots; i++) {
+		slots[i].size = bench_size();
+		vmem_xalloc(&vmem, slots[i].size, 0, 0, 0, 0, 0,
+		    strategies[s].flags, &slots[i].addr);
+		live += slots[i].size;
+	}
 
-#if 0
-	kprintf("\nsegs\n");
-	TAILQ_FOREACH (span, &vmem->segqueue, segqueue) {
-		kprintf("[%s:%p-%p]\n", vmem_seg_type_str[span->type],
-		    span->base, span->base + span->size);
+	for (size_t i = 0; i < kBenchOps; i++) {
+		size_t slot = bench_rand() % kBenchSlots;
+
+		t = bench_nanos();
+		vmem_xfree(&vmem, slots[slot].addr, slots[slot].size);
+		freetotal += bench_nanos() - t;
+		live -= slots[slot].size;
+
+		slots[slot].size = bench_size();
+		t = bench_nanos();
+		if (vmem_xalloc(&vmem, slots[slot].size, 0, 0, 0, 0, 0,
+			strategies[s].flags, &slots[slot].addr) < 0)
+			fatal("%s: arena exhausted\n", strategies[s].name);
+		lat[i] = bench_nanos() - t;
+		total += lat[i];
+		live += slots[slot].size;
 	}
 
-	kprintf("FREEING\n");
-	vmem_xfree(vmem, addr, 0x2000);
-#endif
+	TAILQ_FOREACH (seg, &vmem.segqueue, segqueue)
+		if (seg->type == kVMemSegAllocated)
+			extent = seg->base + seg->size - vmem.base;
+
+	qsort(lat, kBenchOps, sizeof(*lat), bench_cmp);
+	kprintf("%-12s%-10lu%-10u%-10u%-10lu%-12.2f%-10zu\n",
+	    strategies[s].name, total / kBenchOps, lat[kBenchOps / 100 * 99],
+	    lat[kBenchOps - 1], freetotal / kBenchOps,
+	    (double)extent / live, count_segs(&vmem, kVMemSegFree));
+
+	for (size_t i = 0; i < kBenchSlots; i++)
+		vmem_xfree(&vmem, slots[i].addr, slots[i].size);
+	vmem_destroy(&vmem);
+}
 
-	kprintf("\nsegs\n");
+int
+main()
+{
+	vmem_earlyinit();
+
+	constraint_check();
+
+	kprintf("\n%-12s%-10s%-10s%-10s%-10s%-12s%-10s\n", "strategy",
+	    "alloc ns", "p99 ns", "max ns", "free ns", "extent/live",
+	    "free segs");
+	for (size_t s = 0; s < elementsof(strategies); s++)
+		frag_run(s);
+
+	return 0;
 }
 #endif
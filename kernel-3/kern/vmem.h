@@ -36,6 +36,13 @@ typedef enum vmem_flag {
 	kVMemExact = 0x2,
 	/** @private */
 	kVMemBootstrap = 0x4,
+
+	/** approximate best-fit in constant time; the default strategy */
+	kVMemInstantFit = 0x0,
+	/** smallest free segment that fits */
+	kVMemBestFit = 0x8,
+	/** first fit after the previous next-fit allocation, e.g. for PIDs */
+	kVMemNextFit = 0x10,
 } vmem_flag_t;
 
 typedef int (*vmem_alloc_t)(vmem_t *vmem, vmem_size_t size, vmem_flag_t flags,
@@ -47,9 +54,44 @@ vmem_t *vmem_init(vmem_t *vmem, const char *name, vmem_addr_t base,
     vmem_size_t size, vmem_size_t quantum, vmem_alloc_t allocfn,
     vmem_free_t freefn, vmem_t *source, size_t qcache_max, vmem_flag_t flags,
     ipl_t ipl);
+/**
+ * Set up the quantum caches of an arena which was created with a nonzero
+ * qcache_max before kmem was available (i.e. with kVMemBootstrap.) Arenas
+ * created otherwise get them from vmem_init().
+ */
+void vmem_qcache_init(vmem_t *vmem);
 /** Destroy a VMem arena. (Does not free it; that must be done manually.) */
 void vmem_destroy(vmem_t *vmem);
 
+/**
+ * Allocate \p size units. Sizes up to the arena's qcache_max are served from
+ * its quantum caches, which only touch the arena lock to refill; others are
+ * passed on to vmem_xalloc().
+ */
+int vmem_alloc(vmem_t *vmem, vmem_size_t size, vmem_flag_t flags,
+    vmem_addr_t *out);
+
+/**
+ * Release an allocation made by vmem_alloc(); \p size must match. Memory from
+ * vmem_xalloc() or a kVMemBootstrap vmem_alloc() must go to vmem_xfree(); a
+ * KASAN kernel checks this of sizes which would go to a quantum cache.
+ */
+void vmem_free(vmem_t *vmem, vmem_addr_t addr, vmem_size_t size);
+
+/**
+ * Allocate \p size units (rounded up to the quantum) subject to constraints,
+ * using the strategy given in \p flags.
+ *
+ * @param align if nonzero, a power-of-2 multiple of the quantum to which the
+ * allocation (less \p phase) must be aligned.
+ * @param phase offset from an \p align boundary at which to allocate.
+ * @param nocross if nonzero, a power of 2 boundary which the allocation must
+ * not cross.
+ * @param min lowest acceptable address; with kVMemExact, the only one.
+ * @param max if nonzero, the allocation must end at or below this address.
+ *
+ * @returns 0 and sets *\p out if successful, otherwise -ERESOURCEEXHAUSTED.
+ */
 int vmem_xalloc(vmem_t *vmem, vmem_size_t size, vmem_size_t align,
     vmem_size_t phase, vmem_size_t nocross, vmem_addr_t min, vmem_addr_t max,
     vmem_flag_t flags, vmem_addr_t *out);
@@ -21,12 +21,28 @@
 
 #include <kern/vmem.h>
 
+#ifdef _KERNEL
+#include <kern/sync.h>
+#else
+#include <pthread.h>
+
+#define mutex_t pthread_mutex_t
+#endif
+
 #include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-enum { kNFreeLists = sizeof(vmem_addr_t) * CHAR_BIT, kNHashBuckets = 16 };
+enum {
+	kNFreeLists = sizeof(vmem_addr_t) * CHAR_BIT,
+	/** buckets in the inline hash table an arena starts with */
+	kNHashBuckets = 16,
+	/** maximum number of quantum caches, i.e. of qcache_max / quantum */
+	kVMemMaxQCaches = 16,
+};
+
+struct kmem_zone;
 
 /**
  * A segment is either a free area, an allocated area, or a span marker (either
@@ -46,7 +62,7 @@ typedef struct vmem_seg {
 
 	TAILQ_ENTRY(vmem_seg) segqueue; /** links vmem_t::segqueue */
 	LIST_ENTRY(vmem_seg)  seglist;	/** links a vmem_t::freelist[n] if free;
-					 * a vmem_t::hashtab bucket if allocated
+					 * a hash bucket if allocated
 					 * otherwise vmem_t::spanlist
 					 */
 } vmem_seg_t;
@@ -66,10 +82,27 @@ typedef struct vmem {
 	vmem_free_t  freefn;  /** release to :: source */
 	vmem_t	    *source;  /** backing arena to allocate from */
 
+	vmem_size_t	   qcache_max; /** largest size to be quantum cached */
+	size_t		   nqcaches;   /** number of quantum caches set up */
+	struct kmem_zone *qcache[kVMemMaxQCaches]; /** quantum caches */
+
+	mutex_t lock; /** protects the below */
+
 	vmem_segqueue_t segqueue;		/** all segments */
 	vmem_seglist_t	freelist[kNFreeLists];	/** power of 2 freelist */
-	vmem_seglist_t	hashtab[kNHashBuckets]; /** allocated segs */
 	vmem_seglist_t	spanlist;		/** span marker segs */
+
+	/*
+	 * Allocated segs are hashed by base address, at first into hash0; once
+	 * they outnumber its buckets, into pages of buckets listed in hashdir,
+	 * whose count doubles as the number of allocated segs does.
+	 */
+	vmem_seglist_t	 hash0[kNHashBuckets]; /** initial hash table */
+	vmem_seglist_t **hashdir;	       /** pages of hash buckets */
+	size_t		 nhashbuckets;	       /** current number of buckets */
+	size_t		 nalloced;	       /** number of allocated segs */
+	bool		 hashgrowing; /** whether a thread is growing the hash */
+	vmem_addr_t	rotor; /** base of the last next-fit allocation */
 } vmem_t;
 
 void vmem_earlyinit();
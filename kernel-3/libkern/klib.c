@@ -10,10 +10,11 @@
 
 #include <kern/sync.h>
 #include <kern/kmem.h>
-#include <kern/liballoc.h>
 
+#include <stdint.h>
 #include <string.h>
 #include <libkern/klib.h>
+#include <libkern/klib_libc.h>
 
 spinlock_t lock_msgbuf = SPINLOCK_INITIALISER;
 
@@ -85,11 +86,26 @@ char *
 strdup(const char *src)
 {
 	size_t size = strlen(src) + 1;
-	char  *str = kmem_alloc(size);
+	char  *str = kmem_genalloc(size);
 	memcpy(str, src, size);
 	return str;
 }
 
+void *
+klib_libc_gencalloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		return NULL;
+
+	ptr = kmem_genalloc(nmemb * size);
+	if (ptr != NULL)
+		memset(ptr, 0x0, nmemb * size);
+
+	return ptr;
+}
+
 char *
 strcpy(char *restrict dst, const char *restrict src)
 {
@@ -18,7 +18,6 @@
 
 #include <kern/kmem.h>
 #include <libkern/klib.h>
-#include <kern/liballoc.h>
 
 #include <string.h>
 
@@ -29,10 +28,10 @@
 
 #define abort() fatal("abort!")
 
-#define malloc liballoc_kmalloc
-#define calloc liballoc_kcalloc
-#define free liballoc_kfree
-#define realloc liballoc_krealloc
+#define malloc kmem_genalloc
+#define calloc klib_libc_gencalloc
+#define free kmem_genfree
+#define realloc kmem_genrealloc
 
 void *klib_libc_gencalloc(size_t nmemb, size_t size);
 
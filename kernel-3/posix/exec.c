@@ -18,11 +18,23 @@
 #include <errno.h>
 #include <string.h>
 
-#include <vm/vm.h>
+#include <kern/kmem.h>
+#include <kern/task.h>
 #include <libkern/klib.h>
+#include <posix/sys.h>
+#include <posix/vfs.h>
+#include <vm/vm.h>
 
 #define ELFMAG "\177ELF"
 
+enum {
+	kExecStackSize = 1024 * 1024,
+	/*! maximum length of a path to exec, with its terminator */
+	kExecPathMax = 1024,
+	/*! maximum bytes of arguments and environment, with their pointers */
+	kExecArgMax = 64 * 1024,
+};
+
 typedef struct exec_package {
 	vm_map_t *map;	     /* map to load into */
 	vaddr_t	  stack;     /* bottom of stack */
@@ -33,91 +45,394 @@ typedef struct exec_package {
 	size_t	  phnum;     /* count of phdrs */
 } exec_package_t;
 
+/*!
+ * Layout of a PT_LOAD segment, precomputed from its program header.
+ */
+typedef struct exec_seg {
+	vaddr_t vaddr;	  /* page-aligned address, relative to load base */
+	voff_t	fileoff;  /* page-aligned offset of segment in the file */
+	size_t	pageoff;  /* offset of p_vaddr within the first page */
+	size_t	filesize; /* bytes of file-backed pages */
+	size_t	memsize;  /* bytes of pages in total */
+	size_t	fileend;  /* offset from vaddr of the end of file data */
+	bool	zerotail; /* whether to zero the last file page past fileend */
+	vm_prot_t prot;	  /* protection, from p_flags */
+} exec_seg_t;
+
+/*!
+ * A cached executable image: the parsed headers and segment layout of an ELF
+ * file. The file's VM object is retained, so its pages stay resident and are
+ * shared by each process subsequently exec'ing it.
+ *
+ * Images are keyed by vnode. A file may be written through vfs_write(), its VM
+ * object, or a shared mapping of that; each write bumps the vnode's wrgen, so
+ * an image whose wrgen differs is stale and is dropped on lookup.
+ */
+typedef struct exec_image {
+	TAILQ_ENTRY(exec_image) lru;
+	LIST_ENTRY(exec_image)	hashlink;
+	size_t			refcnt;	   /* protected by exec_image_lock */
+	bool			cached;	   /* whether in hash and LRU queue */
+	vnode_t		     *vn;
+	vm_object_t	    *vmobj;
+	size_t			wrgen;	   /* vn->wrgen when parsed */
+	uintptr_t		entry;	   /* entry IP, relative to load base */
+	uintptr_t		phaddr;	   /* PT_PHDR address, or 0 */
+	size_t			phentsize; /* size of a phdr */
+	size_t			phnum;	   /* count of phdrs */
+	size_t			nsegs;
+	exec_seg_t		segs[0];
+} exec_image_t;
+
+enum {
+	kExecImageNBuckets = 32,
+	/*! maximum number of images to keep cached */
+	kExecImageMax = 64,
+};
+
+static mutex_t exec_image_lock = MUTEX_INITIALISER(exec_image_lock);
+static LIST_HEAD(, exec_image) exec_image_hash[kExecImageNBuckets];
+static TAILQ_HEAD(exec_image_lruq, exec_image) exec_image_lru = TAILQ_HEAD_INITIALIZER(
+    exec_image_lru);
+static size_t exec_image_count = 0;
+
+static inline size_t
+image_bucket(vnode_t *vn)
+{
+	return ((uintptr_t)vn >> 6) % kExecImageNBuckets;
+}
+
+static void
+image_release(exec_image_t *img) LOCK_REQUIRES(exec_image_lock)
+{
+	if (--img->refcnt > 0)
+		return;
+
+	if (img->vmobj)
+		vm_object_release(img->vmobj);
+	img->vn->refcnt--;
+	kmem_free(img, sizeof(*img) + sizeof(exec_seg_t) * img->nsegs);
+}
+
+/*! Remove an image from the cache, dropping the cache's reference. */
+static void
+image_uncache(exec_image_t *img) LOCK_REQUIRES(exec_image_lock)
+{
+	if (!img->cached)
+		return;
+
+	LIST_REMOVE(img, hashlink);
+	TAILQ_REMOVE(&exec_image_lru, img, lru);
+	img->cached = false;
+	exec_image_count--;
+	image_release(img);
+}
+
+/*!
+ * Parse the ELF headers of \p vn into a new image (with a refcnt of 1).
+ */
 static int
-loadelf(const char *path, vaddr_t base, exec_package_t *pkg)
+image_parse(vnode_t *vn, const char *path, exec_image_t **out)
 {
-	vnode_t	*vn;
-	Elf64_Ehdr  ehdr;
-	Elf64_Phdr *phdrs;
-	int	    r;
+	Elf64_Ehdr    ehdr;
+	Elf64_Phdr   *phdrs;
+	size_t	      phsize, nsegs = 0, wrgen;
+	exec_image_t *img;
+	int	      r;
 
-	r = vfs_lookup(root_vnode, &vn, path, 0, NULL);
-	if (r < 0) {
-		kprintf("exec: failed to lookup %s (errno %d)\n", path, -r);
-		return r;
-	}
+	/* sampled first, so that a write racing with the parse is noticed */
+	wrgen = vn->wrgen;
 
 	r = vfs_read(vn, &ehdr, sizeof ehdr, 0);
 	if (r < 0) {
 		kprintf("exec: failed to read %s (errno %d)\n", path, -r);
 		return r;
-	}
+	} else if (r != sizeof ehdr)
+		return -ENOEXEC;
 
 	if (memcmp(ehdr.e_ident, ELFMAG, 4) != 0) {
 		kprintf("exec: bad e_ident in %s\n", path);
 		return -ENOEXEC;
 	}
 
-	phdrs = kmalloc(ehdr.e_phnum * ehdr.e_phentsize);
+	if (ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ehdr.e_ident[EI_DATA] != ELFDATA2LSB ||
+	    ehdr.e_machine != EM_X86_64 ||
+	    (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN)) {
+		kprintf("exec: %s is not an x86-64 executable\n", path);
+		return -ENOEXEC;
+	}
+
+	if (ehdr.e_phentsize != sizeof(Elf64_Phdr))
+		return -ENOEXEC;
+
+	phsize = ehdr.e_phnum * ehdr.e_phentsize;
+	phdrs = kmem_alloc(phsize);
 	if (!phdrs)
 		return -ENOMEM;
 
-	r = vfs_read(vn, phdrs, ehdr.e_phnum * ehdr.e_phentsize, ehdr.e_phoff);
+	r = vfs_read(vn, phdrs, phsize, ehdr.e_phoff);
 	if (r < 0)
-		return r;
+		goto fail;
+	else if ((size_t)r != phsize) {
+		r = -ENOEXEC;
+		goto fail;
+	}
+
+	for (int i = 0; i < ehdr.e_phnum; i++)
+		if (phdrs[i].p_type == PT_LOAD)
+			nsegs++;
 
-	pkg->entry = base + ehdr.e_entry;
-	pkg->phentsize = ehdr.e_phentsize;
-	pkg->phnum = ehdr.e_phnum;
-	pkg->phaddr = 0x0;
+	img = kmem_alloc(sizeof(*img) + sizeof(exec_seg_t) * nsegs);
+	if (!img) {
+		r = -ENOMEM;
+		goto fail;
+	}
+
+	img->refcnt = 1;
+	img->cached = false;
+	img->vn = vn;
+	img->vmobj = vn->vmobj;
+	img->wrgen = wrgen;
+	img->entry = ehdr.e_entry;
+	img->phaddr = 0x0;
+	img->phentsize = ehdr.e_phentsize;
+	img->phnum = ehdr.e_phnum;
+	img->nsegs = 0;
 
 	for (int i = 0; i < ehdr.e_phnum; i++) {
 		Elf64_Phdr *phdr = &phdrs[i];
-		size_t	    pageoff;
-		size_t	    size;
-		vaddr_t	    segbase;
+		exec_seg_t *seg = &img->segs[img->nsegs];
 
 		if (phdr->p_type == PT_PHDR) {
-			pkg->phaddr = base + phdr->p_vaddr;
+			img->phaddr = phdr->p_vaddr;
 			continue;
 		} else if (phdr->p_type != PT_LOAD)
 			continue;
 
-		segbase = (vaddr_t)PGROUNDDOWN(phdr->p_vaddr);
-		pageoff = phdr->p_vaddr - (uintptr_t)segbase;
-		size = PGROUNDUP(pageoff + phdr->p_memsz);
-		segbase += (uintptr_t)base;
+		seg->vaddr = (vaddr_t)PGROUNDDOWN(phdr->p_vaddr);
+		seg->pageoff = phdr->p_vaddr - (uintptr_t)seg->vaddr;
+		seg->fileoff = PGROUNDDOWN(phdr->p_offset);
+		seg->filesize = PGROUNDUP(seg->pageoff + phdr->p_filesz);
+		seg->memsize = PGROUNDUP(seg->pageoff + phdr->p_memsz);
+		seg->fileend = seg->pageoff + phdr->p_filesz;
+		seg->zerotail = phdr->p_memsz > phdr->p_filesz &&
+		    seg->fileend < seg->filesize;
+		seg->prot = kVMRead;
+		if (phdr->p_flags & PF_W)
+			seg->prot |= kVMWrite;
+		if (phdr->p_flags & PF_X)
+			seg->prot |= kVMExecute;
+
+		if ((phdr->p_offset & (PGSIZE - 1)) != seg->pageoff) {
+			kprintf("exec: misaligned segment %d in %s\n", i, path);
+			kmem_free(img, sizeof(*img) + sizeof(exec_seg_t) * nsegs);
+			r = -ENOEXEC;
+			goto fail;
+		}
+
+		img->nsegs++;
+	}
 
-		assert(vm_allocate(pkg->map, NULL, &segbase, size) == 0);
+	kmem_free(phdrs, phsize);
+	vn->refcnt++;
+	if (img->vmobj)
+		vm_object_retain(img->vmobj);
 
-		r = vfs_read(vn, segbase + pageoff, phdr->p_filesz,
-		    phdr->p_offset);
-		if (r < 0)
-			return r; /* TODO: this won't work anymore */
+	*out = img;
+	return 0;
+
+fail:
+	kmem_free(phdrs, phsize);
+	return r;
+}
+
+/*! Check that \p img's file hasn't been written since it was parsed. */
+static bool
+image_valid(exec_image_t *img)
+{
+	return img->vn->wrgen == img->wrgen;
+}
+
+/*! Find the cached image of \p vn and reference it, or return NULL. */
+static exec_image_t *
+image_find(vnode_t *vn) LOCK_REQUIRES(exec_image_lock)
+{
+	exec_image_t *img;
+
+	LIST_FOREACH (img, &exec_image_hash[image_bucket(vn)], hashlink) {
+		if (img->vn != vn)
+			continue;
+
+		img->refcnt++;
+		TAILQ_REMOVE(&exec_image_lru, img, lru);
+		TAILQ_INSERT_HEAD(&exec_image_lru, img, lru);
+		return img;
+	}
+
+	return NULL;
+}
+
+/*!
+ * Get the image for \p vn, parsing it afresh if it is absent or stale. Caller
+ * holds a reference to the result.
+ */
+static int
+image_lookup(vnode_t *vn, const char *path, exec_image_t **out)
+{
+	exec_image_t *img, *old;
+	int	      r;
+
+	mutex_lock(&exec_image_lock);
+	img = image_find(vn);
+	mutex_unlock(&exec_image_lock);
+
+	if (img != NULL) {
+		if (image_valid(img)) {
+			*out = img;
+			return 0;
+		}
+
+		/* the file changed since it was parsed; drop it */
+		mutex_lock(&exec_image_lock);
+		image_uncache(img);
+		image_release(img);
+		mutex_unlock(&exec_image_lock);
 	}
 
+	r = image_parse(vn, path, &img);
+	if (r < 0)
+		return r;
+
+	mutex_lock(&exec_image_lock);
+	/* another exec may have parsed and cached it meanwhile */
+	old = image_find(vn);
+	if (old != NULL) {
+		image_release(img);
+		mutex_unlock(&exec_image_lock);
+		*out = old;
+		return 0;
+	}
+
+	img->refcnt++; /* the cache's reference */
+	img->cached = true;
+	LIST_INSERT_HEAD(&exec_image_hash[image_bucket(vn)], img, hashlink);
+	TAILQ_INSERT_HEAD(&exec_image_lru, img, lru);
+	if (++exec_image_count > kExecImageMax)
+		image_uncache(TAILQ_LAST(&exec_image_lru, exec_image_lruq));
+	mutex_unlock(&exec_image_lock);
+
+	*out = img;
+
 	return 0;
 }
 
+/*!
+ * Map a PT_LOAD segment into the new map.
+ *
+ * The file-backed part is mapped as a private copy of the vnode's VM object,
+ * so no data is copied at exec time: pages are shared with the page cache
+ * (and every other process mapping the same file) until written, which is
+ * never for text and read-only data. The part of the last file page beyond
+ * p_filesz is zeroed if it belongs to BSS; the rest of BSS is anonymous memory
+ * which is zero-filled on fault. Once loaded, the segment is protected as its
+ * p_flags say.
+ */
+static int
+loadseg(exec_image_t *img, exec_seg_t *seg, vaddr_t base, exec_package_t *pkg)
+{
+	vaddr_t segbase = seg->vaddr + (uintptr_t)base;
+	int	r;
+
+	if (img->vmobj == NULL) {
+		/* no page cache to share; read it in the old-fashioned way */
+		r = vm_allocate(pkg->map, NULL, &segbase, seg->memsize);
+		if (r < 0)
+			return r;
+		r = vfs_read(img->vn, segbase + seg->pageoff,
+		    seg->fileend - seg->pageoff, seg->fileoff + seg->pageoff);
+		if (r < 0)
+			return r;
+		return vm_map_protect(pkg->map, segbase, seg->memsize,
+		    seg->prot);
+	}
+
+	if (seg->filesize > 0) {
+		vaddr_t vaddr = segbase;
+
+		r = vm_map_object(pkg->map, img->vmobj, &vaddr, seg->filesize,
+		    seg->fileoff, true);
+		if (r < 0)
+			return r;
+	}
+
+	if (seg->zerotail)
+		memset(segbase + seg->fileend, 0x0,
+		    seg->filesize - seg->fileend);
+
+	if (seg->memsize > seg->filesize) {
+		vaddr_t bss = segbase + seg->filesize;
+
+		r = vm_allocate(pkg->map, NULL, &bss,
+		    seg->memsize - seg->filesize);
+		if (r < 0)
+			return r;
+	}
+
+	return vm_map_protect(pkg->map, segbase, seg->memsize, seg->prot);
+}
+
 static int
-copyargs(exec_package_t *pkg, const char *argp[], const char *envp[])
+loadelf(vnode_t *vn, const char *path, vaddr_t base, exec_package_t *pkg)
+{
+	exec_image_t *img;
+	int	      r;
+
+	r = image_lookup(vn, path, &img);
+	if (r < 0)
+		return r;
+
+	pkg->entry = base + img->entry;
+	pkg->phentsize = img->phentsize;
+	pkg->phnum = img->phnum;
+	pkg->phaddr = img->phaddr ? base + img->phaddr : 0x0;
+
+	for (size_t i = 0; i < img->nsegs; i++) {
+		r = loadseg(img, &img->segs[i], base, pkg);
+		if (r < 0) {
+			kprintf("exec: failed to load segment %zu of %s "
+				"(errno %d)\n",
+			    i, path, -r);
+			break;
+		}
+	}
+
+	mutex_lock(&exec_image_lock);
+	image_release(img);
+	mutex_unlock(&exec_image_lock);
+
+	return r < 0 ? r : 0;
+}
+
+static int
+copyargs(exec_package_t *pkg, char *argp[], char *envp[])
 {
 	size_t	  narg = 0, nenv = 0;
 	char     *stackp = pkg->stack;
 	uint64_t *stackpu64;
 
-	for (const char **env = envp; *env; env++, nenv++) {
+	for (char **env = envp; *env; env++, nenv++) {
 		stackp -= (strlen(*env) + 1);
 		strcpy(stackp, *env);
 	}
 
-	for (const char **arg = argp; *arg; arg++, narg++) {
+	for (char **arg = argp; *arg; arg++, narg++) {
 		stackp -= (strlen(*arg) + 1);
 		strcpy(stackp, *arg);
 	}
 
 	/* align to 16 bytes */
-	stackpu64 = (size_t *)(stackp - ((uintptr_t)stackp & 0xf));
+	stackpu64 = (uint64_t *)(stackp - ((uintptr_t)stackp & 0xf));
 	/* account for args/env */
 	if ((narg + nenv + 3) % 2)
 		--stackpu64;
@@ -136,14 +451,14 @@ copyargs(exec_package_t *pkg, const char *argp[], const char *envp[])
 	stackpu64 -= nenv;
 	stackp = pkg->stack;
 
-	for (int i = 0; i < nenv; i++) {
+	for (size_t i = 0; i < nenv; i++) {
 		stackp -= strlen(envp[i]) + 1;
 		stackpu64[i] = (uint64_t)stackp;
 	}
 
 	*(--stackpu64) = 0;
 	stackpu64 -= narg;
-	for (int i = 0; i < narg; i++) {
+	for (size_t i = 0; i < narg; i++) {
 		stackp -= strlen(argp[i]) + 1;
 		stackpu64[i] = (uint64_t)stackp;
 	}
@@ -155,24 +470,70 @@ copyargs(exec_package_t *pkg, const char *argp[], const char *envp[])
 	return 0;
 }
 
-static int
-copyout_strv(const char *user_strv[], char ***out)
+static void
+strv_free(char **strv)
 {
-	int    cnt = 0;
-	char **strv;
+	if (strv == NULL)
+		return;
 
-	while (true) {
-		if (user_strv[cnt++] == NULL)
-			break;
-	}
+	for (char **ptr = strv; *ptr != NULL; ptr++)
+		kmem_genfree(*ptr);
+	kmem_genfree(strv);
+}
 
-	strv = kmalloc((sizeof *user_strv) * cnt);
-	memcpy(strv, user_strv, (sizeof *user_strv) * cnt);
+/*!
+ * Copy in the NULL-terminated vector of strings at \p u_strv in \p map, using
+ * \p buf as a bounce buffer. It and its strings may take up no more than
+ * *\p space bytes, which is reduced by what they take up.
+ *
+ * @returns 0, -EFAULT, -E2BIG if there's too much, or -ENOMEM.
+ */
+static int
+copyin_strv(vm_map_t *map, const char *u_strv[], char *buf, size_t *space,
+    char ***out)
+{
+	const char *uptr;
+	char	  **strv;
+	size_t	    cnt = 0;
+	int	    r;
 
-	cnt = 0;
-	while (strv[cnt] != NULL) {
-		strv[cnt] = strdup(strv[cnt]);
+	/* count them first, so that the vector may be allocated at once */
+	do {
+		if (sizeof(char *) * (cnt + 1) > *space)
+			return -E2BIG;
+		r = vm_copyin(map, &uptr, (vaddr_t)&u_strv[cnt], sizeof(uptr));
+		if (r < 0)
+			return r;
 		cnt++;
+	} while (uptr != NULL);
+	*space -= sizeof(char *) * cnt;
+
+	strv = kmem_genalloc(sizeof(char *) * cnt);
+	if (strv == NULL)
+		return -ENOMEM;
+	/* kept terminated, so that strv_free() may free it partly filled */
+	memset(strv, 0x0, sizeof(char *) * cnt);
+
+	for (size_t i = 0; i < cnt - 1; i++) {
+		/* re-read, as another thread may have changed it meanwhile */
+		r = vm_copyin(map, &uptr, (vaddr_t)&u_strv[i], sizeof(uptr));
+		if (r == 0 && uptr == NULL)
+			break;
+		else if (r == 0)
+			r = vm_copyinstr(map, buf, (vaddr_t)uptr, *space);
+		if (r == -ENAMETOOLONG)
+			r = -E2BIG;
+		if (r < 0) {
+			strv_free(strv);
+			return r;
+		}
+		*space -= r + 1;
+
+		strv[i] = strdup(buf);
+		if (strv[i] == NULL) {
+			strv_free(strv);
+			return -ENOMEM;
+		}
 	}
 
 	*out = strv;
@@ -180,62 +541,82 @@ copyout_strv(const char *user_strv[], char ***out)
 	return 0;
 }
 
-static void
-strv_free(char **strv)
-{
-	if (*strv == NULL)
-		return;
-
-	for (char **ptr = strv; *ptr != NULL; ptr++)
-		kfree(*ptr);
-	kfree(strv);
-}
-
 int
-sys_exec(proc_t *proc, const char *u_path, const char *u_argp[],
-    const char *u_envp[], md_intr_frame_t *frame)
+sys_exec(const char *u_path, const char *u_argp[], const char *u_envp[],
+    md_intr_frame_t *frame)
 {
 	int	       r = 0;
 	exec_package_t pkg, rtldpkg;
 	vaddr_t	       stack = VADDR_MAX;
-	thread_t	 *thread = CURTHREAD();
-	char	     *path = NULL, **argp = NULL, **envp = NULL;
-	vm_map_t	 *oldmap = proc->task->map;
+	thread_t	 *thread = curthread();
+	task_t	       *task = thread->task;
+	char	     *path = NULL, **argp = NULL, **envp = NULL, *buf;
+	size_t	       space = kExecArgMax;
+	vm_map_t	 *oldmap = task->map;
+	vnode_t	*vn = NULL, *rtld_vn = NULL;
 
 	/* TODO: end all other threads of the process.... */
 
+	assert(task->map != &kmap);
+
+	/* copied in first, while the old map is still there to copy from */
+	buf = kmem_genalloc(kExecArgMax);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	r = vm_copyinstr(oldmap, buf, (vaddr_t)u_path, kExecPathMax);
+	if (r >= 0) {
+		path = strdup(buf);
+		r = path == NULL ? -ENOMEM : 0;
+	}
+	if (r == 0)
+		r = copyin_strv(oldmap, u_argp, buf, &space, &argp);
+	if (r == 0)
+		r = copyin_strv(oldmap, u_envp, buf, &space, &envp);
+	kmem_genfree(buf);
+	if (r < 0)
+		goto out;
+
 #if DEBUG_SYSCALLS == 1
-	kprintf("SYS_EXEC(%s)\n", u_path);
+	kprintf("SYS_EXEC(%s)\n", path);
 #endif
 
-	assert(proc->task->map != &kmap);
 	pkg.map = rtldpkg.map = vm_map_new();
 	assert(pkg.map != NULL);
 
-	path = strdup(u_path);
-	assert(copyout_strv(u_argp, &argp) == 0);
-	assert(copyout_strv(u_envp, &envp) == 0);
-
-	proc->task->map = pkg.map;
+	task->map = pkg.map;
 	vm_activate(pkg.map);
 
+	r = vfs_lookup(root_vnode, &vn, path, 0, NULL);
+	if (r < 0) {
+		kprintf("exec: failed to lookup %s (errno %d)\n", path, -r);
+		goto fail;
+	}
+
 	/* assume it's not PIE */
-	r = loadelf(path, (vaddr_t)0x0, &pkg);
+	r = loadelf(vn, path, (vaddr_t)0x0, &pkg);
 	if (r < 0)
 		goto fail;
 
-	r = loadelf("/usr/lib/ld.so", (vaddr_t)0x40000000, &rtldpkg);
+	/* looked up each time, as it may have been replaced */
+	r = vfs_lookup(root_vnode, &rtld_vn, "/usr/lib/ld.so", 0, NULL);
+	if (r < 0) {
+		kprintf("exec: failed to lookup ld.so (errno %d)\n", -r);
+		goto fail;
+	}
+
+	r = loadelf(rtld_vn, "/usr/lib/ld.so", (vaddr_t)0x40000000, &rtldpkg);
 	if (r < 0)
 		goto fail;
 
 	pkg.stack = VADDR_MAX;
-	assert(vm_allocate(pkg.map, NULL, &stack, USER_STACK_SIZE) == 0);
-	stack += USER_STACK_SIZE;
+	assert(vm_allocate(pkg.map, NULL, &stack, kExecStackSize) == 0);
+	stack += kExecStackSize;
 	pkg.stack = stack;
 	assert(copyargs(&pkg, argp, envp) == 0);
 
 	vm_map_release(oldmap);
-	thread->stack = stack;
+	thread->ustack = stack;
 
 	frame->rip = (uint64_t)rtldpkg.entry;
 	frame->rsp = (uint64_t)pkg.sp;
@@ -245,10 +626,17 @@ sys_exec(proc_t *proc, const char *u_path, const char *u_argp[],
 
 fail:
 	vm_activate(oldmap);
-	proc->task->map = oldmap;
+	task->map = oldmap;
+	vm_map_release(pkg.map);
 
 succ:
-	kfree(path);
+	/* the images hold their own references to the vnodes */
+	if (vn != NULL)
+		vn->refcnt--;
+	if (rtld_vn != NULL)
+		rtld_vn->refcnt--;
+out:
+	kmem_genfree(path);
 	strv_free(argp);
 	strv_free(envp);
 
@@ -71,6 +71,7 @@ unpack_ramdisk(void)
 		fatal("No initrd module.\n");
 	}
 
+	tmpfs_init();
 	root_vfs.ops = &tmpfs_vfsops;
 
 	r = root_vfs.ops->mount(&root_vfs, NULL, NULL);
@@ -129,7 +130,7 @@ unpack_ramdisk(void)
 				kprintf("failed to make file: %d\n", -r);
 			}
 
-			r = vn->ops->write(vn, initbin + i + 512, fsize, 0);
+			r = vfs_write(vn, initbin + i + 512, fsize, 0);
 			break;
 		}
 
@@ -0,0 +1,43 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+#include <kern/task.h>
+#include <libkern/klib.h>
+#include <posix/sys.h>
+
+#include <errno.h>
+
+void
+posix_syscall(md_intr_frame_t *frame, void *arg)
+{
+	int r;
+
+	(void)arg;
+
+	/* system calls may sleep */
+	md_intr_x(true);
+
+	switch (frame->rax) {
+	case kPXSysExec:
+		r = sys_exec((const char *)frame->rdi,
+		    (const char **)frame->rsi, (const char **)frame->rdx,
+		    frame);
+		/* on success, the frame returns into the new image */
+		if (r == 0)
+			return;
+		break;
+
+	default:
+		kprintf("posix_syscall: unknown syscall %lu\n", frame->rax);
+		r = -ENOSYS;
+	}
+
+	frame->rax = (int64_t)r;
+}
@@ -0,0 +1,41 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+/*
+ * Copyright 2022 NetaScale Systems Ltd.
+ * All rights reserved.
+ */
+
+/*!
+ * @file sys.h
+ * @brief POSIX system calls.
+ *
+ * User code makes a system call with INT 0x80, passing its number in %rax and
+ * its arguments in %rdi, %rsi, %rdx, %r10, %r8 and %r9. The result, or -errno,
+ * is returned in %rax.
+ */
+
+#ifndef POSIX_SYS_H_
+#define POSIX_SYS_H_
+
+#include <machine/intr.h>
+
+/*! System call numbers. */
+enum posix_syscall {
+	kPXSysExec = 1,
+};
+
+/*!
+ * Replace the current task's image with that of the ELF executable at \p
+ * u_path, with arguments \p u_argp and environment \p u_envp. On success,
+ * \p frame is altered to return into the new image.
+ */
+int sys_exec(const char *u_path, const char *u_argp[], const char *u_envp[],
+    md_intr_frame_t *frame);
+
+/*! System call handler. */
+void posix_syscall(md_intr_frame_t *frame, void *arg);
+
+#endif /* POSIX_SYS_H_ */
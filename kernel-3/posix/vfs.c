@@ -8,6 +8,8 @@
  * All rights reserved.
  */
 
+#include <sys/param.h>
+
 #include <string.h>
 
 #include "vfs.h"
@@ -121,3 +123,65 @@ out:
 	*out = vn;
 	return 0;
 }
+
+/*! Whether a vnode's contents are cached in a vnode object. */
+static bool
+has_vnobj(vnode_t *vn)
+{
+	return vn->type == VREG && vn->vmobj != NULL &&
+	    vn->vmobj->type == kVMObjVNode;
+}
+
+int
+vfs_read(vnode_t *vn, void *buf, size_t nbyte, off_t off)
+{
+	if (has_vnobj(vn)) {
+		/* read through the page cache; its pages are paged in by read */
+		size_t size = vn->vmobj->size;
+
+		if ((size_t)off >= size)
+			return 0;
+		return vm_object_read(vn->vmobj, buf, MIN(nbyte, size - off),
+		    off);
+	}
+
+	return vn->ops->read(vn, buf, nbyte, off);
+}
+
+int
+vfs_write(vnode_t *vn, void *buf, size_t nbyte, off_t off)
+{
+	int r;
+
+	if (has_vnobj(vn)) {
+		/*
+		 * Writes made through mappings reach the file first, so that
+		 * writing back cached pages can't later overwrite this write.
+		 */
+		r = vm_object_flush(vn->vmobj);
+		if (r < 0)
+			return r;
+	}
+
+	r = vn->ops->write(vn, buf, nbyte, off);
+	if (r <= 0)
+		return r;
+
+	vn->wrgen++;
+	if (has_vnobj(vn)) {
+		mutex_lock(&vn->vmobj->lock);
+		vn->vmobj->size = MAX(vn->vmobj->size, off + r);
+		mutex_unlock(&vn->vmobj->lock);
+
+		/*
+		 * The cached copies of the pages written are now stale. One
+		 * busy with I/O can't be dropped, but the write has been made,
+		 * so that is no reason to fail it.
+		 */
+		for (voff_t pg = PGROUNDDOWN(off); pg < (voff_t)off + r;
+		     pg += PGSIZE)
+			vm_object_evict(vn->vmobj, pg);
+	}
+
+	return r;
+}
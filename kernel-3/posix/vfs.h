@@ -46,6 +46,7 @@ typedef struct vnode {
 	bool	     isroot;
 	vtype_t	     type;
 	vm_object_t *vmobj; /* page cache */
+	atomic_size_t wrgen; /* bumped by each write, however made */
 	void  *data;	/* fs-private data */
 	vfs_t *vfsp;	/* vfs to which this vnode belongs */
         vfs_t *vfsmountedhere; /* if a mount point, vfs mounted over it */
@@ -19,11 +19,24 @@
 
 static int tmpfs_vget(vfs_t *vfs, vnode_t **vout, ino_t ino);
 
+kmem_zone_t tmpfs_node_zone, tmpfs_dirent_zone;
+
+void
+tmpfs_init(void)
+{
+	kmem_cache_init(&tmpfs_node_zone, "tmpfs_node", sizeof(tmpnode_t), 0,
+	    NULL, NULL, 0);
+	kmem_cache_init(&tmpfs_dirent_zone, "tmpfs_dirent", sizeof(tmpdirent_t),
+	    0, NULL, NULL, 0);
+}
+
 static int
 tmpfs_mount(vfs_t *vfs, const char *path, void *data)
 {
-	tmpnode_t *root = kmem_alloc(sizeof(*root));
-	vnode_t	*vroot;
+	tmpnode_t *root;
+	vnode_t	  *vroot;
+
+	root = kmem_zonealloc(&tmpfs_node_zone);
 
 	root->attr.type = VDIR;
 	root->vn = NULL;
@@ -61,6 +74,7 @@ tmpfs_vget(vfs_t *vfs, vnode_t **vout, ino_t ino)
 		vn->vfsp = vfs;
 		vn->vfsmountedhere = NULL;
 		vn->isroot = false;
+		vn->wrgen = 0;
 		if (node->attr.type == VREG) {
 			vn->vmobj = node->reg.vmobj;
 		} else if (node->attr.type == VCHR) {
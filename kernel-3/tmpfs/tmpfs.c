@@ -44,8 +44,8 @@ tlookup(tmpnode_t *node, const char *filename)
 static tmpnode_t *
 tmakenode(tmpnode_t *dn, const char *name, vattr_t *attr)
 {
-	tmpnode_t   *n = kmem_alloc(sizeof(*n));
-	tmpdirent_t *td = kmem_alloc(sizeof(*td));
+	tmpnode_t   *n = kmem_zonealloc(&tmpfs_node_zone);
+	tmpdirent_t *td = kmem_zonealloc(&tmpfs_dirent_zone);
 
 	td->name = strdup(name);
 	td->node = n;
@@ -134,7 +134,6 @@ tmp_getattr(vnode_t *vn, vattr_t *out)
 int
 tmp_read(vnode_t *vn, void *buf, size_t nbyte, off_t off)
 {
-	vaddr_t	   vaddr = VADDR_MAX;
 	tmpnode_t *tn = VNTOTN(vn);
 
 	if (tn->attr.type != VREG)
@@ -145,32 +144,26 @@ tmp_read(vnode_t *vn, void *buf, size_t nbyte, off_t off)
 	if (nbyte == 0)
 		return 0;
 
-	assert(vm_map_object(&kmap, vn->vmobj, &vaddr, PGROUNDUP(nbyte + off),
-		   0, false) == 0);
-	memcpy(buf, vaddr + off, nbyte);
-	vm_deallocate(&kmap, vaddr, PGROUNDUP(nbyte + off));
-
-	return nbyte; /* FIXME */
+	return vm_object_read(vn->vmobj, buf, nbyte, off);
 }
 
 int
 tmp_write(vnode_t *vn, void *buf, size_t nbyte, off_t off)
 {
-	vaddr_t	   vaddr = VADDR_MAX;
 	tmpnode_t *tn = VNTOTN(vn);
+	int	   r;
 
 	if (nbyte == 0)
 		return 0;
 
-	if (off + nbyte > tn->attr.size)
-		tn->attr.size = off + nbyte;
+	r = vm_object_write(vn->vmobj, buf, nbyte, off);
+	if (r < 0)
+		return r;
 
-	assert(vm_map_object(&kmap, vn->vmobj, &vaddr, PGROUNDUP(nbyte + off),
-		   0, false) == 0);
-	memcpy(vaddr + off, buf, nbyte);
-	vm_deallocate(&kmap, vaddr, PGROUNDUP(nbyte + off));
+	if (off + r > tn->attr.size)
+		tn->attr.size = off + r;
 
-	return nbyte;
+	return r;
 }
 
 #define DIRENT_RECLEN(NAMELEN) \
@@ -11,6 +11,7 @@
 #ifndef TMPFS_H_
 #define TMPFS_H_
 
+#include <kern/kmem.h>
 #include <posix/vfs.h>
 
 typedef struct tmpdirent {
@@ -40,6 +41,12 @@ typedef struct tmpnode {
 	};
 } tmpnode_t;
 
+/*! object caches for nodes and directory entries; set up by tmpfs_init() */
+extern kmem_zone_t tmpfs_node_zone, tmpfs_dirent_zone;
+
+/*! Initialise tmpfs. Must be called once, before any tmpfs is mounted. */
+void tmpfs_init(void);
+
 extern struct vfsops tmpfs_vfsops;
 extern struct vnops tmpfs_vnops;
 extern struct vnops tmpfs_spec_vnops;
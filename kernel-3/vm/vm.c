@@ -8,22 +8,38 @@
  * All rights reserved.
  */
 
+#include <sys/param.h>
+
 #include <kern/kmem.h>
 #include <kern/task.h>
 #include <libkern/klib.h>
 #include <libkern/obj.h>
 #include <machine/intr.h>
+#include <posix/vfs.h>
 #include <vm/vm.h>
 
+#include <errno.h>
 #include <stdatomic.h>
 #include <string.h>
 
+/*! object caches for the hot VM structures */
+static kmem_zone_t vm_anon_zone, vm_object_zone, vm_map_entry_zone;
+
 /*!
  * Return a pointer to the slot of an amap where the anonymous page that maps
  * \p page is found. The slot may of course contain NULL.
  */
 static vm_anon_t **amap_anon_at(vm_amap_t *amap, pgoff_t page);
 
+/*! Allocate a new, empty amap. */
+static vm_amap_t *amap_new(void);
+
+/*!
+ * As vm_object_copy(), but if \p reprotect is false, the caller has already
+ * write-protected all mappings of \p obj's pages itself.
+ */
+static vm_object_t *object_clone(vm_object_t *obj, bool reprotect);
+
 /**
  * Create a new anon for a given offset.
  * @returns LOCKED new anon
@@ -44,12 +60,21 @@ vm_anon_t *anon_copy(vm_anon_t *anon) LOCK_REQUIRES(anon->lock);
 static vm_map_entry_t *map_entry_for_addr(vm_map_t *map, vaddr_t addr)
     LOCK_REQUIRES(map->lock);
 
+/*!
+ * Get the page at offset \p off of vnode object \p obj, paging it in if it is
+ * not resident.
+ * @returns 0 and writes out the LOCKED anon holding it, or -errno.
+ */
+static int vnobj_getpage(vm_object_t *obj, voff_t off, vm_anon_t **out)
+    LOCK_REQUIRES(obj->lock);
+
 /*
- * faults
+ * faults. Pages are mapped with at most \p maxprot, their entry's protection.
  */
 static int
 fault_aobj(vm_map_t *map, vm_object_t *aobj, vaddr_t vaddr, voff_t voff,
-    vm_fault_flags_t flags) LOCK_REQUIRES(map->lock) LOCK_REQUIRES(aobj->lock)
+    vm_fault_flags_t flags, vm_prot_t maxprot) LOCK_REQUIRES(map->lock)
+    LOCK_REQUIRES(aobj->lock)
 {
 	vm_anon_t **pAnon, *anon;
 
@@ -84,13 +109,13 @@ fault_aobj(vm_map_t *map, vm_object_t *aobj, vaddr_t vaddr, voff_t voff,
 					 * there is an existing read-only
 					 * mapping which must be removed
 					 */
-					pmap_unenter(map, anon->physpage, vaddr,
-					    NULL);
+					pmap_unenter(map, anon->physpage,
+					    vaddr);
 				}
 
 				mutex_unlock(&anon->lock);
 				anon = *pAnon;
-				pmap_enter(map, anon->physpage, vaddr, kVMAll);
+				pmap_enter(map, anon->physpage, vaddr, maxprot);
 			} else {
 				/*
 				 * refcnt >1 and it's a read; we can just map
@@ -99,7 +124,7 @@ fault_aobj(vm_map_t *map, vm_object_t *aobj, vaddr_t vaddr, voff_t voff,
 
 				assert(!(flags & kVMFaultPresent));
 				pmap_enter(map, anon->physpage, vaddr,
-				    kVMRead | kVMExecute);
+				    maxprot & ~kVMWrite);
 			}
 		} else {
 			if (flags & kVMFaultPresent) {
@@ -112,7 +137,7 @@ fault_aobj(vm_map_t *map, vm_object_t *aobj, vaddr_t vaddr, voff_t voff,
 				 */
 				assert(flags & kVMFaultWrite);
 				pmap_reenter(map, anon->physpage, vaddr,
-				    kVMAll);
+				    maxprot);
 			} else {
 				/*
 				 * a not-present fault with an anon having a
@@ -120,16 +145,46 @@ fault_aobj(vm_map_t *map, vm_object_t *aobj, vaddr_t vaddr, voff_t voff,
 				 * inactive queue
 				 */
 				/** XXX FIXME: is this legal? */
-				pmap_enter(map, anon->physpage, vaddr, kVMAll);
+				pmap_enter(map, anon->physpage, vaddr, maxprot);
 			}
 		}
 
 		mutex_unlock(&anon->lock);
 		return 0;
 	} else if (aobj->anon.parent) {
-		kprintf("vm_fault: fetch from parent is not yet supported\n");
-		/* does this need some thought to do properly? */
-		return -1;
+		vm_object_t *parent = aobj->anon.parent;
+		vm_anon_t   *panon;
+		int	     r;
+
+		assert(parent->type == kVMObjVNode);
+
+		mutex_lock(&parent->lock);
+		r = vnobj_getpage(parent, voff, &panon);
+		if (r < 0) {
+			mutex_unlock(&parent->lock);
+			return r;
+		}
+
+		if (flags & kVMFaultWrite) {
+			/* private copy of the parent's page is made now */
+			anon = anon_copy(panon);
+			*pAnon = anon;
+
+			if (flags & kVMFaultPresent)
+				pmap_unenter(map, panon->physpage, vaddr);
+
+			pmap_enter(map, anon->physpage, vaddr, maxprot);
+			mutex_unlock(&anon->lock);
+		} else {
+			/* share the parent's page read-only until written */
+			assert(!(flags & kVMFaultPresent));
+			pmap_enter(map, panon->physpage, vaddr,
+			    maxprot & ~kVMWrite);
+		}
+
+		mutex_unlock(&panon->lock);
+		mutex_unlock(&parent->lock);
+		return 0;
 	}
 
 	/* page not present locally, nor in parent => map new zero page */
@@ -137,7 +192,38 @@ fault_aobj(vm_map_t *map, vm_object_t *aobj, vaddr_t vaddr, voff_t voff,
 	*pAnon = anon;
 
 	/* can just map in readwrite as it's new thus refcnt = 1 */
-	pmap_enter(map, anon->physpage, vaddr, kVMAll);
+	pmap_enter(map, anon->physpage, vaddr, maxprot);
+	mutex_unlock(&anon->lock);
+
+	return 0;
+}
+
+static int
+fault_vnobj(vm_map_t *map, vm_object_t *vobj, vaddr_t vaddr, voff_t voff,
+    vm_fault_flags_t flags, vm_prot_t maxprot) LOCK_REQUIRES(map->lock)
+    LOCK_REQUIRES(vobj->lock)
+{
+	vm_anon_t *anon;
+	int	   r;
+
+	r = vnobj_getpage(vobj, voff, &anon);
+	if (r < 0)
+		return r;
+
+	if (flags & kVMFaultWrite) {
+		/* a write through a shared mapping dirties the page */
+		anon->dirty = true;
+		vobj->vnode.vnode->wrgen++;
+		if (flags & kVMFaultPresent)
+			pmap_reenter(map, anon->physpage, vaddr, maxprot);
+		else
+			pmap_enter(map, anon->physpage, vaddr, maxprot);
+	} else {
+		/* mapped read-only so that the first write is noticed */
+		assert(!(flags & kVMFaultPresent));
+		pmap_enter(map, anon->physpage, vaddr, maxprot & ~kVMWrite);
+	}
+
 	mutex_unlock(&anon->lock);
 
 	return 0;
@@ -180,20 +266,36 @@ vm_fault(md_intr_frame_t *frame, vm_map_t *map, vaddr_t vaddr,
 		goto unlockmap;
 	}
 
+	if ((flags & kVMFaultWrite && !(ent->prot & kVMWrite)) ||
+	    (flags & kVMFaultExecute && !(ent->prot & kVMExecute))) {
+		spinlock_unlock(&lock_msgbuf);
+		kprintf("vm_fault: protection violation at vaddr %p in map %p\n",
+		    vaddr, map);
+		r = -1;
+		goto unlockmap;
+	}
+
 	mutex_lock(&ent->obj->lock);
 
-	if (ent->obj->type != kVMObjAnon) {
+	obj_off = vaddr - ent->start;
+
+	switch (ent->obj->type) {
+	case kVMObjAnon:
+		r = fault_aobj(map, ent->obj, vaddr, obj_off + ent->offset,
+		    flags, ent->prot);
+		break;
+
+	case kVMObjVNode:
+		r = fault_vnobj(map, ent->obj, vaddr, obj_off + ent->offset,
+		    flags, ent->prot);
+		break;
+
+	default:
 		kprintf("vm_fault: fault in unfaultable object (type %d)\n",
 		    ent->obj->type);
 		r = -1;
-		goto unlockall;
 	}
 
-	obj_off = vaddr - ent->start;
-
-	r = fault_aobj(map, ent->obj, vaddr, obj_off + ent->offset, flags);
-
-unlockall:
 	mutex_unlock(&ent->obj->lock);
 unlockmap:
 	mutex_unlock(&map->lock);
@@ -203,6 +305,129 @@ unlockmap:
 	return r;
 }
 
+int
+vm_map_wire_page(vm_map_t *map, vaddr_t vaddr, bool write, vm_page_t **out)
+{
+	vm_map_entry_t	*ent;
+	vm_fault_flags_t flags = write ? kVMFaultWrite : 0;
+	voff_t		 obj_off;
+	paddr_t		 paddr;
+	int		 r = 0;
+
+	vaddr = (vaddr_t)PGROUNDDOWN(vaddr);
+
+	mutex_lock(&map->lock);
+
+	ent = map_entry_for_addr(map, vaddr);
+	if (!ent || (write && !(ent->prot & kVMWrite))) {
+		mutex_unlock(&map->lock);
+		return -EFAULT;
+	}
+
+	mutex_lock(&ent->obj->lock);
+
+	obj_off = vaddr - ent->start;
+	if (pmap_trans(map->pmap, vaddr) != 0)
+		flags |= kVMFaultPresent;
+
+	/* a read of a page already mapped needn't fault */
+	if (flags != kVMFaultPresent) {
+		switch (ent->obj->type) {
+		case kVMObjAnon:
+			r = fault_aobj(map, ent->obj, vaddr,
+			    obj_off + ent->offset, flags, ent->prot);
+			break;
+
+		case kVMObjVNode:
+			r = fault_vnobj(map, ent->obj, vaddr,
+			    obj_off + ent->offset, flags, ent->prot);
+			break;
+
+		default:
+			r = -EFAULT;
+		}
+	}
+
+	if (r == 0) {
+		paddr = pmap_trans(map->pmap, vaddr);
+		assert(paddr != 0);
+		*out = vm_page_from_paddr((paddr_t)PGROUNDDOWN(paddr));
+		assert(*out != NULL);
+		/* vm_object_evict() checks for wiring under the object lock */
+		vm_page_wire(*out);
+	}
+
+	mutex_unlock(&ent->obj->lock);
+	mutex_unlock(&map->lock);
+
+	return r;
+}
+
+/*! Whether the \p nBytes bytes at \p uaddr lie within the user range. */
+static bool
+user_range(vaddr_t uaddr, size_t nBytes)
+{
+	uintptr_t start = (uintptr_t)uaddr;
+
+	return start >= USER_BASE && start + nBytes >= start &&
+	    start + nBytes <= USER_BASE + USER_SIZE;
+}
+
+int
+vm_copyin(vm_map_t *map, void *dst, vaddr_t uaddr, size_t nBytes)
+{
+	if (!user_range(uaddr, nBytes))
+		return -EFAULT;
+
+	while (nBytes > 0) {
+		size_t	   pageoff = (uintptr_t)uaddr & (PGSIZE - 1);
+		size_t	   len = MIN(nBytes, PGSIZE - pageoff);
+		vm_page_t *page;
+
+		if (vm_map_wire_page(map, uaddr, false, &page) < 0)
+			return -EFAULT;
+		memcpy(dst, P2V(page->paddr) + pageoff, len);
+		vm_page_unwire(page);
+
+		dst += len;
+		uaddr += len;
+		nBytes -= len;
+	}
+
+	return 0;
+}
+
+int
+vm_copyinstr(vm_map_t *map, char *dst, vaddr_t uaddr, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		size_t	   pageoff = (uintptr_t)uaddr & (PGSIZE - 1);
+		size_t	   len = MIN(size - done, PGSIZE - pageoff);
+		vm_page_t *page;
+		char	  *src;
+		size_t	   n;
+
+		if (!user_range(uaddr, len) ||
+		    vm_map_wire_page(map, uaddr, false, &page) < 0)
+			return -EFAULT;
+		src = P2V(page->paddr) + pageoff;
+		for (n = 0; n < len && src[n] != '\0'; n++)
+			dst[done + n] = src[n];
+		vm_page_unwire(page);
+
+		if (n < len) {
+			dst[done + n] = '\0';
+			return done + n;
+		}
+		done += len;
+		uaddr += len;
+	}
+
+	return -ENAMETOOLONG;
+}
+
 /*
  * maps
  */
@@ -231,6 +456,34 @@ finish:
 	return 0;
 }
 
+static void
+anon_ctor(void *ptr)
+{
+	vm_anon_t *anon = ptr;
+	mutex_init(&anon->lock);
+}
+
+static void
+object_ctor(void *ptr)
+{
+	vm_object_t *obj = ptr;
+	mutex_init(&obj->lock);
+}
+
+void
+vm_init(void)
+{
+	/* kmem is up now, so the wired arena can get its quantum caches */
+	vmem_qcache_init(&vm_kernel_wired);
+
+	kmem_cache_init(&vm_anon_zone, "vm_anon", sizeof(vm_anon_t), 0,
+	    anon_ctor, NULL, 0);
+	kmem_cache_init(&vm_object_zone, "vm_object", sizeof(vm_object_t), 0,
+	    object_ctor, NULL, 0);
+	kmem_cache_init(&vm_map_entry_zone, "vm_map_entry",
+	    sizeof(vm_map_entry_t), 0, NULL, NULL, 0);
+}
+
 static vm_map_entry_t *
 map_entry_for_addr(vm_map_t *map, vaddr_t addr) LOCK_REQUIRES(map->lock)
 {
@@ -247,14 +500,10 @@ unmap_entry(vm_map_t *map, vm_map_entry_t *entry) LOCK_REQUIRES(map->lock)
 {
 	assert(vmem_xfree(&map->vmem, (vmem_addr_t)entry->start,
 		   entry->end - entry->start) >= 0);
-	for (vaddr_t v = entry->start; v < entry->end; v += PGSIZE) {
-		pmap_unenter(map, NULL, v, NULL);
-	}
+	pmap_remove_range(map, entry->start, entry->end);
 	vm_object_release(entry->obj);
 	TAILQ_REMOVE(&map->entries, entry, queue);
-	kmem_free(entry, sizeof(*entry));
-	/* todo: tlb shootdowns if map is used by multiple
-	 * threads */
+	kmem_zonefree(&vm_map_entry_zone, entry);
 	return 0;
 }
 
@@ -285,7 +534,7 @@ vm_deallocate(vm_map_t *map, vaddr_t start, size_t size)
 }
 
 vm_map_t *
-vm_map_new()
+vm_map_new(void)
 {
 	vm_map_t *newmap = kmem_alloc(sizeof *newmap);
 
@@ -325,15 +574,35 @@ vm_map_fork(vm_map_t *map)
 		vm_object_t *newobj;
 		vaddr_t	     start = ent->start;
 
-		if (ent->obj->type != kVMObjAnon)
-			fatal("vm_map_fork: only handles anon objects\n");
-
-		newobj = vm_object_copy(ent->obj);
-		assert(newobj != NULL);
+		if (ent->obj->type == kVMObjVNode) {
+			/* shared file mappings remain shared */
+			newobj = ent->obj;
+			vm_object_retain(newobj);
+		} else if (ent->obj->type == kVMObjAnon &&
+		    ent->obj->refcnt == 1) {
+			/*
+			 * Mapped only here, so write-protecting the range is
+			 * enough for copy-on-write, in one shootdown rather
+			 * than one per page.
+			 */
+			mutex_lock(&map->lock);
+			pmap_protect_range(map, ent->start, ent->end,
+			    kVMRead | kVMExecute);
+			mutex_unlock(&map->lock);
+			newobj = object_clone(ent->obj, false);
+		} else if (ent->obj->type == kVMObjAnon) {
+			newobj = vm_object_copy(ent->obj);
+			assert(newobj != NULL);
+		} else
+			fatal("vm_map_fork: can't fork object of type %d\n",
+			    ent->obj->type);
 
 		r = vm_map_object(newmap, newobj, &start, ent->end - ent->start,
 		    ent->offset, false);
 		assert(r == 0);
+		r = vm_map_protect(newmap, start, ent->end - ent->start,
+		    ent->prot);
+		assert(r == 0);
 
 		vm_object_release(newobj);
 	}
@@ -367,11 +636,12 @@ vm_map_object(vm_map_t *map, vm_object_t *obj, vaddr_t *vaddrp, size_t size,
 		return r;
 	}
 
-	entry = kmem_alloc(sizeof *entry);
+	entry = kmem_zonealloc(&vm_map_entry_zone);
 	entry->start = (vaddr_t)addr;
 	entry->end = (vaddr_t)addr + size;
 	entry->offset = offset;
 	entry->obj = obj;
+	entry->prot = kVMAll;
 
 	TAILQ_INSERT_TAIL(&map->entries, entry, queue);
 
@@ -380,6 +650,41 @@ vm_map_object(vm_map_t *map, vm_object_t *obj, vaddr_t *vaddrp, size_t size,
 	return r;
 }
 
+int
+vm_map_protect(vm_map_t *map, vaddr_t start, size_t size, vm_prot_t prot)
+{
+	vaddr_t		end = start + size;
+	vm_map_entry_t *ent;
+
+	assert((size & (PGSIZE - 1)) == 0);
+
+	mutex_lock(&map->lock);
+
+	TAILQ_FOREACH (ent, &map->entries, queue) {
+		if (ent->end <= start || ent->start >= end)
+			continue;
+		if (ent->start < start || ent->end > end) {
+			mutex_unlock(&map->lock);
+			return -EINVAL;
+		}
+	}
+
+	TAILQ_FOREACH (ent, &map->entries, queue) {
+		if (ent->start >= start && ent->end <= end)
+			ent->prot = prot;
+	}
+
+	/*
+	 * Writable pages are left read-only too: a write re-faults and gets
+	 * write access back only if the entry allows it.
+	 */
+	pmap_protect_range(map, start, end, (prot | kVMRead) & ~kVMWrite);
+
+	mutex_unlock(&map->lock);
+
+	return 0;
+}
+
 /*
  * objects
  */
@@ -404,7 +709,7 @@ copyphyspage(paddr_t dst, paddr_t src)
  */
 
 static vm_amap_t *
-amap_copy(vm_amap_t *amap)
+amap_copy(vm_amap_t *amap, bool reprotect)
 {
 	vm_amap_t *newamap = kmem_alloc(sizeof(*newamap));
 
@@ -427,7 +732,8 @@ amap_copy(vm_amap_t *amap)
 
 			mutex_lock(&oldanon->lock);
 			oldanon->refcnt++;
-			pmap_reenter_all_readonly(oldanon->physpage);
+			if (reprotect)
+				pmap_reenter_all_readonly(oldanon->physpage);
 			mutex_unlock(&oldanon->lock);
 		}
 	}
@@ -457,11 +763,12 @@ amap_release(vm_amap_t *amap)
 vm_anon_t *
 anon_new()
 {
-	vm_anon_t *newanon = kmem_alloc(sizeof *newanon);
+	vm_anon_t *newanon = kmem_zonealloc(&vm_anon_zone);
 	newanon->refcnt = 1;
-	mutex_init(&newanon->lock);
 	mutex_lock(&newanon->lock);
 	newanon->resident = true;
+	newanon->dirty = false;
+	newanon->busy = false;
 	newanon->physpage = vm_pagealloc(1, &vm_pgactiveq);
 	newanon->physpage->anon = newanon;
 	return newanon;
@@ -487,7 +794,7 @@ anon_release(vm_anon_t *anon)
 	assert(anon->physpage);
 
 	vm_page_free(anon->physpage);
-	kmem_free(anon, sizeof(*anon));
+	kmem_zonefree(&vm_anon_zone, anon);
 }
 
 static vm_anon_t **
@@ -511,17 +818,363 @@ amap_anon_at(vm_amap_t *amap, pgoff_t page)
 	return &amap->chunks[chunk]->anon[(page % kAMapChunkNPages)];
 }
 
+static vm_amap_t *
+amap_new(void)
+{
+	vm_amap_t *amap = kmem_alloc(sizeof(*amap));
+	amap->chunks = NULL;
+	amap->curnchunk = 0;
+	return amap;
+}
+
+/*
+ * vnode pager
+ */
+
+/*!
+ * Page in the page at offset \p off of vnode object \p obj with the vnode's
+ * read op. The new anon is only stored to \p pAnon on success.
+ */
+static int
+vnpager_get(vm_object_t *obj, voff_t off, vm_anon_t **pAnon)
+    LOCK_REQUIRES(obj->lock)
+{
+	vnode_t	*vn = obj->vnode.vnode;
+	vm_anon_t *anon = anon_new();
+	int	   r;
+
+	/* anon_new() zeroes the page, so a short read at EOF is fine */
+	r = vn->ops->read(vn, P2V(anon->physpage->paddr), PGSIZE,
+	    PGROUNDDOWN(off));
+	if (r < 0) {
+		mutex_unlock(&anon->lock);
+		anon_release(anon);
+		return r;
+	}
+
+	anon->dirty = false;
+	*pAnon = anon;
+
+	return 0;
+}
+
+/*!
+ * Write back the page held by \p anon at offset \p off of vnode object \p obj
+ * with the vnode's write op, if it is dirty. Any mappings of it are first made
+ * read-only, so that the next write through them dirties it anew.
+ *
+ * The anon must be marked busy by the caller, who holds no locks: the pmap
+ * takes page and map locks, which vm_fault() takes before the object's.
+ */
+static int
+vnpager_put(vm_object_t *obj, vm_anon_t *anon, voff_t off)
+{
+	vnode_t *vn = obj->vnode.vnode;
+	size_t	 len = PGSIZE;
+	bool	 dirty;
+	int	 r;
+
+	off = PGROUNDDOWN(off);
+
+	mutex_lock(&obj->lock);
+	if (off + len > obj->size)
+		len = obj->size > off ? obj->size - off : 0;
+	mutex_lock(&anon->lock);
+	assert(anon->busy);
+	dirty = anon->dirty;
+	anon->dirty = false;
+	mutex_unlock(&anon->lock);
+	mutex_unlock(&obj->lock);
+
+	if (!dirty)
+		return 0;
+
+	pmap_reenter_all_readonly(anon->physpage);
+
+	if (len == 0)
+		return 0;
+
+	r = vn->ops->write(vn, P2V(anon->physpage->paddr), len, off);
+	if (r < 0) {
+		mutex_lock(&anon->lock);
+		anon->dirty = true;
+		mutex_unlock(&anon->lock);
+		return r;
+	}
+
+	return 0;
+}
+
+static int
+vnobj_getpage(vm_object_t *obj, voff_t off, vm_anon_t **out)
+    LOCK_REQUIRES(obj->lock)
+{
+	vm_anon_t **pAnon = amap_anon_at(obj->vnode.amap, off / PGSIZE);
+
+	if (*pAnon == NULL) {
+		int r = vnpager_get(obj, off, pAnon);
+		if (r < 0)
+			return r;
+	} else
+		mutex_lock(&(*pAnon)->lock);
+
+	*out = *pAnon;
+
+	return 0;
+}
+
+/*!
+ * Get the page at offset \p off of anonymous object \p obj for reading or
+ * writing. For writing, the page is allocated or copied as needed such that
+ * the anon belongs to \p obj alone. For reading, a page absent from \p obj may
+ * be provided by its parent, or be absent entirely (NULL written out).
+ *
+ * @returns 0 and writes out the LOCKED anon, or -errno.
+ */
+static int
+aobj_getpage(vm_object_t *obj, voff_t off, bool write, vm_anon_t **out)
+    LOCK_REQUIRES(obj->lock)
+{
+	vm_anon_t **pAnon = amap_anon_at(obj->anon.amap, off / PGSIZE);
+	vm_anon_t  *anon = *pAnon;
+
+	if (anon != NULL) {
+		mutex_lock(&anon->lock);
+		if (write && anon->refcnt > 1) {
+			anon->refcnt--;
+			*pAnon = anon_copy(anon);
+			mutex_unlock(&anon->lock);
+			anon = *pAnon;
+		}
+	} else if (obj->anon.parent != NULL) {
+		vm_object_t *parent = obj->anon.parent;
+		vm_anon_t   *panon;
+		int	     r;
+
+		mutex_lock(&parent->lock);
+		r = vnobj_getpage(parent, off, &panon);
+		mutex_unlock(&parent->lock);
+		if (r < 0)
+			return r;
+
+		if (write) {
+			anon = anon_copy(panon);
+			*pAnon = anon;
+			mutex_unlock(&panon->lock);
+		} else
+			anon = panon;
+	} else if (write) {
+		anon = anon_new();
+		*pAnon = anon;
+	}
+
+	*out = anon;
+
+	return 0;
+}
+
+/*!
+ * Copy between \p buf and up to the end of the page at offset \p off of
+ * @locked \p obj.
+ */
+static int
+object_copy_page(vm_object_t *obj, void *buf, size_t nbyte, voff_t off,
+    bool write) LOCK_REQUIRES(obj->lock)
+{
+	vm_anon_t *anon;
+	void	     *pagev;
+	int	   r;
+
+	assert((off % PGSIZE) + nbyte <= PGSIZE);
+
+	if (obj->type == kVMObjVNode)
+		r = vnobj_getpage(obj, off, &anon);
+	else
+		r = aobj_getpage(obj, off, write, &anon);
+	if (r < 0)
+		return r;
+
+	if (anon == NULL) {
+		assert(!write);
+		memset(buf, 0x0, nbyte);
+		return 0;
+	}
+
+	pagev = P2V(anon->physpage->paddr) + (off % PGSIZE);
+	if (write) {
+		memcpy(pagev, buf, nbyte);
+		anon->dirty = true;
+		if (obj->type == kVMObjVNode)
+			obj->vnode.vnode->wrgen++;
+	} else
+		memcpy(buf, pagev, nbyte);
+
+	mutex_unlock(&anon->lock);
+
+	return 0;
+}
+
+static int
+object_copy(vm_object_t *obj, void *buf, size_t nbyte, voff_t off, bool write)
+{
+	size_t done = 0;
+	int    r = 0;
+
+	assert(obj->type == kVMObjAnon || obj->type == kVMObjVNode);
+
+	mutex_lock(&obj->lock);
+	while (done < nbyte) {
+		size_t len = MIN(PGSIZE - ((off + done) % PGSIZE),
+		    nbyte - done);
+
+		r = object_copy_page(obj, buf + done, len, off + done, write);
+		if (r < 0)
+			break;
+
+		done += len;
+	}
+	if (write && obj->type == kVMObjVNode && off + done > obj->size)
+		obj->size = off + done;
+	mutex_unlock(&obj->lock);
+
+	return r < 0 ? r : (int)done;
+}
+
+int
+vm_object_read(vm_object_t *obj, void *buf, size_t nbyte, voff_t off)
+{
+	return object_copy(obj, buf, nbyte, off, false);
+}
+
+int
+vm_object_write(vm_object_t *obj, void *buf, size_t nbyte, voff_t off)
+{
+	return object_copy(obj, buf, nbyte, off, true);
+}
+
+int
+vm_object_flush(vm_object_t *obj)
+{
+	vm_amap_t *amap;
+	int	   r = 0;
+
+	if (obj->type != kVMObjVNode)
+		return 0;
+
+	mutex_lock(&obj->lock);
+	amap = obj->vnode.amap;
+	for (pgoff_t pg = 0; pg < amap->curnchunk * kAMapChunkNPages; pg++) {
+		vm_amap_chunk_t *chunk = amap->chunks[pg / kAMapChunkNPages];
+		vm_anon_t	  *anon;
+		int		 r2;
+
+		if (chunk == NULL)
+			continue;
+		anon = chunk->anon[pg % kAMapChunkNPages];
+		if (anon == NULL)
+			continue;
+
+		mutex_lock(&anon->lock);
+		/* busy pages are being written back by someone else */
+		if (!anon->dirty || anon->busy) {
+			mutex_unlock(&anon->lock);
+			continue;
+		}
+		anon->busy = true;
+		mutex_unlock(&anon->lock);
+		mutex_unlock(&obj->lock);
+
+		r2 = vnpager_put(obj, anon, pg * PGSIZE);
+		if (r2 < 0)
+			r = r2;
+
+		mutex_lock(&obj->lock);
+		mutex_lock(&anon->lock);
+		anon->busy = false;
+		mutex_unlock(&anon->lock);
+	}
+	mutex_unlock(&obj->lock);
+
+	return r;
+}
+
+int
+vm_object_evict(vm_object_t *obj, voff_t off)
+{
+	vm_anon_t **pAnon, *anon;
+	int	    r;
+
+	assert(obj->type == kVMObjVNode);
+
+	mutex_lock(&obj->lock);
+	anon = *amap_anon_at(obj->vnode.amap, off / PGSIZE);
+	if (anon == NULL) {
+		mutex_unlock(&obj->lock);
+		return 0;
+	}
+
+	mutex_lock(&anon->lock);
+	/* a wired page may be in use for I/O by an MDL */
+	if (anon->busy || anon->physpage->wirecnt > 0) {
+		mutex_unlock(&anon->lock);
+		mutex_unlock(&obj->lock);
+		return -EBUSY;
+	}
+	anon->busy = true;
+	mutex_unlock(&anon->lock);
+	mutex_unlock(&obj->lock);
+
+	/*
+	 * Unmapped and written back with nothing locked (see vnpager_put());
+	 * being busy keeps the anon in the object meanwhile, though it may be
+	 * faulted in again, which is checked for below.
+	 */
+	pmap_unenter_all(anon->physpage);
+	r = vnpager_put(obj, anon, off);
+
+	mutex_lock(&obj->lock);
+	pAnon = amap_anon_at(obj->vnode.amap, off / PGSIZE);
+	mutex_lock(&anon->lock);
+	anon->busy = false;
+	/* faults on the page hold its anon's lock while they map it */
+	if (r == 0 && (anon->dirty || anon->physpage->pv_table.nentries != 0))
+		r = -EBUSY;
+	if (r < 0) {
+		mutex_unlock(&anon->lock);
+		mutex_unlock(&obj->lock);
+		return r;
+	}
+	assert(*pAnon == anon);
+	*pAnon = NULL;
+	mutex_unlock(&anon->lock);
+	mutex_unlock(&obj->lock);
+	anon_release(anon);
+
+	return 0;
+}
+
 vm_object_t *
 vm_aobj_new(size_t size)
 {
-	vm_object_t *obj = kmem_alloc(sizeof(*obj));
+	vm_object_t *obj = kmem_zonealloc(&vm_object_zone);
 
-	mutex_init(&obj->lock);
 	obj->type = kVMObjAnon;
 	obj->anon.parent = NULL;
-	obj->anon.amap = kmem_alloc(sizeof(*obj->anon.amap));
-	obj->anon.amap->chunks = NULL;
-	obj->anon.amap->curnchunk = 0;
+	obj->anon.amap = amap_new();
+	obj->size = size;
+	obj->refcnt = 1;
+
+	return obj;
+}
+
+vm_object_t *
+vm_vnobj_new(vnode_t *vn, size_t size)
+{
+	vm_object_t *obj = kmem_zonealloc(&vm_object_zone);
+
+	obj->type = kVMObjVNode;
+	obj->vnode.vnode = vn;
+	obj->vnode.amap = amap_new();
 	obj->size = size;
 	obj->refcnt = 1;
 
@@ -531,23 +1184,32 @@ vm_aobj_new(size_t size)
 vm_object_t *
 vm_object_copy(vm_object_t *obj)
 {
-	vm_object_t *newobj = kmem_alloc(sizeof *newobj);
+	return object_clone(obj, true);
+}
 
-	mutex_lock(&obj->lock);
+static vm_object_t *
+object_clone(vm_object_t *obj, bool reprotect)
+{
+	vm_object_t *newobj = kmem_zonealloc(&vm_object_zone);
 
-	if (obj->type != kVMObjAnon) {
-		fatal("vm_object_copy: only implemented for anons as of yet\n");
-	}
+	mutex_lock(&obj->lock);
 
-	mutex_init(&newobj->lock);
 	newobj->refcnt = 1;
 	newobj->size = obj->size;
-	newobj->type = obj->type;
+	newobj->type = kVMObjAnon;
 	if (obj->type == kVMObjAnon) {
-		newobj->anon.parent = obj->anon.parent ? obj->anon.parent :
-							 NULL;
-	}
-	newobj->anon.amap = amap_copy(obj->anon.amap);
+		newobj->anon.parent = obj->anon.parent;
+		if (newobj->anon.parent)
+			vm_object_retain(newobj->anon.parent);
+		newobj->anon.amap = amap_copy(obj->anon.amap, reprotect);
+	} else if (obj->type == kVMObjVNode) {
+		/* pages are fetched from the vnode object until written */
+		newobj->anon.parent = obj;
+		vm_object_retain(obj);
+		newobj->anon.amap = amap_new();
+	} else
+		fatal("vm_object_copy: can't copy object of type %d\n",
+		    obj->type);
 
 	mutex_unlock(&obj->lock);
 
@@ -566,10 +1228,22 @@ vm_object_release(vm_object_t *obj)
 	if (--obj->refcnt > 0)
 		return;
 
-	if (obj->type == kVMObjAnon)
+	switch (obj->type) {
+	case kVMObjAnon:
 		amap_release(obj->anon.amap);
-	else
-		fatal("vm_object_release: only implemented for anons\n");
+		if (obj->anon.parent)
+			vm_object_release(obj->anon.parent);
+		break;
+
+	case kVMObjVNode:
+		vm_object_flush(obj);
+		amap_release(obj->vnode.amap);
+		break;
+
+	default:
+		fatal("vm_object_release: can't release object of type %d\n",
+		    obj->type);
+	}
 
-	kmem_free(obj, sizeof(*obj));
+	kmem_zonefree(&vm_object_zone, obj);
 }
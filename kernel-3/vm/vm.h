@@ -41,6 +41,9 @@
 #define PGROUNDUP(addr) ROUNDUP(addr, PGSIZE)
 #define PGROUNDDOWN(addr) ROUNDDOWN(addr, PGSIZE)
 
+struct vm_page;
+struct vnode;
+
 typedef struct vm_object vm_object_t;
 
 /*!
@@ -78,6 +81,7 @@ typedef struct vm_map_entry {
 	vaddr_t			  start, end;
 	voff_t			  offset;
 	vm_object_t		    *obj;
+	vm_prot_t		  prot; /*!< maximum protection of mappings */
 } vm_map_entry_t;
 
 /*!
@@ -91,6 +95,16 @@ typedef struct vm_map {
 	struct pmap *pmap;
 } vm_map_t;
 
+/*!
+ * Initialise the object caches of the machine-independent VM. Called once kmem
+ * is up.
+ */
+void vm_init(void);
+
+/*! Create a new, empty user map. */
+vm_map_t *vm_map_new(void);
+/*! Deallocate everything in a user map, then free it. */
+void vm_map_release(vm_map_t *map);
 /*! Activate a given map. */
 void vm_activate(vm_map_t *map);
 /*!
@@ -135,6 +149,45 @@ vm_fault(md_intr_frame_t *frame, vm_map_t *map, vaddr_t vaddr,
 int vm_map_object(vm_map_t *map, vm_object_t *obj, vaddr_t *vaddrp, size_t size,
     voff_t offset, bool copy);
 
+/*!
+ * Set the maximum protection of the entries of \p map lying within [\p start,
+ * \p start + \p size) to \p prot, and downgrade their existing mappings.
+ * Faults beyond \p prot then fail. New entries get kVMAll.
+ *
+ * @returns 0, or -EINVAL if an entry straddles either end of the range.
+ */
+int vm_map_protect(vm_map_t *map, vaddr_t start, size_t size, vm_prot_t prot);
+
+/*!
+ * Fault in the page at \p vaddr in \p map as an access would (a write, if
+ * \p write) and wire it, with the object locked throughout so that it can't be
+ * evicted in between.
+ *
+ * @returns 0 and writes out the page, -EFAULT if nothing is mapped at \p vaddr,
+ * or another -errno if the fault failed.
+ */
+int vm_map_wire_page(vm_map_t *map, vaddr_t vaddr, bool write,
+    struct vm_page **out);
+
+/*!
+ * Copy \p nBytes bytes at user address \p uaddr in \p map into \p dst. The
+ * pages are wired while they are copied, so \p map needn't be the current one,
+ * and other threads may unmap them meanwhile.
+ *
+ * @returns 0, or -EFAULT if any of them isn't mapped in the user part of
+ * \p map.
+ */
+int vm_copyin(vm_map_t *map, void *dst, vaddr_t uaddr, size_t nBytes);
+
+/*!
+ * As vm_copyin(), but of the NUL-terminated string at \p uaddr, into the
+ * \p size bytes at \p dst.
+ *
+ * @returns the length of the string, -EFAULT, or -ENAMETOOLONG if it and its
+ * terminator don't fit in \p size bytes.
+ */
+int vm_copyinstr(vm_map_t *map, char *dst, vaddr_t uaddr, size_t size);
+
 /*! Global kernel map. */
 extern vm_map_t kmap;
 
@@ -190,11 +243,39 @@ size_t vm_mdl_capacity(vm_mdl_t *mdl);
  */
 void vm_mdl_copy(vm_mdl_t *mdl, void *buf, size_t nBytes, off_t off);
 
+/*!
+ * Copy data from a buffer into an MDL.
+ */
+void vm_mdl_copyin(vm_mdl_t *mdl, const void *buf, size_t nBytes, off_t off);
+
+/*!
+ * Free a buffer MDL made by vm_mdl_new_with_capacity(), and its pages. Not to
+ * be called from interrupt context.
+ */
+void vm_mdl_free(vm_mdl_t *mdl);
+
 /*!
  * Zero out an entire MDL.
  */
 void vm_mdl_zero(vm_mdl_t *mdl);
 
+/*!
+ * Create an MDL describing the \p nBytes bytes at \p start in \p map. Their
+ * pages are faulted in (for writing, if \p write, so that copy-on-write is
+ * resolved first) and wired with vm_map_wire_page(), so that I/O may be done to
+ * or from them directly. Free it with vm_mdl_unwire().
+ *
+ * @returns 0, or -errno (e.g. -EFAULT if any of the range isn't mapped.)
+ */
+int vm_mdl_new_with_range(vm_mdl_t **out, vm_map_t *map, vaddr_t start,
+    size_t nBytes, bool write);
+
+/*!
+ * Unwire the pages of an MDL made by vm_mdl_new_with_range(), and free it. Not
+ * to be called from interrupt context.
+ */
+void vm_mdl_unwire(vm_mdl_t *mdl);
+
 /*!
  * @name Objects
  */
@@ -209,6 +290,7 @@ typedef struct vm_object {
 		kDirectMap,
 		kKHeap,
 		kVMObjAnon,
+		kVMObjVNode,
 	} type;
 	size_t size; /**< size in bytes */
 
@@ -224,6 +306,12 @@ typedef struct vm_object {
 			ssize_t		  maxsize;
 			struct vm_object *parent;
 		} anon;
+		struct {
+			/** resident pages, each held by an anon */
+			struct vm_amap *amap;
+			/** the vnode paged; not retained (it owns us) */
+			struct vnode *vnode;
+		} vnode;
 	};
 } vm_object_t;
 
@@ -233,7 +321,9 @@ typedef struct vm_object {
 typedef struct vm_anon {
 	mutex_t lock;
 	int refcnt : 24, /** number of amaps referencing it; if >1, must COW. */
-	    resident : 1; /** whether currently resident in memory */
+	    resident : 1, /** whether currently resident in memory */
+	    dirty : 1, /** (vnode object pages) modified since last paged */
+	    busy : 1;  /** (vnode object pages) being unmapped or written back */
 
 	union {
 		struct vm_page *physpage; /** physical page if resident */
@@ -263,6 +353,12 @@ void anon_release(vm_anon_t *anon);
  * Allocate a new anonymous VM object of size \p size bytes.
  */
 vm_object_t *vm_aobj_new(size_t size);
+/*!
+ * Allocate a new vnode object paging the vnode \p vn, with size \p size bytes.
+ * Pages are filled on demand by the vnode's read op and are written back with
+ * its write op when they are evicted or the object is flushed.
+ */
+vm_object_t *vm_vnobj_new(struct vnode *vn, size_t size);
 /*!
  * Create a (copy-on-write optimised) copy of a VM object.
 
@@ -283,6 +379,35 @@ void vm_object_retain(vm_object_t *obj);
 /** Release a reference to an object. */
 void vm_object_release(vm_object_t *obj);
 
+/*!
+ * Copy \p nbyte bytes at offset \p off of an object into \p buf. Absent pages
+ * of anonymous objects read as zero; those of vnode objects are paged in.
+ *
+ * @returns number of bytes read, or -errno.
+ */
+int vm_object_read(vm_object_t *obj, void *buf, size_t nbyte, voff_t off);
+
+/*!
+ * Copy \p nbyte bytes from \p buf into an object at offset \p off. Pages are
+ * allocated (or paged in) as needed, and shared anons are copied first.
+ *
+ * @returns number of bytes written, or -errno.
+ */
+int vm_object_write(vm_object_t *obj, void *buf, size_t nbyte, voff_t off);
+
+/*!
+ * Write back all dirty pages of a vnode object. No-op for other objects.
+ */
+int vm_object_flush(vm_object_t *obj);
+
+/*!
+ * Evict the page at offset \p off of a vnode object: its mappings are removed,
+ * it is written back if dirty, and then freed.
+ * @returns -EBUSY if it is being written back, or was faulted in again before
+ * it could be freed.
+ */
+int vm_object_evict(vm_object_t *obj, voff_t off);
+
 /*!
  * @}
  */
@@ -294,6 +419,11 @@ void vm_object_release(vm_object_t *obj);
 /*! Port-specific physical map. */
 typedef struct pmap pmap_t;
 
+/*!
+ * Initialise the pmap module's allocators. Called once kmem is up.
+ */
+void pmap_init(void);
+
 /*!
  * Create a new pmap. It will share the higher half with the kernel pmap kpmap.
  */
@@ -304,6 +434,12 @@ pmap_t *pmap_new();
  */
 void pmap_free(pmap_t *pmap);
 
+/*!
+ * Translate a virtual address to the physical address it maps, or 0 if it is
+ * unmapped.
+ */
+paddr_t pmap_trans(pmap_t *pmap, vaddr_t virt);
+
 /*!
  * Pageable mapping of a virtual address to a page.
  */
@@ -317,6 +453,13 @@ void pmap_enter(vm_map_t *map, struct vm_page *page, vaddr_t virt,
 void pmap_enter_kern(struct pmap *pmap, paddr_t phys, vaddr_t virt,
     vm_prot_t prot);
 
+/*!
+ * As pmap_enter_kern(), but the mapping is uncached, as device registers must
+ * be.
+ */
+void pmap_enter_kern_uncached(struct pmap *pmap, paddr_t phys, vaddr_t virt,
+    vm_prot_t prot);
+
 /**
  * Reset the protection flags for an existing pageable mapping. Does not carry
  * out TLB shootdowns.
@@ -328,18 +471,36 @@ void pmap_reenter(vm_map_t *map, struct vm_page *page, vaddr_t virt, vm_prot_t p
  */
 void pmap_reenter_all_readonly(struct vm_page *page);
 
+/*!
+ * Remove all pageable mappings of a page. Carries out TLB shootdowns.
+ */
+void pmap_unenter_all(struct vm_page *page);
+
 /*!
  * Unmap a single page of a pageable mapping. CPU local TLB invalidated; not
  * others. TLB shootdown may therefore be required afterwards. Page's pv_table
  * updated accordingly.
  *
  * @param map from which map to remove the mapping.
- * @param page which page to unmap from \p map.
+ * @param page which page to unmap from \p map; if NULL, it is looked up.
  * @param virt virtual address to be unmapped from \p map.
- * @param pv optionally specify which pv_entry_t represents this mapping, if
- * already known, so it does not have to be found again.
  */
-void pmap_unenter(vm_map_t *map, struct vm_page *page, vaddr_t virt, pv_entry_t *pv);
+void pmap_unenter(vm_map_t *map, struct vm_page *page, vaddr_t virt);
+
+/*!
+ * Remove all pageable mappings within [\p start, \p end) of \p map. The page
+ * tables are walked once; page tables left empty are freed. The TLBs of the
+ * CPUs which have the pmap loaded are invalidated, in one shootdown per batch.
+ */
+void pmap_remove_range(vm_map_t *map, vaddr_t start, vaddr_t end);
+
+/*!
+ * Reset the protection of all pageable mappings within [\p start, \p end) of
+ * \p map to \p prot (which must include kVMRead), as pmap_remove_range()
+ * walks and shoots down.
+ */
+void pmap_protect_range(vm_map_t *map, vaddr_t start, vaddr_t end,
+    vm_prot_t prot);
 
 /*!
  * Low-level unmapping of a page. Invalidates local TLB but does not do a TLB
@@ -358,6 +519,9 @@ void pmap_invlpg(vaddr_t addr);
  */
 void pmap_global_invlpg(vaddr_t vaddr);
 
+/*! Private - carry out a TLB shootdown on this CPU. Called by the IPI. */
+void pmap_shootdown_intr(void);
+
 /*!
  * @}
  */
@@ -392,13 +556,27 @@ typedef struct vm_page {
 	/*! Page state. */
 	enum vm_page_queue queue : 4;
 
+	/*! NUMA node the page belongs to. */
+	uint8_t node;
+	/*!
+	 * Whether it is on a free queue. Unlike queue, which changes under the
+	 * lock of the queue a page enters, this is exact under the free queues'
+	 * locks, so that vm_pagealloc_contig() may trust it.
+	 */
+	bool onfreeq;
+	/*!
+	 * Count of MDLs wiring a pageable page; it's on the wired queue while
+	 * this is non-zero. Pages wired for other reasons leave it at zero.
+	 */
+	uint16_t wirecnt;
+
 	/*! for pageable mappings */
 	union {
 		struct vm_anon   *anon; /*! if belonging to an anon */
 		struct vm_object *obj;	/*! if belonging to non-anon object */
 	};
 
-	LIST_HEAD(, pv_entry) pv_table; /*! physical page -> virtual mappings */
+	pv_table_t pv_table; /*! physical page -> virtual mappings */
 
 	paddr_t paddr; /*! physical address of page */
 } vm_page_t;
@@ -407,6 +585,8 @@ typedef struct vm_pagequeue {
 	TAILQ_HEAD(, vm_page) queue;
 	size_t	npages;
 	mutex_t lock;
+	/*! Which queue this is; pages entering it take this as their state. */
+	enum vm_page_queue kind;
 } vm_pagequeue_t;
 
 /*!
@@ -419,15 +599,34 @@ typedef struct vm_pregion {
 	paddr_t base;
 	/*! Number of pages the region covers. */
 	size_t npages;
+	/*! NUMA node of the region (of its first page, if it spans several). */
+	int node;
 	/*! Resident page table part for region. */
 	vm_page_t pages[0];
 } vm_pregion_t;
 
 typedef TAILQ_HEAD(, vm_pregion) vm_pregion_queue_t;
 
-/*! Allocate a new page. It is enqueued on the specified queue. */
+/*!
+ * Allocate a new page, preferably from the current CPU's NUMA node. It is
+ * enqueued on the specified queue.
+ */
 vm_page_t *vm_pagealloc(bool sleep, vm_pagequeue_t *queue);
 
+/*!
+ * Allocate a new page from NUMA node \p node, or failing that from the nearest
+ * node with free pages.
+ */
+vm_page_t *vm_pagealloc_node(int node, bool sleep, vm_pagequeue_t *queue);
+
+/*!
+ * Allocate \p npages physically contiguous pages, zeroed, for devices which
+ * need them (e.g. for DMA rings.) They are enqueued on the specified queue,
+ * and are the consecutive entries of the array whose first is returned.
+ * Doesn't sleep; returns NULL if no free run is long enough.
+ */
+vm_page_t *vm_pagealloc_contig(size_t npages, vm_pagequeue_t *queue);
+
 /*! Free a page. It is automatically removed from its current queue. */
 void vm_page_free(vm_page_t *page);
 
@@ -445,9 +644,68 @@ vm_page_t *vm_page_from_paddr(paddr_t paddr);
 void vm_page_changequeue(vm_page_t *page, NULLABLE vm_pagequeue_t *from,
     vm_pagequeue_t *to) LOCK_RELEASE(from->lock);
 
-/*! The page queues. */
-extern vm_pagequeue_t vm_pgfreeq, vm_pgkmemq, vm_pgwiredq, vm_pgactiveq,
-    vm_pginactiveq, vm_pgpmapq;
+/*! Wire a pageable page, taking it off the pageable queues. Wirings count. */
+void vm_page_wire(vm_page_t *page);
+
+/*! Drop a wiring of a page; the last returns it to the active queue. */
+void vm_page_unwire(vm_page_t *page);
+
+/*!
+ * Number of free pages below which vm_pagealloc() wakes the pagedaemon to
+ * reclaim memory.
+ */
+#define VM_PAGE_LOWWATER 256
+
+/*! Entry point of the pagedaemon thread. */
+void vm_pagedaemon(void *unused);
+
+/*! Wake the pagedaemon if it is not already awake. */
+void vm_pagedaemon_wakeup(void);
+
+/*! The page queues. Free pages are kept per-node, in vm_node::freeq. */
+extern vm_pagequeue_t vm_pgkmemq, vm_pgwiredq, vm_pgactiveq, vm_pginactiveq,
+    vm_pgpmapq;
+
+/*! Maximum number of NUMA nodes. */
+#define VM_MAX_NODES 8
+
+/*! A NUMA node: a set of CPUs and the memory local to them. */
+typedef struct vm_node {
+	/*! Free pages of the node. */
+	vm_pagequeue_t freeq;
+	/*! Distance to each node, as given by the ACPI SLIT (10 is local). */
+	uint8_t distance[VM_MAX_NODES];
+	/*! All nodes in order of increasing distance, starting with this. */
+	uint8_t fallback[VM_MAX_NODES];
+	/*! Kernel wired memory of the node, and the addresses it uses. */
+	vmem_t	wired, kva;
+	vaddr_t kvabase;
+	size_t	kvasize;
+} vm_node_t;
+
+/*! A range of physical memory belonging to a node. */
+struct vm_numa_range {
+	paddr_t base;
+	size_t	size;
+	int	node;
+};
+
+/*! The NUMA nodes; there's just the one until vm_numa_configure(). */
+extern vm_node_t vm_nodes[VM_MAX_NODES];
+extern int	 vm_nnodes;
+
+/*!
+ * Describe the machine's NUMA topology, from the firmware's tables: move pages
+ * onto their node's free list and set up node-local kernel memory. Called
+ * once, from autoconfiguration; the other CPUs may be allocating meanwhile.
+ *
+ * @param ranges physical memory of each node; memory not within any of these
+ * is taken to be on node 0.
+ * @param distance \p nnodes x \p nnodes matrix of distances between nodes,
+ * or NULL, in which case remote nodes are taken to be at distance 20.
+ */
+void vm_numa_configure(int nnodes, const struct vm_numa_range *ranges,
+    size_t nranges, const uint8_t *distance);
 
 /*! Page region queue. */
 extern vm_pregion_queue_t vm_pregion_queue;
@@ -472,18 +730,47 @@ enum vm_kalloc_flags {
 /** Set up the kernel memory subsystem. */
 void vm_kernel_init();
 
+/*! Set up the nodes' kernel wired memory; for vm_numa_configure(). */
+void vm_kernel_numa_init(int nnodes);
+
 /*!
- * Allocate pages of kernel heap.
+ * Arena of kernel wired memory, from which vm_kalloc() allocates until NUMA
+ * nodes are set up; after that, memory is allocated from the nodes' arenas.
+ */
+extern vmem_t vm_kernel_wired;
+
+/*! Arena of kernel wired memory local to \p node. */
+vmem_t *vm_kernel_wired_arena(int node);
+
+/*! Arena of kernel wired memory from which \p addr was allocated. */
+vmem_t *vm_kernel_wired_owner(vaddr_t addr);
+
+/*!
+ * Allocate pages of kernel heap, local to the current CPU's NUMA node.
  *
  * @param flags see vm_kalloc_flags
  */
 vaddr_t vm_kalloc(size_t npages, enum vm_kalloc_flags flags);
 
+/*!
+ * Allocate pages of kernel heap local to NUMA node \p node, or failing that,
+ * to the nearest node that can satisfy it.
+ */
+vaddr_t vm_kalloc_node(int node, size_t npages, enum vm_kalloc_flags flags);
+
 /*!
  * Free pages of kernel heap.
  */
 void vm_kfree(vaddr_t addr, size_t pages);
 
+/*!
+ * Map \p size bytes of device memory at physical address \p phys, which may
+ * lie beyond the direct map, uncached into kernel virtual address space.
+ *
+ * @returns the address at which \p phys is mapped, or NULL if out of space.
+ */
+void *vm_kernel_map_mmio(paddr_t phys, size_t size);
+
 /*! @} */
 
 #define ASSERT_IN_KHEAP(PTR) assert((uintptr_t)PTR >= KHEAP_BASE && (uintptr_t)PTR < KHEAP_BASE +0x100000000 )
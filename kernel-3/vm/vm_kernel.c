@@ -13,34 +13,65 @@
  * @brief Management of the kernel's virtual address space.
  */
 
+#include <kern/kasan.h>
+#include <kern/kmem_trace.h>
+#include <kern/task.h>
 #include <kern/vmem.h>
 #include <kern/vmem_impl.h>
 #include <libkern/klib.h>
 #include <vm/vm.h>
 
+#include <errno.h>
+
 /** Kernel wired memory. */
 vmem_t vm_kernel_wired;
 
+/*!
+ * Each node's wired arena imports from the node's own range of kernel virtual
+ * addresses, carved out of kmap by vm_kernel_numa_init(), so that vm_kfree()
+ * can tell from an address alone which arena to return it to. Those ranges
+ * together take this fraction of the kernel heap.
+ */
+#define NUMA_KVA_DIVISOR 2
+
+/*! the node whose wired arena imports from \p vmem, or -1 for none */
+static int
+vmem_node(vmem_t *vmem)
+{
+	for (int i = 0; i < vm_nnodes; i++)
+		if (vmem == &vm_nodes[i].kva)
+			return i;
+	return -1;
+}
+
 static int
 internal_allocwired(vmem_t *vmem, vmem_size_t size, vmem_flag_t flags,
     vmem_addr_t *out)
 {
+	int node = vmem_node(vmem);
 	int r;
 
-	assert(vmem == &kmap.vmem);
+	assert(vmem == &kmap.vmem || node != -1);
+
+	if (node == -1)
+		node = curcpu()->node;
 
+	/* may fail, e.g. for a kVMemNoSleep try of one node of several */
 	r = vmem_xalloc(vmem, size, 0, 0, 0, 0, 0, flags, out);
-	if (r < 0) {
-		fatal("vmem_xalloc returned %d\n", r);
+	if (r < 0)
 		return r;
-	}
 
-	for (int i = 0; i < size - 1; i += PGSIZE) {
-		vm_page_t *page = vm_pagealloc(flags & kVMemSleep, &vm_pgkmemq);
+	for (vmem_size_t i = 0; i < size - 1; i += PGSIZE) {
+		vm_page_t *page = vm_pagealloc_node(node, flags & kVMemSleep,
+		    &vm_pgkmemq);
 		pmap_enter_kern(kmap.pmap, page->paddr, (vaddr_t)*out + i,
 		    kVMAll);
 	}
 
+	/* not allocated till vm_kalloc() or kmem hands it out */
+	kasan_map_shadow((void *)*out, size);
+	kasan_poison((void *)*out, size, kKasanFreePage);
+
 	return 0;
 }
 
@@ -49,7 +80,7 @@ internal_freewired(vmem_t *vmem, vmem_addr_t addr, vmem_size_t size)
 {
 	int r;
 
-	assert(vmem == &kmap.vmem);
+	assert(vmem == &kmap.vmem || vmem_node(vmem) != -1);
 
 	r = vmem_xfree(vmem, addr, size);
 	if (r < 0) {
@@ -70,6 +101,26 @@ vm_kernel_dump()
 {
 	vmem_dump(&kmap.vmem);
 	vmem_dump(&vm_kernel_wired);
+	if (vm_nnodes > 1)
+		for (int i = 0; i < vm_nnodes; i++)
+			vmem_dump(&vm_nodes[i].wired);
+}
+
+void *
+vm_kernel_map_mmio(paddr_t phys, size_t size)
+{
+	uintptr_t   base = PGROUNDDOWN(phys);
+	size_t	    len = PGROUNDUP((uintptr_t)phys + size) - base;
+	vmem_addr_t addr;
+
+	if (vmem_xalloc(&kmap.vmem, len, 0, 0, 0, 0, 0, kVMemSleep, &addr) < 0)
+		return NULL;
+
+	for (size_t i = 0; i < len; i += PGSIZE)
+		pmap_enter_kern_uncached(kmap.pmap, (paddr_t)(base + i),
+		    (vaddr_t)addr + i, kVMRead | kVMWrite);
+
+	return (void *)addr + ((uintptr_t)phys - base);
 }
 
 void
@@ -79,32 +130,94 @@ vm_kernel_init()
 	vmem_init(&kmap.vmem, "kernel-va", KHEAP_BASE, KHEAP_SIZE, PGSIZE, NULL,
 	    NULL, NULL, 0, kVMemBootstrap, 0);
 	vmem_init(&vm_kernel_wired, "kernel-wired", 0, 0, PGSIZE,
-	    internal_allocwired, internal_freewired, &kmap.vmem, 0,
+	    internal_allocwired, internal_freewired, &kmap.vmem, 4 * PGSIZE,
 	    kVMemBootstrap, 0);
 
 	kmap.vmem.flags = 0;
 	vm_kernel_wired.flags = 0;
 }
 
+void
+vm_kernel_numa_init(int nnodes)
+{
+	vmem_size_t slice = PGROUNDDOWN(KHEAP_SIZE / NUMA_KVA_DIVISOR / nnodes);
+
+	for (int i = 0; i < nnodes; i++) {
+		vm_node_t  *node = &vm_nodes[i];
+		vmem_addr_t base;
+		char	    name[32];
+		int	    r;
+
+		r = vmem_xalloc(&kmap.vmem, slice, 0, 0, 0, 0, 0, kVMemSleep,
+		    &base);
+		if (r < 0)
+			fatal("vm_kernel_numa_init: vmem_xalloc returned %d\n",
+			    r);
+
+		node->kvabase = (vaddr_t)base;
+		node->kvasize = slice;
+		ksnprintf(name, sizeof(name), "kernel-va-node%d", i);
+		vmem_init(&node->kva, name, base, slice, PGSIZE, NULL, NULL,
+		    NULL, 0, kVMemSleep, 0);
+		ksnprintf(name, sizeof(name), "kernel-wired-node%d", i);
+		vmem_init(&node->wired, name, 0, 0, PGSIZE, internal_allocwired,
+		    internal_freewired, &node->kva, 4 * PGSIZE, kVMemSleep, 0);
+	}
+}
+
+vmem_t *
+vm_kernel_wired_arena(int node)
+{
+	return vm_nnodes > 1 ? &vm_nodes[node].wired : &vm_kernel_wired;
+}
+
+vmem_t *
+vm_kernel_wired_owner(vaddr_t addr)
+{
+	for (int i = 0; i < vm_nnodes && vm_nnodes > 1; i++)
+		if (addr >= vm_nodes[i].kvabase &&
+		    addr < vm_nodes[i].kvabase + vm_nodes[i].kvasize)
+			return &vm_nodes[i].wired;
+
+	return &vm_kernel_wired;
+}
+
 vaddr_t
 vm_kalloc(size_t npages, enum vm_kalloc_flags wait)
+{
+	return vm_kalloc_node(curcpu()->node, npages, wait);
+}
+
+vaddr_t
+vm_kalloc_node(int node, size_t npages, enum vm_kalloc_flags wait)
 {
 	vmem_addr_t addr;
+	int	    nnodes = vm_nnodes;
 	int	    flags;
-	int	    r;
+	int	    r = -ENOMEM;
 
 	flags = wait & 0x1 ? kVMemSleep : kVMemNoSleep;
 	flags |= wait & 0x2 ? kVMemBootstrap : 0;
-	r = vmem_xalloc(&vm_kernel_wired, npages * PGSIZE, 0, 0, 0, 0, 0, flags,
-	    &addr);
-	if (r == 0)
-		return (vaddr_t)addr;
-	else
+
+	/* only wait on the last node tried */
+	for (int i = 0; i < nnodes && r < 0; i++)
+		r = vmem_alloc(vm_kernel_wired_arena(vm_nodes[node].fallback[i]),
+		    npages * PGSIZE, i == nnodes - 1 ? flags : flags | kVMemNoSleep,
+		    &addr);
+	if (r < 0)
 		return NULL;
+
+	kasan_unpoison((void *)addr, npages * PGSIZE);
+	kmem_trace_alloc(kKMemTraceKWired, (void *)addr, npages * PGSIZE,
+	    KMEM_TRACE_SITE());
+	return (vaddr_t)addr;
 }
 
 void
 vm_kfree(vaddr_t addr, size_t npages)
 {
-	vmem_xfree(&vm_kernel_wired, (vmem_addr_t)addr, npages * PGSIZE);
+	kmem_trace_free(kKMemTraceKWired, addr, npages * PGSIZE);
+	kasan_poison(addr, npages * PGSIZE, kKasanFreePage);
+	vmem_free(vm_kernel_wired_owner(addr), (vmem_addr_t)addr,
+	    npages * PGSIZE);
 }
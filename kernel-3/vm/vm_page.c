@@ -8,7 +8,11 @@
  * All rights reserved.
  */
 
+#include <sys/param.h>
+
 #include <kern/kmem.h>
+#include <kern/kmem_trace.h>
+#include <kern/task.h>
 #include <libkern/klib.h>
 #include <vm/vm.h>
 
@@ -16,18 +20,29 @@
 #include <stdatomic.h>
 #include <string.h>
 
-#define PGQ_INITIALIZER(PGQ)                                             \
+#define PGQ_INITIALIZER(PGQ, KIND)                                       \
 	{                                                                \
 		.queue = TAILQ_HEAD_INITIALIZER(PGQ.queue), .npages = 0, \
-		.lock = MUTEX_INITIALISER(PGQ.lock)                     \
+		.lock = MUTEX_INITIALISER(PGQ.lock), .kind = KIND        \
+	}
+
+#define NODE_INITIALIZER(N)                                                 \
+	{                                                                   \
+		.freeq = PGQ_INITIALIZER(vm_nodes[N].freeq, kVMPageFree), \
+		.distance = { [N] = 10 }, .fallback = { N }                 \
 	}
 
-vm_pagequeue_t vm_pgfreeq = PGQ_INITIALIZER(vm_pgfreeq),
-	       vm_pgkmemq = PGQ_INITIALIZER(vm_pgkmemq),
-	       vm_pgwiredq = PGQ_INITIALIZER(vm_pgwiredq),
-	       vm_pgactiveq = PGQ_INITIALIZER(vm_pgactiveq),
-	       vm_pginactiveq = PGQ_INITIALIZER(vm_pginactiveq),
-	       vm_pgpmapq = PGQ_INITIALIZER(vm_pgpmapq);
+vm_pagequeue_t vm_pgkmemq = PGQ_INITIALIZER(vm_pgkmemq, kVMPageKMem),
+	       vm_pgwiredq = PGQ_INITIALIZER(vm_pgwiredq, kVMPageWired),
+	       vm_pgactiveq = PGQ_INITIALIZER(vm_pgactiveq, kVMPageActive),
+	       vm_pginactiveq = PGQ_INITIALIZER(vm_pginactiveq,
+		   kVMPageInactive),
+	       vm_pgpmapq = PGQ_INITIALIZER(vm_pgpmapq, kVMPagePMap);
+
+vm_node_t vm_nodes[VM_MAX_NODES] = { NODE_INITIALIZER(0), NODE_INITIALIZER(1),
+	NODE_INITIALIZER(2), NODE_INITIALIZER(3), NODE_INITIALIZER(4),
+	NODE_INITIALIZER(5), NODE_INITIALIZER(6), NODE_INITIALIZER(7) };
+int vm_nnodes = 1;
 
 vm_pregion_queue_t vm_pregion_queue = TAILQ_HEAD_INITIALIZER(vm_pregion_queue);
 
@@ -46,37 +61,132 @@ vm_page_from_paddr(paddr_t paddr)
 	return NULL;
 }
 
+static size_t
+nfreepages(void)
+{
+	size_t npages = 0;
+
+	for (int i = 0; i < vm_nnodes; i++)
+		npages += vm_nodes[i].freeq.npages;
+
+	return npages;
+}
+
 vm_page_t *
 vm_pagealloc(bool sleep, vm_pagequeue_t *queue)
 {
-	vm_page_t *page;
+	return vm_pagealloc_node(curcpu()->node, sleep, queue);
+}
+
+vm_page_t *
+vm_pagealloc_node(int node, bool sleep, vm_pagequeue_t *queue)
+{
+	vm_page_t *page = NULL;
+	int	   nnodes = vm_nnodes;
+
+	for (int i = 0; i < nnodes && page == NULL; i++) {
+		vm_pagequeue_t *freeq;
 
-	mutex_lock(&vm_pgfreeq.lock);
-	page = TAILQ_FIRST(&vm_pgfreeq.queue);
+		freeq = &vm_nodes[vm_nodes[node].fallback[i]].freeq;
+		mutex_lock(&freeq->lock);
+		page = TAILQ_FIRST(&freeq->queue);
+		if (page != NULL)
+			vm_page_changequeue(page, freeq, queue);
+		else
+			mutex_unlock(&freeq->lock);
+	}
 	if (!page) {
 		fatal("vm_allocpage: oom not yet handled\n");
 	}
-	vm_page_changequeue(page, &vm_pgfreeq, queue);
+
+	if (nfreepages() < VM_PAGE_LOWWATER)
+		vm_pagedaemon_wakeup();
 
 	memset(P2V(page->paddr), 0x0, PGSIZE);
+	kmem_trace_alloc(kKMemTracePage, page, PGSIZE, KMEM_TRACE_SITE());
 
 	return page;
 }
 
+vm_page_t *
+vm_pagealloc_contig(size_t npages, vm_pagequeue_t *queue)
+{
+	vm_pregion_t *preg;
+	vm_page_t    *run = NULL;
+
+	assert(npages > 0);
+
+	/* all, not just vm_nnodes', lest vm_numa_configure() run meanwhile */
+	for (int i = 0; i < VM_MAX_NODES; i++)
+		mutex_lock(&vm_nodes[i].freeq.lock);
+
+	TAILQ_FOREACH (preg, &vm_pregion_queue, queue) {
+		size_t len = 0;
+
+		for (size_t i = 0; i < preg->npages; i++) {
+			if (!preg->pages[i].onfreeq) {
+				len = 0;
+				continue;
+			}
+			if (++len == npages) {
+				run = &preg->pages[i + 1 - npages];
+				break;
+			}
+		}
+		if (run != NULL)
+			break;
+	}
+
+	if (run != NULL)
+		for (size_t i = 0; i < npages; i++) {
+			vm_pagequeue_t *freeq = &vm_nodes[run[i].node].freeq;
+
+			TAILQ_REMOVE(&freeq->queue, &run[i], pagequeue);
+			freeq->npages--;
+			run[i].onfreeq = false;
+		}
+
+	for (int i = VM_MAX_NODES - 1; i >= 0; i--)
+		mutex_unlock(&vm_nodes[i].freeq.lock);
+
+	if (run == NULL)
+		return NULL;
+
+	mutex_lock(&queue->lock);
+	for (size_t i = 0; i < npages; i++) {
+		TAILQ_INSERT_HEAD(&queue->queue, &run[i], pagequeue);
+		queue->npages++;
+		run[i].queue = queue->kind;
+	}
+	mutex_unlock(&queue->lock);
+
+	if (nfreepages() < VM_PAGE_LOWWATER)
+		vm_pagedaemon_wakeup();
+
+	memset(P2V(run->paddr), 0x0, PGSIZE * npages);
+	for (size_t i = 0; i < npages; i++)
+		kmem_trace_alloc(kKMemTracePage, &run[i], PGSIZE,
+		    KMEM_TRACE_SITE());
+
+	return run;
+}
+
 vm_pagequeue_t *
 vm_page_queue(vm_page_t *page)
 {
 	switch (page->queue) {
 	case kVMPageFree:
-		return &vm_pgfreeq;
+		return &vm_nodes[page->node].freeq;
 	case kVMPageKMem:
 		return &vm_pgkmemq;
 	case kVMPageWired:
-		return &vm_pgactiveq;
+		return &vm_pgwiredq;
 	case kVMPageActive:
 		return &vm_pgactiveq;
 	case kVMPageInactive:
 		return &vm_pginactiveq;
+	case kVMPagePMap:
+		return &vm_pgpmapq;
 	default:
 		assert(!"unreached\n");
 	}
@@ -86,7 +196,8 @@ void
 vm_page_free(vm_page_t *page)
 {
 	assert(page != NULL);
-	vm_page_changequeue(page, NULL, &vm_pgfreeq);
+	kmem_trace_free(kKMemTracePage, page, PGSIZE);
+	vm_page_changequeue(page, NULL, &vm_nodes[page->node].freeq);
 }
 
 void
@@ -103,14 +214,124 @@ vm_page_changequeue(vm_page_t *page, NULLABLE vm_pagequeue_t *from,
 
 	TAILQ_REMOVE(&from->queue, page, pagequeue);
 	from->npages--;
+	if (from->kind == kVMPageFree)
+		page->onfreeq = false;
 	mutex_unlock(&from->lock);
 
 	mutex_lock(&to->lock);
+	/*
+	 * A page being freed may have been retagged to another node by
+	 * vm_numa_configure() while we waited; it holds every free queue's lock
+	 * while it does so, and does so but once, so one retry suffices.
+	 */
+	if (to->kind == kVMPageFree && to != &vm_nodes[page->node].freeq) {
+		mutex_unlock(&to->lock);
+		to = &vm_nodes[page->node].freeq;
+		mutex_lock(&to->lock);
+	}
 	TAILQ_INSERT_HEAD(&to->queue, page, pagequeue);
 	to->npages++;
+	page->queue = to->kind;
+	if (to->kind == kVMPageFree)
+		page->onfreeq = true;
 	mutex_unlock(&to->lock);
 }
 
+/*! which node physical address \p paddr is on */
+static int
+paddr_node(paddr_t paddr, const struct vm_numa_range *ranges, size_t nranges)
+{
+	for (size_t i = 0; i < nranges; i++)
+		if (paddr >= ranges[i].base &&
+		    paddr < ranges[i].base + ranges[i].size)
+			return ranges[i].node;
+	return 0;
+}
+
+void
+vm_numa_configure(int nnodes, const struct vm_numa_range *ranges,
+    size_t nranges, const uint8_t *distance)
+{
+	vm_pregion_t *preg;
+	vm_page_t    *page, *next;
+
+	assert(nnodes > 0 && nnodes <= VM_MAX_NODES);
+	assert(vm_nnodes == 1);
+
+	if (nnodes == 1)
+		return;
+
+	for (int i = 0; i < nnodes; i++) {
+		vm_node_t *node = &vm_nodes[i];
+		int	   n = 0;
+
+		for (int j = 0; j < nnodes; j++)
+			if (distance != NULL)
+				node->distance[j] = distance[i * nnodes + j];
+			else
+				node->distance[j] = i == j ? 10 : 20;
+
+		/* insertion sort by distance; stable, so this node first */
+		node->fallback[n++] = i;
+		for (int j = 0; j < nnodes; j++) {
+			int k;
+
+			if (j == i)
+				continue;
+			for (k = n; k > 1 &&
+			     node->distance[node->fallback[k - 1]] >
+				 node->distance[j];
+			     k--)
+				node->fallback[k] = node->fallback[k - 1];
+			node->fallback[k] = j;
+			n++;
+		}
+	}
+
+	/*
+	 * A free page's queue is found from its tag, so retag with every free
+	 * queue locked (see vm_page_changequeue() for frees racing this.) Only
+	 * node 0's has any pages yet, so only those on it may need moving.
+	 */
+	for (int i = 0; i < VM_MAX_NODES; i++)
+		mutex_lock(&vm_nodes[i].freeq.lock);
+
+	TAILQ_FOREACH (preg, &vm_pregion_queue, queue) {
+		preg->node = paddr_node(preg->base, ranges, nranges);
+		for (size_t i = 0; i < preg->npages; i++)
+			preg->pages[i].node = paddr_node(preg->pages[i].paddr,
+			    ranges, nranges);
+	}
+
+	for (page = TAILQ_FIRST(&vm_nodes[0].freeq.queue); page != NULL;
+	     page = next) {
+		vm_pagequeue_t *to = &vm_nodes[page->node].freeq;
+
+		next = TAILQ_NEXT(page, pagequeue);
+		if (page->node == 0)
+			continue;
+
+		TAILQ_REMOVE(&vm_nodes[0].freeq.queue, page, pagequeue);
+		vm_nodes[0].freeq.npages--;
+		TAILQ_INSERT_TAIL(&to->queue, page, pagequeue);
+		to->npages++;
+	}
+
+	for (int i = VM_MAX_NODES - 1; i >= 0; i--)
+		mutex_unlock(&vm_nodes[i].freeq.lock);
+
+	vm_kernel_numa_init(nnodes);
+	__atomic_store_n(&vm_nnodes, nnodes, __ATOMIC_RELEASE);
+
+	for (int i = 0; i < nnodes; i++) {
+		kprintf("vm: node %d: %zu pages free; distances", i,
+		    vm_nodes[i].freeq.npages);
+		for (int j = 0; j < nnodes; j++)
+			kprintf(" %d", vm_nodes[i].distance[j]);
+		kprintf("\n");
+	}
+}
+
 void
 vm_pagedump(void)
 {
@@ -118,8 +339,12 @@ vm_pagedump(void)
 	    "wired", "active", "inactive", "pmap");
 
 	kprintf("%-9zu%-9zu%-9zu%-9zu%-9zu%-9zu\n",
-	    vm_pgfreeq.npages, vm_pgkmemq.npages, vm_pgwiredq.npages,
+	    nfreepages(), vm_pgkmemq.npages, vm_pgwiredq.npages,
 	    vm_pgactiveq.npages, vm_pginactiveq.npages, vm_pgpmapq.npages);
+	if (vm_nnodes > 1)
+		for (int i = 0; i < vm_nnodes; i++)
+			kprintf("node %d: %zu free\n", i,
+			    vm_nodes[i].freeq.npages);
 }
 
 int
@@ -181,30 +406,113 @@ void
 vm_mdl_copy(vm_mdl_t *mdl, void *buf, size_t nBytes, off_t off)
 {
 	off += mdl->offset;
-	voff_t base = PGROUNDDOWN(off);
-	voff_t pageoff = off - base;
-	size_t firstpage = base / PGSIZE;
-	size_t lastpage = firstpage + (pageoff + nBytes - 1) / PGSIZE + 1;
 
-	for (size_t iPage = firstpage; iPage < lastpage; iPage++) {
-		vm_page_t *page;
-		size_t	   tocopy;
+	while (nBytes > 0) {
+		voff_t pageoff = off % PGSIZE;
+		size_t tocopy = MIN(nBytes, PGSIZE - pageoff);
 
-		if (nBytes > PGSIZE)
-			tocopy = PGSIZE - pageoff;
-		else
-			tocopy = nBytes;
+		memcpy(buf, P2V(mdl->pages[off / PGSIZE]->paddr) + pageoff,
+		    tocopy);
 
-		page = mdl->pages[iPage];
+		buf += tocopy;
+		off += tocopy;
+		nBytes -= tocopy;
+	}
+}
 
-		memcpy(buf + (iPage - firstpage) * PGSIZE,
-		    P2V(page->paddr) + pageoff, tocopy);
+void
+vm_mdl_copyin(vm_mdl_t *mdl, const void *buf, size_t nBytes, off_t off)
+{
+	off += mdl->offset;
+
+	while (nBytes > 0) {
+		voff_t pageoff = off % PGSIZE;
+		size_t tocopy = MIN(nBytes, PGSIZE - pageoff);
+
+		memcpy(P2V(mdl->pages[off / PGSIZE]->paddr) + pageoff, buf,
+		    tocopy);
 
+		buf += tocopy;
+		off += tocopy;
 		nBytes -= tocopy;
-		pageoff = 0;
 	}
 }
 
+void
+vm_mdl_free(vm_mdl_t *mdl)
+{
+	for (size_t i = 0; i < mdl->nPages; i++)
+		vm_page_free(mdl->pages[i]);
+
+	kmem_free(mdl, sizeof(*mdl) + sizeof(vm_page_t *) * mdl->nPages);
+}
+
+void
+vm_page_wire(vm_page_t *page)
+{
+	mutex_lock(&page->lock);
+	if (page->wirecnt > 0)
+		page->wirecnt++;
+	else if (page->queue == kVMPageActive ||
+	    page->queue == kVMPageInactive) {
+		page->wirecnt = 1;
+		vm_page_changequeue(page, NULL, &vm_pgwiredq);
+	}
+	mutex_unlock(&page->lock);
+}
+
+void
+vm_page_unwire(vm_page_t *page)
+{
+	mutex_lock(&page->lock);
+	if (page->wirecnt > 0 && --page->wirecnt == 0)
+		vm_page_changequeue(page, NULL, &vm_pgactiveq);
+	mutex_unlock(&page->lock);
+}
+
+int
+vm_mdl_new_with_range(vm_mdl_t **out, vm_map_t *map, vaddr_t start,
+    size_t nBytes, bool write)
+{
+	vaddr_t	  base = (vaddr_t)PGROUNDDOWN(start);
+	size_t	  nPages = (PGROUNDUP(start + nBytes) - (uintptr_t)base) / PGSIZE;
+	vm_mdl_t *mdl = kmem_alloc(sizeof(*mdl) + sizeof(vm_page_t *) * nPages);
+
+	if (!mdl)
+		return -ENOMEM;
+
+	mdl->offset = start - base;
+	mdl->nBytes = nBytes;
+	mdl->nPages = nPages;
+
+	for (size_t i = 0; i < nPages; i++) {
+		int r;
+
+		r = vm_map_wire_page(map, base + PGSIZE * i, write,
+		    &mdl->pages[i]);
+		if (r < 0) {
+			while (i-- > 0)
+				vm_page_unwire(mdl->pages[i]);
+			kmem_free(mdl,
+			    sizeof(*mdl) + sizeof(vm_page_t *) * nPages);
+			return r;
+		}
+	}
+
+	*out = mdl;
+
+	return 0;
+}
+
+void
+vm_mdl_unwire(vm_mdl_t *mdl)
+{
+	for (size_t i = 0; i < mdl->nPages; i++)
+		vm_page_unwire(mdl->pages[i]);
+
+	kmem_free(mdl, sizeof(*mdl) + sizeof(vm_page_t *) * mdl->nPages);
+}
+
 void
 vm_mdl_zero(vm_mdl_t *mdl)
 {
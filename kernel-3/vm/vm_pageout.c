@@ -12,3 +12,35 @@
  * @file vm_pageout.c
  * @brief Implements automatic page-out (write back to backing store) of pages.
  */
+
+#include <kern/kmem.h>
+#include <kern/sync.h>
+#include <vm/vm.h>
+
+#include <stdatomic.h>
+
+static semaphore_t vm_pagedaemon_sem =
+    SEMAPHORE_INITIALIZER(vm_pagedaemon_sem);
+/*! whether a wakeup is pending, so that the semaphore isn't signalled once
+ * for every page allocated while memory is low */
+static atomic_bool vm_pagedaemon_awake = false;
+
+void
+vm_pagedaemon_wakeup(void)
+{
+	if (!atomic_exchange(&vm_pagedaemon_awake, true))
+		semaphore_signal(&vm_pagedaemon_sem);
+}
+
+void
+vm_pagedaemon(void *unused)
+{
+	for (;;) {
+		semaphore_wait(&vm_pagedaemon_sem, -1);
+
+		/* there is no pageout yet; kmem's caches are all we can take */
+		kmem_reap();
+
+		vm_pagedaemon_awake = false;
+	}
+}
@@ -27,6 +27,11 @@ typedef struct md_cpu {
 	uint64_t    lapic_tps; /* lapic timer ticks per second (divider 1) */
 	struct tss *tss;
 	struct thread *old;
+	/* cache of free pv chunks; accessed with interrupts disabled */
+	struct pv_chunk *pvcache;
+	size_t		 npvcache;
+	/* the pmap loaded, by vm_activate(); NULL if not known */
+	struct pmap *pmap;
 } md_cpu_t;
 
 static inline struct cpu *
@@ -64,12 +69,23 @@ md_intr_x(bool en)
 			     : "r10", "memory");
 }
 
+/*! read this CPU's timestamp counter, which is assumed to be invariant */
+static inline uint64_t
+md_cycles(void)
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (uint64_t)hi << 32 | lo;
+}
+
 /*! switch from one thread to another on this CPU */
 void md_switch(struct thread *from, struct thread *to);
 /*! send an invlpg IPI to a CPU */
 void md_ipi_invlpg(struct cpu *cpu);
 /*! send a reschedule IPI to a CPU */
 void md_ipi_resched(struct cpu *cpu);
+/*! request the DPC interrupt on this CPU; interrupts must be disabled */
+void md_raise_dpc_interrupt(void);
 /*! set a cpu-local timer to interrupt in \p nano ns, or disable with -1 */
 void md_timer_set(uint64_t nanos);
 /*! get nanoseconds remaining before timer elapses */
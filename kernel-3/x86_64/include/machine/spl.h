@@ -10,6 +10,12 @@
 
 /*
  * SPL stands for System Interrupt Priority Level.
+ *
+ * On amd64 an IPL is the priority class (vector >> 4) up to which interrupts
+ * are blocked by CR8, so md_intr_alloc() gives a handler of IPL n a vector in
+ * class n (or the lowest above it that's free), so that raising the IPL to n
+ * blocks it. Class kSPLSoft is reserved for the DPC (soft) interrupt; device
+ * interrupts should be allocated at kSPLHard or a level aliasing it.
  */
 
 #ifndef SPL_H_
@@ -21,11 +27,11 @@ typedef enum {
 	kSPLHigh = 15, /* all interrupts blocked, including hardclock */
 #if 0
 	kSPLSched = kSPLHigh, /* scheduler; todo split hardclock out */
+#endif
 	kSPLHard = 3, /* hard interrupts blocked */
 	kSPLVM = kSPLHard, /* virtual memory */
 	kSPLBIO = kSPLHard, /* block I/O */
-	kSPLSoft = 2, /* soft interrupts blocked */
-#endif
+	kSPLSoft = 2, /* soft interrupts (DPCs) blocked */
 	kSPL0 = 0,    /* blocks none */
 	_kSPLForceLong = INT64_MAX,
 } ipl_t;
@@ -18,21 +18,62 @@
 #define USER_BASE 0x1000
 #define HHDM_BASE 0xffff800000000000
 #define KHEAP_BASE 0xffff800100000000
+#define KASAN_SHADOW_BASE 0xffff800200000000
 #define KERN_BASE 0xffffffff80000000
 
 #define USER_SIZE 0x100000000
 #define HHDM_SIZE 0x100000000  /* 4GiB */
 #define KHEAP_SIZE 0x100000000 /* 4GiB */
+#define KASAN_SHADOW_SIZE (KHEAP_SIZE / 8)
 #define KERN_SIZE 0x10000000   /* 256MiB */
 
 #define P2V(addr) (((void *)(addr)) + HHDM_BASE)
 #define V2P(addr) (((void *)(addr)) - HHDM_BASE)
 
-/** entry for vm_page::pv_table's map of virtual mappings per physical page */
+/** entry in vm_page::pv_table's map of virtual mappings per physical page */
 typedef struct pv_entry {
-	LIST_ENTRY(pv_entry) pv_entries;
-	struct vm_map	      *map;
-	void		*vaddr;
+	struct vm_map *map; /** NULL if the entry is unused */
+	void	      *vaddr;
 } pv_entry_t;
 
+enum {
+	/** number of entries in a pv_chunk */
+	kPVChunkNEntries = 7,
+	/** once a page has more mappings than this, its chunks are hashed */
+	kPVHashThreshold = 4 * kPVChunkNEntries,
+	/** buckets in a hashed pv table; power of 2 */
+	kPVHashNBuckets = 16,
+};
+
+/** chunk of pv entries, densely packed from index 0 */
+typedef struct pv_chunk {
+	struct pv_chunk *next;
+	size_t		 nentries;
+	pv_entry_t	 entries[kPVChunkNEntries];
+} pv_chunk_t;
+
+/**
+ * Map of a physical page's virtual mappings. The first is stored inline; any
+ * more are stored in a list of chunks, or (for heavily shared pages) a hash of
+ * lists of chunks keyed by mapping.
+ */
+typedef struct pv_table {
+	pv_entry_t single;   /** inline entry */
+	uint32_t   nentries; /** total entries, including inline */
+	uint32_t   hashed;   /** whether buckets (rather than chunks) is used */
+	union {
+		pv_chunk_t  *chunks;
+		pv_chunk_t **buckets;
+	};
+} pv_table_t;
+
+static inline void
+pv_table_init(pv_table_t *pvt)
+{
+	pvt->single.map = NULL;
+	pvt->nentries = 0;
+	pvt->hashed = 0;
+	pvt->chunks = NULL;
+}
+
 #endif /* VM_H_ */
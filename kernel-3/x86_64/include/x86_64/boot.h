@@ -1,6 +1,8 @@
 #ifndef BOOT_H_
 #define BOOT_H_
 
+#include <stdbool.h>
+
 #include "limine.h"
 
 extern volatile struct limine_framebuffer_request framebuffer_request;
@@ -8,4 +10,7 @@ extern volatile struct limine_module_request	  module_request;
 extern volatile struct limine_rsdp_request	  rsdp_request;
 extern volatile struct limine_terminal_request	  terminal_request;
 
+/*! Whether the word \p option appears on the kernel command line. */
+bool boot_option(const char *option);
+
 #endif /* BOOT_H_ */
@@ -15,6 +15,7 @@
 #include <kern/types.h>
 #include <libkern/klib.h>
 #include <machine/intr.h>
+#include <posix/sys.h>
 #include <x86_64/asmintr.h>
 #include <x86_64/cpu.h>
 #include "machine/machdep.h"
@@ -30,6 +31,8 @@ typedef struct {
 } __attribute__((packed)) idt_entry_t;
 
 enum {
+	/* the one vector of priority class kSPLSoft, so splsoft() blocks it */
+	kIntNumDPC = 32,
 	kIntNumSyscall = 128,
 	/* set below 224, so that we can filter it out with CR8 */
 	kIntNumLAPICTimer = 223,
@@ -51,6 +54,7 @@ enum {
 
 enum {
 	kLAPICTimerPeriodic = 0x4e20,
+	kLAPICICRSelf = 1 << 18, /* ICR destination shorthand: self */
 };
 
 static idt_entry_t idt[256] = { 0 };
@@ -111,8 +115,10 @@ idt_init()
 
 	idt_load();
 	md_intr_register(14, kSPL0, pagefault_interrupt, NULL);
+	md_intr_register(kIntNumDPC, kSPLSoft, dpc_interrupt, NULL);
 	md_intr_register(kIntNumLAPICTimer, kSPL0, callout_interrupt, NULL);
 	md_intr_register(kIntNumReschedule, kSPL0, sched_timeslice, NULL);
+	md_intr_register(kIntNumSyscall, kSPL0, posix_syscall, NULL);
 }
 
 void lapic_eoi(void);
@@ -139,10 +145,7 @@ handle_int(md_intr_frame_t *frame, uintptr_t num)
 		spinlock_unlock(&sched_lock);
 		return;
 	} else if (num == kIntNumInvlPG) {
-		extern vaddr_t		   invlpg_addr;
-		extern volatile atomic_int invlpg_done_cnt;
-		pmap_invlpg(invlpg_addr);
-		atomic_fetch_add(&invlpg_done_cnt, 1);
+		pmap_shootdown_intr();
 		lapic_eoi();
 		return;
 	}
@@ -151,13 +154,14 @@ handle_int(md_intr_frame_t *frame, uintptr_t num)
 		fatal("unhandled interrupt %lu\n", num);
 	}
 
-	if (num >= 32) {
+	/* system calls are software interrupts, made from thread context */
+	if (num >= 32 && num != kIntNumSyscall) {
 		curcpu()->inInterrupt = true;
 	}
 
 	md_intrs[num].handler(frame, md_intrs[num].arg);
 
-	if (num >= 32) {
+	if (num >= 32 && num != kIntNumSyscall) {
 		lapic_eoi();
 		curcpu()->inInterrupt = oldInInterrupt;
 	}
@@ -251,7 +255,8 @@ md_intr_alloc(ipl_t prio, intr_handler_fn_t handler, void *arg)
 {
 	uint8_t vec = 0;
 
-	for (int i = MAX(prio << 4, 32); i < 256; i++)
+	/* classes up to kSPLSoft's are reserved, for the DPC interrupt */
+	for (int i = MAX(prio << 4, (kSPLSoft + 1) << 4); i < 256; i++)
 		if (md_intrs[i].handler == NULL) {
 			vec = i;
 			break;
@@ -317,6 +322,12 @@ md_ipi_resched(cpu_t *cpu)
 	send_ipi(cpu->md.lapic_id, kIntNumReschedule);
 }
 
+void
+md_raise_dpc_interrupt(void)
+{
+	lapic_write(kLAPICRegICR0, kLAPICICRSelf | kIntNumDPC);
+}
+
 void
 md_timer_set(uint64_t nanos)
 {
@@ -8,11 +8,15 @@
  * All rights reserved.
  */
 
+#include <sys/param.h>
+
 #include <dev/fbterm/FBTerminal.h>
+#include <devicekit/dk_buf.h>
 #include <kern/kmem.h>
 #include <kern/task.h>
 #include <libkern/klib.h>
 #include <vm/vm.h>
+#include <x86_64/boot.h>
 #include <x86_64/cpu.h>
 #include <x86_64/limine.h>
 
@@ -113,6 +117,32 @@ md_kputc(int ch, void *ctx)
 	}
 }
 
+bool
+boot_option(const char *option)
+{
+	struct limine_kernel_file_response *resp = kernel_file_request.response;
+	const char			   *word;
+	size_t				    len = strlen(option);
+
+	if (resp == NULL || resp->kernel_file->cmdline == NULL)
+		return false;
+
+	word = resp->kernel_file->cmdline;
+	while (*word != '\0') {
+		size_t wordlen = 0;
+
+		while (word[wordlen] != '\0' && word[wordlen] != ' ')
+			wordlen++;
+		if (wordlen == len && memcmp(word, option, len) == 0)
+			return true;
+		word += wordlen;
+		while (*word == ' ')
+			word++;
+	}
+
+	return false;
+}
+
 static void
 done(void)
 {
@@ -154,6 +184,7 @@ mem_init()
 		/* set up a pregion for this area */
 		bm->base = (void *)entries[i]->base;
 		bm->npages = entries[i]->length / PGSIZE;
+		bm->node = 0; /* until vm_numa_configure() */
 
 		used = ROUNDUP(sizeof(vm_pregion_t) +
 			sizeof(vm_page_t) * bm->npages,
@@ -170,8 +201,11 @@ mem_init()
 		for (b = 0; b < bm->npages; b++) {
 			bm->pages[b].paddr = bm->base + PGSIZE * b;
 			mutex_init(&bm->pages[b].lock);
-			LIST_INIT(&bm->pages[b].pv_table);
+			pv_table_init(&bm->pages[b].pv_table);
 			bm->pages[b].obj = NULL;
+			bm->pages[b].node = 0;
+			bm->pages[b].wirecnt = 0;
+			bm->pages[b].onfreeq = false;
 		}
 
 		/* mark off the pages used */
@@ -185,9 +219,10 @@ mem_init()
 		/* now zero the remainder */
 		for (; b < bm->npages; b++) {
 			bm->pages[b].queue = kVMPageFree;
-			TAILQ_INSERT_TAIL(&vm_pgfreeq.queue, &bm->pages[b],
-			    pagequeue);
-			vm_pgfreeq.npages++;
+			bm->pages[b].onfreeq = true;
+			TAILQ_INSERT_TAIL(&vm_nodes[0].freeq.queue,
+			    &bm->pages[b], pagequeue);
+			vm_nodes[0].freeq.npages++;
 		}
 
 		TAILQ_INSERT_TAIL(&vm_pregion_queue, bm, queue);
@@ -219,6 +254,7 @@ common_init(struct limine_smp_info *smpi)
 	/* measure thrice and average it */
 	cpu->md.lapic_tps = 0;
 	cpu->md.lapic_id = smpi->lapic_id;
+	cpu->node = 0; /* until AcpiPC parses the SRAT */
 	for (int i = 0; i < 3; i++)
 		cpu->md.lapic_tps += lapic_timer_calibrate() / 3;
 
@@ -228,6 +264,7 @@ common_init(struct limine_smp_info *smpi)
 	cpu->timeslicer.callback = sched_timeslice;
 	cpu->timeslicer.state = kCalloutDisabled;
 	TAILQ_INIT(&cpu->pendingcallouts);
+	TAILQ_INIT(&cpu->pendingdpcs);
 	TAILQ_INIT(&cpu->runqueue);
 
 	cpu->idlethread = cpu->curthread;
@@ -254,6 +291,7 @@ ap_init(struct limine_smp_info *smpi)
 	spinlock_init(&thread->lock);
 	cpu->curthread = thread;
 	thread->task = &task0;
+	thread->blkplug = NULL;
 
 	common_init(smpi);
 	/* this is now that CPU's idle thread loop */
@@ -264,30 +302,39 @@ static void
 smp_init()
 {
 	struct limine_smp_response *smpr = smp_request.response;
+	/* APs which may yet be started, leaving room for the BSP */
+	int naps, num = 0;
+
+	/* per-CPU kmem state is sized for KMEM_MAX_CPUS */
+	ncpu = MIN(smpr->cpu_count, KMEM_MAX_CPUS);
+	naps = ncpu - 1;
 
-	cpus = kmem_alloc(sizeof *cpus * smpr->cpu_count);
+	cpus = kmem_alloc(sizeof *cpus * ncpu);
 
 	kprintf("%lu cpus\n", smpr->cpu_count);
-	ncpu = smpr->cpu_count;
+	if ((uint64_t)ncpu < smpr->cpu_count)
+		kprintf("only starting %d cpus\n", ncpu);
 
 	for (size_t i = 0; i < smpr->cpu_count; i++) {
 		struct limine_smp_info *smpi = smpr->cpus[i];
 
 		if (smpi->lapic_id == smpr->bsp_lapic_id) {
 			smpi->extra_argument = (uint64_t)&cpu0;
-			cpu0.num = i;
-			cpus[i] = &cpu0;
+			cpu0.num = num;
+			cpus[num++] = &cpu0;
 			common_init(smpi);
-		} else {
+		} else if (naps > 0) {
 			cpu_t *cpu = kmem_alloc(sizeof *cpu);
-			cpu->num = i;
-			cpus[i] = cpu;
+			naps--;
+			cpu->num = num;
+			cpu->md.pmap = NULL; /* until it calls vm_activate() */
+			cpus[num++] = cpu;
 			smpi->extra_argument = (uint64_t)cpu;
 			smpi->goto_address = ap_init;
 		}
 	}
 
-	while (cpus_up != smpr->cpu_count)
+	while (cpus_up != ncpu)
 		__asm__("pause");
 }
 
@@ -330,6 +377,8 @@ kmain(void *arg)
 	}
 #endif
 
+	dk_buf_init();
+
 	int posix_main(void);
 	posix_main();
 
@@ -360,6 +409,8 @@ _start(void)
 	mem_init();
 	vm_kernel_init();
 	kmem_init();
+	vm_init();
+	pmap_init();
 
 	smp_init();
 
@@ -367,9 +418,11 @@ _start(void)
 	// callout.nanosecs = NS_PER_S * 1;
 	// callout_enqueue(&callout);
 
-	thread_t *vm_pagedaemon = thread_new(&task0, kmain, 0);
+	thread_t *kmain_thread = thread_new(&task0, kmain, 0);
 	kprintf("thread0: made vm_pagedaemon\n");
-	thread_resume(vm_pagedaemon);
+	thread_resume(kmain_thread);
+
+	thread_resume(thread_new(&task0, vm_pagedaemon, NULL));
 
 	/* this thread is now the idle thread */
 
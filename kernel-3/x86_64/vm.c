@@ -21,6 +21,13 @@ enum {
 	kPTShift = 0x12,
 };
 
+enum {
+	/*! most pages a shootdown invalidates singly, before flushing all */
+	kPMapBatchInvlpgMax = 32,
+	/*! most page tables a range removal frees per shootdown */
+	kPMapBatchFreeMax = 16,
+};
+
 enum {
 	kMMUPresent = 0x1,
 	kMMUWrite = 0x2,
@@ -127,7 +134,12 @@ void
 vm_activate(vm_map_t *map)
 {
 	uint64_t val = (uint64_t)map->pmap->pml4;
+	int	 iff = md_intr_disable();
+
+	/* noted first, so a shootdown can't miss this CPU (see shootdown()) */
+	__atomic_store_n(&curcpu()->md.pmap, map->pmap, __ATOMIC_SEQ_CST);
 	write_cr3(val);
+	md_intr_x(iff);
 }
 
 static uint64_t
@@ -236,20 +248,245 @@ pmap_trans(pmap_t *pmap, vaddr_t virt)
 		return pte_get_addr(pte[pti]) + pi;
 }
 
+/*
+ * PV tables. The first mapping of a page is stored inline in its pv_table;
+ * further mappings are stored in chunks of kPVChunkNEntries. A list of chunks
+ * is kept dense: only the head chunk may be partially full, and a removed
+ * entry is replaced with the last entry of the head chunk. Once a page has
+ * more than kPVHashThreshold mappings, its chunks are distributed among
+ * kPVHashNBuckets lists by a hash of the mapping, so that a lookup scans only a
+ * fraction of them.
+ *
+ * Chunks come from a dedicated zone, fronted by a small per-CPU cache of free
+ * chunks which is accessed with interrupts disabled.
+ */
+
+enum {
+	/*! maximum free chunks cached per CPU */
+	kPVCacheMax = 16,
+};
+
+static kmem_zone_t pv_chunk_zone;
+
 void
-pmap_enter(vm_map_t *map, vm_page_t *page, vaddr_t virt, vm_prot_t prot)
+pmap_init(void)
 {
-	pv_entry_t *ent = kmem_alloc(sizeof(*ent));
+	kmem_cache_init(&pv_chunk_zone, "pv_chunk", sizeof(pv_chunk_t), 0, NULL,
+	    NULL, kKMemCacheAlign);
+}
+
+static pv_chunk_t *
+pv_chunk_alloc(void)
+{
+	md_cpu_t   *md;
+	pv_chunk_t *chunk;
+	bool	    iff = md_intr_disable();
+
+	md = &curcpu()->md;
+	if (md->npvcache > 0) {
+		chunk = md->pvcache;
+		md->pvcache = chunk->next;
+		md->npvcache--;
+		md_intr_x(iff);
+	} else {
+		md_intr_x(iff);
+		chunk = kmem_zonealloc(&pv_chunk_zone);
+		assert(chunk != NULL);
+	}
 
-	ent->map = map;
-	ent->vaddr = virt;
+	chunk->next = NULL;
+	chunk->nentries = 0;
 
-	pmap_enter_kern(map->pmap, page->paddr, virt, prot);
-	LIST_INSERT_HEAD(&page->pv_table, ent, pv_entries);
+	return chunk;
+}
+
+static void
+pv_chunk_free(pv_chunk_t *chunk)
+{
+	md_cpu_t *md;
+	bool	  iff = md_intr_disable();
+
+	md = &curcpu()->md;
+	if (md->npvcache < kPVCacheMax) {
+		chunk->next = md->pvcache;
+		md->pvcache = chunk;
+		md->npvcache++;
+		md_intr_x(iff);
+		return;
+	}
+	md_intr_x(iff);
+
+	kmem_zonefree(&pv_chunk_zone, chunk);
+}
+
+static inline bool
+pv_matches(pv_entry_t *pv, vm_map_t *map, vaddr_t vaddr)
+{
+	return pv->map == map && pv->vaddr == vaddr;
+}
+
+/*! Get the chunk list in which the entry for (map, vaddr) belongs. */
+static pv_chunk_t **
+pv_list(pv_table_t *pvt, vm_map_t *map, vaddr_t vaddr)
+{
+	uintptr_t hash;
+
+	if (!pvt->hashed)
+		return &pvt->chunks;
+
+	hash = ((uintptr_t)vaddr >> 12) ^ ((uintptr_t)map >> 6);
+	return &pvt->buckets[hash & (kPVHashNBuckets - 1)];
+}
+
+static void
+pv_list_insert(pv_chunk_t **list, vm_map_t *map, vaddr_t vaddr)
+{
+	pv_chunk_t *chunk = *list;
+
+	if (chunk == NULL || chunk->nentries == kPVChunkNEntries) {
+		chunk = pv_chunk_alloc();
+		chunk->next = *list;
+		*list = chunk;
+	}
+
+	chunk->entries[chunk->nentries].map = map;
+	chunk->entries[chunk->nentries].vaddr = vaddr;
+	chunk->nentries++;
+}
+
+static bool
+pv_list_remove(pv_chunk_t **list, vm_map_t *map, vaddr_t vaddr)
+{
+	for (pv_chunk_t *chunk = *list; chunk != NULL; chunk = chunk->next) {
+		for (size_t i = 0; i < chunk->nentries; i++) {
+			pv_chunk_t *head = *list;
+
+			if (!pv_matches(&chunk->entries[i], map, vaddr))
+				continue;
+
+			chunk->entries[i] = head->entries[--head->nentries];
+			if (head->nentries == 0) {
+				*list = head->next;
+				pv_chunk_free(head);
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*! Convert a page's chunk list into a hash of chunk lists. */
+static void
+pv_rehash(pv_table_t *pvt)
+{
+	pv_chunk_t *chunk = pvt->chunks, *next;
+
+	pvt->buckets = kmem_zalloc(sizeof(pv_chunk_t *) * kPVHashNBuckets);
+	pvt->hashed = 1;
+
+	for (; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		for (size_t i = 0; i < chunk->nentries; i++) {
+			pv_entry_t *pv = &chunk->entries[i];
+			pv_list_insert(pv_list(pvt, pv->map, pv->vaddr),
+			    pv->map, pv->vaddr);
+		}
+		pv_chunk_free(chunk);
+	}
+}
+
+static void
+pv_insert(vm_page_t *page, vm_map_t *map, vaddr_t vaddr)
+{
+	pv_table_t *pvt = &page->pv_table;
+
+	if (pvt->single.map == NULL) {
+		pvt->single.map = map;
+		pvt->single.vaddr = vaddr;
+	} else {
+		if (!pvt->hashed && pvt->nentries > kPVHashThreshold)
+			pv_rehash(pvt);
+		pv_list_insert(pv_list(pvt, map, vaddr), map, vaddr);
+	}
+
+	pvt->nentries++;
+}
+
+/*!
+ * Remove the pv entry for the mapping of \p page at \p vaddr in \p map.
+ */
+static void
+pv_remove(vm_page_t *page, vm_map_t *map, vaddr_t vaddr)
+{
+	pv_table_t *pvt = &page->pv_table;
+
+	if (pv_matches(&pvt->single, map, vaddr))
+		pvt->single.map = NULL;
+	else if (!pv_list_remove(pv_list(pvt, map, vaddr), map, vaddr))
+		fatal("pv_remove: no mapping of frame %p at vaddr %p in map %p\n",
+		    page->paddr, vaddr, map);
+
+	if (--pvt->nentries == 0 && pvt->hashed) {
+		kmem_free(pvt->buckets, sizeof(pv_chunk_t *) * kPVHashNBuckets);
+		pvt->hashed = 0;
+		pvt->chunks = NULL;
+	}
+}
+
+/*!
+ * Get any one mapping of a page.
+ * @returns false if it has none.
+ */
+static bool
+pv_any(vm_page_t *page, pv_entry_t *out)
+{
+	pv_table_t *pvt = &page->pv_table;
+	size_t	    nlists = pvt->hashed ? kPVHashNBuckets : 1;
+	pv_chunk_t **lists = pvt->hashed ? pvt->buckets : &pvt->chunks;
+
+	if (pvt->single.map != NULL) {
+		*out = pvt->single;
+		return true;
+	}
+
+	for (size_t i = 0; i < nlists; i++)
+		if (lists[i] != NULL) {
+			*out = lists[i]->entries[0];
+			return true;
+		}
+
+	return false;
+}
+
+/*! Call \p fn for each mapping of a page. \p fn must not alter the table. */
+static void
+pv_foreach(vm_page_t *page, void (*fn)(vm_page_t *, pv_entry_t *))
+{
+	pv_table_t *pvt = &page->pv_table;
+	size_t	    nlists = pvt->hashed ? kPVHashNBuckets : 1;
+	pv_chunk_t **lists = pvt->hashed ? pvt->buckets : &pvt->chunks;
+
+	if (pvt->single.map != NULL)
+		fn(page, &pvt->single);
+
+	for (size_t i = 0; i < nlists; i++)
+		for (pv_chunk_t *chunk = lists[i]; chunk; chunk = chunk->next)
+			for (size_t i2 = 0; i2 < chunk->nentries; i2++)
+				fn(page, &chunk->entries[i2]);
 }
 
 void
-pmap_enter_kern(pmap_t *pmap, paddr_t phys, vaddr_t virt, vm_prot_t prot)
+pmap_enter(vm_map_t *map, vm_page_t *page, vaddr_t virt, vm_prot_t prot)
+{
+	pmap_enter_kern(map->pmap, page->paddr, virt, prot);
+	pv_insert(page, map, virt);
+}
+
+/*! Map \p phys at \p virt with PTE flags \p flags. */
+static void
+enter_kern(pmap_t *pmap, paddr_t phys, vaddr_t virt, uint64_t flags)
 {
 	uintptr_t virta = (uintptr_t)virt;
 	int	  pml4i = ((virta >> 39) & 0x1FF);
@@ -272,7 +509,21 @@ pmap_enter_kern(pmap_t *pmap, paddr_t phys, vaddr_t virt, vm_prot_t prot)
 		/* TODO(med): do we care about this case? */
 		;
 
-	pte_set(pti_virt, phys, vm_prot_to_i386(prot));
+	pte_set(pti_virt, phys, flags);
+}
+
+void
+pmap_enter_kern(pmap_t *pmap, paddr_t phys, vaddr_t virt, vm_prot_t prot)
+{
+	enter_kern(pmap, phys, virt, vm_prot_to_i386(prot));
+}
+
+void
+pmap_enter_kern_uncached(pmap_t *pmap, paddr_t phys, vaddr_t virt,
+    vm_prot_t prot)
+{
+	enter_kern(pmap, phys, virt,
+	    vm_prot_to_i386(prot) | kMMUCacheDisable | kMMUWriteThrough);
 }
 
 void
@@ -281,35 +532,30 @@ pmap_reenter(vm_map_t *map, vm_page_t *page, vaddr_t virt, vm_prot_t prot)
 	pmap_enter_kern(map->pmap, page->paddr, virt, prot);
 }
 
+static void
+reenter_readonly(vm_page_t *page, pv_entry_t *pv)
+{
+	mutex_lock(&pv->map->lock);
+	pmap_reenter(pv->map, page, pv->vaddr, kVMRead | kVMExecute);
+	pmap_global_invlpg(pv->vaddr);
+	mutex_unlock(&pv->map->lock);
+}
+
 void
 pmap_reenter_all_readonly(vm_page_t *page)
 {
-	pv_entry_t *pv, *tmp;
-
 	mutex_lock(&page->lock);
-
-	LIST_FOREACH_SAFE (pv, &page->pv_table, pv_entries, tmp) {
-		mutex_lock(&pv->map->lock);
-		pmap_reenter(pv->map, page, pv->vaddr, kVMRead | kVMExecute);
-		pmap_global_invlpg(pv->vaddr);
-		mutex_unlock(&pv->map->lock);
-	}
+	pv_foreach(page, reenter_readonly);
 	mutex_unlock(&page->lock);
 }
 
 void
-pmap_unenter(vm_map_t *map, vm_page_t *page, vaddr_t vaddr, pv_entry_t *pv)
+pmap_unenter(vm_map_t *map, vm_page_t *page, vaddr_t vaddr)
 {
-	/** \todo free no-longer-needed page tables */
+	/** \todo free no-longer-needed page tables (pmap_remove_range does) */
 	pte_t  *pte = pmap_fully_descend(map->pmap, vaddr);
 	paddr_t paddr;
 
-	/*
-	 * todo(med): maybe we should be more careful about this
-	 * perhaps instead of bulk pmap_unenter'ing on deallocation, instead
-	 * we should iterate through the object's page queue (amap for anon
-	 * objects). would it add significant cost?
-	 */
 	if (pte == NULL)
 		return;
 
@@ -327,21 +573,209 @@ pmap_unenter(vm_map_t *map, vm_page_t *page, vaddr_t vaddr, pv_entry_t *pv)
 
 	assert(page);
 
-	if (!pv) {
-		LIST_FOREACH (pv, &page->pv_table, pv_entries) {
-			if (pv->map == map && pv->vaddr == vaddr) {
-				goto next;
+	pv_remove(page, map, vaddr);
+}
+
+/*
+ * Range operations. These walk the page tables once over the range, skipping
+ * absent PDPTEs/PDEs wholesale, and batch up TLB invalidations into a single
+ * shootdown: up to kPMapBatchInvlpgMax pages are invalidated individually;
+ * beyond that (or if any page tables were freed) the whole TLB is flushed by
+ * reloading CR3. Emptied page tables are freed only once every CPU with the
+ * pmap loaded has done so, so no stale paging-structure cache entry can refer
+ * to them.
+ */
+
+typedef struct pmap_batch {
+	pmap_t	    *pmap;
+	size_t	   ninvl;
+	vaddr_t	   invl[kPMapBatchInvlpgMax];
+	size_t	   nfreed;
+	vm_page_t *freed[kPMapBatchFreeMax];
+} pmap_batch_t;
+
+enum pmap_range_op {
+	kPMapRangeRemove,
+	kPMapRangeProtect,
+};
+
+static void shootdown(pmap_t *pmap, const vaddr_t *addrs, size_t naddrs);
+
+static void
+batch_flush(pmap_batch_t *batch)
+{
+	/* this must complete before the page tables are freed */
+	if (batch->nfreed > 0)
+		shootdown(batch->pmap, NULL, SIZE_MAX);
+	else if (batch->ninvl > 0)
+		shootdown(batch->pmap, batch->invl, batch->ninvl);
+
+	for (size_t i = 0; i < batch->nfreed; i++)
+		vm_page_free(batch->freed[i]);
+
+	batch->ninvl = 0;
+	batch->nfreed = 0;
+}
+
+static inline void
+batch_invlpg(pmap_batch_t *batch, vaddr_t vaddr)
+{
+	if (batch->ninvl < kPMapBatchInvlpgMax)
+		batch->invl[batch->ninvl] = vaddr;
+	batch->ninvl++;
+}
+
+/*! Unhook the page table \p table (virtual) at \p entry and free it later. */
+static void
+batch_freetable(pmap_batch_t *batch, uint64_t *entry, uint64_t *table)
+{
+	*entry = 0x0;
+	if (batch->nfreed == kPMapBatchFreeMax)
+		batch_flush(batch);
+	batch->freed[batch->nfreed++] = vm_page_from_paddr(V2P(table));
+}
+
+static bool
+table_empty(uint64_t *table)
+{
+	for (int i = 0; i < 512; i++)
+		if (table[i] != 0x0)
+			return false;
+	return true;
+}
+
+/*!
+ * Get the end of the region mapped by the entry at level \p shift covering
+ * \p va, clamped to \p eva.
+ */
+static inline uintptr_t
+level_end(uintptr_t va, int shift, uintptr_t eva)
+{
+	uintptr_t next = (va | ((1ul << shift) - 1)) + 1;
+	return (next == 0 || next > eva) ? eva : next;
+}
+
+static void
+range_pte(vm_map_t *map, pmap_batch_t *batch, pte_t *pte, vaddr_t vaddr,
+    enum pmap_range_op op, vm_prot_t prot)
+{
+	paddr_t	   paddr = pte_get_addr(*pte);
+	vm_page_t *page;
+
+	if (op == kPMapRangeProtect) {
+		pte_set(pte, paddr, vm_prot_to_i386(prot));
+		batch_invlpg(batch, vaddr);
+		return;
+	}
+
+	*pte = 0x0;
+	batch_invlpg(batch, vaddr);
+
+	page = vm_page_from_paddr(paddr);
+	assert(page);
+	pv_remove(page, map, vaddr);
+}
+
+static void
+pmap_range(vm_map_t *map, vaddr_t start, vaddr_t end, enum pmap_range_op op,
+    vm_prot_t prot)
+{
+	pml4e_t	*pml4 = P2V(map->pmap->pml4);
+	uintptr_t    va = (uintptr_t)start, eva = (uintptr_t)end;
+	/* kernel page tables are shared by all pmaps, so are never reclaimed */
+	bool	     reclaim = op == kPMapRangeRemove && map != &kmap;
+	pmap_batch_t batch;
+
+	batch.pmap = map->pmap;
+	batch.ninvl = 0;
+	batch.nfreed = 0;
+
+	for (uintptr_t n4; va < eva; va = n4) {
+		int	 i4 = (va >> 39) & 0x1FF;
+		pdpte_t *pdpt;
+
+		n4 = level_end(va, 39, eva);
+		if (!(pml4[i4] & kMMUPresent))
+			continue;
+		pdpt = P2V(pte_get_addr(pml4[i4]));
+
+		for (uintptr_t v3 = va, n3; v3 < n4; v3 = n3) {
+			int    i3 = (v3 >> 30) & 0x1FF;
+			pde_t *pd;
+
+			n3 = level_end(v3, 30, n4);
+			if (!(pdpt[i3] & kMMUPresent))
+				continue;
+			pd = P2V(pte_get_addr(pdpt[i3]));
+
+			for (uintptr_t v2 = v3, n2; v2 < n3; v2 = n2) {
+				int    i2 = (v2 >> 21) & 0x1FF;
+				pte_t *pt;
+
+				n2 = level_end(v2, 21, n3);
+				if (!(pd[i2] & kMMUPresent))
+					continue;
+				pt = P2V(pte_get_addr(pd[i2]));
+
+				for (uintptr_t v1 = v2; v1 < n2; v1 += PGSIZE) {
+					pte_t *pte = &pt[(v1 >> 12) & 0x1FF];
+					if (*pte != 0x0)
+						range_pte(map, &batch, pte,
+						    (vaddr_t)v1, op, prot);
+				}
+
+				if (reclaim && table_empty(pt))
+					batch_freetable(&batch, &pd[i2], pt);
 			}
+
+			if (reclaim && table_empty(pd))
+				batch_freetable(&batch, &pdpt[i3], pd);
 		}
 
-		fatal(
-		    "pmap_unenter: no mapping of frame %p at vaddr %p in map %p\n",
-		    page->paddr, vaddr, map);
+		/* PML4 entries from 255 up are shared with the kernel */
+		if (reclaim && i4 < 255 && table_empty(pdpt))
+			batch_freetable(&batch, &pml4[i4], pdpt);
 	}
 
-next:
-	LIST_REMOVE(pv, pv_entries);
-	kmem_free(pv, sizeof(*pv));
+	batch_flush(&batch);
+}
+
+void
+pmap_remove_range(vm_map_t *map, vaddr_t start, vaddr_t end)
+{
+	pmap_range(map, start, end, kPMapRangeRemove, 0);
+}
+
+void
+pmap_protect_range(vm_map_t *map, vaddr_t start, vaddr_t end, vm_prot_t prot)
+{
+	assert(prot & kVMRead);
+	pmap_range(map, start, end, kPMapRangeProtect, prot);
+}
+
+void
+pmap_unenter_all(vm_page_t *page)
+{
+	pv_entry_t pv;
+
+	mutex_lock(&page->lock);
+	while (pv_any(page, &pv)) {
+		pte_t *pte;
+
+		mutex_lock(&pv.map->lock);
+		pte = pmap_fully_descend(pv.map->pmap, pv.vaddr);
+		if (pte != NULL) {
+			pte = P2V(pte);
+			if ((paddr_t)pte_get_addr(*pte) == page->paddr) {
+				*pte = 0x0;
+				pmap_global_invlpg(pv.vaddr);
+			}
+		}
+		/* removed whatever the PTE held, so that each pass progresses */
+		pv_remove(page, pv.map, pv.vaddr);
+		mutex_unlock(&pv.map->lock);
+	}
+	mutex_unlock(&page->lock);
 }
 
 vm_page_t *
@@ -384,27 +818,73 @@ pmap_invlpg(vaddr_t addr)
 	asm volatile("invlpg %0" : : "m"(*((const char *)addr)) : "memory");
 }
 
-static spinlock_t invlpg_global_lock = SPINLOCK_INITIALISER;
-vaddr_t		  invlpg_addr;
-volatile atomic_int invlpg_done_cnt;
+/*! protects the shootdown in progress */
+static spinlock_t	  invlpg_global_lock = SPINLOCK_INITIALISER;
+/*! addresses to invalidate; if more than kPMapBatchInvlpgMax, flush all */
+static const vaddr_t *invlpg_addrs;
+static size_t	      invlpg_naddrs;
+/*! count of CPUs which have done the shootdown */
+static volatile atomic_int invlpg_done_cnt;
 
 void
-pmap_global_invlpg(vaddr_t vaddr)
+pmap_shootdown_intr(void)
+{
+	if (invlpg_naddrs > kPMapBatchInvlpgMax)
+		write_cr3(read_cr3());
+	else
+		for (size_t i = 0; i < invlpg_naddrs; i++)
+			pmap_invlpg(invlpg_addrs[i]);
+	atomic_fetch_add(&invlpg_done_cnt, 1);
+}
+
+/*! Whether \p cpu may hold TLB entries of \p pmap (NULL meaning any.) */
+static bool
+cpu_has_pmap(struct cpu *cpu, pmap_t *pmap)
+{
+	pmap_t *loaded = __atomic_load_n(&cpu->md.pmap, __ATOMIC_SEQ_CST);
+
+	/* the kernel's mappings are in every pmap */
+	return pmap == NULL || pmap == &kpmap || loaded == NULL ||
+	    loaded == pmap;
+}
+
+/*!
+ * Invalidate \p naddrs addresses \p addrs of \p pmap (NULL for any), or the
+ * whole TLB if there are more than kPMapBatchInvlpgMax, on every CPU which has
+ * it loaded, and wait for them to do so.
+ *
+ * A CPU which hasn't it loaded needn't be interrupted: loading CR3 flushes the
+ * TLB, and vm_activate() notes the pmap before doing so, so a CPU that loads it
+ * after the check below does so after the page tables were changed.
+ */
+static void
+shootdown(pmap_t *pmap, const vaddr_t *addrs, size_t naddrs)
 {
 	int iff = md_intr_disable();
+	int ntargets = 1;
 
 	spinlock_lock(&invlpg_global_lock);
-	invlpg_addr = vaddr;
-	invlpg_done_cnt = 1;
+	invlpg_addrs = addrs;
+	invlpg_naddrs = naddrs;
+	invlpg_done_cnt = 0;
+	/* order the page table changes before the checks of cpu_has_pmap() */
+	atomic_thread_fence(memory_order_seq_cst);
 	for (int i = 0; i < ncpu; i++) {
-		if (cpus[i] == curcpu())
+		if (cpus[i] == curcpu() || !cpu_has_pmap(cpus[i], pmap))
 			continue;
 
+		ntargets++;
 		md_ipi_invlpg(cpus[i]);
 	}
-	pmap_invlpg(vaddr);
-	while (invlpg_done_cnt != ncpu)
+	pmap_shootdown_intr();
+	while (invlpg_done_cnt != ntargets)
 		__asm__("pause");
 	spinlock_unlock(&invlpg_global_lock);
 	md_intr_x(iff);
 }
+
+void
+pmap_global_invlpg(vaddr_t vaddr)
+{
+	shootdown(NULL, &vaddr, 1);
+}